@@ -37,7 +37,7 @@ public:
   }
 
   Halifax(VCpu *vcpu) : InstructionCache(vcpu) {
-    vcpu->executor.add(this,  receive_static);
+    vcpu->executor.add(this,  receive_static, ExecutorBus::type(CpuMessage::TYPE_SINGLE_STEP));
   }
   void *operator new(size_t size)
   {
@@ -45,6 +45,9 @@ public:
   }
 };
 
+// The XSAVE area needs it, plain operator new only gives 16 bytes.
+static_assert(__alignof__(Halifax) >= 64, "Halifax allocations are not aligned for XSAVE");
+
 PARAM_HANDLER(halifax,
 	      "halifax - create a halifax that emulatates instructions.")
 {
@@ -167,7 +167,80 @@ class InstructionCache : public MemTlb
   unsigned _ointr_state;
   mword _dr6;
   mword _dr[4];
-  unsigned _fpustate [512/sizeof(unsigned)] __attribute__((aligned(16)));
+
+  /**
+   * The guest FPU state in XSAVE layout, the FXSAVE area followed by
+   * the XSAVE header. XSAVE and XRSTOR fault unless it is 64-byte
+   * aligned, so whoever allocates us has to honor our alignment.
+   */
+  enum {
+    FPU_LEGACY = 512,
+    FPU_XSAVE  = FPU_LEGACY + 64,
+  };
+  unsigned _fpustate [FPU_XSAVE/sizeof(unsigned)] __attribute__((aligned(64)));
+  bool     _fpu_dirty;  ///< the host FPU holds newer guest state than _fpustate
+
+  /**
+   * 64-bit host code computes with SSE only, so the guest x87 state
+   * can stay in the host FPU between emulated instructions. It is
+   * written back with XSAVE restricted to the x87 component, which
+   * leaves the host SSE registers and MXCSR alone. Without XSAVE, or
+   * on a 32-bit host that uses the x87 itself, the state is loaded and
+   * saved around every instruction.
+   */
+  static bool fpu_lazy()
+  {
+#ifdef __x86_64__
+    static int lazy = -1;
+    if (lazy < 0) {
+      unsigned ebx = 0, ecx = 0, edx = 0;
+      Cpu::cpuid(1, ebx, ecx, edx);
+      // XSAVE and OSXSAVE
+      lazy = (ecx & (3u << 26)) == (3u << 26);
+    }
+    return lazy;
+#else
+    return false;
+#endif
+  }
+
+  /**
+   * The cache whose state is live in the FPU of this thread. The
+   * kernel switches the FPU with the thread, we only have to care
+   * about several vCPUs sharing one.
+   */
+  static InstructionCache *&fpu_owner() { static __thread InstructionCache *owner; return owner; }
+
+  /**
+   * Make the guest x87 state current in the host FPU before an
+   * emulated FPU instruction. Returns false if the caller has to load
+   * and save the whole state itself.
+   */
+  bool fpu_acquire(bool load, bool write)
+  {
+    if (!fpu_lazy()) return false;
+    InstructionCache *&owner = fpu_owner();
+    if (owner != this) {
+      if (owner) owner->fpu_spill(true);
+      if (load) asm volatile("xrstor (%0)" : : "r"(_fpustate), "a"(1), "d"(0) : "memory");
+      owner = this;
+    }
+    _fpu_dirty |= write;
+    return true;
+  }
+
+  /**
+   * Write the live guest state back to _fpustate and optionally give
+   * up the host FPU. Must run on the thread that owns it.
+   */
+  void fpu_spill(bool release)
+  {
+    InstructionCache *&owner = fpu_owner();
+    if (owner != this) return;
+    if (_fpu_dirty) asm volatile("xsave (%0)" : : "r"(_fpustate), "a"(1), "d"(0) : "memory");
+    _fpu_dirty = false;
+    if (release) owner = 0;
+  }
 
   int send_message(CpuMessage::Type type)
   {
@@ -580,5 +653,12 @@ public:
     msg.mtr_out = _mtr_out;
   }
 
- InstructionCache(VCpu *vcpu) : MemTlb(vcpu->mem, vcpu->memregion), _pos(), _tags(), _values(), _vcpu(vcpu), _entry(), _oeip(), _oesp(), _ointr_state(), _dr6(), _dr(), _fpustate() { }
+ InstructionCache(VCpu *vcpu) : MemTlb(vcpu->mem, vcpu->memregion), _pos(), _tags(), _values(), _vcpu(vcpu), _entry(), _oeip(), _oesp(), _ointr_state(), _dr6(), _dr(), _fpustate(), _fpu_dirty()
+  {
+    assert(!(reinterpret_cast<mword>(_fpustate) & 63));
+    // FCW and MXCSR after RESET, the x87 part of the XSAVE area is valid
+    _fpustate[0] = 0x40;
+    _fpustate[6] = 0x1f80;
+    _fpustate[FPU_LEGACY/sizeof(unsigned)] = 1;
+  }
 };
@@ -929,7 +929,8 @@ int helper_FXSAVE()
 {
   unsigned virt = modrm2virt();
   if (virt & 0xf) GP0; // could be also AC if enabled
-  for (unsigned i=0; i < sizeof(_fpustate)/sizeof(unsigned); i++)
+  fpu_spill(false);
+  for (unsigned i=0; i < FPU_LEGACY/sizeof(unsigned); i++)
     {
       void *addr = nullptr;
       if (!virt_to_ptr(addr, 4, user_access(TYPE_W), virt + i*sizeof(unsigned)))  return _fault;
@@ -26,6 +26,10 @@
  * Expressions, Bernhard Kauer, TU Dresden technical report
  * TUD-FI09-09, Dresden, Germany, August 2009".
  *
+ * The absolute names of all tables are hashed once they are read,
+ * and the routing of every (parent, slot, pin) triple is resolved
+ * up front, so a GSI query is a single table lookup.
+ *
  * State: testing
  * Features: direct PRT, referenced PRTs, exact name resolution, Routing Entries
  */
@@ -50,16 +54,32 @@ class Atare : public StaticReceiver<Atare>
   struct NamedRef {
 
     NamedRef *next;
+    NamedRef *parent;   ///< the innermost enclosing ref in the same table
+    NamedRef *hnext;    ///< next in the same hash bucket
     const unsigned char *ptr;
     unsigned len;
     const char *name;
     int namelen;
     PciRoutingEntry *routing;
-    NamedRef(NamedRef *_next, const unsigned char *_ptr, unsigned _len, const char *_name, int _namelen)
-      : next(_next), ptr(_ptr), len(_len), name(_name), namelen(_namelen), routing(0) {}
+    NamedRef(NamedRef *_next, NamedRef *_parent, const unsigned char *_ptr, unsigned _len, const char *_name, int _namelen)
+      : next(_next), parent(_parent), hnext(0), ptr(_ptr), len(_len), name(_name), namelen(_namelen), routing(0) {}
+  };
+
+
+  /**
+   * The GSI for a (parent bdf, slot, pin) triple. A zero key is free.
+   */
+  struct GsiRoute {
+    unsigned long long key;
+    unsigned char gsi;
   };
 
   NamedRef *_head;
+  NamedRef **_index;
+  unsigned   _index_mask;
+  GsiRoute  *_routes;
+  unsigned   _routes_mask;
+  unsigned   _debug;
 
 
   void debug_show_items() {
@@ -70,11 +90,11 @@ class Atare : public StaticReceiver<Atare>
 
 
   void debug_show_routing() {
-    if (!Atare::search_ref(_head, 0, "_PIC", false)) Logging::printf("at: APIC mode unavailable - no _PIC method\n");
+    if (!search_ref(0, "_PIC", false)) Logging::printf("at: APIC mode unavailable - no _PIC method\n");
 
     for (Atare::NamedRef *dev = _head; dev; dev = dev->next)
       if (dev->ptr[0] == 0x82) {
-        unsigned bdf = Atare::get_device_bdf(_head, dev);
+        unsigned bdf = get_device_bdf(dev);
         Logging::printf("at: %04x:%02x:%02x.%x tag %p name %.*s\n",
           bdf >> 16, (bdf >> 8) & 0xff, (bdf >> 3) & 0x1f, bdf & 7, dev->ptr - 1, 4, dev->name + dev->namelen - 4);
         for (Atare::PciRoutingEntry *p = dev->routing; p; p = p->next)
@@ -235,7 +255,7 @@ class Atare : public StaticReceiver<Atare>
    * Searches for PCI routing information by following references in
    * the PRT method and adds them to dev.
    */
-  static void search_prt_indirect(NamedRef *head, NamedRef *dev, NamedRef *prt) {
+  void search_prt_indirect(NamedRef *dev, NamedRef *prt) {
 
     unsigned found = 0;
     unsigned name_len;
@@ -250,7 +270,7 @@ class Atare : public StaticReceiver<Atare>
 	char name[name_len+1];
 	memcpy(name, prt->ptr + offset, name_len);
 	name[name_len] = 0;
-	NamedRef *ref = search_ref(head, dev, name, true);
+	NamedRef *ref = search_ref(dev, name, true);
 	if (ref)  search_prt_direct(dev, ref);
       }
       else name_len = 1;
@@ -261,9 +281,9 @@ class Atare : public StaticReceiver<Atare>
   /**
    * Return a single value of a namedef declaration.
    */
-  static unsigned get_namedef_value(NamedRef *head, NamedRef *parent, const char *name) {
+  unsigned get_namedef_value(NamedRef *parent, const char *name) {
 
-    NamedRef *ref = search_ref(head, parent, name, false);
+    NamedRef *ref = search_ref(parent, name, false);
     if (ref && ref->ptr[0] == 0x8) {
 
       unsigned name_len = get_name_len(ref->ptr + 1);
@@ -275,10 +295,54 @@ class Atare : public StaticReceiver<Atare>
   }
 
 
+  /**
+   * FNV-1a over an absolute name.
+   */
+  static unsigned name_hash(const char *name, int namelen) {
+    unsigned res = 2166136261u;
+    for (int i=0; i < namelen; i++)
+      res = (res ^ static_cast<unsigned char>(name[i])) * 16777619u;
+    return res;
+  }
+
+
+  /**
+   * Lookup an absolute name in the index.
+   */
+  NamedRef *lookup_name(const char *name, int namelen) {
+    for (NamedRef *ref = _index[name_hash(name, namelen) & _index_mask]; ref; ref = ref->hnext)
+      if (ref->namelen == namelen && !memcmp(ref->name, name, namelen))
+	return ref;
+    return 0;
+  }
+
+
+  /**
+   * Hash all refs by their absolute name. If a name is defined
+   * twice, the ref nearer to the list head wins.
+   */
+  void build_index() {
+    unsigned count = 0;
+    for (NamedRef *ref = _head; ref; ref = ref->next) count++;
+
+    unsigned size = 1;
+    while (size < count) size <<= 1;
+    _index = new NamedRef *[size]();
+    _index_mask = size - 1;
+
+    for (NamedRef *ref = _head; ref; ref = ref->next) {
+      if (lookup_name(ref->name, ref->namelen)) continue;
+      NamedRef **bucket = _index + (name_hash(ref->name, ref->namelen) & _index_mask);
+      ref->hnext = *bucket;
+      *bucket = ref;
+    }
+  }
+
+
   /**
    * Search some reference per name, either absolute or relative to some parent.
    */
-  static NamedRef *search_ref(NamedRef *head, NamedRef *parent, const char *name, bool upstream) {
+  NamedRef *search_ref(NamedRef *parent, const char *name, bool upstream) {
 
     int slen = strlen(name);
     int plen = parent ? parent->namelen : 0;
@@ -286,9 +350,8 @@ class Atare : public StaticReceiver<Atare>
       int n = slen;
       char output[slen + plen];
       get_absname(parent, reinterpret_cast<const unsigned char *>(name), n, output, skip);
-      for (NamedRef *ref = head; ref; ref = ref->next)
-	if (ref->namelen == n && !memcmp(ref->name, output, n))
-	  return ref;
+      NamedRef *ref = lookup_name(output, n);
+      if (ref) return ref;
       if (!upstream) break;
     }
     return 0;
@@ -298,11 +361,11 @@ class Atare : public StaticReceiver<Atare>
   /**
    * Return a single bdf for a device struct by combining different device properties.
    */
-  static unsigned long long get_device_bdf(NamedRef *head, NamedRef *dev) {
+  unsigned long long get_device_bdf(NamedRef *dev) {
 
-    unsigned adr = get_namedef_value(head, dev, "_ADR");
-    unsigned bbn = get_namedef_value(head, dev, "_BBN");
-    unsigned seg = get_namedef_value(head, dev, "_SEG");
+    unsigned adr = get_namedef_value(dev, "_ADR");
+    unsigned bbn = get_namedef_value(dev, "_BBN");
+    unsigned seg = get_namedef_value(dev, "_SEG");
     return (seg << 16) + (bbn << 8) + ((adr >> 16)<<3) + (adr & 0xffff);
   }
 
@@ -333,16 +396,17 @@ class Atare : public StaticReceiver<Atare>
 	// fix previous len
 	if (res && !res->len) res->len = data - res->ptr;
 
-	// search for the parent in this table
+	// search for the parent in this table, every older ref that
+	// encloses us also encloses the previous one
 	NamedRef *parent = res;
-	for (; parent; parent = parent->next)
+	for (; parent; parent = parent->parent)
 	  if (parent->ptr < data && parent->ptr + parent->len > data)
 	    break;
 
 	// to get an absolute name
 	char *name = new char[name_len + (parent ? parent->namelen : 0)];
 	get_absname(parent, data + 1 + pkgsize_len, name_len, name);
-	res = new NamedRef(res, data, pkgsize, name, name_len);
+	res = new NamedRef(res, parent, data, pkgsize, name, name_len);
 
 	// at least skip the header
 	data += pkgsize_len;
@@ -357,48 +421,88 @@ class Atare : public StaticReceiver<Atare>
   /**
    * Add the PCI routing information to the devices.
    */
-  static void add_routing(NamedRef *head) {
-    for (NamedRef *dev = head; dev; dev = dev->next)
+  void add_routing() {
+    for (NamedRef *dev = _head; dev; dev = dev->next)
       if (dev->ptr[0] == 0x82) {
 
-	NamedRef *prt = search_ref(head, dev, "_PRT", false);
+	NamedRef *prt = search_ref(dev, "_PRT", false);
 	if (prt) {
 	  search_prt_direct(dev, prt);
-	  search_prt_indirect(head, dev, prt);
+	  search_prt_indirect(dev, prt);
 	}
       }
   }
 
 
-public:
+  static unsigned long long route_key(unsigned parent_bdf, unsigned slot, unsigned char pin) {
+    return 1ull << 48 | static_cast<unsigned long long>(parent_bdf) << 16 | slot << 8 | pin;
+  }
 
 
-  bool  receive(MessageAcpi &msg)
-  {
-    if (msg.type != MessageAcpi::ACPI_GET_IRQ) return false;
+  /**
+   * Find the route for a key or the free slot to put it in.
+   */
+  GsiRoute *route_slot(unsigned long long key) {
+    unsigned i = static_cast<unsigned>((key * 0x9e3779b97f4a7c15ull) >> 32) & _routes_mask;
+    for (; _routes[i].key && _routes[i].key != key; i = (i + 1) & _routes_mask)
+      ;
+    return _routes + i;
+  }
 
-    Logging::printf("at: ATARE - search for %x_%x parent %x\n", msg.bdf, msg.pin, msg.parent_bdf);
 
-    // find the device
-    for (Atare::NamedRef *dev = _head; dev; dev = dev->next)
-      if (dev->ptr[0] == 0x82 && Atare::get_device_bdf(_head, dev) == msg.parent_bdf) {
+  /**
+   * Resolve the GSI of every routing entry. The first device with a
+   * matching bdf wins, as with a linear search through the devices.
+   */
+  void build_routes() {
+    unsigned count = 0;
+    for (NamedRef *dev = _head; dev; dev = dev->next)
+      for (PciRoutingEntry *p = dev->routing; p; p = p->next)
+	count++;
+
+    unsigned size = 1;
+    while (size < 2 * count) size <<= 1;
+    _routes = new GsiRoute[size]();
+    _routes_mask = size - 1;
+
+    for (NamedRef *dev = _head; dev; dev = dev->next) {
+      if (dev->ptr[0] != 0x82 || !dev->routing) continue;
+
+      unsigned bdf = get_device_bdf(dev);
+      for (PciRoutingEntry *p = dev->routing; p; p = p->next) {
+	if ((p->adr >> 16) > 0x1f) continue;
+
+	unsigned long long key = route_key(bdf, p->adr >> 16, p->pin);
+	GsiRoute *route = route_slot(key);
+	if (route->key) continue;
+	route->key = key;
+	route->gsi = p->gsi;
+      }
+    }
+  }
 
-	// look for the right entry
-	for (Atare::PciRoutingEntry *p = dev->routing; p; p = p->next)
-	  if ((p->adr >> 16) == ((msg.bdf >> 3) & 0x1f) && (msg.pin == p->pin)) {
 
-	    Logging::printf("at: ATARE - found %x for %x_%x parent %x\n", p->gsi, msg.bdf, msg.pin, msg.parent_bdf);
+public:
 
-	    msg.gsi = p->gsi;
-	    return true;
-	  }
-      }
+
+  bool  receive(MessageAcpi &msg)
+  {
+    if (msg.type != MessageAcpi::ACPI_GET_IRQ) return false;
+
+    GsiRoute *route = route_slot(route_key(msg.parent_bdf, (msg.bdf >> 3) & 0x1f, msg.pin));
+    if (route->key) {
+      if (_debug & 2)
+	Logging::printf("at: ATARE - found %x for %x_%x parent %x\n", route->gsi, msg.bdf, msg.pin, msg.parent_bdf);
+      msg.gsi = route->gsi;
+      return true;
+    }
     Logging::printf("at: ATARE - search for %x_%x parent %x failed\n", msg.bdf, msg.pin, msg.parent_bdf);
     return false;
   }
 
 
-  Atare(DBus<MessageAcpi> &bus_acpi, unsigned debug) : _head(0) {
+  Atare(DBus<MessageAcpi> &bus_acpi, unsigned debug)
+    : _head(0), _index(0), _index_mask(0), _routes(0), _routes_mask(0), _debug(debug) {
 
     // add entries from the SSDT
     MessageAcpi msg("DSDT");
@@ -410,7 +514,9 @@ public:
     for (; bus_acpi.send(msg, true) && msg.table; msg.instance++)
       _head = add_refs(reinterpret_cast<unsigned char *>(msg.table), msg.len, _head);
 
-    add_routing(_head);
+    build_index();
+    add_routing();
+    build_routes();
 
     if (debug & 1) debug_show_items();
     if (debug & 2) debug_show_routing();
@@ -72,12 +72,16 @@ class HostSerialPci : public StaticReceiver<HostSerialPci>
   bool  receive(MessageSerial &msg)
   {
     if (msg.serial != _serialdev + 1)  return false;
-    for (unsigned i=0; i < 10000; i++)
+    const unsigned char *data = msg.data();
+    for (unsigned n=0; n < msg.len; n++)
       {
-	if (inb(_base+5) & 0x20) break;
-	Cpu::pause();
+	for (unsigned i=0; i < 10000; i++)
+	  {
+	    if (inb(_base+5) & 0x20) break;
+	    Cpu::pause();
+	  }
+	outb(data[n], _base);
       }
-    outb(msg.ch, _base);
     return true;
   }
 
@@ -15,14 +15,6 @@
  * General Public License version 2 for more details.
  */
 
-/* Activate checksumming for debugging purposes
- * of the received range after migrating.
- * As this really makes the freeze gap larger,
- * this should only be used for testing when
- * the migration algorithm is changed. */
-//#define DO_CHECKSUMMING
-
-
 #include <stdio.h> // snprintf
 
 #include <nul/motherboard.h>
@@ -30,6 +22,286 @@
 
 #include <nul/migration.h>
 #include <service/vprintf.h>
+#include <service/pagecodec.h>
+
+/***********************************************************************
+ * Page stream encoding
+ ***********************************************************************/
+
+PageEncoder::Config PageEncoder::config = { 2, 16384, true };
+
+PageEncoder::PageEncoder(char *physmem, unsigned long size, bool delta)
+    : _physmem(physmem), _hash(NULL), _cache_slots(delta ? VMM_MIN(config.cache_pages, size >> 12) : 0),
+    _cache_tag(NULL), _cache(NULL),
+    _batch(new unsigned[BATCH_PAGES]), _batch_count(0),
+    _out(new unsigned char[BATCH_PAGES * SLOT_SIZE]),
+    _worker_count(config.workers), _workers(NULL), _exit(false)
+{
+    if (delta) {
+        _hash = new PageCodec::Hash[size >> 12];
+        memset(_hash, 0, (size >> 12) * sizeof(*_hash));
+    }
+    if (_cache_slots) {
+        _cache_tag = new unsigned[_cache_slots];
+        _cache     = new unsigned char[_cache_slots * PAGE_SIZE];
+        memset(_cache_tag, 0, _cache_slots * sizeof(*_cache_tag));
+    }
+
+    // Worker 0 is the calling thread itself.
+    _workers = new Worker[_worker_count + 1];
+    sem_init(&_done, 0, 0);
+    for (unsigned i=0; i <= _worker_count; ++i) {
+        Worker &w = _workers[i];
+        memset(&w.stats, 0, sizeof(w.stats));
+        w.encoder = this;
+        w.nr      = i;
+        w.scratch = new unsigned char[PAGE_SIZE];
+        sem_init(&w.go, 0, 0);
+        if (i && 0 != pthread_create(&w.tid, NULL, worker_fn, &w))
+            Logging::panic("Could not create page encoder thread.\n");
+    }
+}
+
+PageEncoder::~PageEncoder()
+{
+    _exit = true;
+    for (unsigned i=1; i <= _worker_count; ++i) {
+        sem_post(&_workers[i].go);
+        pthread_join(_workers[i].tid, NULL);
+    }
+    for (unsigned i=0; i <= _worker_count; ++i)
+        delete [] _workers[i].scratch;
+
+    delete [] _workers;
+    delete [] _out;
+    delete [] _batch;
+    delete [] _cache;
+    delete [] _cache_tag;
+    delete [] _hash;
+}
+
+void PageEncoder::encode_page(Worker &w, unsigned idx)
+{
+    unsigned page = _batch[idx];
+    MigrationPage *rec = record(idx);
+    unsigned char *payload = reinterpret_cast<unsigned char *>(rec + 1);
+
+    /* Work on a private copy. The guest keeps running and the
+     * cache has to hold exactly what the receiver gets. */
+    memcpy(w.scratch, _physmem + (static_cast<mword>(page) << 12), PAGE_SIZE);
+
+    unsigned slot = _cache_slots ? page % _cache_slots : 0;
+    bool cached   = _cache_slots && _cache_tag[slot] == page + 1;
+    int len       = -1;
+
+    bool zero = PageCodec::is_zero(w.scratch);
+    PageCodec::Hash hash = { 0, 0 };
+    if (_hash && !zero) hash = PageCodec::hash(w.scratch);
+
+    if (zero) {
+        rec->encoding = MigrationPage::ZERO;
+        len = 0;
+        if (cached) _cache_tag[slot] = 0;
+    } else if (_hash && (cached ? !memcmp(_cache + slot * PAGE_SIZE, w.scratch, PAGE_SIZE)
+                                : hash == _hash[page])) {
+        /* Dirtied, but written back with what we sent last time. With
+         * the page still in the XBZRLE cache we compare the contents,
+         * otherwise only the hash is left. */
+        rec->encoding = MigrationPage::UNCHANGED;
+        len = 0;
+    } else {
+        if (cached) {
+            // A delta beyond a quarter page rarely beats LZ.
+            len = PageCodec::xbzrle_encode(_cache + slot * PAGE_SIZE, w.scratch,
+                    payload, PAGE_SIZE / 4);
+            rec->encoding = MigrationPage::XBZRLE;
+        }
+        if (len < 0 && config.lz) {
+            len = PageCodec::lz_compress(w.scratch, payload, PAGE_SIZE - 1);
+            rec->encoding = MigrationPage::LZ;
+        }
+        if (len < 0) {
+            memcpy(payload, w.scratch, PAGE_SIZE);
+            len = PAGE_SIZE;
+            rec->encoding = MigrationPage::RAW;
+        }
+        if (_cache_slots) {
+            memcpy(_cache + slot * PAGE_SIZE, w.scratch, PAGE_SIZE);
+            _cache_tag[slot] = page + 1;
+        }
+    }
+
+    if (_hash) _hash[page] = hash;
+    rec->length = len;
+    w.stats.pages[rec->encoding]++;
+    w.stats.bytes += sizeof(*rec) + len;
+}
+
+void PageEncoder::encode_share(Worker &w)
+{
+    /* Pages sharing a cache slot always go to the same worker, which
+     * handles them in stream order. */
+    unsigned workers = _worker_count + 1;
+    for (unsigned i=0; i < _batch_count; ++i) {
+        unsigned key = _cache_slots ? _batch[i] % _cache_slots : i;
+        if (key % workers == w.nr) encode_page(w, i);
+    }
+}
+
+void *PageEncoder::worker_fn(void *arg)
+{
+    Worker &w = *reinterpret_cast<Worker *>(arg);
+    PageEncoder *enc = w.encoder;
+
+    while (1) {
+        sem_wait(&w.go);
+        if (enc->_exit) break;
+        enc->encode_share(w);
+        sem_post(&enc->_done);
+    }
+    return NULL;
+}
+
+void PageEncoder::encode()
+{
+    for (unsigned i=1; i <= _worker_count; ++i) sem_post(&_workers[i].go);
+    encode_share(_workers[0]);
+    for (unsigned i=1; i <= _worker_count; ++i) sem_wait(&_done);
+}
+
+bool PageEncoder::decode(MigrationPage &rec, unsigned char *payload, unsigned char *page)
+{
+    switch (rec.encoding) {
+    case MigrationPage::RAW:
+        if (rec.length != PAGE_SIZE) return false;
+        memcpy(page, payload, PAGE_SIZE);
+        return true;
+    case MigrationPage::ZERO:
+        memset(page, 0, PAGE_SIZE);
+        return true;
+    case MigrationPage::XBZRLE:
+        return PageCodec::xbzrle_decode(page, payload, rec.length);
+    case MigrationPage::LZ:
+        return PageCodec::lz_decompress(page, payload, rec.length);
+    case MigrationPage::UNCHANGED:
+        return !rec.length;
+    default:
+        return false;
+    }
+}
+
+bool PageEncoder::receive_ranges(TcpSocket *sock, char *physmem, unsigned long physsize,
+        unsigned long &bytes, unsigned long &wire_bytes)
+{
+    Prd current;
+    unsigned char payload[PAGE_SIZE];
+
+    while (1) {
+        if (!sock->receive(&current, sizeof(current))) return false;
+        if (!current.value())
+            // Receiving an empty range descriptor means "EOF"
+            return true;
+        if (current.base() + current.size() > physsize) {
+            Logging::printf("Range %#x+%#x is outside of guest memory\n",
+                    current.base(), current.size());
+            return false;
+        }
+
+        // Every page of the range comes as its own encoded record
+        for (unsigned long off = 0; off < current.size(); off += PAGE_SIZE) {
+            MigrationPage rec;
+            if (!sock->receive(&rec, sizeof(rec)) || rec.length > sizeof(payload) ||
+                (rec.length && !sock->receive(payload, rec.length)))
+                return false;
+
+            unsigned char *page = reinterpret_cast<unsigned char *>(physmem + current.base() + off);
+            if (!decode(rec, payload, page)) {
+                Logging::printf("Could not decode page %#lx (encoding %u)\n",
+                        (current.base() + off) >> 12, rec.encoding);
+                return false;
+            }
+            wire_bytes += sizeof(rec) + rec.length;
+        }
+        bytes += current.size();
+    }
+}
+
+void PageEncoder::print_stats()
+{
+    Stats total;
+    memset(&total, 0, sizeof(total));
+    for (unsigned i=0; i <= _worker_count; ++i) {
+        for (unsigned j=0; j < MigrationPage::ENCODINGS; ++j)
+            total.pages[j] += _workers[i].stats.pages[j];
+        total.bytes += _workers[i].stats.bytes;
+    }
+
+    unsigned long pages = 0;
+    for (unsigned j=0; j < MigrationPage::ENCODINGS; ++j) pages += total.pages[j];
+    if (!pages) return;
+
+    Logging::printf("Page stream: %lu pages, %lu zero, %lu unchanged, %lu xbzrle, %lu lz, %lu raw."
+            " %llu KB on the wire (%llu%% of raw).\n",
+            pages, total.pages[MigrationPage::ZERO], total.pages[MigrationPage::UNCHANGED],
+            total.pages[MigrationPage::XBZRLE],
+            total.pages[MigrationPage::LZ], total.pages[MigrationPage::RAW],
+            total.bytes / 1024, 100ull * total.bytes / (pages * PAGE_SIZE));
+}
+
+/***********************************************************************
+ * Convergence
+ ***********************************************************************/
+
+ConvergenceControl::Config ConvergenceControl::config = { 300, 20, 10, 99 };
+
+bool ConvergenceControl::round_done(unsigned sent, unsigned dirtied, unsigned remaining, timevalue ms)
+{
+    ms = VMM_MAX(ms, 1ULL);
+    ++_round;
+
+    if (sent) {
+        unsigned rate = (static_cast<unsigned long long>(sent) << 12) / ms;
+        // A single slow batch should not spoil the estimate.
+        _bandwidth = _bandwidth ? (_bandwidth + rate) / 2 : rate;
+    }
+    _dirty_rate = (static_cast<unsigned long long>(dirtied) << 12) / ms;
+
+    if (expected_downtime(remaining) <= config.downtime) return true;
+
+    /* The guest dirtied more than half of what we could send.
+     * If that keeps happening, we never get below the downtime. */
+    if (2ULL * _dirty_rate <= _bandwidth) {
+        _stalled = 0;
+        return false;
+    }
+    if (++_stalled < STALLED) return false;
+    _stalled = 0;
+
+    if (_throttle >= config.throttle_max) {
+        // Nothing left to take away, a longer downtime it is.
+        _gave_up = true;
+        return true;
+    }
+    _throttle = VMM_MIN(_throttle ? _throttle + config.throttle_step : config.throttle_start,
+                        config.throttle_max);
+    return false;
+}
+
+unsigned long ConvergenceControl::throttle_sleep(timevalue now_us, timevalue &slice)
+{
+    unsigned throttle = _throttle;
+    if (!throttle) {
+        slice = 0;
+        return 0;
+    }
+    if (!slice) slice = now_us;
+    if (now_us - slice < SLICE_US) return 0;
+
+    // Run for a slice, then sleep long enough to lose the throttle share.
+    unsigned long sleep = static_cast<unsigned long long>(SLICE_US) * throttle / (100 - throttle);
+    slice = now_us + sleep;
+    return sleep;
+}
 
 Migration::Migration(Motherboard *mb)
 : _mb(mb),
@@ -38,8 +310,8 @@ Migration::Migration(Motherboard *mb)
     _vcpu_blocked_sem(cap, true),
     _vcpu_sem(cap+1, true),
 #endif
-    _vcpu_should_block(false),
-    _socket(NULL),
+    _vcpu_should_block(false), _handed_over(false),
+    _socket(NULL), _encoder(NULL), _postcopy(NULL),
     _sendmem(0), _sendmem_total(0),
     _freeze_timer(_mb->clock())
 {
@@ -48,6 +320,13 @@ Migration::Migration(Motherboard *mb)
 
 Migration::~Migration()
 {
+    /* The post-copy receiver uses our streams until the last page
+     * arrived. It kills the VM itself if that never happens. */
+    if (_postcopy) {
+        _postcopy->wait();
+        delete _postcopy;
+    }
+    delete _encoder;
 }
 
 void Migration::init_memrange_info()
@@ -60,7 +339,7 @@ void Migration::init_memrange_info()
     _physmem_start = msg.ptr;
     _physmem_size  = msg.len;
 
-    _dirtman = DirtManager(_physmem_size >> 12);
+    _dirtman.init(_physmem_size >> 12);
 }
 
 void Migration::save_guestregs(CpuState *utcb)
@@ -85,6 +364,15 @@ void Migration::save_guestregs(CpuState *utcb)
 #endif
 }
 
+unsigned long Migration::throttle_vcpu(timevalue &slice)
+{
+    if (!_converge.throttle()) {
+        slice = 0;
+        return 0;
+    }
+    return _converge.throttle_sleep(_mb->clock()->clock(1000000), slice);
+}
+
 /* This is used to print messages onto the screen
  * just after the VMM has started and waits for incoming
  * guest state data.
@@ -113,12 +401,23 @@ void Migration::freeze_vcpus()
 
     _vcpu_should_block = true;
 
+#if PORTED_TO_UNIX
     CpuEvent smsg(VCpu::EVENT_RESUME);
     for (VCpu *vcpu = _mb->last_vcpu; vcpu; vcpu=vcpu->get_last())
         vcpu->bus_event.send(smsg);
 
-#if PORTED_TO_UNIX
     _vcpu_blocked_sem.downmulti();
+#else
+    /* The frontend stops the vCPUs where they are. EVENT_RESUME
+     * would take a halted guest out of HLT. */
+    MessageHostOp msg(MessageHostOp::OP_VCPU_FREEZE, 1UL);
+    if (!_mb->bus_hostop.send(msg))
+        Logging::panic("%s failed to stop the vCPUs\n", __PRETTY_FUNCTION__);
+
+    mword vcpu_bytes = reinterpret_cast<mword>(&msg.vcpu_state->id+1);
+    vcpu_bytes -= reinterpret_cast<mword>(&msg.vcpu_state->mtd);
+
+    memcpy(&_vcpu_utcb->mtd, &msg.vcpu_state->mtd, vcpu_bytes);
 #endif
 
     _freeze_timer.start();
@@ -126,98 +425,250 @@ void Migration::freeze_vcpus()
 
 void Migration::unfreeze_vcpus()
 {
-    _vcpu_should_block = false;
 #if PORTED_TO_UNIX
+    _vcpu_should_block = false;
     /* After releasing the VCPU it will continue
      * through the rest of the recall handler.
      */
     _vcpu_sem.up();
+#else
+    /* The receiver runs listen() on its vCPU thread and never
+     * stopped anything. */
+    if (!_vcpu_should_block) return;
+    _vcpu_should_block = false;
+
+    MessageHostOp msg(MessageHostOp::OP_VCPU_FREEZE, 0UL);
+    _mb->bus_hostop.send(msg);
 #endif
 }
 
-bool Migration::chksum_page(unsigned page_nr, mword &their_chksum, bool compare)
+/***********************************************************************
+ * Verification
+ ***********************************************************************/
+
+struct HashShare {
+    const char         *physmem;
+    PageCodec::Hash    *out;
+    unsigned            first;
+    unsigned            count;
+};
+
+static void *hash_fn(void *arg)
+{
+    HashShare *s = reinterpret_cast<HashShare *>(arg);
+    for (unsigned i=s->first; i < s->first + s->count; ++i)
+        s->out[i] = PageCodec::hash(s->physmem + (static_cast<mword>(i) << 12));
+    return NULL;
+}
+
+void PageVerifier::hash_all(const char *physmem, unsigned pages, PageCodec::Hash *out)
 {
-    mword my_chksum = 0;
-    assert(page_nr < (_physmem_size >> 12));
+    unsigned threads = PageEncoder::config.workers + 1;
+    unsigned share   = (pages + threads - 1) / threads;
+    HashShare *shares = new HashShare[threads];
+    pthread_t *tids   = new pthread_t[threads];
+
+    // Share 0 is ours, a thread we cannot get leaves its share to us.
+    for (unsigned i=0; i < threads; ++i) {
+        shares[i].physmem = physmem;
+        shares[i].out     = out;
+        shares[i].first   = VMM_MIN(i * share, pages);
+        shares[i].count   = VMM_MIN(share, pages - shares[i].first);
+        if (i && 0 != pthread_create(&tids[i], NULL, hash_fn, &shares[i])) {
+            hash_fn(&shares[i]);
+            shares[i].count = 0;
+        }
+    }
+    hash_fn(&shares[0]);
+    for (unsigned i=1; i < threads; ++i)
+        if (shares[i].count) pthread_join(tids[i], NULL);
 
-    mword *ptr = reinterpret_cast<mword*>(_physmem_start + (page_nr << 12));
+    delete [] tids;
+    delete [] shares;
+}
 
-    for (unsigned i=0; i < 4096 / sizeof(ptr[0]); ++i)
-        // checksum = sum over (address_i * value_i^2)
-        my_chksum += reinterpret_cast<mword>(ptr+1) * (ptr[i]) * (ptr[i]);
+bool PageVerifier::send(TcpSocket *sock, char *physmem, unsigned long size, unsigned long &repaired)
+{
+    unsigned pages = size >> 12;
+    PageCodec::Hash *hashes = new PageCodec::Hash[pages];
+    hash_all(physmem, pages, hashes);
+    bool ok = sock->send(hashes, pages * sizeof(*hashes));
+    delete [] hashes;
+
+    /* Take all ranges before answering, the receiver does not read
+     * while it sends them. */
+    Prd *ranges = new Prd[pages];
+    unsigned count = 0;
+    while (ok) {
+        Prd range;
+        if (!(ok = sock->receive(&range, sizeof(range))) || !range.value()) break;
+        if (!(ok = count < pages && range.base() + range.size() <= size)) break;
+        ranges[count++] = range;
+    }
 
-    // Use case one: return true if given memory range is correct
-    if (compare) return my_chksum == their_chksum;
+    MigrationPage raw = { MigrationPage::RAW, PageEncoder::PAGE_SIZE };
+    for (unsigned c=0; ok && c < count; ++c) {
+        ok = sock->send(&ranges[c], sizeof(ranges[c]));
+        for (unsigned long off=0; ok && off < ranges[c].size(); off += PageEncoder::PAGE_SIZE)
+            ok = sock->send(&raw, sizeof(raw)) &&
+                sock->send(physmem + ranges[c].base() + off, PageEncoder::PAGE_SIZE);
+        repaired += ranges[c].size() >> 12;
+    }
+    delete [] ranges;
 
-    // Second use case: Provide a checksum for a given memory range
-    their_chksum = my_chksum;
-    return true;
+    Prd end_of_crds;
+    return ok && sock->send(&end_of_crds, sizeof(end_of_crds));
 }
 
-bool Migration::checksums(bool retrieve)
+bool PageVerifier::receive(TcpSocket *sock, char *physmem, unsigned long size, unsigned long &repaired)
 {
-    mword pagenr = 0;
-    mword checksum;
-    mword magic = 0xfafab0b0;
-    bool success = true;
+    unsigned pages = size >> 12;
+    PageCodec::Hash *ours   = new PageCodec::Hash[pages];
+    PageCodec::Hash *theirs = new PageCodec::Hash[pages];
+
+    // The sender hashes at the same time, its list waits in the socket.
+    hash_all(physmem, pages, ours);
+    bool ok = sock->receive(theirs, pages * sizeof(*theirs));
+
+    for (unsigned page=0; ok && page < pages;) {
+        if (ours[page] == theirs[page]) {
+            ++page;
+            continue;
+        }
 
-    if (retrieve) {
-        // Receiver. Check the existing checksum list against our memory
-        mword rec_magic;
+        unsigned len = 1;
+        while (page + len < pages && ours[page + len] != theirs[page + len]) ++len;
+        repaired += len;
 
-        _socket->receive(&rec_magic, sizeof(rec_magic));
-        _socket->receive(&pagenr, sizeof(pagenr));
-        _socket->receive(&checksum, sizeof(checksum));
+        // Cut the run into naturally aligned ranges
+        while (ok && len) {
+            Prd range(page, Cpu::minshift(page, len), Prd::VALID);
+            ok = sock->send(&range, sizeof(range));
+            page += 1 << range.order();
+            len  -= 1 << range.order();
+        }
+    }
+    delete [] theirs;
+    delete [] ours;
 
-        while (pagenr != ~0ul) {
-            assert(magic == rec_magic);
-            MessageMemRegion mmsg(pagenr);
-            assert(_mb->bus_memregion.send(mmsg, true));
-            assert(mmsg.actual_physmem);
+    Prd end_of_crds;
+    unsigned long bytes = 0, wire_bytes = 0;
+    return ok && sock->send(&end_of_crds, sizeof(end_of_crds)) &&
+        PageEncoder::receive_ranges(sock, physmem, size, bytes, wire_bytes);
+}
 
-            bool area_success = chksum_page(mmsg.start_page, checksum, true);
-            success &= area_success;
 
-            Logging::printf("Checksum of area [%8lx - %8lx) - %s\n",
-                reinterpret_cast<mword>(mmsg.start_page),
-                reinterpret_cast<mword>(mmsg.start_page + mmsg.count),
-                area_success ? "OK" : "Error");
+/***********************************************************************
+ * Parallel streams
+ ***********************************************************************/
 
-            _socket->receive(&rec_magic, sizeof(rec_magic));
-            _socket->receive(&pagenr, sizeof(pagenr));
-            _socket->receive(&checksum, sizeof(checksum));
-        }
+unsigned MigrationStreams::config_streams = 1;
+
+MigrationStreams::MigrationStreams()
+    : _count(1), _fn(NULL), _ctx(NULL), _exit(false)
+{
+    memset(_streams, 0, sizeof(_streams));
+    sem_init(&_done, 0, 0);
+}
+
+MigrationStreams::~MigrationStreams()
+{
+    _exit = true;
+    for (unsigned i=1; i < _count; ++i) {
+        sem_post(&_streams[i].go);
+        pthread_join(_streams[i].tid, NULL);
     }
-    else {
-        // Sender. Make a list of checksums and send it away.
+}
 
-        while (pagenr < _physmem_size) {
-            MessageMemRegion mmsg(pagenr);
-            if (!_mb->bus_memregion.send(mmsg, true) || !mmsg.actual_physmem) {
-                // No one claims this region. do not check.
-                ++pagenr;
-                continue;
-            }
+Prd MigrationStreams::clip(Prd range)
+{
+    const unsigned chunk = 1u << CHUNK_ORDER;
+    unsigned page  = range.base() >> 12;
+    unsigned order = range.order();
 
-            Logging::printf("Checksumming the area [%8lx - %8lx)\n",
-                reinterpret_cast<mword>(mmsg.start_page),
-                reinterpret_cast<mword>(mmsg.start_page + mmsg.count));
+    while (order && (page & (chunk - 1)) + (1u << order) > chunk) --order;
+    return order == range.order() ? range : Prd(page, order, range.attr());
+}
 
-            chksum_page(pagenr, checksum, false);
-            success &= _socket->send(&magic, sizeof(magic));
-            success &= _socket->send(&pagenr, sizeof(pagenr));
-            success &= _socket->send(&checksum, sizeof(checksum));
+void *MigrationStreams::stream_fn(void *arg)
+{
+    Stream &s = *reinterpret_cast<Stream *>(arg);
 
-            pagenr += mmsg.count;
-        }
+    while (1) {
+        sem_wait(&s.go);
+        if (s.set->_exit) break;
+        s.ok = s.set->_fn(s.set->_ctx, s.socket, s.nr);
+        sem_post(&s.set->_done);
+    }
+    return NULL;
+}
 
-        pagenr = ~0ul;
-        success &= _socket->send(&magic, sizeof(magic));
-        success &= _socket->send(&pagenr, sizeof(pagenr));
-        success &= _socket->send(&pagenr, sizeof(pagenr));
+void MigrationStreams::start_threads()
+{
+    for (unsigned i=0; i < _count; ++i) {
+        Stream &s = _streams[i];
+        s.set = this;
+        s.nr  = i;
+        sem_init(&s.go, 0, 0);
+        // Stream 0 is run by the caller
+        if (i && 0 != pthread_create(&s.tid, NULL, stream_fn, &s))
+            Logging::panic("Could not create migration stream thread.\n");
     }
+}
+
+bool MigrationStreams::run(StreamFn fn, void *ctx)
+{
+    _fn  = fn;
+    _ctx = ctx;
+    for (unsigned i=1; i < _count; ++i) sem_post(&_streams[i].go);
+
+    bool ok = fn(ctx, _streams[0].socket, 0);
+    for (unsigned i=1; i < _count; ++i) sem_wait(&_done);
+    for (unsigned i=1; i < _count; ++i) ok &= _streams[i].ok;
+    return ok;
+}
 
-    return success;
+bool MigrationStreams::connect(unsigned long addr, unsigned long port, unsigned count,
+        TcpSocket *control)
+{
+    _count = VMM_MAX(1u, VMM_MIN(count, static_cast<unsigned>(MAX_STREAMS)));
+    _streams[0].socket = control;
+
+    for (unsigned i=1; i < _count; ++i) {
+        MigrationStreamHello hello(i);
+        _streams[i].socket = IpHelper::instance().connect(addr, port);
+        if (!_streams[i].socket || !_streams[i].socket->send(&hello, sizeof(hello))) {
+            Logging::printf("Could not open migration stream %u.\n", i);
+            _count = i;
+            start_threads();
+            return false;
+        }
+    }
+    start_threads();
+    return true;
+}
+
+bool MigrationStreams::accept(unsigned port, unsigned count, TcpSocket *control)
+{
+    if (count < 1 || count > MAX_STREAMS) return false;
+
+    _count = count;
+    _streams[0].socket = control;
+
+    // Streams may connect in any order, the hello tells us which one it is.
+    for (unsigned i=1; i < _count; ++i) {
+        MigrationStreamHello hello;
+        TcpSocket *sock = IpHelper::instance().listen(port);
+        if (!sock || !sock->receive(&hello, sizeof(hello)) || !hello.magic_string_check() ||
+            !hello.nr || hello.nr >= _count || _streams[hello.nr].socket) {
+            Logging::printf("Bad migration stream connection.\n");
+            _count = 1;
+            return false;
+        }
+        _streams[hello.nr].socket = sock;
+    }
+    start_threads();
+    return true;
 }
 
 
@@ -242,7 +693,7 @@ bool Migration::receive_ping()
     return true;
 }
 
-void Migration::receive_header()
+unsigned Migration::receive_header(bool &postcopy, bool &verify)
 {
     MigrationHeader mig_header;
 
@@ -251,34 +702,57 @@ void Migration::receive_header()
     _socket->receive(&mig_header, sizeof(mig_header));
     if (!mig_header.magic_string_check())
         Logging::panic("Magic string check failed: MigrationHeader\n");
+    if (mig_header.version != MIGRATION_VERSION)
+        Logging::panic("Migration stream version %lu, expected %u\n",
+                mig_header.version, MIGRATION_VERSION);
 
     MessageRestore vgamsg(MessageRestore::VGA_VIDEOMODE, NULL, true);
     vgamsg.bytes = mig_header.videomode;
     _mb->bus_restore.send(vgamsg, true);
+
+    postcopy = mig_header.postcopy;
+    verify   = mig_header.verify;
+    return mig_header.streams;
+}
+
+struct ReceiveContext {
+    char          *physmem;
+    unsigned long  physsize;
+    unsigned long  bytes[MigrationStreams::MAX_STREAMS];
+    unsigned long  wire_bytes[MigrationStreams::MAX_STREAMS];
+};
+
+static bool receive_stream(void *ctx, TcpSocket *socket, unsigned nr)
+{
+    ReceiveContext *c = reinterpret_cast<ReceiveContext *>(ctx);
+    return PageEncoder::receive_ranges(socket, c->physmem, c->physsize,
+            c->bytes[nr], c->wire_bytes[nr]);
 }
 
 void Migration::receive_memory()
 {
     StopWatch watch(_mb->clock());
-    Logging::printf("Receiving guest memory.\n");
+    Logging::printf("Receiving guest memory over %u stream%s.\n",
+            _streams.count(), _streams.count() == 1 ? "" : "s");
 
-    Prd current;
-    unsigned long bytes = 0;
+    ReceiveContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.physmem  = _physmem_start;
+    ctx.physsize = _physmem_size;
 
     watch.start();
-    while (1) {
-        _socket->receive(&current, sizeof(current));
-        if (!current.value())
-            // Receiving an empty range descriptor means "EOF"
-            break;
+    if (!_streams.run(receive_stream, &ctx))
+        Logging::panic("Receiving guest memory failed.\n");
+    watch.stop();
 
-        _socket->receive(current.base() + _physmem_start, current.size());
-        bytes += current.size();
+    unsigned long bytes = 0, wire_bytes = 0;
+    for (unsigned i=0; i < _streams.count(); ++i) {
+        bytes      += ctx.bytes[i];
+        wire_bytes += ctx.wire_bytes[i];
     }
-    watch.stop();
 
-    Logging::printf("Received %lu MB. RX Rate: %u KB/s\n",
-            bytes / 1024 / 1024, watch.rate(bytes));
+    Logging::printf("Received %lu MB (%lu MB on the wire). RX Rate: %u KB/s\n",
+            bytes / 1024 / 1024, wire_bytes / 1024 / 1024, watch.rate(wire_bytes));
 }
 
 /* Being equipped with a pointer to the stopped VCPU's
@@ -358,19 +832,30 @@ bool Migration::listen(unsigned port, CpuState *vcpu_utcb)
 
     receive_ping();
 
-    receive_header();
-
-    receive_memory();
+    bool postcopy, verify;
+    unsigned streams = receive_header(postcopy, verify);
+    if (!_streams.accept(port, streams, _socket))
+        Logging::panic("Could not set up %u migration streams.\n", streams);
+
+    if (postcopy) {
+        /* Memory follows on stream 1 while the guest already runs.
+         * The receiver outlives this call, it has to serve faults
+         * until the last page arrived. */
+        _postcopy = new PostcopyReceiver(_streams.socket(1),
+                _physmem_start, _physmem_size);
+        if (!_postcopy->start())
+            Logging::panic("Could not start post-copy receiver.\n");
+    } else
+        receive_memory();
 
     receive_guestdevices(vcpu_utcb);
 
-#ifdef DO_CHECKSUMMING
-    // Checksumming really makes the migration gap larger
-    if (!checksums(true)) {
-        Logging::printf("Error while comparing checksums.\n");
+    unsigned long repaired = 0;
+    if (verify && !PageVerifier::receive(_socket, _physmem_start, _physmem_size, repaired)) {
+        Logging::printf("Error while verifying guest memory.\n");
         return false;
     }
-#endif
+    if (repaired) Logging::printf("Repaired %lu pages of guest memory.\n", repaired);
 
     _socket->close();
 
@@ -433,7 +918,7 @@ bool Migration::send_header()
     MessageRestore vgamsg(MessageRestore::VGA_VIDEOMODE, NULL, false);
     _mb->bus_restore.send(vgamsg, true);
 
-    MigrationHeader mig_header(vgamsg.bytes);
+    MigrationHeader mig_header(vgamsg.bytes, streams(), config_postcopy, verify());
     return _socket->send(&mig_header, sizeof(mig_header));
 }
 
@@ -464,12 +949,10 @@ timevalue Migration::send_ping()
         msg.value; \
 })
 
-unsigned Migration::enqueue_all_dirty_pages(longrange_data &async_data)
+unsigned Migration::collect_dirty_pages()
 {
-    Prd *crds = async_data.crds;
-    unsigned crds_sent=0;
-
     Prd first_crd, last_crd;
+    unsigned fresh = 0;
 
     /* This loop will cycle through the memory space
      * until it ends up without any new dirty regions
@@ -485,45 +968,70 @@ unsigned Migration::enqueue_all_dirty_pages(longrange_data &async_data)
             break;
 
         /* These pages are just _marked_ dirty in another data structure,
-         * the dirt manager.
-         * This structure might be able to apply some smart optimizations
-         * in the future like e.g. "don't resend pages too often which are dirtied
-         * with high access-frequency to reduce traffic", etc.
+         * the dirt manager. It counts how often every page got dirty,
+         * which tells us the hot ones.
          */
-        _dirtman.mark_dirty(current);
+        fresh += _dirtman.mark_dirty(current);
 
         if (!first_crd.value()) first_crd = current;
         last_crd = current;
     }
 
-    unsigned pages_enqueued = 0;
+    return fresh;
+}
+
+bool Migration::enqueue_dirty_pages(longrange_data &async_data, unsigned hot_rounds, unsigned &pages)
+{
+    Prd *crds = async_data.crds;
+    unsigned crds_sent=0;
+
+    /* The previous batch was ACKed by now (wait_complete), so its
+     * encoded records can go. Collect as many ranges as fit into
+     * one batch, encode them in parallel and send them in order.
+     */
+    _encoder->reset();
+
+    pages = 0;
     while (_dirtman.dirty_pages() > 0 && crds_sent < async_data.crd_count) {
-        Prd current = crds[crds_sent] = _dirtman.next_dirty();
+        Prd current = _dirtman.next_dirty(hot_rounds);
         if (!current.value())
             // That's it for now.
             break;
 
-        _dirtman.mark_clean(current);
+        // Split ranges which do not fit into the batch or cross a stream chunk
+        current = MigrationStreams::clip(current);
+        unsigned order = current.order();
+        while (order && (1u << order) > _encoder->room()) --order;
+        if ((1u << order) > _encoder->room()) break;
+        current = crds[crds_sent] = Prd(current.base() >> 12, order, Prd::VALID);
 
-        if (!_socket->send_nonblocking(&crds[crds_sent], sizeof(*crds)) ||
-            !_socket->send_nonblocking(current.base() + _physmem_start,
-                current.size()))
-            return 0;
+        _dirtman.mark_clean(current);
+        for (unsigned i=0; i < (1u << order); ++i)
+            _encoder->add((current.base() >> 12) + i);
 
         ++crds_sent;
-        pages_enqueued += 1 << current.order();
     }
 
-    return pages_enqueued;
+    _encoder->encode();
+
+    for (unsigned c=0, idx=0; c < crds_sent; ++c) {
+        unsigned stream = _streams.stream_of(crds[c]);
+        if (!_streams.send_nonblocking(stream, &crds[c], sizeof(*crds)))
+            return false;
+
+        for (unsigned i=0; i < (1u << crds[c].order()); ++i, ++idx)
+            if (!_streams.send_nonblocking(stream, _encoder->record(idx), _encoder->record_size(idx)))
+                return false;
+
+        pages += 1 << crds[c].order();
+    }
+
+    return true;
 }
 
 bool Migration::send_memory(longrange_data &async_data)
 {
     StopWatch lap_time(_mb->clock());
-    StopWatch last_lap(_mb->clock());
-
-    unsigned transfer_rate;
-    unsigned dirtying_rate;
 
     /* The underlying socket architecture works a little bit different than
      * BSD sockets, where you stuff data to be sent into the send buffer
@@ -535,66 +1043,83 @@ bool Migration::send_memory(longrange_data &async_data)
      */
 
     const unsigned page_limit = 1000;
-    unsigned pages_transferred;
-    unsigned round = 0;
+    unsigned pages_transferred, pages;
     async_data.crds = new Prd[page_limit];
     async_data.crd_count = page_limit;
 
     MessageRestore unplug_msg(MessageRestore::PCI_PLUG, NULL, false);
     _mb->bus_restore.send(unplug_msg, false);
 
+    /* Every round sends what got dirty during the previous one.
+     * Pages that keep getting dirty wait for the frozen round,
+     * as long as they fit into it.
+     */
+    collect_dirty_pages();
+    bool converged;
     do {
-        last_lap = lap_time;
-        lap_time.start();
-
-        if (!(pages_transferred = enqueue_all_dirty_pages(async_data)) ||
-            !_socket->wait_complete())
-            return false;
+        unsigned hot_rounds = ConvergenceControl::HOT_ROUNDS;
+        if (!_converge.round() || _dirtman.hot_pages(hot_rounds) > _converge.budget())
+            hot_rounds = ~0u;
 
+        lap_time.start();
+        pages_transferred = 0;
+        do {
+            if (!enqueue_dirty_pages(async_data, hot_rounds, pages) ||
+                !_streams.wait_complete())
+                return false;
+            pages_transferred += pages;
+        } while (pages);
+        unsigned dirtied = collect_dirty_pages();
         lap_time.stop();
 
-        transfer_rate = lap_time.rate(pages_transferred << 12);
-        dirtying_rate = last_lap.rate(pages_transferred << 12);
-        Logging::printf("RND %u PAGE_CNT %5u TX %5u KB/s DRT %5u KB/s DELTA"
-                " %llu START %llu\n",
-                round, pages_transferred, transfer_rate, dirtying_rate,
+        converged = _converge.round_done(pages_transferred, dirtied, _dirtman.dirty_pages(),
+                                         lap_time.delta());
+        Logging::printf("RND %u PAGE_CNT %5u TX %5u KB/s DRT %5u KB/s LEFT %5u THROTTLE %2u%%"
+                " DELTA %llu START %llu\n",
+                _converge.round() - 1, pages_transferred, _converge.bandwidth(),
+                _converge.dirty_rate(), _dirtman.dirty_pages(), _converge.throttle(),
                 lap_time.delta(), lap_time.abs_start());
 
-        assert(pages_transferred);
-
         _sendmem_total += pages_transferred << 12;
         if (_sendmem == 0) _sendmem = _sendmem_total;
-        ++round;
-    } while (transfer_rate >= dirtying_rate);
+    } while (!converged);
+
+    if (_converge.gave_up())
+        Logging::printf("Guest dirties memory faster than we can send it, even throttled.\n");
 
     // The last transfer round with a frozen guest system will follow now
     freeze_vcpus();
+    _converge.unthrottle();
 
-    unsigned freeze_pages = 0;
-    while ((freeze_pages = enqueue_all_dirty_pages(async_data)) > 0) {
-        if (!_socket->wait_complete()) return false;
-        pages_transferred += freeze_pages;
-    }
+    collect_dirty_pages();
+    unsigned expected = _converge.expected_downtime(_dirtman.dirty_pages());
+    pages_transferred = 0;
+    do {
+        if (!enqueue_dirty_pages(async_data, ~0u, pages) || !_streams.wait_complete())
+            return false;
+        pages_transferred += pages;
+    } while (pages);
 
+    // Every stream ends with its own end marker
     static Prd end_of_crds;
-    if (!pages_transferred ||
-        !_socket->send_nonblocking(&end_of_crds, sizeof(end_of_crds)))
-        return false;
+    for (unsigned i=0; i < _streams.count(); ++i)
+        if (!_streams.send_nonblocking(i, &end_of_crds, sizeof(end_of_crds)))
+            return false;
+    if (!_streams.wait_complete()) return false;
 
-    Logging::printf("Enqueued the last %u dirty pages\n", pages_transferred);
+    Logging::printf("Enqueued the last %u dirty pages, expected to take %u ms\n",
+            pages_transferred, expected);
     return true;
 }
 
 bool Migration::send_devices(longrange_data dat)
 {
     // Send VCPU state
-#if PORTED_TO_UNIX
-    unsigned vcpu_bytes = reinterpret_cast<unsigned>(&_vcpu_utcb->id+1);
-    vcpu_bytes -= reinterpret_cast<unsigned>(&_vcpu_utcb->mtd);
+    mword vcpu_bytes = reinterpret_cast<mword>(&_vcpu_utcb->id+1);
+    vcpu_bytes -= reinterpret_cast<mword>(&_vcpu_utcb->mtd);
 
     if (!_socket->send(&_vcpu_utcb->mtd, vcpu_bytes))
         return false;
-#endif
 
     /* There are multiple RESTORE_xxx types of restore messages.
      * For each kind of device there is one.
@@ -663,11 +1188,34 @@ bool Migration::send_devices(longrange_data dat)
 }
 
 bool Migration::send(unsigned long addr, unsigned long port)
+{
+    // The stream carries the state of a single vCPU.
+    if (_mb->last_vcpu && _mb->last_vcpu->get_last()) {
+        Logging::printf("Quitting: Cannot migrate more than one vCPU.\n");
+        return false;
+    }
+
+    if (send_guest(addr, port)) return true;
+
+    /* Let the guest run on if it was stopped for nothing. Once the
+     * target has the devices, it may run the guest already. */
+    if (!_handed_over) {
+        if (config_postcopy) {
+            MessageRestore replug_msg(MessageRestore::PCI_PLUG, NULL, true);
+            _mb->bus_restore.send(replug_msg, false);
+        }
+        unfreeze_vcpus();
+    }
+    return false;
+}
+
+bool Migration::send_guest(unsigned long addr, unsigned long port)
 {
     StopWatch migration_timer(_mb->clock());
     longrange_data async_data;
 
     init_memrange_info();
+    _encoder = new PageEncoder(_physmem_start, _physmem_size);
 
     Logging::printf("Trying to connect...\n");
     _socket = IpHelper::instance().connect(addr, port);
@@ -710,28 +1258,58 @@ bool Migration::send(unsigned long addr, unsigned long port)
         Logging::printf("Sending header failed.\n");
         return false;
     }
-    if (!send_memory(async_data)) {
-        Logging::printf("Sending guest state failed.\n");
+    if (!_streams.connect(addr, mig_port, streams(), _socket)) {
+        Logging::printf("Opening parallel streams failed.\n");
         return false;
     }
 
-    if (!send_devices(async_data)) {
-        Logging::printf("Sending guest devices failed.\n");
-        return false;
+    if (config_postcopy) {
+        /* Stop the guest right away and let the target run it as soon
+         * as the devices arrived. Memory follows on stream 1. */
+        MessageRestore unplug_msg(MessageRestore::PCI_PLUG, NULL, false);
+        _mb->bus_restore.send(unplug_msg, false);
+        freeze_vcpus();
+
+        PostcopySender pc(_streams.socket(1), _physmem_start, _physmem_size);
+        pc.start();
+        if (!send_devices(async_data)) {
+            Logging::printf("Sending guest devices failed.\n");
+            return false;
+        }
+        _handed_over = true;
+        _freeze_timer.stop();
+        if (!pc.wait()) {
+            Logging::printf("Post-copy memory transfer failed.\n");
+            return false;
+        }
+        _sendmem = _sendmem_total = _physmem_size;
+    } else {
+        bool sent = send_memory(async_data);
+        // Never leave the guest throttled, whatever happened.
+        _converge.unthrottle();
+        if (!sent) {
+            Logging::printf("Sending guest state failed.\n");
+            return false;
+        }
+
+        if (!send_devices(async_data)) {
+            Logging::printf("Sending guest devices failed.\n");
+            return false;
+        }
+        _handed_over = true;
     }
 
-#ifdef DO_CHECKSUMMING
-    // Checksumming really makes the freeze gap larger
-    if (!checksums(false)) {
-        Logging::printf("Error while sending checksums.\n");
+    unsigned long repaired = 0;
+    if (verify() && !PageVerifier::send(_socket, _physmem_start, _physmem_size, repaired)) {
+        Logging::printf("Error while verifying guest memory.\n");
         return false;
     }
-#endif
+    if (repaired) Logging::printf("Resent %lu pages that did not arrive intact.\n", repaired);
 
     // Uncomment this to "clone" the VM instead of migrating it away.
     //unfreeze_vcpus();
 
-    _freeze_timer.stop();
+    if (!config_postcopy) _freeze_timer.stop();
 
     _socket->close();
 
@@ -745,6 +1323,7 @@ bool Migration::send(unsigned long addr, unsigned long port)
             (_sendmem_total - _sendmem) / 1024u / 1024u);
 
     _dirtman.print_stats();
+    _encoder->print_stats();
 
     delete [] async_data.crds;
     delete [] async_data.restore_buf;
@@ -755,6 +1334,56 @@ bool Migration::send(unsigned long addr, unsigned long port)
     return true;
 }
 
+PARAM_HANDLER(migration_compress,
+	      "migration_compress:workers,cache_pages,lz - configure the outgoing migration page stream.",
+	      "Example: 'migration_compress:4,32768,0' uses 4 extra encoder threads,",
+	      "a XBZRLE cache of 128 MB and disables LZ compression.")
+{
+    if (argv[0] != ~0UL) PageEncoder::config.workers     = argv[0];
+    if (argv[1] != ~0UL) PageEncoder::config.cache_pages = argv[1];
+    if (argv[2] != ~0UL) PageEncoder::config.lz          = argv[2];
+}
+
+PARAM_HANDLER(migration_streams,
+	      "migration_streams:count - stripe outgoing migrations over count TCP connections.",
+	      "Example: 'migration_streams:4'")
+{
+    if (argv[0] != ~0UL)
+        MigrationStreams::config_streams = VMM_MAX(1UL, VMM_MIN(argv[0],
+                static_cast<unsigned long>(MigrationStreams::MAX_STREAMS)));
+}
+
+PARAM_HANDLER(migration_converge,
+	      "migration_converge:downtime,throttle_start,throttle_step,throttle_max - bound the downtime of a migration.",
+	      "Example: 'migration_converge:100' freezes the guest once the rest is sent within 100 ms (default 300).",
+	      "A guest that dirties memory too fast loses throttle_start percent (20) of its vCPU time,",
+	      "and throttle_step (10) more every time that was not enough, up to throttle_max (99).")
+{
+    ConvergenceControl::Config &c = ConvergenceControl::config;
+    if (argv[0] != ~0UL) c.downtime       = argv[0];
+    if (argv[1] != ~0UL) c.throttle_start = VMM_MIN(argv[1], 99UL);
+    if (argv[2] != ~0UL) c.throttle_step  = argv[2];
+    if (argv[3] != ~0UL) c.throttle_max   = VMM_MIN(argv[3], 99UL);
+}
+
+bool Migration::config_postcopy = false;
+
+PARAM_HANDLER(migration_postcopy,
+	      "migration_postcopy - start the guest on the target before its memory arrived.",
+	      "Missing pages are fetched on demand. Uses at least two streams.")
+{
+    Migration::config_postcopy = true;
+}
+
+bool Migration::config_verify = true;
+
+PARAM_HANDLER(migration_verify,
+	      "migration_verify:enable - compare page hashes after a migration and resend broken pages.",
+	      "On by default, 'migration_verify:0' turns it off. Not done with post-copy.")
+{
+    if (argv[0] != ~0UL) Migration::config_verify = argv[0];
+}
+
 PARAM_HANDLER(retrieve_guest,
 	      "retrieve_guest:<port> - Start a VMM instance which waits for guest",
           " state input over network listening on <port>")
@@ -0,0 +1,532 @@
+/** @file
+ * Shared virtio definitions: split virtqueues and the modern PCI
+ * transport.
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+#include "nul/motherboard.h"
+#include "nul/types.h"
+#include "model/pci.h"
+
+/**
+ * A split virtqueue that lives in guest memory.
+ *
+ * The three rings are mapped once when the driver enables the queue,
+ * so the fast path only touches host pointers.
+ */
+struct VirtQueue
+{
+  enum {
+    MAX_SIZE            = 256,
+    DESC_F_NEXT         = 1,
+    DESC_F_WRITE        = 2,
+    DESC_F_INDIRECT     = 4,
+    AVAIL_F_NO_INTERRUPT = 1,
+    NO_VECTOR           = 0xffff,
+  };
+
+  struct Desc {
+    uint64 addr;
+    uint32 len;
+    uint16 flags;
+    uint16 next;
+  };
+
+  struct UsedElem {
+    uint32 id;
+    uint32 len;
+  };
+
+  // Registers as seen through the common configuration.
+  unsigned size;
+  unsigned vector;
+  bool     enabled;
+  uint64   desc_addr;
+  uint64   avail_addr;
+  uint64   used_addr;
+
+  // Host view of the rings, valid while enabled.
+  Desc              *desc;
+  volatile uint16   *avail;     ///< flags, idx, ring[size], used_event
+  volatile uint16   *used;      ///< flags, idx, then the used ring
+  UsedElem          *used_ring;
+  unsigned short     last_avail;
+  unsigned short     signalled;
+
+  static char *guest_ptr(DBus<MessageMemRegion> &bus_memregion, uint64 addr, size_t len)
+  {
+    MessageMemRegion msg(addr >> 12);
+    if (!bus_memregion.send(msg) || !msg.ptr || addr + len > (uint64(msg.start_page) + msg.count) << 12)
+      return 0;
+    return msg.ptr + (addr - (uint64(msg.start_page) << 12));
+  }
+
+  void reset()
+  {
+    memset(this, 0, sizeof(*this));
+    size   = MAX_SIZE;
+    vector = NO_VECTOR;
+  }
+
+  /**
+   * Map the rings. Returns false if any of them is outside guest RAM.
+   */
+  bool map(DBus<MessageMemRegion> &bus_memregion)
+  {
+    desc  = reinterpret_cast<Desc *>(guest_ptr(bus_memregion, desc_addr, sizeof(Desc) * size));
+    avail = reinterpret_cast<volatile uint16 *>(guest_ptr(bus_memregion, avail_addr, 6 + 2 * size));
+    used  = reinterpret_cast<volatile uint16 *>(guest_ptr(bus_memregion, used_addr, 6 + sizeof(UsedElem) * size));
+    if (!size || desc_addr & 0xf || avail_addr & 1 || used_addr & 3 || !desc || !avail || !used) return false;
+
+    used_ring  = reinterpret_cast<UsedElem *>(const_cast<uint16 *>(used) + 2);
+    last_avail = avail[1];
+    signalled  = used[1];
+    enabled    = true;
+    return true;
+  }
+
+  /**
+   * Take the next chain head from the available ring.
+   */
+  bool pop(unsigned &head)
+  {
+    if (last_avail == avail[1]) return false;
+    __sync_synchronize();
+    head = avail[2 + last_avail++ % size];
+    return true;
+  }
+
+  /**
+   * Tell the driver up to which entry we are going to look before the
+   * next notification. Returns true if new entries raced in meanwhile.
+   */
+  bool publish_avail_event()
+  {
+    used[2 + 4 * size] = last_avail;
+    __sync_synchronize();
+    return last_avail != avail[1];
+  }
+
+  /**
+   * Descriptor i of a chain, or null if the driver handed us garbage.
+   */
+  Desc *get(unsigned i) { return i < size ? desc + i : 0; }
+
+  void push(unsigned head, unsigned len)
+  {
+    UsedElem &e = used_ring[used[1] % size];
+    e.id  = head;
+    e.len = len;
+    __sync_synchronize();
+    used[1]++;
+  }
+
+  /**
+   * Does the driver want an interrupt for the entries we added since
+   * the last one? With EVENT_IDX, only if we crossed used_event.
+   */
+  bool need_signal(bool event_idx)
+  {
+    __sync_synchronize();
+    unsigned short old = signalled, now = used[1];
+    signalled = now;
+    if (old == now) return false;
+    if (!event_idx) return !(avail[0] & AVAIL_F_NO_INTERRUPT);
+    unsigned short event = avail[2 + size];
+    return static_cast<unsigned short>(now - event - 1) < static_cast<unsigned short>(now - old);
+  }
+};
+
+
+/**
+ * The virtio 1.0 PCI transport. A device derives from it, provides its
+ * features, configuration space and queue handling, and forwards
+ * MessageMem and MessagePciConfig here.
+ *
+ * Everything lives in a single 16k memory BAR. Every queue has its own
+ * notification dword, so notifications need no decoding.
+ */
+class VirtioPciDevice
+{
+public:
+  enum {
+    MAX_QUEUES   = 16,
+    BAR_MASK     = 0xffffc000,
+
+    // BAR layout
+    COMMON_CFG   = 0x0000,
+    COMMON_LEN   = 0x38,
+    ISR_CFG      = 0x1000,
+    DEVICE_CFG   = 0x2000,
+    NOTIFY_CFG   = 0x3000,
+    NOTIFY_MUL   = 4,
+    MSIX_TABLE   = 0x3800,
+    MSIX_PBA     = 0x3c00,
+    MSIX_VECTORS = MAX_QUEUES + 1,
+
+    // PCI capabilities
+    CAP_COMMON   = 0x40,
+    CAP_NOTIFY   = 0x50,
+    CAP_ISR      = 0x64,
+    CAP_DEVICE   = 0x74,
+    CAP_MSIX     = 0x84,
+
+    // device status
+    STATUS_ACKNOWLEDGE = 1,
+    STATUS_DRIVER      = 2,
+    STATUS_DRIVER_OK   = 4,
+    STATUS_FEATURES_OK = 8,
+    STATUS_NEEDS_RESET = 0x40,
+    STATUS_FAILED      = 0x80,
+
+    // transport features
+    F_RING_EVENT_IDX   = 29,
+    F_VERSION_1        = 32,
+  };
+
+private:
+  DBus<MessageIrqLines>  &_bus_irqlines;
+
+  unsigned _bdf;
+  unsigned _pci_id;
+  unsigned _pci_class;
+  unsigned _device_cfg_len;
+  unsigned _cmd_sts;
+  unsigned _bar;
+  unsigned _intr;
+  unsigned _msix_ctrl;
+
+  unsigned _device_feature_select;
+  unsigned _driver_feature_select;
+  unsigned _msix_config;
+  unsigned _queue_select;
+  unsigned _generation;
+  unsigned _isr;
+
+  struct MsixEntry {
+    uint32 addr_lo;
+    uint32 addr_hi;
+    uint32 data;
+    uint32 ctrl;
+  } _msix[MSIX_VECTORS];
+  unsigned _msix_pending;
+
+  /*
+   * Noncopyable
+   */
+  VirtioPciDevice(VirtioPciDevice const &);
+  VirtioPciDevice &operator = (VirtioPciDevice const &);
+
+  bool msix_enabled() { return _msix_ctrl & 0x80000000; }
+
+  void msix_deliver(unsigned vector)
+  {
+    MsixEntry &e = _msix[vector];
+    if (_msix_ctrl & 0x40000000 || e.ctrl & 1) {
+      _msix_pending |= 1 << vector;
+      return;
+    }
+    _msix_pending &= ~(1 << vector);
+    MessageMem msg(false, static_cast<uintptr_t>(uint64(e.addr_hi) << 32 | e.addr_lo), &e.data);
+    _bus_mem.send(msg);
+  }
+
+  void msix_unmasked()
+  {
+    for (unsigned v = 0; v < MSIX_VECTORS; v++)
+      if (_msix_pending & (1 << v)) msix_deliver(v);
+  }
+
+  void interrupt(unsigned vector, unsigned isr)
+  {
+    if (msix_enabled()) {
+      if (vector < MSIX_VECTORS) msix_deliver(vector);
+      return;
+    }
+    _isr |= isr;
+    if (~_cmd_sts & 0x400) {
+      MessageIrqLines msg(MessageIrq::ASSERT_IRQ, _intr & 0xff);
+      _bus_irqlines.send(msg);
+    }
+  }
+
+  VirtQueue *selected() { return _queue_select < _num_queues ? _queues + _queue_select : 0; }
+
+  bool common_read(unsigned offset, unsigned &value)
+  {
+    VirtQueue *q = selected();
+    switch (offset) {
+    case 0x00: value = _device_feature_select; break;
+    case 0x04: value = _device_feature_select < 2 ? device_features() >> (32 * _device_feature_select) : 0; break;
+    case 0x08: value = _driver_feature_select; break;
+    case 0x0c: value = _driver_feature_select < 2 ? _driver_features >> (32 * _driver_feature_select) : 0; break;
+    case 0x10: value = _num_queues << 16 | _msix_config; break;
+    case 0x14: value = _queue_select << 16 | _generation << 8 | _status; break;
+    case 0x18: value = q ? q->vector << 16 | q->size : 0; break;
+    case 0x1c: value = q ? _queue_select << 16 | q->enabled : 0; break;
+    case 0x20: value = q ? q->desc_addr       : 0; break;
+    case 0x24: value = q ? q->desc_addr >> 32 : 0; break;
+    case 0x28: value = q ? q->avail_addr       : 0; break;
+    case 0x2c: value = q ? q->avail_addr >> 32 : 0; break;
+    case 0x30: value = q ? q->used_addr       : 0; break;
+    case 0x34: value = q ? q->used_addr >> 32 : 0; break;
+    default: return false;
+    }
+    return true;
+  }
+
+  void set_half(uint64 &reg, bool high, unsigned value)
+  {
+    if (high) reg = (reg & 0xffffffffull) | uint64(value) << 32;
+    else      reg = (reg & ~0xffffffffull) | value;
+  }
+
+  void write_status(unsigned status)
+  {
+    if (!status) {
+      if (_status) reset();
+      return;
+    }
+
+    // The driver may only ask for what we offered.
+    if (status & ~_status & STATUS_FEATURES_OK &&
+        (_driver_features & ~device_features() || !has_feature(F_VERSION_1)))
+      status &= ~STATUS_FEATURES_OK;
+    _status = status | (_status & STATUS_NEEDS_RESET);
+  }
+
+  bool common_write(unsigned offset, unsigned value)
+  {
+    VirtQueue *q = selected();
+    switch (offset) {
+    case 0x00: _device_feature_select = value; break;
+    case 0x08: _driver_feature_select = value; break;
+    case 0x0c:
+      if (_driver_feature_select < 2 && ~_status & STATUS_FEATURES_OK)
+        set_half(_driver_features, _driver_feature_select, value);
+      break;
+    case 0x10:
+      _msix_config = (value & 0xffff) < MSIX_VECTORS ? value & 0xffff : unsigned(VirtQueue::NO_VECTOR);
+      break;
+    case 0x14:
+      // Sub-dword writes arrive here as read-modify-write.
+      write_status(value & 0xff);
+      _queue_select = value >> 16;
+      break;
+    case 0x18:
+      if (!q || q->enabled) break;
+      {
+        // The rings wrap with the free-running 16-bit indices only for
+        // powers of two, which is all the spec allows anyway.
+        unsigned size = value & 0xffff;
+        if (size && !(size & (size - 1)) && size <= VirtQueue::MAX_SIZE) q->size = size;
+      }
+      q->vector = (value >> 16) < MSIX_VECTORS ? value >> 16 : unsigned(VirtQueue::NO_VECTOR);
+      break;
+    case 0x1c:
+      if (q && value & 1 && !q->enabled && !q->map(_bus_memregion)) {
+        Logging::printf("virtio %x: queue %u outside of guest memory\n", _bdf, _queue_select);
+        q->enabled = false;
+        _status |= STATUS_NEEDS_RESET;
+        if (_status & STATUS_DRIVER_OK) config_changed();
+      }
+      break;
+    case 0x20: case 0x24: if (q && !q->enabled) set_half(q->desc_addr,  offset & 4, value); break;
+    case 0x28: case 0x2c: if (q && !q->enabled) set_half(q->avail_addr, offset & 4, value); break;
+    case 0x30: case 0x34: if (q && !q->enabled) set_half(q->used_addr,  offset & 4, value); break;
+    case 0x04: // read-only
+      break;
+    default: return false;
+    }
+    return true;
+  }
+
+  bool match_bar(uintptr_t &address) {
+    bool res = !((address ^ _bar) & BAR_MASK);
+    address &= ~BAR_MASK;
+    return res;
+  }
+
+protected:
+  DBus<MessageMem>        &_bus_mem;
+  DBus<MessageMemRegion>  &_bus_memregion;
+  unsigned  _num_queues;
+  unsigned  _status;
+  uint64    _driver_features;
+  VirtQueue _queues[MAX_QUEUES];
+
+  virtual uint64 device_features() = 0;
+  virtual bool device_config(unsigned offset, unsigned &value, bool read) = 0;
+  virtual void queue_notify(unsigned nr) = 0;
+  virtual void device_reset() {}
+
+  bool has_feature(unsigned bit) { return _driver_features & (1ull << bit); }
+  bool running() { return (_status & (STATUS_DRIVER_OK | STATUS_NEEDS_RESET)) == STATUS_DRIVER_OK; }
+
+  /**
+   * Interrupt the driver if it wants to hear about new used entries.
+   */
+  void signal_queue(unsigned nr)
+  {
+    VirtQueue &q = _queues[nr];
+    if (q.need_signal(has_feature(F_RING_EVENT_IDX))) interrupt(q.vector, 1);
+  }
+
+  void config_changed()
+  {
+    _generation = (_generation + 1) & 0xff;
+    interrupt(_msix_config, 2);
+  }
+
+public:
+
+  void reset()
+  {
+    _device_feature_select = _driver_feature_select = 0;
+    _driver_features = 0;
+    _msix_config  = VirtQueue::NO_VECTOR;
+    _queue_select = 0;
+    _status       = 0;
+    if (_isr) {
+      _isr = 0;
+      MessageIrqLines msg(MessageIrq::DEASSERT_IRQ, _intr & 0xff);
+      _bus_irqlines.send(msg);
+    }
+    for (unsigned i=0; i < MAX_QUEUES; i++) _queues[i].reset();
+    device_reset();
+  }
+
+  bool PCI_read(unsigned dword, unsigned &value)
+  {
+    switch (dword) {
+    case 0x00: value = _pci_id; break;
+    case 0x01: value = _cmd_sts; break;
+    case 0x02: value = _pci_class << 8 | 0x01; break;
+    case 0x04: value = _bar; break;
+    case 0x0b: value = _pci_id << 16 | 0x1af4; break;
+    case 0x0d: value = CAP_COMMON; break;
+    case 0x0f: value = 0x0100 | (_intr & 0xff); break;
+
+      // vendor specific capabilities: type, BAR, offset, length
+    case CAP_COMMON/4 + 0: value = 1 << 24 | 16 << 16 | CAP_NOTIFY << 8 | 0x09; break;
+    case CAP_COMMON/4 + 2: value = COMMON_CFG; break;
+    case CAP_COMMON/4 + 3: value = COMMON_LEN; break;
+    case CAP_NOTIFY/4 + 0: value = 2 << 24 | 20 << 16 | CAP_ISR << 8 | 0x09; break;
+    case CAP_NOTIFY/4 + 2: value = NOTIFY_CFG; break;
+    case CAP_NOTIFY/4 + 3: value = NOTIFY_MUL * MAX_QUEUES; break;
+    case CAP_NOTIFY/4 + 4: value = NOTIFY_MUL; break;
+    case CAP_ISR/4 + 0:    value = 3 << 24 | 16 << 16 | CAP_DEVICE << 8 | 0x09; break;
+    case CAP_ISR/4 + 2:    value = ISR_CFG; break;
+    case CAP_ISR/4 + 3:    value = 1; break;
+    case CAP_DEVICE/4 + 0: value = 4 << 24 | 16 << 16 | CAP_MSIX << 8 | 0x09; break;
+    case CAP_DEVICE/4 + 2: value = DEVICE_CFG; break;
+    case CAP_DEVICE/4 + 3: value = _device_cfg_len; break;
+    case CAP_MSIX/4 + 0:   value = _msix_ctrl | (MSIX_VECTORS - 1) << 16 | 0x11; break;
+    case CAP_MSIX/4 + 1:   value = MSIX_TABLE; break;
+    case CAP_MSIX/4 + 2:   value = MSIX_PBA; break;
+    default: value = 0;
+    }
+    return true;
+  }
+
+  bool PCI_write(unsigned dword, unsigned value)
+  {
+    switch (dword) {
+    case 0x01: _cmd_sts = 0x100000 | (value & 0x406); break;
+    case 0x04: _bar = value & BAR_MASK; break;
+    case 0x0f: _intr = value & 0xff; break;
+    case CAP_MSIX/4:
+      _msix_ctrl = value & 0xc0000000;
+      if (msix_enabled()) msix_unmasked();
+      break;
+    default: break;
+    }
+    return true;
+  }
+
+  bool receive(MessageMem &msg)
+  {
+    uintptr_t addr = msg.phys;
+    if (!match_bar(addr) || !(_cmd_sts & 0x2)) return false;
+    addr &= ~3;
+
+    if (addr >= NOTIFY_CFG && addr < NOTIFY_CFG + NOTIFY_MUL * MAX_QUEUES) {
+      unsigned nr = (addr - NOTIFY_CFG) / NOTIFY_MUL;
+      if (msg.read) *msg.ptr = 0;
+      else if (nr < _num_queues && _queues[nr].enabled && running()) queue_notify(nr);
+      return true;
+    }
+
+    unsigned value = 0;
+    if (addr < COMMON_CFG + COMMON_LEN) {
+      if (msg.read) common_read(addr, value);
+      else          common_write(addr, *msg.ptr);
+    } else if (addr == ISR_CFG) {
+      if (msg.read && _isr) {
+        value = _isr;
+        _isr  = 0;
+        MessageIrqLines msg2(MessageIrq::DEASSERT_IRQ, _intr & 0xff);
+        _bus_irqlines.send(msg2);
+      }
+    } else if (addr >= DEVICE_CFG && addr < DEVICE_CFG + _device_cfg_len) {
+      if (msg.read) device_config(addr - DEVICE_CFG, value, true);
+      else          device_config(addr - DEVICE_CFG, *msg.ptr, false);
+    } else if (addr >= MSIX_TABLE && addr < MSIX_TABLE + sizeof(_msix)) {
+      uint32 *reg = reinterpret_cast<uint32 *>(_msix) + (addr - MSIX_TABLE) / 4;
+      if (msg.read) value = *reg;
+      else {
+        *reg = (addr & 0xf) == 0xc ? *msg.ptr & 1 : *msg.ptr;
+        if ((addr & 0xf) == 0xc && !*reg) msix_unmasked();
+      }
+    } else if (addr == MSIX_PBA)
+      value = _msix_pending;
+
+    if (msg.read) *msg.ptr = value;
+    return true;
+  }
+
+  bool receive(MessagePciConfig &msg) { return PciHelper::receive(msg, this, _bdf); }
+
+  bool receive(MessageLegacy &msg)
+  {
+    if (msg.type == MessageLegacy::RESET) reset();
+    return false;
+  }
+
+  /**
+   * The BIOS part: program BAR and IRQ and enable the device.
+   */
+  void pci_setup(unsigned long bar, unsigned long irq)
+  {
+    PCI_write(0x04, bar);
+    PCI_write(0x0f, irq);
+    // enable IRQ, busmaster DMA and memory accesses
+    PCI_write(0x01, 0x406);
+  }
+
+  VirtioPciDevice(Motherboard &mb, unsigned bdf, unsigned device_type, unsigned pci_class, unsigned device_cfg_len)
+    : _bus_irqlines(mb.bus_irqlines), _bdf(bdf), _pci_id((0x1040 + device_type) << 16 | 0x1af4),
+      _pci_class(pci_class), _device_cfg_len(device_cfg_len), _cmd_sts(0x100000), _bar(0), _intr(0),
+      _msix_ctrl(0), _generation(0), _isr(0), _msix(), _msix_pending(0),
+      _bus_mem(mb.bus_mem), _bus_memregion(mb.bus_memregion), _num_queues(1), _status(0)
+  {
+    for (unsigned i=0; i < MSIX_VECTORS; i++) _msix[i].ctrl = 1;
+  }
+
+  virtual ~VirtioPciDevice() {}
+};
+
+// EOF
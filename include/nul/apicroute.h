@@ -0,0 +1,257 @@
+/** @file
+ * Destination lookup for messages on the APIC bus.
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+#include "bus.h"
+#include "service/cpu.h"
+
+/**
+ * Asks a LAPIC whether it would accept a lowest priority message and
+ * how busy it is. The LAPIC with the lowest prio wins arbitration.
+ */
+struct MessageApicPrio
+{
+  MessageApic &msg;
+  unsigned     prio;
+  MessageApicPrio(MessageApic &_msg) : msg(_msg), prio(~0u) {}
+};
+
+/**
+ * Routes IPIs and MSIs to the LAPICs that may accept them.
+ *
+ * Every LAPIC registers itself here and updates its entry whenever
+ * the guest changes its APIC ID, LDR, DFR or switches to x2APIC
+ * mode. Physical and logical destinations then map to a small set of
+ * LAPICs, so a message does not have to be offered to all of them.
+ *
+ * The set is a superset: a LAPIC still checks every message it gets
+ * with its own accept logic. Only the order in which LAPICs are asked
+ * mirrors bus_apic, so LIFO for send().
+ *
+ * Lowest priority messages go to the candidate with the lowest
+ * priority as reported by the LAPIC. Ties are broken in favor of
+ * the LAPIC that got the same vector last time, as its caches are
+ * likely warm, and round-robin otherwise.
+ */
+class ApicRouter
+{
+public:
+  enum {
+    MAX_APICS = 256,
+    XAPIC_IDS = 256,
+  };
+  typedef bool (*ReceiveFunction)(Device *, MessageApic &);
+  typedef bool (*PrioFunction)(Device *, MessageApicPrio &);
+
+  struct Set {
+    unsigned bits[MAX_APICS / 32];
+
+    void clear(unsigned words = MAX_APICS / 32) { memset(bits, 0, words * sizeof(*bits)); }
+    void set(unsigned nr, bool value=true) { Cpu::set_bit(bits, nr, value); }
+    void add(const Set &other, unsigned words) {
+      for (unsigned i=0; i < words; i++) bits[i] |= other.bits[i];
+    }
+  };
+
+private:
+  struct Entry {
+    Device          *dev;
+    ReceiveFunction  func;
+    PrioFunction     prio;
+    bool             x2apic;
+    bool             flat;
+    unsigned         id;
+    unsigned         ldr;
+  };
+
+  Entry    _entries[MAX_APICS];
+  unsigned _count;
+  unsigned _words;     ///< bitmap words in use
+  unsigned _x2count;   ///< LAPICs in x2APIC mode
+  unsigned short _affinity[256];  ///< last lowest priority recipient + 1, by vector
+
+  // xAPIC mode: 8-bit IDs, flat or cluster model logical destinations
+  Set _xapic;
+  Set _xphys[XAPIC_IDS];
+  Set _xflat[8];
+  Set _xcluster[16][4];
+
+  // x2APIC mode: the logical ID follows from the APIC ID
+  Set _x2apic;
+  Set _x2phys[XAPIC_IDS];
+  Set _x2high;   ///< x2APICs with an ID beyond the table
+
+  void link(unsigned nr, bool value) {
+    Entry &e = _entries[nr];
+    if (e.x2apic) {
+      _x2count += value ? 1 : -1;
+      _x2apic.set(nr, value);
+      if (e.id < XAPIC_IDS) _x2phys[e.id].set(nr, value);
+      else                  _x2high.set(nr, value);
+      return;
+    }
+
+    _xapic.set(nr, value);
+    _xphys[e.id & 0xff].set(nr, value);
+    if (e.flat)
+      for (unsigned b=0; b < 8; b++) {
+        if (e.ldr & (1 << b)) _xflat[b].set(nr, value);
+      }
+    else
+      for (unsigned b=0; b < 4; b++) {
+        if (e.ldr & (1 << b)) _xcluster[e.ldr >> 4][b].set(nr, value);
+      }
+  }
+
+  /**
+   * Collect every LAPIC that could accept msg. The destination is
+   * interpreted both ways, as LAPICs in different modes may share
+   * the bus.
+   */
+  void candidates(MessageApic &msg, Set &res) {
+    unsigned w = _words;
+    res.clear(w);
+    bool logical = msg.icr & MessageApic::ICR_DM;
+
+    // xAPICs only look at the lowest byte
+    unsigned dst = msg.dst & 0xff;
+    if (_count != _x2count) {
+      if (dst == 0xff)   res.add(_xapic, w);
+      else if (!logical) res.add(_xphys[dst], w);
+      else {
+        for (unsigned b=0; b < 8; b++)
+          if (dst & (1 << b)) res.add(_xflat[b], w);
+        for (unsigned b=0; b < 4; b++)
+          if (dst & (1 << b)) res.add(_xcluster[dst >> 4][b], w);
+      }
+    }
+
+    if (!_x2count) return;
+    if (msg.dst == ~0u) { res.add(_x2apic, w); return; }
+    res.add(_x2high, w);
+    if (!logical) {
+      if (msg.dst < XAPIC_IDS) res.add(_x2phys[msg.dst], w);
+      return;
+    }
+
+    // x2APIC logical: cluster in the upper half, one bit per member
+    for (unsigned b=0; b < 16; b++) {
+      unsigned id = ((msg.dst >> 16) << 4) | b;
+      if (msg.dst & (1 << b) && id < XAPIC_IDS) res.add(_x2phys[id], w);
+    }
+  }
+
+  ApicRouter(const ApicRouter &);
+
+public:
+  /**
+   * Register a LAPIC and return its number for update().
+   */
+  unsigned add(Device *dev, ReceiveFunction func, PrioFunction prio) {
+    if (_count >= MAX_APICS) Logging::panic("ApicRouter: too many LAPICs\n");
+    Entry &e = _entries[_count];
+    memset(&e, 0, sizeof(e));
+    e.dev  = dev;
+    e.func = func;
+    e.prio = prio;
+    link(_count, true);
+    _words = _count / 32 + 1;
+    return _count++;
+  }
+
+  /**
+   * A LAPIC changed its addressing. In x2APIC mode id is the 32-bit
+   * APIC ID and ldr and flat are ignored. Otherwise id and ldr are
+   * the 8-bit APIC ID and logical APIC ID.
+   */
+  void update(unsigned nr, bool x2apic, unsigned id, unsigned ldr, bool flat) {
+    assert(nr < _count);
+    Entry &e = _entries[nr];
+    if (e.x2apic == x2apic && e.id == id && e.ldr == ldr && e.flat == flat) return;
+
+    link(nr, false);
+    e.x2apic = x2apic;
+    e.id     = id;
+    e.ldr    = ldr;
+    e.flat   = flat;
+    link(nr, true);
+  }
+
+  /**
+   * Deliver to all accepting LAPICs.
+   */
+  bool send(MessageApic &msg) {
+    Set set;
+    candidates(msg, set);
+
+    bool res = false;
+    for (unsigned i = _words; i--;)
+      for (unsigned bits = set.bits[i]; bits; ) {
+        unsigned b = Cpu::bsr(bits);
+        bits &= ~(1u << b);
+        Entry &e = _entries[i * 32 + b];
+        res |= e.func(e.dev, msg);
+      }
+    return res;
+  }
+
+  /**
+   * Deliver a lowest priority message to a single LAPIC. The caller
+   * has already turned it into a fixed one. start is the round-robin
+   * position of the sender.
+   */
+  bool send_lowest(MessageApic &msg, unsigned &start) {
+    Set set;
+    candidates(msg, set);
+
+    unsigned vector = msg.icr & 0xff;
+    unsigned best = ~0u, best_prio = ~0u;
+    for (unsigned i=0; i < _count; i++) {
+      unsigned nr = (i + start) % _count;
+      if (!Cpu::get_bit(set.bits, nr)) continue;
+
+      Entry &e = _entries[nr];
+      MessageApicPrio query(msg);
+      if (!e.prio(e.dev, query)) continue;
+      if (query.prio < best_prio || (query.prio == best_prio && _affinity[vector] == nr + 1)) {
+        best = nr;
+        best_prio = query.prio;
+      }
+    }
+    if (best == ~0u) return false;
+
+    Entry &e = _entries[best];
+    if (!e.func(e.dev, msg)) return false;
+    _affinity[vector] = best + 1;
+    start = (best + 1) % _count;
+    return true;
+  }
+
+  unsigned count() { return _count; }
+
+  ApicRouter() : _count(0), _words(0), _x2count(0) {
+    memset(_entries, 0, sizeof(_entries));
+    memset(_affinity, 0, sizeof(_affinity));
+    _xapic.clear();
+    _x2apic.clear();
+    _x2high.clear();
+    for (unsigned i=0; i < XAPIC_IDS; i++) { _xphys[i].clear(); _x2phys[i].clear(); }
+    for (unsigned i=0; i < 8; i++) _xflat[i].clear();
+    for (unsigned i=0; i < 16; i++)
+      for (unsigned b=0; b < 4; b++) _xcluster[i][b].clear();
+  }
+};
@@ -43,18 +43,101 @@ public:
 };
 
 
+/**
+ * The address a message is decoded by. Listeners on buses whose
+ * messages carry one can restrict themselves to an address range and
+ * are then skipped without calling them. This is resolved at compile
+ * time, all other buses dispatch as before.
+ */
+template <class M>
+struct BusAddress
+{
+  enum { DECODED = false };
+  static unsigned long get(M &) { return 0; }
+};
+
+template <> struct BusAddress<MessageIOIn>
+{
+  enum { DECODED = true };
+  static unsigned long get(MessageIOIn &msg) { return msg.port; }
+};
+
+template <> struct BusAddress<MessageIOOut>
+{
+  enum { DECODED = true };
+  static unsigned long get(MessageIOOut &msg) { return msg.port; }
+};
+
+template <> struct BusAddress<MessageMem>
+{
+  enum { DECODED = true };
+  static unsigned long get(MessageMem &msg) { return msg.phys; }
+};
+
+template <> struct BusAddress<MessageIrqLines>
+{
+  enum { DECODED = true };
+  static unsigned long get(MessageIrqLines &msg) { return msg.line; }
+};
+
+
+/**
+ * What a bus remembers about the messages passing it. pass() records
+ * a message and decides whether it can change anything at the
+ * listeners. Only the interrupt lines keep state.
+ */
+template <class M>
+struct BusState
+{
+  bool pass(M &) { return true; }
+};
+
+/**
+ * The level of every interrupt line. An assert is an edge that the
+ * controllers latch on their own, so it always goes out. A deassert
+ * of a line that is already low cannot change anything and is
+ * dropped. A line starts as unknown, which counts as high.
+ *
+ * The senders of one line are serialized, on unix by the irq_mtx.
+ * As the level is raised before an assert is delivered, a deassert
+ * that follows it always finds the line high and goes out as well.
+ */
+template <> struct BusState<MessageIrqLines>
+{
+  unsigned _high[256 / 32];
+
+  bool pass(MessageIrqLines &msg)
+  {
+    unsigned bit = 1u << (msg.line % 32);
+    unsigned *word = _high + msg.line / 32;
+    if (msg.type != MessageIrq::DEASSERT_IRQ) {
+      if (~*word & bit) __sync_fetch_and_or(word, bit);
+      return true;
+    }
+    return *word & bit && __sync_fetch_and_and(word, ~bit) & bit;
+  }
+
+  BusState() { memset(_high, 0xff, sizeof(_high)); }
+};
+
+
 /**
  * A bus is a way to connect devices.
  */
 template <class M>
 class DBus
 {
+public:
   typedef bool (*ReceiveFunction)(Device *, M&);
+
+private:
   typedef bool (*EnqueueFunction)(Device *, M&, MessageIOThread::Mode, MessageIOThread::Sync, unsigned*, VCpu *vcpu);
   struct Entry
   {
     Device *_dev;
     ReceiveFunction _func;
+    unsigned long _base;
+    unsigned long _limit;
   };
   struct EnqEntry
   {
@@ -64,6 +147,7 @@ class DBus
   };
 
   unsigned long _debug_counter { 0 };
+  BusState<M> _state;
   unsigned _list_count;
   unsigned _list_size;
   struct Entry *_list;
@@ -94,14 +178,45 @@ class DBus
     _iothread_callback = n;
     _callback_size = new_size;
   };
+
+  /**
+   * Deliver a message to a single listener, if it covers its address.
+   */
+  static bool call(Entry &e, M &msg)
+  {
+    if (BusAddress<M>::DECODED && BusAddress<M>::get(msg) - e._base > e._limit) return false;
+    return e._func(e._dev, msg);
+  }
+
+protected:
+  /**
+   * Hand the message to the I/O thread, unless one of the callbacks
+   * claims it for direct delivery. Without an I/O thread there is
+   * nothing to claim it from.
+   */
+  bool iothread_enqueue(M &msg, MessageIOThread::Mode mode, MessageIOThread::Sync sync, unsigned *value)
+  {
+    if (_iothread_enqueue == nullptr) return false;
+    for (unsigned i = _callback_count; i--;)
+      if (_iothread_callback[i]._func(_iothread_callback[i]._dev, msg)) return false;
+    return _iothread_enqueue->_func(_iothread_enqueue->_dev, msg, mode, sync, value, _iothread_enqueue->_vcpu);
+  }
+
 public:
 
-  void add(Device *dev, ReceiveFunction func)
+  /**
+   * Add a listener. On a decoded bus it only gets the messages for
+   * size addresses starting at base, which it has to accept or reject
+   * on its own as before. A size of zero covers all addresses.
+   */
+  void add(Device *dev, ReceiveFunction func, unsigned long base = 0, unsigned long size = 0)
   {
     if (_list_count >= _list_size)
       set_size(_list_size > 0 ? _list_size * 2 : 1);
     _list[_list_count]._dev    = dev;
     _list[_list_count]._func = func;
+    _list[_list_count]._base  = base;
+    _list[_list_count]._limit = size - 1;
     _list_count++;
   }
 
@@ -133,12 +248,12 @@ public:
     _debug_counter++;
     bool res = false;
     for (unsigned i = 0; i < _list_count; i++)
-      res |= _list[i]._func(_list[i]._dev, msg);
+      res |= call(_list[i], msg);
     return res;
   }
   bool  send_direct_rr(M &msg, unsigned *value) {
     for (unsigned i = 0; i < _list_count; i++)
-      if (_list[i]._func(_list[(i + *value) % _list_count]._dev, msg)) {
+      if (call(_list[(i + *value) % _list_count], msg)) {
 	*value = (i + *value + 1) % _list_count;
 	return true;
       }
@@ -153,7 +268,7 @@ public:
     bool res = false;
     bool earlyout = (mode == MessageIOThread::MODE_EARLYOUT);
     for (unsigned i = _list_count; i-- && !(earlyout && res);)
-      res |= _list[i]._func(_list[i]._dev, msg);
+      res |= call(_list[i], msg);
     return res;
   }
 
@@ -162,21 +277,13 @@ public:
    */
   bool  send_sync(M &msg, bool earlyout = false)
   {
-    bool res = false;
-    if (_iothread_callback) {
-      for (unsigned i = _callback_count; i-- && !res;) {
-        res |= _iothread_callback[i]._func(_iothread_callback[i]._dev, msg);
-      }
-    }
-    if (!res && _iothread_enqueue != nullptr) {
-      // No one wants the message directly, enqueue it.
-      if (_iothread_enqueue->_func(_iothread_enqueue->_dev, msg, earlyout ? MessageIOThread::MODE_EARLYOUT : MessageIOThread::MODE_NORMAL, MessageIOThread::SYNC_SYNC, nullptr, _iothread_enqueue->_vcpu))
-        return true;
-    }
+    if (!_state.pass(msg)) return true;
+    if (iothread_enqueue(msg, earlyout ? MessageIOThread::MODE_EARLYOUT : MessageIOThread::MODE_NORMAL, MessageIOThread::SYNC_SYNC, nullptr))
+      return true;
     _debug_counter++;
-    res = false;
+    bool res = false;
     for (unsigned i = _list_count; i-- && !(earlyout && res);)
-      res |= _list[i]._func(_list[i]._dev, msg);
+      res |= call(_list[i], msg);
     return res;
   }
 
@@ -185,21 +292,13 @@ public:
    */
   bool  send(M &msg, bool earlyout = false)
   {
-    bool res = false;
-    if (_iothread_callback) {
-      for (unsigned i = _callback_count; i-- && !res;) {
-        res |= _iothread_callback[i]._func(_iothread_callback[i]._dev, msg);
-      }
-    }
-    if (!res && _iothread_enqueue != nullptr) {
-      // No one wants the message directly, enqueue it.
-      if (_iothread_enqueue->_func(_iothread_enqueue->_dev, msg, earlyout ? MessageIOThread::MODE_EARLYOUT : MessageIOThread::MODE_NORMAL, MessageIOThread::SYNC_ASYNC, nullptr, _iothread_enqueue->_vcpu))
-        return true;
-    }
+    if (!_state.pass(msg)) return true;
+    if (iothread_enqueue(msg, earlyout ? MessageIOThread::MODE_EARLYOUT : MessageIOThread::MODE_NORMAL, MessageIOThread::SYNC_ASYNC, nullptr))
+      return true;
     _debug_counter++;
-    res = false;
+    bool res = false;
     for (unsigned i = _list_count; i-- && !(earlyout && res);)
-      res |= _list[i]._func(_list[i]._dev, msg);
+      res |= call(_list[i], msg);
     return res;
   }
 
@@ -208,21 +307,13 @@ public:
    */
   bool  send_fifo(M &msg)
   {
-    bool res = false;
-    if (_iothread_callback) {
-      for (unsigned i = _callback_count; i-- && !res;) {
-        res |= _iothread_callback[i]._func(_iothread_callback[i]._dev, msg);
-      }
-    }
-    if (!res && _iothread_enqueue != nullptr) {
-      // No one wants the message directly, enqueue it.
-      if (_iothread_enqueue->_func(_iothread_enqueue->_dev, msg, MessageIOThread::MODE_FIFO, MessageIOThread::SYNC_ASYNC, nullptr, _iothread_enqueue->_vcpu))
-        return true;
-    }
+    if (!_state.pass(msg)) return true;
+    if (iothread_enqueue(msg, MessageIOThread::MODE_FIFO, MessageIOThread::SYNC_ASYNC, nullptr))
+      return true;
     _debug_counter++;
-    res = false;
+    bool res = false;
     for (unsigned i = 0; i < _list_count; i++)
-      res |= _list[i]._func(_list[i]._dev, msg);
+      res |= call(_list[i], msg);
     return 0;
   }
 
@@ -233,20 +324,11 @@ public:
    */
   bool  send_rr(M &msg, unsigned &start)
   {
-    bool res = false;
-    if (_iothread_callback) {
-      for (unsigned i = _callback_count; i-- && !res;) {
-        res |= _iothread_callback[i]._func(_iothread_callback[i]._dev, msg);
-      }
-    }
-    if (!res && _iothread_enqueue != nullptr) {
-      // No one wants the message directly, enqueue it.
-      if (_iothread_enqueue->_func(_iothread_enqueue->_dev, msg, MessageIOThread::MODE_RR, MessageIOThread::SYNC_ASYNC, &start, _iothread_enqueue->_vcpu))
-        return true;
-    }
+    if (iothread_enqueue(msg, MessageIOThread::MODE_RR, MessageIOThread::SYNC_ASYNC, &start))
+      return true;
     _debug_counter++;
     for (unsigned i = 0; i < _list_count; i++)
-      if (_list[i]._func(_list[(i + start) % _list_count]._dev, msg)) {
+      if (call(_list[(i + start) % _list_count], msg)) {
 	start = (i + start + 1) % _list_count;
 	return true;
       }
@@ -279,3 +361,77 @@ public:
   /** Default constructor. */
   DBus() : _list_count(0), _list_size(0), _list(nullptr), _callback_count(0), _callback_size(0), _iothread_callback(nullptr), _iothread_enqueue(nullptr) {}
 };
+
+
+/**
+ * Interrupt line changes a device collects while it handles one
+ * request and sends at once. Nobody acknowledges an interrupt in
+ * between, so a single assert per line, with notify if any of them
+ * asked for it, followed by a deassert if that was the last change,
+ * has the same effect as the whole sequence.
+ */
+class IrqLineBatch
+{
+  enum { MAX_LINES = 8 };
+  struct Line {
+    unsigned char line;
+    bool          assert;
+    bool          notify;
+    bool          low;
+  };
+
+  DBus<MessageIrqLines> &_bus;
+  Line     _lines[MAX_LINES];
+  unsigned _count;
+
+  IrqLineBatch(const IrqLineBatch &);
+  IrqLineBatch &operator = (const IrqLineBatch &);
+
+public:
+  void post(MessageIrq::Type type, unsigned char line)
+  {
+    unsigned i = 0;
+    while (i < _count && _lines[i].line != line) i++;
+    if (i == MAX_LINES) {
+      flush();
+      i = 0;
+    }
+    if (i == _count) {
+      _lines[_count++] = Line { line, false, false, false };
+    }
+
+    Line &l = _lines[i];
+    l.low = type == MessageIrq::DEASSERT_IRQ;
+    if (l.low) return;
+    l.assert = true;
+    l.notify |= type == MessageIrq::ASSERT_NOTIFY;
+  }
+
+  /**
+   * Send everything posted so far. Listeners may post again, which
+   * goes out in the same call.
+   */
+  void flush()
+  {
+    while (_count) {
+      Line lines[MAX_LINES];
+      unsigned count = _count;
+      memcpy(lines, _lines, count * sizeof(*lines));
+      _count = 0;
+
+      for (unsigned i=0; i < count; i++) {
+        if (lines[i].assert) {
+          MessageIrqLines msg(lines[i].notify ? MessageIrq::ASSERT_NOTIFY : MessageIrq::ASSERT_IRQ, lines[i].line);
+          _bus.send(msg);
+        }
+        if (lines[i].low) {
+          MessageIrqLines msg(MessageIrq::DEASSERT_IRQ, lines[i].line);
+          _bus.send(msg);
+        }
+      }
+    }
+  }
+
+  IrqLineBatch(DBus<MessageIrqLines> &bus) : _bus(bus), _lines(), _count(0) { }
+  ~IrqLineBatch() { flush(); }
+};
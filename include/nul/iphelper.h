@@ -15,9 +15,8 @@
  * General Public License version 2 for more details.
  *
  * This was previously used for network communication in the NUL userland
- * when virtualizing with the NOVA microhypervisor.  Functionality was not
- * ported and rather the interface is described here to ease porting to the
- * UNIX socket interface.
+ * when virtualizing with the NOVA microhypervisor. The UNIX frontend
+ * implements the socket part on top of BSD sockets (unix/iphelper.cc).
  */
 
 #ifndef __IPHELPER_H
@@ -25,6 +24,9 @@
 
 #include <nul/timer.h>
 
+#include <sys/uio.h>
+#include <vector>
+
 #define IP_AS_UL(a, b, c, d) ((((d) & 0xff) << 24) | (((c) & 0xff) << 16) | (((b) & 0xff) << 8) | ((a) & 0xff))
 
 class IpHelper;
@@ -45,13 +47,15 @@ class TcpSocket
     // After sending this data, the socket will finally be marked as "closed"
     bool            _closed;
 
-    /* ... semaphores used to be initialized here */
-    /* ... buffers ... */
+    int             _fd;
+    // Ranges handed to send_nonblocking(), written by wait_complete()
+    std::vector<struct iovec> _pending;
 
     /* Only to be called by IpHelper */
-    TcpSocket(unsigned caps)
-        : _remote_port(0), _connected(false), _closed(true)
-    { /* ... */ }
+    TcpSocket(int fd, unsigned short local_port, unsigned short remote_port)
+        : _outgoing(false), _local_port(local_port), _remote_port(remote_port),
+          _connected(fd >= 0), _closed(fd < 0), _fd(fd), _pending()
+    {}
 
     /* Forbidden and hence not implemented: */
     TcpSocket(TcpSocket const&);
@@ -62,25 +66,26 @@ class TcpSocket
      * Methods for the end user!
      */
 
-    bool block_until_connected() { return false; }
+    bool block_until_connected() { return _connected; }
 
     /* Close this socket. */
-    void close() {}
+    void close();
 
     /* Blocking receive function. Difference to BSD sockets:
      * Does _not_ return before it received the expected number of bytes. */
-    bool receive(void *data, unsigned bytes) { return false; }
+    bool receive(void *data, unsigned bytes);
 
     /* Blocking send function. Difference to BSD sockets:
      * Does _not_ return before the user ACKed all bytes. */
-    bool send(void *data, unsigned bytes) { return false; }
+    bool send(void *data, unsigned bytes);
 
-    /* Nonblocking send function. Returns immediately.
+    /* Nonblocking send function. Returns immediately. The data is
+     * not copied and has to stay valid until wait_complete().
      * Call wait_complete after you pushed multiple send_nonblocking() calls. */
-    bool send_nonblocking(void *data, unsigned bytes) { return false; }
+    bool send_nonblocking(void *data, unsigned bytes);
 
     /* Wait until the receiver ACKed all packets sent from this socket. */
-    bool wait_complete() { return false; }
+    bool wait_complete();
 };
 
 class IpHelper
@@ -96,7 +101,14 @@ class IpHelper
 
         TcpSocket *_sockets;
 
-        IpHelper() : _mac(0), _ip(0), _netmask(0), _gateway(0), _sockets(NULL)
+        // Listening sockets, kept open to accept further connections
+        struct Listener {
+            unsigned port;
+            int      fd;
+        };
+        std::vector<Listener> _listeners;
+
+        IpHelper() : _mac(0), _ip(0), _netmask(0), _gateway(0), _sockets(NULL), _listeners()
         {};
 
 
@@ -136,11 +148,12 @@ class IpHelper
         mword get_ip() { return 0; }
 
         /* Connect to port at given IP and return a working socket. */
-        TcpSocket * connect(unsigned addr, unsigned port) { return NULL; }
+        TcpSocket * connect(unsigned addr, unsigned port);
 
         /* Make a socket listen on port and return a TcpSocket object when a connection
-         * was established */
-        TcpSocket * listen(unsigned port) { return NULL; }
+         * was established. Calling this again for the same port accepts the
+         * next connection. */
+        TcpSocket * listen(unsigned port);
 };
 
 #endif /* __IPHELPER_H */
@@ -253,18 +253,23 @@ struct MessagePic
   MessagePic(unsigned char _slave) :  slave(_slave) { }
 };
 
+/**
+ * A broadcast EOI from a LAPIC. The HW uses a special cycle on the
+ * APIC bus that is snooped by all IOAPICs, we give it a bus of its
+ * own, so it does not have to pass every memory-mapped device.
+ */
+struct MessageEoi
+{
+  unsigned char vector;
+  MessageEoi(unsigned char _vector) : vector(_vector) {}
+};
+
 /**
  * IPI-Message on the APIC bus.
  */
 struct MessageApic
 {
   enum {
-    /**
-     * The HW uses a special cycle for broadcast EOIs. We model that
-     * by performing a write transaction to the first IOAPIC EOI
-     * registers that is snooped by all IOApics.
-     */
-    IOAPIC_EOI = 0xfec00040,
     ICR_DM     = 1 << 11,
     ICR_ASSERT = 1 << 14,
     ICR_LEVEL  = 1 << 15
@@ -349,13 +354,19 @@ struct MessageInput
 
 
 /**
- * An ascii character from the serial port.
+ * Ascii characters from the serial port. Either a single character
+ * or a span of them, as a drained transmit FIFO produces. Receivers
+ * walk data() and len.
  */
 struct MessageSerial
 {
   unsigned serial;
   unsigned char ch;
-  MessageSerial(unsigned _serial, unsigned char _ch) : serial(_serial), ch(_ch) {}
+  const unsigned char *buffer;
+  unsigned len;
+  const unsigned char *data() const { return buffer ? buffer : &ch; }
+  MessageSerial(unsigned _serial, unsigned char _ch) : serial(_serial), ch(_ch), buffer(0), len(1) {}
+  MessageSerial(unsigned _serial, const unsigned char *_buffer, unsigned _len) : serial(_serial), ch(_len ? _buffer[0] : 0), buffer(_buffer), len(_len) {}
 };
 
 
@@ -464,6 +475,7 @@ struct MessageVesa
 /****************************************************/
 
 class VCpu;
+class CpuState;
 typedef void (*ServiceThreadFn)(void *) VMM_REGPARM(0) VMM_NORETURN;
 
 /**
@@ -495,6 +507,8 @@ struct MessageHostOp
       OP_GET_CONFIG_STRING,
       OP_MIGRATION_RETRIEVE_INIT,
       OP_MIGRATION_START,
+      OP_DISCARD_GUEST_MEM,
+      OP_VCPU_FREEZE,
     } type;
   union {
     unsigned long value;
@@ -530,6 +544,14 @@ struct MessageHostOp
     struct {
       VCpu *vcpu;
     };
+    struct {
+      // OP_VCPU_BLOCK: sleep until VCpu::STATE_WAKEUP shows up here
+      volatile unsigned *event;
+    };
+    struct {
+      // OP_VCPU_FREEZE: the state of the first vCPU while all are stopped
+      CpuState *vcpu_state;
+    };
     struct {
       ServiceThreadFn work;
       void *work_arg;
@@ -19,6 +19,10 @@
 #include <nul/iphelper.h>
 #include <nul/migration_structs.h>
 #include <service/time.h>
+#include <service/pagecodec.h>
+
+#include <pthread.h>
+#include <semaphore.h>
 
 class Desc
 {
@@ -39,6 +43,9 @@ class Prd
         unsigned _value;
 
     public:
+        // Set on every range we send, page 0 alone would look like the end marker.
+        enum { VALID = 1 };
+
         unsigned order() { return ((_value >> 7) & 0x1f); }
         unsigned size()  { return 1 << (order() + 12); }
         unsigned base()  { return _value & ~0xfff; }
@@ -54,39 +61,53 @@ class Prd
 /* The DirtManager is feeded with CRDs of dirty page regions.
  * There's an internal bitmap which can be used for future resend-optimizations
  * as well as generating resend-statistics.
+ * Every page counts the rounds it was found dirty in. Pages with a
+ * high count are hot, they can be left for the final round, where
+ * they are sent only once.
  */
 class DirtManager
 {
     private:
         unsigned *_map;
         unsigned  _pages;
+        unsigned  _next;      ///< where next_dirty() continues
 
         unsigned char *_cnt;
 
         unsigned _dirt_count;
 
+        DirtManager(const DirtManager &);
+        DirtManager &operator = (const DirtManager &);
+
     public:
-        void mark_dirty(Prd dirty)
+        /* Returns how many pages were not dirty before. */
+        unsigned mark_dirty(Prd dirty)
         {
             unsigned base  = dirty.base() >> 12;
             unsigned pages = 1 << dirty.order();
-            for (unsigned i=base; i < base + pages; ++i) mark_dirty(i);
+            unsigned fresh = 0;
+            for (unsigned i=base; i < base + pages && i < _pages; ++i) fresh += mark_dirty(i);
+            return fresh;
         }
 
-        void mark_dirty(unsigned page)
+        bool mark_dirty(unsigned page)
         {
-            if (!Cpu::get_bit(_map, page)) {
-                ++_dirt_count;
-                ++_cnt[page];
-            }
+            if (Cpu::get_bit(_map, page)) return false;
+
+            ++_dirt_count;
+            if (_cnt[page] < 255) ++_cnt[page];
             Cpu::set_bit(_map, page, true);
+            return true;
         }
 
+        /* Callers may clean less than next_dirty() returned, the
+         * search continues right behind what they took. */
         void mark_clean(Prd clean)
         {
             unsigned base  = clean.base() >> 12;
             unsigned pages = 1 << clean.order();
             for (unsigned i=base; i < base + pages; ++i) mark_clean(i);
+            _next = base + pages;
         }
 
         void mark_clean(unsigned page)
@@ -97,20 +118,35 @@ class DirtManager
 
         unsigned dirty_pages() { return _dirt_count; }
 
-        Prd next_dirty() {
-            unsigned base, len;
+        bool hot(unsigned page, unsigned rounds) { return _cnt[page] >= rounds; }
 
-            for (base = 0; base < _pages; ++base) {
-                len = 0;
-                while (Cpu::get_bit(_map, base + len)) ++len;
+        /* Dirty pages that were found dirty in at least that many rounds. */
+        unsigned hot_pages(unsigned rounds)
+        {
+            unsigned count = 0;
+            for (unsigned i=0; i < _pages; ++i)
+                count += Cpu::get_bit(_map, i) && hot(i, rounds);
+            return count;
+        }
 
-                if (len > 0) break;
+        /* The next naturally sized piece of a run of dirty pages,
+         * skipping hot ones. The search continues behind the pages
+         * returned or cleaned last, so a round through memory costs a
+         * single pass. */
+        Prd next_dirty(unsigned hot_rounds = ~0u) {
+            for (unsigned n=0; n < _pages; ++n) {
+                unsigned base = (_next + n) % _pages;
+                if (!Cpu::get_bit(_map, base) || hot(base, hot_rounds)) continue;
+
+                unsigned len = 1;
+                while (base + len < _pages && Cpu::get_bit(_map, base + len) &&
+                       !hot(base + len, hot_rounds))
+                    ++len;
+
+                _next = base + (1u << Cpu::bsr(len));
+                return Prd(base, Cpu::bsr(len), Prd::VALID);
             }
-
-            if (len == 0) return Prd();
-
-            Prd ret(base, Cpu::bsr(len), 0);
-            return ret;
+            return Prd();
         }
 
         static inline unsigned char fir_max(unsigned char *in, unsigned limit, unsigned pos, int size)
@@ -133,7 +169,7 @@ class DirtManager
         void print_stats()
         {
             const unsigned size = 20;
-            unsigned char bucket[size];
+            unsigned bucket[size] = { 0 };
 
             unsigned sx = 0, sqx = 0;
 
@@ -144,7 +180,7 @@ class DirtManager
             smooth[2] = new unsigned char[_pages];
 
             for (unsigned i=0; i < _pages; ++i) {
-                unsigned faults = VMM_MIN(_cnt[i], size);
+                unsigned faults = VMM_MIN(_cnt[i], size - 1);
                 ++bucket[faults];
 
                 sx  += faults;
@@ -175,13 +211,24 @@ class DirtManager
             delete [] smooth[2];
         }
 
-        DirtManager() : _map(NULL), _pages(0), _cnt(NULL), _dirt_count(0) {}
-        DirtManager(unsigned pages) : _map(NULL), _pages(pages), _cnt(NULL), _dirt_count(0)
+        void init(unsigned pages)
         {
-            _map = new unsigned[(pages + sizeof(*_map) -1) / sizeof(*_map)];
+            delete [] _map;
+            delete [] _cnt;
+            _pages = pages;
+            _next  = 0;
+            _dirt_count = 0;
+            _map = new unsigned[(pages + 31) / 32];
             _cnt = new unsigned char[pages];
+            memset(_map, 0, (pages + 31) / 32 * sizeof(*_map));
             memset(_cnt, 0, pages * sizeof(*_cnt));
         }
+
+        DirtManager() : _map(NULL), _pages(0), _next(0), _cnt(NULL), _dirt_count(0) {}
+        DirtManager(unsigned pages) : _map(NULL), _pages(0), _next(0), _cnt(NULL), _dirt_count(0)
+        {
+            init(pages);
+        }
         ~DirtManager()
         {
             if (_map) delete [] _map;
@@ -189,6 +236,325 @@ class DirtManager
         }
 };
 
+/*
+ * Decides when the pre-copy rounds have done enough. Every round
+ * reports the pages it sent, the pages the guest dirtied meanwhile and
+ * how long that took. What is still dirty afterwards goes while the
+ * guest is frozen, so we stop as soon as it fits into the downtime at
+ * the measured bandwidth. A guest that dirties memory faster than the
+ * link drains it never gets there. Its vCPUs lose a growing share of
+ * their time instead, until it does.
+ */
+class ConvergenceControl
+{
+    public:
+        enum {
+            SLICE_US   = 10000,   ///< vCPUs run and sleep in slices of this length
+            HOT_ROUNDS = 3,       ///< pages dirtied in that many rounds wait for the last one
+            STALLED    = 2,       ///< rounds outrun by the guest before we throttle more
+        };
+
+        struct Config {
+            unsigned downtime;        ///< ms the guest may be frozen
+            unsigned throttle_start;  ///< percent of vCPU time taken away first
+            unsigned throttle_step;   ///< added whenever that was not enough
+            unsigned throttle_max;
+        };
+        static Config config;
+
+    private:
+        unsigned          _round;
+        unsigned          _bandwidth;   ///< B/ms, averaged over the rounds
+        unsigned          _dirty_rate;  ///< B/ms during the last round
+        unsigned          _stalled;
+        bool              _gave_up;
+        volatile unsigned _throttle;
+
+    public:
+        /* Account a finished round. Returns true if the remaining
+         * pages should be sent with the guest frozen. */
+        bool round_done(unsigned sent, unsigned dirtied, unsigned remaining, timevalue ms);
+
+        /* How long a vCPU should sleep now, in us. Every vCPU keeps
+         * its own slice, which starts out as zero. */
+        unsigned long throttle_sleep(timevalue now_us, timevalue &slice);
+
+        /* Pages we can send within the downtime. */
+        unsigned budget()
+        { return static_cast<unsigned long long>(_bandwidth) * config.downtime >> 12; }
+
+        unsigned expected_downtime(unsigned pages)
+        { return _bandwidth ? (static_cast<unsigned long long>(pages) << 12) / _bandwidth : ~0u; }
+
+        void unthrottle() { _throttle = 0; }
+
+        unsigned round()      { return _round; }
+        unsigned bandwidth()  { return _bandwidth; }
+        unsigned dirty_rate() { return _dirty_rate; }
+        unsigned throttle()   { return _throttle; }
+        bool     gave_up()    { return _gave_up; }
+
+        ConvergenceControl()
+            : _round(0), _bandwidth(0), _dirty_rate(0), _stalled(0), _gave_up(false), _throttle(0) {}
+};
+
+/*
+ * Encodes batches of guest pages for the migration stream.
+ * Zero pages become a marker, pages we sent before are delta-encoded
+ * against a cache of their last sent content (XBZRLE), the rest is
+ * optionally LZ compressed. A pool of worker threads does the
+ * encoding, so it keeps up with the link.
+ */
+class PageEncoder
+{
+    public:
+        struct Config {
+            unsigned workers;
+            unsigned cache_pages; // XBZRLE cache size, 0 disables it
+            bool     lz;
+        };
+        static Config config;
+
+        enum {
+            PAGE_SIZE   = 0x1000,
+            BATCH_PAGES = 4096,
+            SLOT_SIZE   = sizeof(MigrationPage) + PAGE_SIZE,
+        };
+
+    private:
+        struct Stats {
+            unsigned long      pages[MigrationPage::ENCODINGS];
+            unsigned long long bytes;
+        };
+
+        struct Worker {
+            PageEncoder   *encoder;
+            unsigned       nr;
+            pthread_t      tid;
+            sem_t          go;
+            unsigned char *scratch;
+            Stats          stats;
+        };
+
+        char          *_physmem;
+        PageCodec::Hash *_hash;     // of the content last sent, 0 is unknown
+
+        unsigned       _cache_slots;
+        unsigned      *_cache_tag;   // page number + 1, 0 is empty
+        unsigned char *_cache;
+
+        unsigned      *_batch;
+        unsigned       _batch_count;
+        unsigned char *_out;
+
+        unsigned       _worker_count;
+        Worker        *_workers;
+        sem_t          _done;
+        bool           _exit;
+
+        void encode_page(Worker &w, unsigned idx);
+        void encode_share(Worker &w);
+        static void *worker_fn(void *arg);
+
+    public:
+        /* Queue a page for the next encode() call. Returns false
+         * if the batch is full. */
+        bool add(unsigned page)
+        {
+            if (_batch_count >= BATCH_PAGES) return false;
+            _batch[_batch_count++] = page;
+            return true;
+        }
+        unsigned room() { return BATCH_PAGES - _batch_count; }
+
+        /* Encode all queued pages. Records stay valid until reset(). */
+        void encode();
+        void reset() { _batch_count = 0; }
+
+        MigrationPage *record(unsigned idx)
+        { return reinterpret_cast<MigrationPage *>(_out + idx * SLOT_SIZE); }
+        unsigned record_size(unsigned idx)
+        { return sizeof(MigrationPage) + record(idx)->length; }
+
+        /* Decode a record received from the stream into page. */
+        static bool decode(MigrationPage &rec, unsigned char *payload, unsigned char *page);
+
+        /* Receive and decode ranges from sock into physmem until the
+         * empty range descriptor arrives. */
+        static bool receive_ranges(TcpSocket *sock, char *physmem, unsigned long physsize,
+                unsigned long &bytes, unsigned long &wire_bytes);
+
+        void print_stats();
+
+        /* Without delta, every page is encoded on its own. Neither
+         * the XBZRLE cache nor the hashes of sent pages are kept. */
+        PageEncoder(char *physmem, unsigned long size, bool delta = true);
+        ~PageEncoder();
+};
+
+/*
+ * Compares guest memory on both ends after a migration. The sender
+ * sends the hashes of all pages, the receiver answers with the ranges
+ * that differ on its side, which the sender then resends raw. Both
+ * sides hash with all encoder workers.
+ */
+class PageVerifier
+{
+        static void hash_all(const char *physmem, unsigned pages, PageCodec::Hash *out);
+
+    public:
+        static bool send(TcpSocket *sock, char *physmem, unsigned long size, unsigned long &repaired);
+        static bool receive(TcpSocket *sock, char *physmem, unsigned long size, unsigned long &repaired);
+};
+
+/*
+ * A set of TCP connections carrying one migration. Stream 0 is the
+ * control connection, which also carries device state. Guest memory
+ * is striped over all streams by fixed-size chunks, so a page always
+ * travels on the same stream and pages arrive in the order they were
+ * sent, which XBZRLE relies on.
+ */
+class MigrationStreams
+{
+    public:
+        enum {
+            MAX_STREAMS = 16,
+            CHUNK_ORDER = 8, // 1 MB
+        };
+        static unsigned config_streams;
+
+        typedef bool (*StreamFn)(void *ctx, TcpSocket *socket, unsigned nr);
+
+    private:
+        struct Stream {
+            MigrationStreams *set;
+            unsigned          nr;
+            TcpSocket        *socket;
+            pthread_t         tid;
+            sem_t             go;
+            bool              ok;
+        };
+
+        unsigned  _count;
+        Stream    _streams[MAX_STREAMS];
+        sem_t     _done;
+        StreamFn  _fn;
+        void     *_ctx;
+        bool      _exit;
+
+        void start_threads();
+        static void *stream_fn(void *arg);
+        static bool flush_fn(void *, TcpSocket *socket, unsigned)
+        { return socket->wait_complete(); }
+
+    public:
+        unsigned count() { return _count; }
+        TcpSocket *socket(unsigned nr) { return _streams[nr].socket; }
+
+        /* Which stream carries the given range. Ranges must not cross
+         * a chunk, see clip(). */
+        unsigned stream_of(Prd range)
+        { return (range.base() >> (12 + CHUNK_ORDER)) % _count; }
+        static Prd clip(Prd range);
+
+        /* Open count - 1 data connections next to control. */
+        bool connect(unsigned long addr, unsigned long port, unsigned count, TcpSocket *control);
+        /* Accept the data connections the sender opens. */
+        bool accept(unsigned port, unsigned count, TcpSocket *control);
+
+        /* Call fn for every stream, each from its own thread. */
+        bool run(StreamFn fn, void *ctx);
+        /* Flush all streams in parallel. */
+        bool wait_complete() { return run(flush_fn, NULL); }
+        bool send_nonblocking(unsigned nr, void *data, unsigned bytes)
+        { return _streams[nr].socket->send_nonblocking(data, bytes); }
+
+        MigrationStreams();
+        ~MigrationStreams();
+};
+
+/*
+ * Post-copy: the guest starts on the destination before its memory
+ * arrived. The receiver catches accesses to missing pages with
+ * userfaultfd and asks the sender for them, while the sender pushes
+ * all remaining pages in the background. Requested pages jump the
+ * queue, and the background push continues right behind them, since
+ * guests tend to touch neighbouring pages next.
+ *
+ * Both directions use one data stream: the sender writes
+ * PostcopyPage records, the receiver writes page numbers it wants.
+ */
+class PostcopySender
+{
+        enum {
+            QUEUE = 1024,
+            BATCH = 32,
+        };
+
+        TcpSocket     *_socket;
+        char          *_physmem;
+        unsigned       _pages;
+        PageEncoder    _encoder;
+        unsigned char *_sent;
+
+        pthread_mutex_t _lock;
+        unsigned        _queue[QUEUE];
+        unsigned        _queue_head, _queue_tail;
+        unsigned long   _requests;
+
+        pthread_t      _push_thread;
+        pthread_t      _request_thread;
+        bool           _ok;
+
+        bool next_request(unsigned &page);
+        bool push();
+        static void *push_fn(void *arg);
+        static void *request_fn(void *arg);
+
+    public:
+        void start();
+        bool wait();
+
+        PostcopySender(TcpSocket *socket, char *physmem, unsigned long size);
+        ~PostcopySender();
+};
+
+class PostcopyReceiver
+{
+        TcpSocket      *_socket;
+        char           *_physmem;
+        unsigned        _pages;
+        int             _uffd;
+        int             _wakeup[2];
+        volatile unsigned char *_received;
+        unsigned char  *_requested;
+        pthread_mutex_t _send_lock;
+
+        pthread_t       _fault_thread;
+        pthread_t       _page_thread;
+        bool            _ok;
+
+        unsigned long   _faults;
+        unsigned long   _received_pages;
+
+        bool request(unsigned page);
+        bool place(unsigned page, MigrationPage &rec, unsigned char *payload, unsigned char *scratch);
+        static void *fault_fn(void *arg);
+        static void *page_fn(void *arg);
+
+    public:
+        /* Drop guest memory, start catching faults and receiving
+         * pages. Returns immediately, the guest may run afterwards. */
+        bool start();
+        /* Wait until every page is in place. */
+        bool wait();
+
+        unsigned long faults() { return _faults; }
+
+        PostcopyReceiver(TcpSocket *socket, char *physmem, unsigned long size);
+        ~PostcopyReceiver();
+};
+
 class Migration : public StaticReceiver<Migration>
 {
     Motherboard     *_mb;
@@ -206,8 +572,14 @@ class Migration : public StaticReceiver<Migration>
     KernelSemaphore   _vcpu_sem;
 #endif
     bool              _vcpu_should_block;
+    /* The target got the devices and may run the guest. */
+    bool              _handed_over;
 
     TcpSocket       *_socket;
+    PageEncoder     *_encoder;
+    MigrationStreams _streams;
+    /* Still reads from _streams after listen() returned. */
+    PostcopyReceiver *_postcopy;
 
     unsigned long   _sendmem;
     unsigned long   _sendmem_total;
@@ -234,7 +606,8 @@ class Migration : public StaticReceiver<Migration>
             latency(0) {}
     };
 
-    DirtManager _dirtman;
+    DirtManager        _dirtman;
+    ConvergenceControl _converge;
 
     void init_memrange_info();
     void print_welcomescreen();
@@ -247,17 +620,16 @@ class Migration : public StaticReceiver<Migration>
     bool send_header();
     timevalue send_ping();
     bool send_devices(longrange_data dat);
-    unsigned enqueue_all_dirty_pages(longrange_data &async_data);
+    unsigned collect_dirty_pages();
+    bool enqueue_dirty_pages(longrange_data &async_data, unsigned hot_rounds, unsigned &pages);
     bool send_memory(longrange_data &async_data);
+    bool send_guest(unsigned long addr, unsigned long port);
 
-    void receive_header();
+    unsigned receive_header(bool &postcopy, bool &verify);
     bool receive_ping();
     void receive_memory();
     bool receive_guestdevices(CpuState *vcpu_utcb);
 
-    bool chksum_page(unsigned page_nr, mword &their_chksum, bool compare);
-    bool checksums(bool retrieve);
-
  public:
     enum RestoreModes {
         MODE_OFF = 0,
@@ -265,11 +637,23 @@ class Migration : public StaticReceiver<Migration>
         MODE_RECEIVE
     };
 
+    static bool config_postcopy;
+    static bool config_verify;
+
+    // Post-copy needs a data stream next to control.
+    static unsigned streams()
+    { return VMM_MAX(MigrationStreams::config_streams, config_postcopy ? 2u : 1u); }
+    // With post-copy, memory is still in flight when we could verify it.
+    static bool verify() { return config_verify && !config_postcopy; }
+
     bool listen(unsigned port , CpuState *vcpu_utcb);
     bool send(unsigned long addr, unsigned long port);
 
     // To be called from do_recall
     void save_guestregs(CpuState *utcb);
+    // How long a vCPU should sleep between two runs, in us. Only
+    // reads the clock while the guest is throttled.
+    unsigned long throttle_vcpu(timevalue &slice);
 
 	bool receive(MessageHostOp &msg);
 
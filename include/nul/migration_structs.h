@@ -49,16 +49,65 @@ struct RestoreIndex {
 
 struct MigrationHeader {
 #define MAGIC_STRING_HEADER 0xb0015366
+// Version 2: memory ranges carry encoded pages (MigrationPage)
+// Version 3: memory is striped over several streams
+// Version 4: post-copy mode
+// Version 5: unchanged pages, page hash verification
+// Version 6: 128-bit page hashes
+#define MIGRATION_VERSION 6
     mword magic_string;
     mword version;
     mword videomode;
-
-    MigrationHeader() : magic_string(MAGIC_STRING_HEADER) {}
-    MigrationHeader(mword _videomode)
-        : magic_string(MAGIC_STRING_HEADER), videomode(_videomode) {}
+    mword streams;
+    mword postcopy;
+    mword verify;
+
+    MigrationHeader() : magic_string(MAGIC_STRING_HEADER), version(MIGRATION_VERSION) {}
+    MigrationHeader(mword _videomode, mword _streams, mword _postcopy, mword _verify)
+        : magic_string(MAGIC_STRING_HEADER), version(MIGRATION_VERSION),
+        videomode(_videomode), streams(_streams), postcopy(_postcopy), verify(_verify) {}
     bool magic_string_check() { return magic_string == MAGIC_STRING_HEADER; }
 };
 
+/*
+ * First thing sent on every additional data stream.
+ */
+struct MigrationStreamHello {
+#define MAGIC_STRING_STREAM 0x5743a11
+    mword magic_string;
+    mword nr;
+
+    MigrationStreamHello() : magic_string(MAGIC_STRING_STREAM), nr(0) {}
+    MigrationStreamHello(mword _nr) : magic_string(MAGIC_STRING_STREAM), nr(_nr) {}
+    bool magic_string_check() { return magic_string == MAGIC_STRING_STREAM; }
+};
+
+/*
+ * Every page of a memory range in the migration stream is preceded
+ * by this record. length bytes of payload follow.
+ */
+struct MigrationPage {
+    enum Encoding {
+        RAW = 0,    // 4096 bytes of page content
+        ZERO,       // No payload, page is all zero
+        XBZRLE,     // Delta against the page content sent last time
+        LZ,         // Compressed page content
+        UNCHANGED,  // No payload, the receiver has this content already
+        ENCODINGS
+    };
+    unsigned short encoding;
+    unsigned short length;
+};
+
+/*
+ * Post-copy page record: the page number, followed by the encoded
+ * page. A page number of ~0u ends the stream.
+ */
+struct PostcopyPage {
+    unsigned      page;
+    MigrationPage rec;
+};
+
 struct AddressSpaceIndex {
 #define MAGIC_STRING_ADDR_SPACE 0xBADB0B
     unsigned long magic_string;
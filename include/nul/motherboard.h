@@ -23,6 +23,7 @@
 #include "service/params.h"
 #include "service/profile.h"
 #include "service/string.h"
+#include "apicroute.h"
 #include "bus.h"
 #include "message.h"
 #include "timer.h"
@@ -59,6 +60,7 @@ class Motherboard
   DBus<MessageDiscovery>    bus_discovery { };
   DBus<MessageDisk>         bus_disk { };
   DBus<MessageDiskCommit>   bus_diskcommit { };
+  DBus<MessageEoi>          bus_eoi { };        ///< Broadcast EOIs from the LAPICs
   DBus<MessageHostOp>       bus_hostop { };
   DBus<MessageHwIOIn>       bus_hwioin { };	    ///< HW I/O space reads
   DBus<MessageIOIn>         bus_ioin { };       ///< I/O space reads from virtual machines
@@ -85,6 +87,8 @@ class Motherboard
 
   DBus<MessageRestore>      bus_restore { };
 
+  ApicRouter                apic_router { };   ///< Destination lookup for bus_apic messages
+
   VCpu *last_vcpu;
   Clock *clock() { return _clock; }
   Hip   *hip() { return _hip; }
@@ -49,6 +49,7 @@ struct CpuMessage {
     TYPE_CALC_IRQWINDOW,
     TYPE_SINGLE_STEP,
     TYPE_ADD_TSC_OFF,
+    TYPE_MAX,
   } type;
   union {
     struct {
@@ -97,10 +98,53 @@ struct LapicEvent {
     INTA,
     RESET,
     INIT,
-    CHECK_INTR
+    CHECK_INTR,
+    GET_DEADLINE,
+    SET_DEADLINE
   } type;
   unsigned value;
-  LapicEvent(Type _type) : type(_type), value((type == INTA) ? ~0u : 0) {}
+  unsigned long long deadline;   ///< TSC deadline in host TSC, 0 if disarmed
+  LapicEvent(Type _type) : type(_type), value((type == INTA) ? ~0u : 0), deadline(0) {}
+};
+
+
+/**
+ * The executor bus of a VCpu. Listeners subscribe to the message
+ * types they handle, and a message only visits the listeners of its
+ * type. Everything else is the same as with a DBus, including the
+ * LIFO order among the remaining listeners.
+ */
+class ExecutorBus : public DBus<CpuMessage>
+{
+  DBus<CpuMessage> _types[CpuMessage::TYPE_MAX];
+
+public:
+  static unsigned type(CpuMessage::Type t) { return 1u << t; }
+
+  void add(Device *dev, ReceiveFunction func, unsigned types = ~0u)
+  {
+    DBus<CpuMessage>::add(dev, func);
+    for (unsigned i = 0; i < CpuMessage::TYPE_MAX; i++)
+      if (types & type(CpuMessage::Type(i))) _types[i].add(dev, func);
+  }
+
+  bool send_direct(CpuMessage &msg, MessageIOThread::Mode mode, unsigned *value=nullptr)
+  {
+    return _types[msg.type].send_direct(msg, mode, value);
+  }
+
+  bool send_sync(CpuMessage &msg, bool earlyout = false)
+  {
+    MessageIOThread::Mode mode = earlyout ? MessageIOThread::MODE_EARLYOUT : MessageIOThread::MODE_NORMAL;
+    return iothread_enqueue(msg, mode, MessageIOThread::SYNC_SYNC, nullptr) || send_direct(msg, mode);
+  }
+
+  bool send(CpuMessage &msg, bool earlyout = false)
+  {
+    MessageIOThread::Mode mode = earlyout ? MessageIOThread::MODE_EARLYOUT : MessageIOThread::MODE_NORMAL;
+    return iothread_enqueue(msg, mode, MessageIOThread::SYNC_ASYNC, nullptr) || send_direct(msg, mode);
+  }
+
 };
 
 
@@ -108,12 +152,18 @@ class VCpu
 {
   VCpu *_last;
 public:
-  DBus<CpuMessage>       executor  { };
+  ExecutorBus            executor  { };
   DBus<CpuEvent>         bus_event { };
   DBus<LapicEvent>       bus_lapic { };
   DBus<MessageMem>       mem       { };
   DBus<MessageMemRegion> memregion { };
 
+  /**
+   * Set while the vCPU sleeps in OP_VCPU_BLOCK. This is only a hint
+   * for interrupt routing and may change at any time.
+   */
+  volatile bool blocked { false };
+
   VCpu *get_last() { return _last; }
   bool is_ap()     { return _last; }
 
@@ -50,6 +50,11 @@ class Cpu
     return __sync_lock_test_and_set(x, y);
   }
 
+  template <typename T>
+  static T cmpxchg(volatile T *var, T oldvalue, T newvalue) {
+    return __sync_val_compare_and_swap(var, oldvalue, newvalue);
+  }
+
   static  unsigned cmpxchg4b(unsigned *var, unsigned oldvalue, unsigned newvalue) {
     return __sync_val_compare_and_swap(reinterpret_cast<unsigned *>(var), oldvalue, newvalue); }
 
@@ -0,0 +1,63 @@
+/** @file
+ * Futex-based event.
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+#include "service/cpu.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * An auto-reset event for one waiting thread on a Linux host.
+ *
+ * Setting an event nobody sleeps on is a single xchg, waiting on a
+ * set event a single cmpxchg. Only a waiter that has to sleep
+ * announces itself, so that the next set() enters the kernel.
+ */
+class FutexEvent {
+  enum {
+    CLEAR,
+    SET,
+    SLEEPING,
+  };
+  int _state;
+
+  void futex(int op, int value) { syscall(SYS_futex, &_state, op, value, NULL, NULL, 0); }
+
+public:
+  void set() {
+    if (Cpu::xchg(&_state, int(SET)) == SLEEPING)
+      futex(FUTEX_WAKE_PRIVATE, 1);
+  }
+
+  /**
+   * Wait until the event is set and clear it again.
+   */
+  void wait() {
+    while (Cpu::cmpxchg(&_state, int(SET), int(CLEAR)) != SET)
+      if (Cpu::cmpxchg(&_state, int(CLEAR), int(SLEEPING)) != SET)
+        futex(FUTEX_WAIT_PRIVATE, SLEEPING);
+  }
+
+  /**
+   * Consume the event if it is set, but do not wait for it.
+   */
+  bool try_wait() { return Cpu::cmpxchg(&_state, int(SET), int(CLEAR)) == SET; }
+
+  FutexEvent() : _state(CLEAR) {}
+};
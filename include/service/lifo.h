@@ -21,6 +21,9 @@
 
 /**
  * Generic MP-save LIFO implementation.
+ *
+ * Elements are only taken out all at once, so a node can never be
+ * reused while an enqueue still looks at it and there is no ABA.
  */
 template <typename T>
 class AtomicLifo {
@@ -30,12 +33,62 @@ public:
 
   void enqueue(T volatile *value) {
     T *old;
+    T *n = const_cast<T *>(value);
     do {
       old = _head;
       value->lifo_next = old;
-    } while (Cpu::cmpxchg4b(reinterpret_cast<unsigned *>(&_head), reinterpret_cast<unsigned>(old), reinterpret_cast<unsigned>(value)) != reinterpret_cast<unsigned>(old));
+    } while (Cpu::cmpxchg(&_head, old, n) != old);
   }
 
   T *dequeue_all() { return Cpu::xchg(&_head, static_cast<T*>(NULL)); }
   T *head() { return _head; }
 };
+
+
+/**
+ * MP-safe LIFO of the indices 0..SIZE-1, for instance the free slots
+ * of a preallocated array.
+ *
+ * The head index and a modification count share a 64-bit word. A pop
+ * that raced with other threads popping and pushing back the same
+ * head fails its cmpxchg instead of linking in a stale next pointer.
+ * Indices instead of pointers keep this within cmpxchg8b, which both
+ * 32-bit and 64-bit hosts provide.
+ */
+template <unsigned SIZE>
+class TaggedLifo {
+  unsigned long long _head;   ///< count << 32 | index
+  unsigned _next[SIZE];
+
+  static unsigned long long make(unsigned long long old, unsigned index) {
+    return ((old >> 32) + 1) << 32 | index;
+  }
+
+public:
+  enum { EMPTY = ~0u };
+
+  void push(unsigned index) {
+    unsigned long long old;
+    do {
+      // A torn read on 32-bit just lets the cmpxchg fail.
+      old = _head;
+      _next[index] = old;
+    } while (Cpu::cmpxchg8b(&_head, old, make(old, index)) != old);
+  }
+
+  /**
+   * Returns EMPTY if there is nothing left.
+   */
+  unsigned pop() {
+    unsigned long long old;
+    do {
+      old = _head;
+      if (unsigned(old) == EMPTY) return EMPTY;
+    } while (Cpu::cmpxchg8b(&_head, old, make(old, _next[unsigned(old)])) != old);
+    return old;
+  }
+
+  bool empty() { return unsigned(_head) == EMPTY; }
+
+  TaggedLifo() : _head(EMPTY), _next() {}
+};
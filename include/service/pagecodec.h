@@ -0,0 +1,316 @@
+/** @file
+ * Page encoders for the migration memory stream.
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+#include <nul/compiler.h>
+#include <nul/types.h>
+#include <service/string.h>
+
+/**
+ * Stateless page codecs. Every encoder returns the number of bytes
+ * written to out, or -1 if the result does not fit into max bytes.
+ * Every decoder returns false on malformed input.
+ */
+struct PageCodec
+{
+  enum {
+    PAGE_SIZE = 0x1000,
+  };
+
+  static bool is_zero(const void *page)
+  {
+    const mword *p = reinterpret_cast<const mword *>(page);
+    for (unsigned i = 0; i < PAGE_SIZE / sizeof(*p); i += 4)
+      if (p[i] | p[i + 1] | p[i + 2] | p[i + 3]) return false;
+    return true;
+  }
+
+  /**
+   * A 128-bit page hash in the style of XXH3. The page is cut into
+   * 64-byte stripes. Every word goes unchanged into one of eight 64-bit
+   * accumulators and, mixed with a key that depends on its position,
+   * as a 32x32-bit product into its neighbour. Every 1k the
+   * accumulators are scrambled, and at the end they are merged into
+   * two differently keyed halves. All steps before the merge are
+   * invertible, so a change in a single word always reaches the 512
+   * bits of accumulator state. The stripe loop has no dependencies
+   * between the words and vectorizes.
+   */
+  struct Hash
+  {
+    unsigned long long lo, hi;
+
+    bool operator == (const Hash &other) const { return lo == other.lo and hi == other.hi; }
+    bool operator != (const Hash &other) const { return !(*this == other); }
+  };
+
+  static unsigned long long hash_avalanche(unsigned long long h)
+  {
+    h ^= h >> 33;
+    h *= 0xc2b2ae3d27d4eb4fULL;
+    h ^= h >> 29;
+    h *= 0x165667b19e3779f9ULL;
+    return h ^ h >> 32;
+  }
+
+  static unsigned long long hash_merge(const unsigned long long *acc, const unsigned long long *key)
+  {
+    unsigned long long h = 0;
+    for (unsigned j = 0; j < 8; j++)
+      h = (h ^ hash_avalanche(acc[j] ^ key[j])) * 0x9e3779b185ebca87ULL;
+    return hash_avalanche(h);
+  }
+
+  static Hash hash(const void *page)
+  {
+    enum {
+      STRIPE_WORDS  = 8,
+      BLOCK_STRIPES = 16,
+    };
+    // Random numbers. Stripe s of a block uses key[s .. s + 7], then
+    // come 8 to scramble and 2 x 8 to merge.
+    static const unsigned long long key[BLOCK_STRIPES + STRIPE_WORDS + STRIPE_WORDS + 2 * STRIPE_WORDS] = {
+      0x6aedcf4a4599a084ULL, 0x41f60be07cef6aa3ULL, 0x4d9dff9714f60b7aULL, 0x0587212a56b73cfeULL,
+      0x7bf8322a12847494ULL, 0x1d6608f702d34789ULL, 0xcec2d5ef48aa69a3ULL, 0xf4d26f481e22010bULL,
+      0xdafccd9f4fa0336cULL, 0xa638caa5be541a11ULL, 0xe62d3f4c09274947ULL, 0x110edc179ffbe863ULL,
+      0x45869e992290176eULL, 0xe565da21cb89c9f7ULL, 0x27749d9fbca9e904ULL, 0xfe19dbb53604c542ULL,
+      0xc2bf468ad91b8be9ULL, 0x6daacf24b7a115efULL, 0x9ce82c7013300288ULL, 0x248ee65a687b4c7aULL,
+      0x0ea43d37b350c341ULL, 0x083c2879ec46fde3ULL, 0x521739ea2c160877ULL, 0x5b461bc0407a17c2ULL,
+      0xb9a63c39c66c7e86ULL, 0x51ecae94f671b124ULL, 0x695140eb18004d45ULL, 0x056f89f816fefc7aULL,
+      0x5418f039c04d4adeULL, 0xc8acb3b05126362cULL, 0xb2fda54c6303c86dULL, 0xef516257e0574c68ULL,
+      0x87d81695beecb78cULL, 0x8970646aa924aed3ULL, 0xa1ceffb5de1e716fULL, 0x9ef59cf2bb673969ULL,
+      0xb3c33479cf6c7895ULL, 0x4118a8cba4ac1410ULL, 0xa9ca0d2797d938beULL, 0x7e204ae30f5350fbULL,
+      0x5fa97fe2e8dc4e64ULL, 0x35acdddfe96963c4ULL, 0x27ec999359f1a611ULL, 0xc9e201c1a0583cb8ULL,
+      0x3fea718f04537ef1ULL, 0xb626ec8c7ffdf292ULL, 0x6c8cf78b9f9565c0ULL, 0x35bd1a584b3572baULL,
+    };
+    const unsigned long long *scramble = key + BLOCK_STRIPES + STRIPE_WORDS;
+    const unsigned long long *merge    = scramble + STRIPE_WORDS;
+
+    const unsigned long long *p = reinterpret_cast<const unsigned long long *>(page);
+    unsigned long long acc[STRIPE_WORDS] = {
+      0xc2b2ae3dULL, 0x9e3779b185ebca87ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL,
+      0x85ebca77c2b2ae63ULL, 0x85ebca77ULL, 0x27d4eb2f165667c5ULL, 0x9e3779b1ULL,
+    };
+
+    for (unsigned b = 0; b < PAGE_SIZE / sizeof(*p); b += BLOCK_STRIPES * STRIPE_WORDS) {
+      for (unsigned s = 0; s < BLOCK_STRIPES; s++)
+        for (unsigned j = 0; j < STRIPE_WORDS; j++) {
+          unsigned long long value = p[b + s * STRIPE_WORDS + j];
+          unsigned long long mixed = value ^ key[s + j];
+          acc[j ^ 1] += value;
+          acc[j]     += (mixed & 0xffffffffULL) * (mixed >> 32);
+        }
+      for (unsigned j = 0; j < STRIPE_WORDS; j++) {
+        acc[j] ^= acc[j] >> 47;
+        acc[j] ^= scramble[j];
+        acc[j] *= 0x9e3779b1ULL;
+      }
+    }
+
+    Hash res = { hash_merge(acc, merge), hash_merge(acc, merge + STRIPE_WORDS) };
+    return res;
+  }
+
+  static unsigned load32(const unsigned char *p) { unsigned v; memcpy(&v, p, sizeof(v)); return v; }
+  static mword    loadw (const unsigned char *p) { mword    v; memcpy(&v, p, sizeof(v)); return v; }
+
+  static bool put_uleb(unsigned char *out, int &op, int max, unsigned value)
+  {
+    do {
+      if (op >= max) return false;
+      out[op++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+      value >>= 7;
+    } while (value);
+    return true;
+  }
+
+  static bool get_uleb(const unsigned char *in, unsigned &ip, unsigned len, unsigned &value)
+  {
+    value = 0;
+    for (unsigned shift = 0; shift < 32; shift += 7) {
+      if (ip >= len) return false;
+      unsigned char b = in[ip++];
+      value |= (b & 0x7fu) << shift;
+      if (~b & 0x80) return true;
+    }
+    return false;
+  }
+
+  /**
+   * XBZRLE: encode cur as a delta against old. The output is a list
+   * of (equal run, changed run, changed bytes) with ULEB128 lengths.
+   * Trailing equal bytes are implied, so an unchanged page encodes to
+   * zero bytes.
+   */
+  static int xbzrle_encode(const unsigned char *old, const unsigned char *cur, unsigned char *out, int max)
+  {
+    unsigned i = 0;
+    int op = 0;
+
+    while (i < PAGE_SIZE) {
+      unsigned same = i;
+      while (same + sizeof(mword) <= PAGE_SIZE and loadw(old + same) == loadw(cur + same)) same += sizeof(mword);
+      while (same < PAGE_SIZE and old[same] == cur[same]) same++;
+      if (same == PAGE_SIZE) break;
+
+      // Short equal runs inside a changed area are cheaper as literals.
+      unsigned diff = same;
+      while (diff < PAGE_SIZE) {
+        if (old[diff] != cur[diff]) { diff++; continue; }
+        unsigned end = diff;
+        while (end < PAGE_SIZE and end - diff < 2 and old[end] == cur[end]) end++;
+        if (end - diff >= 2 or end == PAGE_SIZE) break;
+        diff = end;
+      }
+
+      if (!put_uleb(out, op, max, same - i) or !put_uleb(out, op, max, diff - same) or
+          op + int(diff - same) > max)
+        return -1;
+      memcpy(out + op, cur + same, diff - same);
+      op += diff - same;
+      i   = diff;
+    }
+    return op;
+  }
+
+  static bool xbzrle_decode(unsigned char *page, const unsigned char *in, unsigned len)
+  {
+    unsigned ip = 0, pos = 0;
+    while (ip < len) {
+      unsigned same, diff;
+      if (!get_uleb(in, ip, len, same) or !get_uleb(in, ip, len, diff)) return false;
+      pos += same;
+      if (pos + diff > PAGE_SIZE or ip + diff > len) return false;
+      memcpy(page + pos, in + ip, diff);
+      pos += diff;
+      ip  += diff;
+    }
+    return true;
+  }
+
+  /**
+   * A byte-oriented LZ77 in the spirit of the LZ4 block format:
+   * token (literal length << 4 | match length - 4), extra length
+   * bytes of 255, literals, 16-bit little endian offset. The last
+   * sequence carries literals only.
+   */
+  enum {
+    LZ_HASH_BITS = 12,
+    LZ_MIN_MATCH = 4,
+  };
+
+  static bool lz_put_len(unsigned char *out, int &op, int max, unsigned len)
+  {
+    for (; len >= 255; len -= 255) {
+      if (op >= max) return false;
+      out[op++] = 255;
+    }
+    if (op >= max) return false;
+    out[op++] = len;
+    return true;
+  }
+
+  static bool lz_emit(unsigned char *out, int &op, int max, const unsigned char *lit, unsigned lit_len,
+                      unsigned offset, unsigned match_len)
+  {
+    unsigned ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if (op >= max) return false;
+    unsigned char &token = out[op++];
+    token = (VMM_MIN(lit_len, 15u) << 4) | VMM_MIN(ml, 15u);
+
+    if (lit_len >= 15 and !lz_put_len(out, op, max, lit_len - 15)) return false;
+    if (op + int(lit_len) > max) return false;
+    memcpy(out + op, lit, lit_len);
+    op += lit_len;
+
+    if (!match_len) return true;
+    if (op + 2 > max) return false;
+    out[op++] = offset;
+    out[op++] = offset >> 8;
+    return ml < 15 or lz_put_len(out, op, max, ml - 15);
+  }
+
+  static int lz_compress(const unsigned char *in, unsigned char *out, int max)
+  {
+    unsigned short table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    unsigned ip = 1, anchor = 0;
+    int op = 0;
+    while (ip + LZ_MIN_MATCH <= PAGE_SIZE) {
+      unsigned seq = load32(in + ip);
+      unsigned h   = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+      unsigned ref = table[h];
+      table[h] = ip;
+
+      if (load32(in + ref) != seq) {
+        // Skip faster through incompressible data.
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      unsigned len = LZ_MIN_MATCH;
+      while (ip + len < PAGE_SIZE and in[ref + len] == in[ip + len]) len++;
+      if (!lz_emit(out, op, max, in + anchor, ip - anchor, ip - ref, len)) return -1;
+      ip += len;
+      anchor = ip;
+    }
+    if (!lz_emit(out, op, max, in + anchor, PAGE_SIZE - anchor, 0, 0)) return -1;
+    return op;
+  }
+
+  static bool lz_get_len(const unsigned char *in, unsigned &ip, unsigned len, unsigned &value)
+  {
+    unsigned char b;
+    do {
+      if (ip >= len) return false;
+      b = in[ip++];
+      value += b;
+    } while (b == 255);
+    return true;
+  }
+
+  static bool lz_decompress(unsigned char *page, const unsigned char *in, unsigned len)
+  {
+    unsigned ip = 0, pos = 0;
+    while (ip < len) {
+      unsigned char token = in[ip++];
+      unsigned lit = token >> 4;
+      if (lit == 15 and !lz_get_len(in, ip, len, lit)) return false;
+      if (ip + lit > len or pos + lit > PAGE_SIZE) return false;
+      memcpy(page + pos, in + ip, lit);
+      ip  += lit;
+      pos += lit;
+      if (ip == len) break;
+
+      if (ip + 2 > len) return false;
+      unsigned offset = in[ip] | in[ip + 1] << 8;
+      ip += 2;
+      unsigned ml = token & 0xf;
+      if (ml == 15 and !lz_get_len(in, ip, len, ml)) return false;
+      ml += LZ_MIN_MATCH;
+      if (!offset or offset > pos or pos + ml > PAGE_SIZE) return false;
+
+      // Matches may overlap their own output, so copy bytewise.
+      for (unsigned i = 0; i < ml; i++, pos++)
+        page[pos] = page[pos - offset];
+    }
+    return pos == PAGE_SIZE;
+  }
+};
+
+// EOF
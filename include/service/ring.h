@@ -0,0 +1,120 @@
+/** @file
+ * Bounded lock-free rings.
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+#include <nul/compiler.h>
+
+/*
+ * Both rings hold SIZE elements of a copyable T. SIZE has to be a
+ * power of two, so that the free running positions stay consistent
+ * when they wrap. A full ring rejects the element, it is up to the
+ * caller to drop, retry or block.
+ *
+ * The positions live in cache lines of their own, otherwise producer
+ * and consumer would keep stealing the line from each other.
+ */
+enum { RING_CACHELINE = 64 };
+
+/**
+ * Ring for exactly one producer and one consumer thread.
+ */
+template <typename T, unsigned SIZE>
+class SpscRing {
+  static_assert(SIZE && !(SIZE & (SIZE - 1)), "SIZE must be a power of two");
+
+  unsigned _tail;             ///< written by the producer
+  char     _pad0[RING_CACHELINE - sizeof(unsigned)];
+  unsigned _head;             ///< written by the consumer
+  char     _pad1[RING_CACHELINE - sizeof(unsigned)];
+  T        _buf[SIZE];
+
+public:
+  bool push(const T &value) {
+    unsigned tail = _tail;
+    if (tail - __atomic_load_n(&_head, __ATOMIC_ACQUIRE) == SIZE) return false;
+    _buf[tail % SIZE] = value;
+    __atomic_store_n(&_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  bool pop(T &value) {
+    unsigned head = _head;
+    if (head == __atomic_load_n(&_tail, __ATOMIC_ACQUIRE)) return false;
+    value = _buf[head % SIZE];
+    __atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  bool empty() { return __atomic_load_n(&_head, __ATOMIC_ACQUIRE) == __atomic_load_n(&_tail, __ATOMIC_ACQUIRE); }
+
+  SpscRing() : _tail(0), _pad0(), _head(0), _pad1(), _buf() {}
+};
+
+
+/**
+ * Ring for any number of producers and a single consumer.
+ *
+ * Producers claim a slot by advancing the tail and publish it through
+ * the sequence number of the slot, so the consumer never sees a slot
+ * that is still being written. A producer preempted in between
+ * delays the consumer, but no other producer.
+ */
+template <typename T, unsigned SIZE>
+class MpscRing {
+  static_assert(SIZE && !(SIZE & (SIZE - 1)), "SIZE must be a power of two");
+
+  struct Slot {
+    unsigned seq;             ///< pos if free, pos + 1 if filled
+    T        value;
+  };
+
+  unsigned _tail;             ///< shared by the producers
+  char     _pad0[RING_CACHELINE - sizeof(unsigned)];
+  unsigned _head;             ///< private to the consumer
+  char     _pad1[RING_CACHELINE - sizeof(unsigned)];
+  Slot     _slots[SIZE];
+
+public:
+  bool push(const T &value) {
+    unsigned pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+    Slot *slot;
+    while (true) {
+      slot = _slots + pos % SIZE;
+      int diff = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos;
+      if (diff < 0) return false;
+      if (!diff && __atomic_compare_exchange_n(&_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+      if (diff) pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+    }
+    slot->value = value;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  bool pop(T &value) {
+    Slot *slot = _slots + _head % SIZE;
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != _head + 1) return false;
+    value = slot->value;
+    __atomic_store_n(&slot->seq, _head + SIZE, __ATOMIC_RELEASE);
+    _head++;
+    return true;
+  }
+
+  MpscRing() : _tail(0), _pad0(), _head(0), _pad1(), _slots() {
+    for (unsigned i=0; i < SIZE; i++) _slots[i].seq = i;
+  }
+};
@@ -0,0 +1,70 @@
+/** @file
+ * Sequence lock.
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+#include "service/cpu.h"
+#include "service/string.h"
+
+/**
+ * Lets readers take consistent snapshots of state that a single
+ * writer updates in place, e.g. the CpuState of a VCPU or the VgaRegs
+ * for a frontend. Readers never block the writer, they just retry
+ * when it was active in between.
+ *
+ * Writers have to be serialized by other means.
+ */
+class SeqLock {
+  unsigned _seq;
+
+public:
+  void write_begin() {
+    __atomic_store_n(&_seq, _seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+
+  void write_end() { __atomic_store_n(&_seq, _seq + 1, __ATOMIC_RELEASE); }
+
+  unsigned read_begin() {
+    unsigned seq;
+    while ((seq = __atomic_load_n(&_seq, __ATOMIC_ACQUIRE)) & 1)
+      Cpu::pause();
+    return seq;
+  }
+
+  bool read_retry(unsigned seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&_seq, __ATOMIC_RELAXED) != seq;
+  }
+
+  template <typename T>
+  void write(T &dst, const T &src) {
+    write_begin();
+    memcpy(&dst, &src, sizeof(T));
+    write_end();
+  }
+
+  template <typename T>
+  void read(T &dst, const T &src) {
+    unsigned seq;
+    do {
+      seq = read_begin();
+      memcpy(&dst, &src, sizeof(T));
+    } while (read_retry(seq));
+  }
+
+  SeqLock() : _seq(0) {}
+};
@@ -59,6 +59,6 @@ PARAM_HANDLER(dio,
     Logging::panic("%s: failed to allocate ports %x/%u\n", __PRETTY_FUNCTION__, base, order);
 
   DirectIODevice *dev = new DirectIODevice(mb.bus_hwioin, mb.bus_hwioout, base, 1 << order);
-  mb.bus_ioin.add(dev,  DirectIODevice::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(dev, DirectIODevice::receive_static<MessageIOOut>);
+  mb.bus_ioin.add(dev,  DirectIODevice::receive_static<MessageIOIn>,  base, 1 << order);
+  mb.bus_ioout.add(dev, DirectIODevice::receive_static<MessageIOOut>, base, 1 << order);
 }
@@ -23,7 +23,7 @@
  * I/OxAPIC model.
  *
  * State: testing
- * Features: MSI generation, level+notify, PAR, EOI
+ * Features: MSI generation, level+notify, PAR, EOI, directed EOI
  * Difference: no APIC bus
  * Documentation: Intel ICH4.
  */
@@ -51,6 +51,7 @@ private:
   bool     _rirr  [PINS];
   bool     _ds    [PINS];
   bool     _notify[PINS];
+  unsigned _vector_pins[256];   ///< pins using a vector, bit per pin
 
   /**
    * Route IRQs and return a pin to a GSI number.
@@ -71,11 +72,22 @@ private:
   }
 
 
+  /**
+   * Update the low half of a redirection entry and the pins of its
+   * vector.
+   */
+  void set_redir_low(unsigned pin, unsigned value) {
+    _vector_pins[_redir[pin * 2] & 0xff] &= ~(1u << pin);
+    _redir[pin * 2] = value;
+    _vector_pins[value & 0xff] |= 1u << pin;
+  }
+
+
   /**
    * Read the data register.
    */
   void read_data(unsigned &value) {
-    if (in_range(_index, 0x10, 0x10 + PINS*2)) {
+    if (in_range(_index, 0x10, PINS*2)) {
       value = _redir[_index - 0x10];
       if (_ds  [(_index - 0x10) / 2]) value |= 1 << 12;
       if (_rirr[(_index - 0x10) / 2]) value |= 1 << 14;
@@ -91,10 +103,11 @@ private:
    * Write to the data register.
    */
   void write_data(unsigned value) {
-    if (in_range(_index, 0x10, 0x3f)) {
+    if (in_range(_index, 0x10, PINS*2)) {
       unsigned mask = (_index & 1) ? 0xffff0000 : 0x1afff;
-      _redir[_index - 0x10] = value & mask;
       unsigned pin = (_index - 0x10) / 2;
+      if (_index & 1) _redir[_index - 0x10] = value & mask;
+      else            set_redir_low(pin, value & mask);
 
       // if edge: clear ds bit
       _ds[pin] = _ds[pin] && _redir[pin * 2] & MessageApic::ICR_LEVEL;
@@ -159,14 +172,16 @@ private:
 
 
   /**
-   * EOI a vector.
+   * EOI a vector. Only the pins using it have to be looked at.
    */
   void eoi(unsigned char vector) {
-    for (unsigned i=0; i < PINS; i++)
-      if ((_redir[i*2] & 0xff) == vector && _rirr[i]) {
+    for (unsigned pins = _vector_pins[vector]; pins; pins &= pins - 1) {
+      unsigned i = Cpu::bsf(pins);
+      if (_rirr[i]) {
 	_rirr[i] = false;
 	notify(i);
       }
+    }
   }
 
 
@@ -174,17 +189,19 @@ private:
    * Reset the registers.
    */
   void reset() {
+    memset(_vector_pins, 0, sizeof(_vector_pins));
     for (unsigned i=0; i < PINS; i++) {
       _redir[2*i]   = 0x10000;
       _redir[2*i+1] = 0;
+      _vector_pins[0] |= 1u << i;
       _notify[i]    = false;
       _ds[i]        = false;
       _rirr[i]      = false;
     }
     // enable virtual wire mode?
     if (!_gsibase) {
-      _redir[2*0]     = 0x10700;
-      _redir[2*23]    = 0x10400;
+      set_redir_low(0,  0x10700);
+      set_redir_low(23, 0x10400);
     }
     _id = 0;
     _index = 0;
@@ -192,9 +209,7 @@ private:
 
 public:
   bool  receive(MessageMem &msg) {
-    if (!in_range(msg.phys, _base, 0x100) &&
-	// all IOApics should get the broadcast EOI from the LAPIC
-	msg.phys != MessageApic::IOAPIC_EOI) return false;
+    if (!in_range(msg.phys, _base, 0x100)) return false;
     switch (msg.phys & 0xff) {
     case OFFSET_INDEX:
       if (msg.read)  *msg.ptr = _index; else  _index = *msg.ptr;
@@ -207,6 +222,7 @@ public:
       pin_assert(*msg.ptr, MessageIrq::ASSERT_IRQ);
       return true;
     case OFFSET_EOI:
+      // directed EOI, when the LAPIC suppresses the broadcast
       if (msg.read) break;
       eoi(*msg.ptr);
       return true;
@@ -215,6 +231,12 @@ public:
   }
 
 
+  bool  receive(MessageEoi &msg) {
+    eoi(msg.vector);
+    return false;
+  }
+
+
   bool  receive(MessageIrq &msg) {
     if (!in_range(msg.line, _gsibase, PINS)) return false;
     COUNTER_INC("GSI");
@@ -259,8 +281,9 @@ public:
   IOApic(Motherboard &mb, uintptr_t base, unsigned gsibase) : _mb(mb), _base(base), _gsibase(gsibase)
   {
     reset();
-    _mb.bus_mem.add(this,       receive_static<MessageMem>);
-    _mb.bus_irqlines.add(this,  receive_static<MessageIrqLines>);
+    _mb.bus_mem.add(this,       receive_static<MessageMem>, _base, 0x100);
+    _mb.bus_irqlines.add(this,  receive_static<MessageIrqLines>, _gsibase, PINS);
+    _mb.bus_eoi.add(this,       receive_static<MessageEoi>);
     _mb.bus_legacy.add(this,    receive_static<MessageLegacy>);
     _mb.bus_discovery.add(this, discover);
   };
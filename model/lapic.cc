@@ -28,9 +28,9 @@
  * Lapic model.
  *
  * State: testing
- * Features: MEM, MSR, MSR-base and CPUID, LVT, LINT0/1, EOI, prioritize IRQ, error, RemoteEOI, timer, IPI, lowest prio, reset, x2apic mode, BIOS ACPI tables
+ * Features: MEM, MSR, MSR-base and CPUID, LVT, LINT0/1, EOI, prioritize IRQ, error, RemoteEOI, timer, TSC-deadline, IPI, lowest prio, reset, x2apic mode, BIOS ACPI tables
  * Missing:  focus checking, CR8/TPR setting
- * Difference:  no interrupt polarity, lowest prio is round-robin
+ * Difference:  no interrupt polarity, lowest prio prefers running vCPUs
  * Documentation: Intel SDM Volume 3a Chapter 10 253668-033.
  */
 class Lapic : public DiscoveryHelper<Lapic>, public StaticReceiver<Lapic>
@@ -57,12 +57,14 @@ private:
   VCpu        &_vcpu;
 
   unsigned  _initial_apic_id;
+  unsigned  _route;
   unsigned  _timer;
   unsigned  _timer_clock_shift { 0 };
 
   // dynamic state
   unsigned  _timer_dcr_shift   { 0 };
   timevalue _timer_start       { 0 };
+  timevalue _tsc_deadline      { 0 };
   unsigned long long _msr      { 0 };
   unsigned  _vector[8*3];
   unsigned  _esr_shadow        { 0 };
@@ -76,8 +78,19 @@ private:
   bool sw_disabled() { return ~_SVR & 0x100; }
   bool hw_disabled() { return ~_msr & 0x800; }
   bool x2apic_mode() { return  (_msr & 0xc00) == 0xc00; }
+  bool tsc_deadline_mode() { return ((_TIMER >> 17) & 3) == 2; }
   unsigned x2apic_ldr() { return ((_initial_apic_id & ~0xf) << 12) | ( 1 << (_initial_apic_id & 0xf)); }
 
+  /**
+   * Tell the APIC router which destinations we accept.
+   */
+  void update_route() {
+    if (x2apic_mode())
+      _mb.apic_router.update(_route, true, _ID, 0, false);
+    else
+      _mb.apic_router.update(_route, false, _ID >> 24, _LDR >> 24, (_DFR >> 28) == 0xf);
+  }
+
 
   /**
    * Handle an INIT signal.
@@ -97,12 +110,13 @@ private:
     memset(_rirr,    0, sizeof(_rirr));
     _isrv = 0;
     _esr_shadow = 0;
+    _tsc_deadline = 0;
     _lowest_rr = 0;
 
 
     _ID = old_id;
     _lvtds[_LINT0_offset - LVT_BASE] = lint0;
-
+    update_route();
 
     update_irqs();
   }
@@ -153,6 +167,7 @@ private:
 
     // set them to default state if disabled
     if (hw_disabled()) init();
+    update_route();
     return true;
   }
 
@@ -161,7 +176,7 @@ private:
    * counter value.
    */
   unsigned get_ccr(timevalue now) {
-    if (!_ICT || !_timer_start)  return 0;
+    if (!_ICT || !_timer_start || tsc_deadline_mode())  return 0;
 
     timevalue delta = (now - _timer_start) >> _timer_dcr_shift;
     if (delta < _ICT)  return _ICT - delta;
@@ -189,6 +204,28 @@ private:
     _mb.bus_timer.send(msg);
   }
 
+  /**
+   * Reprogram the host timer for the TSC deadline. A stale timeout
+   * is filtered when it arrives.
+   */
+  void update_deadline() {
+    if (!_tsc_deadline || !tsc_deadline_mode() || _TIMER & (1 << LVT_MASK_BIT)) return;
+    MessageTimer msg(_timer, _tsc_deadline);
+    _mb.bus_timer.send(msg);
+  }
+
+  /**
+   * The guest switched the timer mode. Leaving or entering
+   * TSC-deadline mode disarms the timer.
+   */
+  void timer_mode_changed() {
+    if (tsc_deadline_mode()) {
+      _ICT = 0;
+      _timer_start = 0;
+    } else
+      _tsc_deadline = 0;
+  }
+
 
   /**
    * We send an IPI.
@@ -237,15 +274,15 @@ private:
     icr = icr & 0x4fff;
     if (event == VCpu::EVENT_LOWEST) {
 
-      // we send them round-robin as EVENT_FIXED
+      // the router arbitrates and delivers them as EVENT_FIXED
       MessageApic msg((icr & ~0x700u), dst, 0);
 
       // we could set an send accept error here if nobody got the
       // message, but that is not supported in the P4...
-      return _mb.bus_apic.send_rr(msg, _lowest_rr);
+      return _mb.apic_router.send_lowest(msg, _lowest_rr);
     }
     MessageApic msg(icr, dst, shorthand == 3 ? this : 0);
-    return _mb.bus_apic.send(msg);
+    return _mb.apic_router.send(msg);
   }
 
 
@@ -345,8 +382,8 @@ private:
     // broadcast suppression?
     if (_SVR & 0x1000) return;
 
-    MessageMem msg(false, MessageApic::IOAPIC_EOI, &vector);
-    _mb.bus_mem.send(msg);
+    MessageEoi msg(vector);
+    _mb.bus_eoi.send(msg);
   }
 
   /**
@@ -423,7 +460,10 @@ private:
     // do side effects of a changed LVT entry
     if (in_range(offset, LVT_BASE, NUM_LVT)) {
       if (_lvtds[offset - LVT_BASE]) trigger_lvt(offset - LVT_BASE);
-      if (offset == _TIMER_offset)   update_timer(_mb.clock()->time());
+      if (offset == _TIMER_offset) {
+	update_timer(_mb.clock()->time());
+	update_deadline();
+      }
       update_irqs();
     }
     return res;
@@ -552,6 +592,12 @@ public:
   bool  receive(MessageTimeout &msg) {
     if (hw_disabled() || msg.nr != _timer) return false;
 
+    // the deadline fires once and may have moved since
+    if (tsc_deadline_mode()) {
+      if (!_tsc_deadline || _mb.clock()->time() < _tsc_deadline) return true;
+      _tsc_deadline = 0;
+    }
+
     // no need to call update timer here, as the CPU needs to do an
     // EOI first
     trigger_lvt(_TIMER_offset - LVT_BASE);
@@ -582,6 +628,16 @@ public:
     return true;
   }
 
+  /**
+   * Lowest priority arbitration. The PPR decides, a vCPU that has
+   * to be woken up first only wins against equally busy ones.
+   */
+  bool  receive(MessageApicPrio &msg) {
+    if (!accept_message(msg.msg)) return false;
+    msg.prio = (processor_prio() >> 4) << 1 | _vcpu.blocked;
+    return true;
+  }
+
   /**
    * Receive INTA cycle or RESET from the CPU.
    */
@@ -616,14 +672,36 @@ public:
       reset();
     else if (msg.type == LapicEvent::INIT)
       init();
+    else if (msg.type == LapicEvent::GET_DEADLINE) {
+      if (hw_disabled()) return false;
+      msg.deadline = tsc_deadline_mode() ? _tsc_deadline : 0;
+    }
+    else if (msg.type == LapicEvent::SET_DEADLINE) {
+      if (hw_disabled()) return false;
+      // writes in other timer modes are ignored
+      if (tsc_deadline_mode()) {
+        _tsc_deadline = msg.deadline;
+        update_deadline();
+      }
+    }
     return true;
   }
 
 
   /**
-   * Receive RDMSR and WRMSR messages.
+   * Receive RDMSR and WRMSR messages. The TSC deadline MSR comes
+   * through the VCPU, as only it knows the guest TSC offset.
    */
   bool  receive(CpuMessage &msg) {
+    // the deadline is kept in host TSC, which just moved
+    if (msg.type == CpuMessage::TYPE_ADD_TSC_OFF) {
+      if (_tsc_deadline) {
+        _tsc_deadline -= msg.current_tsc_off;
+        update_deadline();
+      }
+      return false;
+    }
+
     if (msg.type == CpuMessage::TYPE_RDMSR) {
       msg.mtr_out |= MTD_GPR_ACDB;
 
@@ -769,6 +847,8 @@ public:
       else {
           memcpy(reinterpret_cast<void*>(&_timer), msg.space, bytes);
           memcpy(reinterpret_cast<void*>(&_regstart), msg.space + bytes, bytes2);
+          update_route();
+          update_deadline();
       }
 
       Logging::printf("%s LAPIC\n", msg.write?"Saved":"Restored");
@@ -779,7 +859,9 @@ public:
 
 
   Lapic(Motherboard &mb, VCpu &vcpu, unsigned initial_apic_id, unsigned timer)
-      : _mb(mb), _vcpu(vcpu), _initial_apic_id(initial_apic_id), _timer(timer), _restore_processed(false)
+      : _mb(mb), _vcpu(vcpu), _initial_apic_id(initial_apic_id),
+        _route(mb.apic_router.add(this, receive_static<MessageApic>, receive_static<MessageApicPrio>)),
+        _timer(timer), _restore_processed(false)
   {
     // find a FREQ that is not too high
     for (_timer_clock_shift=0; _timer_clock_shift < 32; _timer_clock_shift++)
@@ -792,6 +874,8 @@ public:
       CpuMessage(11, 3, 0, _initial_apic_id),
       // support for APIC timer that does not sleep in C-states
       CpuMessage(6, 0, ~(1 << 2), 1 << 2),
+      // TSC-deadline timer mode
+      CpuMessage(1,  2, ~(1 << 24), 1 << 24),
     };
     for (unsigned i=0; i < sizeof(msg) / sizeof(*msg); i++)
       _vcpu.executor.send(msg[i]);
@@ -804,7 +888,9 @@ public:
     mb.bus_discovery.add(this,discover);
     mb.bus_restore.add(this, receive_static<MessageRestore>);
 
-    _vcpu.executor.add(this,  receive_static<CpuMessage>);
+    _vcpu.executor.add(this,  receive_static<CpuMessage>,
+                       ExecutorBus::type(CpuMessage::TYPE_RDMSR) | ExecutorBus::type(CpuMessage::TYPE_WRMSR) |
+                       ExecutorBus::type(CpuMessage::TYPE_ADD_TSC_OFF));
     _vcpu.mem.add(this,       receive_static<MessageMem>);
     _vcpu.memregion.add(this, receive_static<MessageMemRegion>);
     _vcpu.bus_lapic.add(this, receive_static<LapicEvent>);
@@ -833,22 +919,23 @@ PARAM_HANDLER(lapic,
 
 #else
 VMM_REGSET(Lapic,
-       VMM_REG_RW(_ID,            0x02,          0, 0xff000000,)
+       VMM_REG_RW(_ID,            0x02,          0, 0xff000000, update_route();)
        VMM_REG_RO(_VERSION,       0x03, 0x01050014)
        VMM_REG_RW(_TPR,           0x08,          0, 0xff,)
-       VMM_REG_RW(_LDR,           0x0d,          0, 0xff000000,)
-       VMM_REG_RW(_DFR,           0x0e, 0xffffffff, 0xf0000000,)
+       VMM_REG_RW(_LDR,           0x0d,          0, 0xff000000, update_route();)
+       VMM_REG_RW(_DFR,           0x0e, 0xffffffff, 0xf0000000, update_route();)
        VMM_REG_RW(_SVR,           0x0f, 0x000000ff, 0x11ff,     update_irqs();)
        VMM_REG_RW(_ESR,           0x28,          0, 0xffffffff, _ESR = Cpu::xchg(&_esr_shadow, 0U); return !value; )
        VMM_REG_RW(_ICR,           0x30,          0, 0x000ccfff, if (!send_ipi(_ICR, _ICR1)) COUNTER_INC("IPI missed");)
        VMM_REG_RW(_ICR1,          0x31,          0, 0xff000000,)
-       VMM_REG_RW(_TIMER,         0x32, 0x00010000, 0x310ff, )
+       VMM_REG_RW(_TIMER,         0x32, 0x00010000, 0x710ff, timer_mode_changed();)
        VMM_REG_RW(_TERM,          0x33, 0x00010000, 0x117ff, )
        VMM_REG_RW(_PERF,          0x34, 0x00010000, 0x117ff, )
        VMM_REG_RW(_LINT0,         0x35, 0x00010000, 0x1b7ff, )
        VMM_REG_RW(_LINT1,         0x36, 0x00010000, 0x1b7ff, )
        VMM_REG_RW(_ERROR,         0x37, 0x00010000, 0x110ff, )
        VMM_REG_RW(_ICT,           0x38,          0, ~0u,
+	      if (tsc_deadline_mode()) { _ICT = 0; return true; }
 	      COUNTER_INC("lapic ict");
 	      _timer_start = _mb.clock()->time();
 	      update_timer(_timer_start); )
@@ -80,7 +80,7 @@ PARAM_HANDLER(mem,
   Logging::printf("physmem: %lx [%lx, %lx]\n", msg.value, start, end);
   MemoryController *dev = new MemoryController(msg.ptr, start, end);
   // physmem access
-  mb.bus_mem.add(dev,       MemoryController::receive_static<MessageMem>);
+  mb.bus_mem.add(dev,       MemoryController::receive_static<MessageMem>, start, end - start);
   mb.bus_mem.add_iothread_callback(dev,       MemoryController::claim_static<MessageMem>);
   mb.bus_memregion.add(dev, MemoryController::receive_static<MessageMemRegion>);
 }
@@ -24,10 +24,10 @@
  * Forward Message Signaled IRQs to the local APICs.
  *
  * State: testing
- * Features: LowestPrio: RoundRobin, 16bit dest
+ * Features: LowestPrio: arbitrated by the ApicRouter, 16bit dest
  */
 class Msi  : public StaticReceiver<Msi> {
-  DBus<MessageApic>  & _bus_apic;
+  ApicRouter & _router;
   unsigned  _lowest_rr;
 
 public:
@@ -48,20 +48,20 @@ public:
 
     // lowest prio mode?
     if (msg.phys & MessageMem::MSI_RH || event & VCpu::EVENT_LOWEST) {
-      // we send them round-robin as EVENT_FIXED
+      // the router picks a target and delivers them as EVENT_FIXED
       MessageApic msg1(icr & ~0x700, dst, 0);
-      return _bus_apic.send_rr(msg1, _lowest_rr);
+      return _router.send_lowest(msg1, _lowest_rr);
     }
     MessageApic msg1(icr, dst, 0);
-    return _bus_apic.send(msg1);
+    return _router.send(msg1);
   }
 
-  Msi(DBus<MessageApic>  &bus_apic) : _bus_apic(bus_apic), _lowest_rr() {}
+  Msi(ApicRouter &router) : _router(router), _lowest_rr() {}
 };
 
 PARAM_HANDLER(msi,
 	      "msi - provide MSI support by forwarding access to 0xfee00000 to the LocalAPICs.")
 {
-  mb.bus_mem.add(new Msi(mb.bus_apic), Msi::receive_static<MessageMem>);
+  mb.bus_mem.add(new Msi(mb.apic_router), Msi::receive_static<MessageMem>, MessageMem::MSI_ADDRESS, 1 << 20);
 }
 
@@ -46,8 +46,9 @@ PARAM_HANDLER(nullio,
 	      "nullio:<range>[,value] - ignore IOIO at given port range. An optional value can be given to return a fixed value on read..",
 	      "Example: 'nullio:0x80+1'.")
 {
-  NullIODevice *dev = new NullIODevice(argv[0], argv[1] == ~0UL ? 1 : argv[1], argv[2]);
-  mb.bus_ioin.add(dev,  NullIODevice::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(dev, NullIODevice::receive_static<MessageIOOut>);
+  unsigned size = argv[1] == ~0UL ? 1 : argv[1];
+  NullIODevice *dev = new NullIODevice(argv[0], size, argv[2]);
+  mb.bus_ioin.add(dev,  NullIODevice::receive_static<MessageIOIn>,  argv[0], size);
+  mb.bus_ioout.add(dev, NullIODevice::receive_static<MessageIOOut>, argv[0], size);
 }
 
@@ -429,9 +429,13 @@ PARAM_HANDLER(pic,
 				 argv[1],
 				 argv[2],
 				 virq);
-  mb.bus_ioin.    add(dev, PicDevice::receive_static<MessageIOIn>);
-  mb.bus_ioout.   add(dev, PicDevice::receive_static<MessageIOOut>);
-  mb.bus_irqlines.add(dev, PicDevice::receive_static<MessageIrqLines>);
+  mb.bus_ioin.    add(dev, PicDevice::receive_static<MessageIOIn>,  argv[0], 2);
+  mb.bus_ioout.   add(dev, PicDevice::receive_static<MessageIOOut>, argv[0], 2);
+  if (~argv[2]) {
+    mb.bus_ioin.  add(dev, PicDevice::receive_static<MessageIOIn>,  argv[2], 1);
+    mb.bus_ioout. add(dev, PicDevice::receive_static<MessageIOOut>, argv[2], 1);
+  }
+  mb.bus_irqlines.add(dev, PicDevice::receive_static<MessageIrqLines>, virq, 8);
   mb.bus_pic.     add(dev, PicDevice::receive_static<MessagePic>);
   mb.bus_restore.add(dev, PicDevice::receive_static<MessageRestore>);
   if (!virq)
@@ -23,6 +23,14 @@
 /**
  * A single counter of a PIT.
  *
+ * Counter and output are computed from the clock when the guest reads
+ * them. The host timer is only armed for the next interrupt after the
+ * previous one was delivered, which the interrupt controllers tell us
+ * with an IrqNotify on EOI or unmask. A masked PIT thus costs nothing.
+ * Periodic ticks that were missed meanwhile are dropped, or up to
+ * _catchup of them are delivered back-to-back, for guests that count
+ * ticks to keep their time.
+ *
  * State: stable
  * Implementation Note: the access to the _modus variable is not SMP safe.
  * Documentation: Intel 82c54 - intel-82c54-timer.pdf
@@ -65,8 +73,12 @@ class PitCounter : public StaticReceiver<PitCounter>
   DBus<MessageTimer> * _bus_timer;
   DBus<MessageIrqLines> * _bus_irq;
   unsigned             _irq;
-  Clock                _clock;
+  Clock              * _clock;
   unsigned             _timer { 0 };
+  unsigned             _catchup;    ///< missed ticks we deliver late
+  unsigned             _missed;
+  timevalue            _tick;       ///< the last tick we accounted for
+  timevalue            _armed;      ///< the pending timeout
   static const long FREQ = 1193180;
 
   bool feature(Features f)
@@ -106,7 +118,7 @@ class PitCounter : public StaticReceiver<PitCounter>
   {
     _latch = get_counter();
     _stopped_out = feature(FPERIODIC) || get_out();
-    _start = _clock.clock(FREQ);
+    _start = _clock->clock(FREQ);
     _stopped = 1;
   }
 
@@ -116,12 +128,30 @@ class PitCounter : public StaticReceiver<PitCounter>
    */
   void update_timer()
   {
-    if (_irq == ~0U)  return;
-    timevalue t = _clock.clock(FREQ);
+    if (_irq == ~0U || _stopped)  return;
+    timevalue t = _clock->clock(FREQ);
     timevalue to= _start;
     if (feature(FPERIODIC))
-      to = t + (_initial + _start - t) % _initial;
-    MessageTimer msg(_timer, _clock.abstime((to < t) ? 0 : (to - t), FREQ));
+      {
+	// the counter wraps at _start + n * _initial, with a new count from the first wrap on
+	if (_modus & NULL_COUNT && t >= _start)  load_counter();
+	to = t < _start ? _start : t + _initial - (t - _start) % _initial;
+	if (_tick && t > _tick)
+	  _missed = VMM_MIN(_missed + (t - _tick) / _initial, _catchup);
+	_tick = to - _initial;
+	if (_missed)
+	  {
+	    _missed--;
+	    to = t;
+	  }
+	else
+	  _tick = to;
+      }
+
+    // The EOI and an unmask may both ask for the same tick.
+    if (to == _armed && to > t)  return;
+    _armed = to;
+    MessageTimer msg(_timer, _clock->abstime((to < t) ? 0 : (to - t), FREQ));
     _bus_timer->send(msg);
   }
 
@@ -133,11 +163,11 @@ class PitCounter : public StaticReceiver<PitCounter>
   {
     if (_stopped)  return _latch;
 
-    long long res = _start - _clock.clock(FREQ);
+    long long res = _start - _clock->clock(FREQ);
     if (_modus & BCD) res = (res % 10000);
 
     // are we still having an old value?
-    if (_start - _initial - 1 == _clock.clock(FREQ))
+    if (_start - _initial - 1 == _clock->clock(FREQ))
       return _latch;
 
     if (res <= 0)  load_counter();
@@ -152,7 +182,8 @@ class PitCounter : public StaticReceiver<PitCounter>
     _latch = get_counter();
     _stopped_out = (_modus & 0xe) != 0 ? get_out() : 0;
     _stopped = 0;
-    _start = _clock.clock(FREQ) + _new_counter + 1;
+    _start = _clock->clock(FREQ) + _new_counter + 1;
+    _tick = _missed = 0;
     load_counter();
     update_timer();
   }
@@ -217,7 +248,7 @@ class PitCounter : public StaticReceiver<PitCounter>
 	else if (_stopped)
 	  {
 	    _initial = _latch ? _latch : 65536;
-	    _start = _clock.clock(FREQ) + _initial + 1;
+	    _start = _clock->clock(FREQ) + _initial + 1;
 	    _stopped = 0;
 	  }
       }
@@ -228,18 +259,18 @@ class PitCounter : public StaticReceiver<PitCounter>
    */
   bool get_out()
   {
-    if (_stopped || _start - _initial -1 == _clock.clock(FREQ))
+    if (_stopped || _start - _initial -1 == _clock->clock(FREQ))
       return _stopped_out;
 
     if (feature(FCOUNTDOWN))
-      return _clock.clock(FREQ) >= _start;
+      return _clock->clock(FREQ) >= _start;
     if (feature(FPERIODIC)) {
       if (!feature(FSQUARE_WAVE))
         return get_counter() != 1;
       else
-        return ((_clock.clock(FREQ) - _start + _initial) % _initial)*2 < _initial;
+        return ((_clock->clock(FREQ) - _start + _initial) % _initial)*2 < _initial;
     }
-    return _clock.clock(FREQ) != _start;
+    return _clock->clock(FREQ) != _start;
   }
 
   /**
@@ -318,7 +349,11 @@ class PitCounter : public StaticReceiver<PitCounter>
 	  if (_stopped)
 	    reload_counter();
 	  else
-	    _start = _clock.clock(FREQ) + get_counter();
+	    {
+	      // the new count is loaded when the current period ends
+	      timevalue t = _clock->clock(FREQ);
+	      if (t >= _start)  _start = t + _initial - (t - _start) % _initial;
+	    }
 	}
   }
 
@@ -335,7 +370,8 @@ class PitCounter : public StaticReceiver<PitCounter>
   {
     if (msg.nr == _timer)
       {
-	// a timeout has triggerd
+	// a timeout has triggerd, the next one waits for the IrqNotify
+	_armed = 0;
 	MessageIrqLines msg1(MessageIrq::ASSERT_NOTIFY, _irq);
 	_bus_irq->send(msg1);
 	return true;
@@ -344,10 +380,11 @@ class PitCounter : public StaticReceiver<PitCounter>
   }
 
 
-  PitCounter(DBus<MessageTimer> *bus_timer, DBus<MessageIrqLines> *bus_irq, unsigned irq, Clock *clock)
-    : _modus(), _latch(), _new_counter(), _initial(), _latched_status(), _start(0), _bus_timer(bus_timer), _bus_irq(bus_irq), _irq(irq), _clock(*clock)
+  PitCounter(DBus<MessageTimer> *bus_timer, DBus<MessageIrqLines> *bus_irq, unsigned irq, Clock *clock, unsigned catchup)
+    : _modus(), _latch(), _new_counter(), _initial(), _latched_status(), _start(0), _bus_timer(bus_timer), _bus_irq(bus_irq), _irq(irq), _clock(clock),
+      _catchup(catchup), _missed(0), _tick(0), _armed(0)
   {
-    assert(_clock.freq() != 0);
+    assert(_clock->freq() != 0);
     if (_irq != ~0U)
       {
 	MessageTimer msg0;
@@ -357,9 +394,22 @@ class PitCounter : public StaticReceiver<PitCounter>
       };
   }
   PitCounter()
-    : _modus(), _latch(), _new_counter(), _initial(), _latched_status(), _start(0), _bus_timer(nullptr), _bus_irq(0), _irq(0), _clock(0)
+    : _modus(), _latch(), _new_counter(), _initial(), _latched_status(), _start(0), _bus_timer(nullptr), _bus_irq(0), _irq(0), _clock(nullptr),
+      _catchup(0), _missed(0), _tick(0), _armed(0)
   { }
 
+  /**
+   * Keep our buses, timer and clock when the rest of the state comes
+   * from another VMM.
+   */
+  void keep_host(PitCounter const &local)
+  {
+    _bus_timer = local._bus_timer;
+    _bus_irq   = local._bus_irq;
+    _clock     = local._clock;
+    _timer     = local._timer;
+  }
+
   PitCounter &operator = (PitCounter const &other)
   {
     memcpy(this, &other, sizeof(*this));
@@ -457,7 +507,10 @@ class PitDevice : public StaticReceiver<PitDevice>
 
      }
      else {
+         PitCounter local[COUNTER];
+         for (unsigned i=0; i < COUNTER; i++) local[i] = _c[i];
          memcpy(reinterpret_cast<void*>(&_base), msg.space, bytes);
+         for (unsigned i=0; i < COUNTER; i++) _c[i].keep_host(local[i]);
      }
 
      //Logging::printf("%s PIT\n", msg.write?"Saved":"Restored");
@@ -466,12 +519,12 @@ class PitDevice : public StaticReceiver<PitDevice>
  }
 
 
-  PitDevice(Motherboard &mb, unsigned short base, unsigned irq, unsigned pit)
+  PitDevice(Motherboard &mb, unsigned short base, unsigned irq, unsigned pit, unsigned catchup)
     : _base(base), _addr(pit*COUNTER), _restore_processed(false)
   {
     for (unsigned i=0; i < COUNTER; i++)
       {
-	_c[i] = PitCounter(&mb.bus_timer, &mb.bus_irqlines, i ? ~0U : irq, mb.clock());
+	_c[i] = PitCounter(&mb.bus_timer, &mb.bus_irqlines, i ? ~0U : irq, mb.clock(), catchup);
 	if (!i) mb.bus_irqnotify.add(&_c[i], PitCounter::receive_static<MessageIrqNotify>);
 	if (!i) mb.bus_timeout.add(&_c[i],   PitCounter::receive_static<MessageTimeout>);
 	_c[i].set_gate(1);
@@ -481,17 +534,19 @@ class PitDevice : public StaticReceiver<PitDevice>
 
 
 PARAM_HANDLER(pit,
-	      "pit:iobase,irq - attach a PIT8254 to the system.",
-	      "Example: 'pit:0x40,0'")
+	      "pit:iobase,irq,catchup=0 - attach a PIT8254 to the system.",
+	      "Example: 'pit:0x40,0'",
+	      "Periodic ticks the guest missed are dropped, unless catchup allows to deliver that many late.")
 {
   static unsigned pit_count;
   PitDevice *dev = new PitDevice(mb,
 				 argv[0],
 				 argv[1],
-				 pit_count++);
+				 pit_count++,
+				 argv[2] == ~0UL ? 0 : argv[2]);
 
-  mb.bus_ioin.add(dev,  PitDevice::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(dev, PitDevice::receive_static<MessageIOOut>);
+  mb.bus_ioin.add(dev,  PitDevice::receive_static<MessageIOIn>,  argv[0], 4);
+  mb.bus_ioout.add(dev, PitDevice::receive_static<MessageIOOut>, argv[0], 4);
   mb.bus_pit.add(dev,   PitDevice::receive_static<MessagePit>);
   mb.bus_restore.add(dev, PitDevice::receive_static<MessageRestore>);
 } 
@@ -25,6 +25,13 @@ using namespace Bcd;
 /**
  * Device model for the MC146818 realtime clock.
  *
+ * Time, flags and the update cycle are computed when the guest
+ * accesses them. A host timer is only armed for an enabled interrupt
+ * after the previous one was acknowledged by reading register C or
+ * delivered, which the interrupt controllers tell us with an
+ * IrqNotify. Missed periodic interrupts are dropped, or up to
+ * _catchup of them are delivered late.
+ *
  * State: testing
  * Features: 128byte RAM, gettime, updatetime, UIE, alarm, periodic-irqs, divider
  * Missing: daylight-saving
@@ -44,6 +51,9 @@ class Rtc146818 : public StaticReceiver<Rtc146818>
   unsigned char         _ram[128];
   timevalue             _offset { 0 };
   timevalue             _last   { 0 };
+  timevalue             _armed  { 0 };  ///< counter value of the pending timeout
+  unsigned              _catchup;       ///< missed periodic interrupts we deliver late
+  unsigned              _missed { 0 };
 
   /**
    * Timing:
@@ -254,7 +264,16 @@ class Rtc146818 : public StaticReceiver<Rtc146818>
     unsigned  periodic_tics = get_periodic_tics();
 
     if (periodic_tics && ((fnow - periodic_tics/2) / periodic_tics) != ((flast - periodic_tics/2) / periodic_tics))
-      set_irqflags(_ram[0xc] | 0x40);
+      {
+	// Every period but one is lost, and that one too if the last is still pending.
+	if (_catchup && _ram[0xb] & 0x40)
+	  {
+	    timevalue periods = (now + periodic_tics/2) / periodic_tics - (_last + periodic_tics/2) / periodic_tics;
+	    if (_ram[0xc] & 0x40) periods++;
+	    if (periods > 1) _missed = VMM_MIN(_missed + periods - 1, static_cast<timevalue>(_catchup));
+	  }
+	set_irqflags(_ram[0xc] | 0x40);
+      }
     seconds /= FREQ;
 
     // update cycle if not SET and not in the very same second
@@ -277,7 +296,9 @@ class Rtc146818 : public StaticReceiver<Rtc146818>
   {
     timevalue next = 0;
     unsigned periodic_tics = get_periodic_tics();
-    if (_ram[0xb] & 0x40 && periodic_tics)
+    if (_ram[0xb] & 0x40 && periodic_tics && _missed)
+      next = 1;
+    else if (_ram[0xb] & 0x40 && periodic_tics)
       next = periodic_tics - (static_cast<unsigned>(now % FREQ) + periodic_tics/2) % periodic_tics;
     else if (_ram[0xb] & 0x10)
       next = FREQ - now % FREQ;
@@ -288,6 +309,10 @@ class Rtc146818 : public StaticReceiver<Rtc146818>
       }
     if (next)
       {
+	// Reading register C and the EOI both ask for the same timeout.
+	if (now + next == _armed)  return;
+	_armed = now + next;
+
 	// scale the next timeout with the divider
 	int divider = get_divider();
 	if (divider < 0)  return;
@@ -313,6 +338,7 @@ public:
     update_ram(now / FREQ);
     set_irqflags(0);
     _offset = _last = 0;
+    _missed = 0;
   }
 
 
@@ -411,31 +437,41 @@ public:
   bool  receive(MessageTimeout &msg)
   {
     if (msg.nr != _timer) return false;
+    _armed = 0;
     update_cycle(get_counter());
+    // a periodic interrupt we still owe the guest
+    if (_missed && _ram[0xb] & 0x40 && ~_ram[0xc] & 0x40)
+      {
+	_missed--;
+	set_irqflags(_ram[0xc] | 0x40);
+      }
     return true;
   }
 
 
-  Rtc146818(DBus<MessageTimer> &bus_timer, DBus<MessageIrqLines> &bus_irqlines, Clock &clock, unsigned timer, unsigned short iobase, unsigned irq)
-    : _bus_timer(bus_timer), _bus_irqlines(bus_irqlines), _clock(clock), _timer(timer), _iobase(iobase), _irq(irq)
+  Rtc146818(DBus<MessageTimer> &bus_timer, DBus<MessageIrqLines> &bus_irqlines, Clock &clock, unsigned timer, unsigned short iobase, unsigned irq,
+	    unsigned catchup)
+    : _bus_timer(bus_timer), _bus_irqlines(bus_irqlines), _clock(clock), _timer(timer), _iobase(iobase), _irq(irq), _catchup(catchup)
   {}
 };
 
 PARAM_HANDLER(rtc,
-	      "rtc:iobase,irq - Attach a realtime clock including its CMOS RAM.",
-	      "Example: 'rtc:0x70,8'")
+	      "rtc:iobase,irq,catchup=0 - Attach a realtime clock including its CMOS RAM.",
+	      "Example: 'rtc:0x70,8'",
+	      "Periodic interrupts the guest missed are dropped, unless catchup allows to deliver that many late.")
 {
   MessageTimer msg0;
   if (!mb.bus_timer.send(msg0))
     Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
 
-  Rtc146818 *rtc = new Rtc146818(mb.bus_timer, mb.bus_irqlines, *mb.clock(), msg0.nr, argv[0],argv[1]);
+  Rtc146818 *rtc = new Rtc146818(mb.bus_timer, mb.bus_irqlines, *mb.clock(), msg0.nr, argv[0],argv[1],
+				  argv[2] == ~0UL ? 0 : argv[2]);
   MessageTime msg1;
   if (!mb.bus_time.send(msg1))
     Logging::printf("could not get wallclock time!\n");
   rtc->reset(msg1);
-  mb.bus_ioin.     add(rtc, Rtc146818::receive_static<MessageIOIn>);
-  mb.bus_ioout.    add(rtc, Rtc146818::receive_static<MessageIOOut>);
+  mb.bus_ioin.     add(rtc, Rtc146818::receive_static<MessageIOIn>,  argv[0], 8);
+  mb.bus_ioout.    add(rtc, Rtc146818::receive_static<MessageIOOut>, argv[0], 8);
   mb.bus_timeout.  add(rtc, Rtc146818::receive_static<MessageTimeout>);
   mb.bus_irqnotify.add(rtc, Rtc146818::receive_static<MessageIrqNotify>);
 }
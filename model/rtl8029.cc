@@ -30,7 +30,7 @@
 class Rtl8029: public StaticReceiver<Rtl8029>
 {
   DBus<MessageNetwork>  &_bus_network;
-  DBus<MessageIrqLines> &_bus_irqlines;
+  IrqLineBatch  _irqs;  ///< flushed at the end of every request
   unsigned char _irq;
   unsigned long long _mac;
   unsigned _bdf;
@@ -73,10 +73,7 @@ class Rtl8029: public StaticReceiver<Rtl8029>
   {
     _regs.isr |= value;
     if (_regs.isr & _regs.imr)
-      {
-	MessageIrqLines msg(MessageIrq::ASSERT_IRQ, _irq);
-	_bus_irqlines.send(msg);
-      }
+      _irqs.post(MessageIrq::ASSERT_IRQ, _irq);
   }
 
 
@@ -276,7 +273,9 @@ public:
   bool  receive(MessageNetwork &msg)
   {
     if (msg.buffer >= _mem && msg.buffer < _mem + sizeof(_mem)) return false;
-    return receive_packet(msg.buffer, msg.len);
+    bool res = receive_packet(msg.buffer, msg.len);
+    _irqs.flush();
+    return res;
   }
 
   bool receive(MessageIOIn &msg)
@@ -288,7 +287,7 @@ public:
     // for every byte
     for (unsigned i = 0; i < (1u<<msg.type); i++, addr++)
       read_byte(addr, reinterpret_cast<unsigned char *>(&msg.value)+i);
-
+    _irqs.flush();
     return true;
   }
 
@@ -301,6 +300,7 @@ public:
 
     for (unsigned i = 0; i < (1u<<msg.type); i++, addr++)
       write_byte(addr, msg.value >> (i*8));
+    _irqs.flush();
     return true;
   }
 
@@ -308,7 +308,7 @@ public:
 
 
   Rtl8029(DBus<MessageNetwork> &bus_network, DBus<MessageIrqLines> &bus_irqlines, unsigned char irq, unsigned long long mac, unsigned bdf) :
-    _bus_network(bus_network), _bus_irqlines(bus_irqlines),  _irq(irq), _mac(mac), _bdf(bdf)
+    _bus_network(bus_network), _irqs(bus_irqlines),  _irq(irq), _mac(mac), _bdf(bdf)
   {
     PCI_reset();
 
@@ -21,9 +21,13 @@
 /**
  * Implements a 16550 UART.
  *
+ * In FIFO mode, THR writes fill a transmit FIFO of 16 bytes, or 64
+ * bytes when enabled 16750 style, that goes to the host as a single
+ * message once it is full, a line ends or the flush timer fires. The
+ * line is infinitely fast, so THRE and TEMT always read as set.
+ *
  * State: stable
  * Missing Features:
- *  * no write fifo
  *  * no transmission effect of stopbit+parity+divisor
  *  * no character timeout indication -> need a timer for that
  *  * no MSR setting via client
@@ -40,6 +44,8 @@ private:
   unsigned char _irq;
   unsigned _hostserial;
   static const unsigned FIFOSIZE = 16;
+  static const unsigned TFIFOSIZE = 64;
+  static const unsigned FLUSH_US  = 1000;
   enum {
     RBR = 0,
     THR = 0,
@@ -61,6 +67,11 @@ private:
   unsigned char _rfcount;
   unsigned char _triggerlevel;
   unsigned char _sendmask;
+  unsigned char _tfifo[TFIFOSIZE];
+  unsigned _tfcount;
+  bool _fifo64;
+  unsigned _timer;
+  bool _timer_armed;
 
   /**
    * Returns the IIR and thereby prioritize the interrupts.
@@ -76,6 +87,7 @@ private:
       value = 4;
     if (_regs[IER] & 4 && _regs[LSR] & 0x1e) value = 6;
     if (_regs[FCR] & 1)  value |= 0xc;
+    if (_regs[FCR] & 1 && _fifo64) value |= 0x20;
     return value;
   }
 
@@ -86,12 +98,38 @@ private:
       _mb.bus_irqlines.send(msg);
   }
 
+  /**
+   * Hand everything in the transmit FIFO to the host at once.
+   */
+  void flush_tx()
+  {
+    if (!_tfcount) return;
+    MessageSerial msg(_hostserial + 1, _tfifo, _tfcount);
+    _tfcount = 0;
+    _mb.bus_serial.send(msg);
+  }
 
-public:
-  bool  receive(MessageSerial &msg)
+  void transmit(unsigned char value)
   {
-    if (msg.serial != _hostserial)   return false;
+    if (~_regs[FCR] & 1)
+      {
+	MessageSerial msg(_hostserial + 1, value);
+	_mb.bus_serial.send(msg);
+	return;
+      }
+
+    _tfifo[_tfcount++] = value;
+    if (_tfcount == (_fifo64 ? TFIFOSIZE : FIFOSIZE) || value == '\n')
+      flush_tx();
+    else if (!_timer_armed)
+      {
+	MessageTimer msg(_timer, _mb.clock()->abstime(FLUSH_US, 1000000));
+	_timer_armed = _mb.bus_timer.send(msg);
+      }
+  }
 
+  void receive_char(unsigned char ch)
+  {
     unsigned char or_lsr;
     if (_regs[FCR] & 1)
       // fifo mode
@@ -102,7 +140,7 @@ public:
 	  }
 	else
 	  {
-	    _rfifo[_rfpos] = msg.ch;
+	    _rfifo[_rfpos] = ch;
 	    _rfpos = (_rfpos+1) % FIFOSIZE;
 	    or_lsr = 1;
 	    _rfcount++;
@@ -111,14 +149,34 @@ public:
     else
       {
 	or_lsr = _regs[LSR] & 1 ? 3 : 1;
-	_regs[RBR] =msg.ch;
+	_regs[RBR] = ch;
       }
     _regs[LSR] |= or_lsr;
+  }
+
+
+public:
+  bool  receive(MessageSerial &msg)
+  {
+    if (msg.serial != _hostserial)   return false;
+
+    const unsigned char *data = msg.data();
+    for (unsigned i=0; i < msg.len; i++)
+      receive_char(data[i]);
     update_irq();
     return true;
   }
 
 
+  bool  receive(MessageTimeout &msg)
+  {
+    if (msg.nr != _timer) return false;
+    _timer_armed = false;
+    flush_tx();
+    return true;
+  }
+
+
   bool  receive(MessageIOIn &msg)
   {
     if (!in_range(msg.port, _base, 8) || msg.type != MessageIOIn::TYPE_INB)
@@ -173,23 +231,18 @@ public:
     switch (offset)
       {
       case THR:
-	{
-	  MessageSerial msg2(_hostserial, msg.value & _sendmask);
-	  if (_regs[MCR] & 0x10)
-	    // loopback
-	    receive(msg2);
-	  else
-	    {
-	      // write directly, no write fifo here
-	      msg2.serial++;
-	      _mb.bus_serial.send(msg2);
-	    }
-	}
+	if (_regs[MCR] & 0x10)
+	  // loopback
+	  receive_char(msg.value & _sendmask);
+	else
+	  transmit(msg.value & _sendmask);
 	break;
       case IER:
 	_regs[offset] = msg.value & 0xf;
 	break;
       case FCR:
+	// the transmitter is done with whatever it holds
+	flush_tx();
 	if ((_regs[FCR] ^ msg.value) & 1 || ((msg.value & 3) == 3))
 	  {
 	    // clear fifos
@@ -197,6 +250,10 @@ public:
 	    _regs[LSR] = 0x60;
 	  }
 
+	// the 64-byte FIFO can only be switched with DLAB set
+	if (_regs[LCR] & 0x80)
+	  _fifo64 = msg.value & 0x20;
+
 	if (msg.value & 1)
 	  {
 	    unsigned char level[] = {1, 4, 8, 14};
@@ -209,6 +266,8 @@ public:
 	_sendmask = (1 << (5 + (msg.value & 3))) -1;
 	break;
       case MCR:
+	if (msg.value & 0x10)
+	  flush_tx();
 	_regs[MCR] = msg.value & 0x1f;
 	if (msg.value & 0x10)
 	  {
@@ -249,14 +308,21 @@ public:
 
 
   SerialDevice(Motherboard &mb, unsigned short base, unsigned char irq, unsigned hostserial)
-    : _mb(mb), _base(base), _irq(irq), _hostserial(hostserial), _rfifo(), _rfpos(), _rfcount(0), _triggerlevel(1), _sendmask(0x1f)
+    : _mb(mb), _base(base), _irq(irq), _hostserial(hostserial), _rfifo(), _rfpos(), _rfcount(0), _triggerlevel(1), _sendmask(0x1f),
+      _tfifo(), _tfcount(0), _fifo64(false), _timer_armed(false)
     {
+      MessageTimer msg0;
+      if (!_mb.bus_timer.send(msg0))
+	Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
+      _timer = msg0.nr;
+
       memset(_regs, 0, sizeof(_regs));
       _regs[LSR] = 0x60;
       _regs[MSR] = 0xb0;
-      _mb.bus_ioin.     add(this, receive_static<MessageIOIn>);
-      _mb.bus_ioout.    add(this, receive_static<MessageIOOut>);
+      _mb.bus_ioin.     add(this, receive_static<MessageIOIn>,  _base, 8);
+      _mb.bus_ioout.    add(this, receive_static<MessageIOOut>, _base, 8);
       _mb.bus_serial.   add(this, receive_static<MessageSerial>);
+      _mb.bus_timeout.  add(this, receive_static<MessageTimeout>);
       _mb.bus_discovery.add(this, discover);
     }
 };
@@ -42,13 +42,11 @@ class HostSink : public StaticReceiver<HostSink>
   HostSink(HostSink const &);
   HostSink &operator = (HostSink const &);
 
- public:
-  bool  receive(MessageSerial &msg)
+  void put(unsigned char ch)
   {
-    if (msg.serial != _hdev)   return false;
-    if (msg.ch == '\r')
-      return true;
-    if (msg.ch == '\n' || _count == _size)
+    if (ch == '\r')
+      return;
+    if (ch == '\n' || _count == _size)
       {
 	_buffer[_count] = 0;
 	if (_overflow)
@@ -58,8 +56,17 @@ class HostSink : public StaticReceiver<HostSink>
 	_overflow = _count == _size;
 	_count = 0;
       }
-    if (msg.ch != '\n')
-      _buffer[_count++] = msg.ch;
+    if (ch != '\n')
+      _buffer[_count++] = ch;
+  }
+
+ public:
+  bool  receive(MessageSerial &msg)
+  {
+    if (msg.serial != _hdev)   return false;
+    const unsigned char *data = msg.data();
+    for (unsigned i=0; i < msg.len; i++)
+      put(data[i]);
     return true;
   }
 
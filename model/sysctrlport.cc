@@ -102,6 +102,9 @@ PARAM_HANDLER(scp,
 	      "Example: 'scp:0x92,0x61'")
 {
   SystemControlPort *scp = new SystemControlPort(mb.bus_legacy, mb.bus_pit, argv[0], argv[1]);
-  mb.bus_ioin.add(scp,  SystemControlPort::receive_static<MessageIOIn>);
-  mb.bus_ioout.add(scp, SystemControlPort::receive_static<MessageIOOut>);
+  // The ports are far apart, so each gets a listener of its own.
+  for (unsigned i=0; i < 2; i++) {
+    mb.bus_ioin.add(scp,  SystemControlPort::receive_static<MessageIOIn>,  argv[i], 1);
+    mb.bus_ioout.add(scp, SystemControlPort::receive_static<MessageIOOut>, argv[i], 1);
+  }
 }
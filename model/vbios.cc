@@ -178,7 +178,7 @@ public:
 
 
   VBios(Motherboard &mb, VCpu &vcpu) : BiosCommon(mb), _vcpu(vcpu) {
-    _vcpu.executor.add(this,   VBios::receive_static<CpuMessage>);
+    _vcpu.executor.add(this,   VBios::receive_static<CpuMessage>, ExecutorBus::type(CpuMessage::TYPE_SINGLE_STEP));
     _vcpu.mem.add(this,        VBios::receive_static<MessageMem>);
     _mb.bus_discovery.add(this, VBios::receive_static<MessageDiscovery>);
   }
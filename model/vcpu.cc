@@ -36,6 +36,44 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
   volatile unsigned _event;
   volatile unsigned _sipi;
   unsigned long _intr_hint { 0 };
+  unsigned long long _pvclock_msr { 0 };
+  unsigned long long _pvclock_tsc { 0 };   ///< guest TSC of the last time info we published
+  unsigned long long _pvclock_ns  { 0 };   ///< and the kvmclock time at that TSC
+  unsigned           _pvclock_mul { 0 };   ///< its scale, 0 if there was none yet
+  int                _pvclock_shift { 0 };
+  bool _restore_processed { false };
+
+  enum {
+    MSR_KVM_WALL_CLOCK      = 0x11,
+    MSR_KVM_SYSTEM_TIME     = 0x12,
+    MSR_KVM_WALL_CLOCK_NEW  = 0x4b564d00,
+    MSR_KVM_SYSTEM_TIME_NEW = 0x4b564d01,
+    KVM_CPUID_SIGNATURE     = 0x40000000,
+    KVM_CPUID_FEATURES      = 0x40000001,
+    KVM_FEATURE_CLOCKSOURCE  = 1 << 0,
+    KVM_FEATURE_CLOCKSOURCE2 = 1 << 3,
+  };
+
+  /**
+   * The kvmclock time info. The guest computes the time in ns as
+   * system_time + ((tsc - tsc_timestamp) << tsc_shift) * mul >> 32.
+   */
+  struct PvclockTime {
+    unsigned           version;
+    unsigned           pad0;
+    unsigned long long tsc_timestamp;
+    unsigned long long system_time;
+    unsigned           tsc_to_system_mul;
+    signed char        tsc_shift;
+    unsigned char      flags;
+    unsigned char      pad[2];
+  } __attribute__((packed));
+
+  struct PvclockWallClock {
+    unsigned version;
+    unsigned sec;
+    unsigned nsec;
+  } __attribute__((packed));
 
   unsigned char debugioin[8192];
   unsigned char debugioout[8192];
@@ -49,6 +87,109 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 
   }
 
+  /**
+   * Return a pointer to guest RAM or null if [addr, addr+size) is
+   * not backed by it.
+   */
+  template <typename T>
+  T *guest_ptr(unsigned long long addr) {
+    MessageMemRegion msg(addr >> 12);
+    if (!_mb.bus_memregion.send(msg, true) || !msg.ptr
+        || addr + sizeof(T) > (static_cast<unsigned long long>(msg.start_page) + msg.count) << 12)
+      return 0;
+    return reinterpret_cast<T *>(msg.ptr + (addr - (msg.start_page << 12)));
+  }
+
+  unsigned long long guest_tsc() { return Cpu::rdtsc() + _reset_tsc_off; }
+
+  /**
+   * The kvmclock time at the given guest TSC. It continues from the
+   * last time info with the scale the guest used for it, so it does
+   * not jump when we come back on a host with another TSC frequency.
+   */
+  unsigned long long pvclock_ns(unsigned long long tsc) {
+    if (!_pvclock_mul) return Math::muldiv128(tsc, 1000000000ull, _mb.clock()->freq());
+    unsigned long long delta = tsc > _pvclock_tsc ? tsc - _pvclock_tsc : 0;
+    delta = _pvclock_shift < 0 ? delta >> -_pvclock_shift : delta << _pvclock_shift;
+    return _pvclock_ns + Math::muldiv128(delta, _pvclock_mul, 1ull << 32);
+  }
+
+  /**
+   * Refresh the time info page. This is needed whenever the guest
+   * moves it and whenever the TSC offset or frequency changes.
+   */
+  void update_pvclock() {
+    if (~_pvclock_msr & 1) return;
+    PvclockTime *t = guest_ptr<PvclockTime>(_pvclock_msr & ~1ull);
+    if (!t) return;
+
+    // Scale TSC ticks to ns like KVM does: 32.32 fixed point with
+    // a binary shift.
+    unsigned long long tps = _mb.clock()->freq(), scaled = 1000000000ull;
+    int shift = 0;
+    while (tps > scaled * 2 || tps >> 32) { tps >>= 1; shift--; }
+    unsigned tps32 = tps;
+    while (tps32 <= scaled || scaled >> 32) {
+      if (scaled >> 32 || tps32 & 0x80000000u) scaled >>= 1;
+      else tps32 <<= 1;
+      shift++;
+    }
+
+    unsigned long long tsc = guest_tsc();
+    _pvclock_ns    = pvclock_ns(tsc);
+    _pvclock_tsc   = tsc;
+    _pvclock_mul   = (scaled << 32) / tps32;
+    _pvclock_shift = shift;
+
+    // odd versions tell the guest that an update is in progress
+    t->version = (t->version + 1) | 1;
+    __sync_synchronize();
+    t->tsc_timestamp     = _pvclock_tsc;
+    t->system_time       = _pvclock_ns;
+    t->tsc_to_system_mul = _pvclock_mul;
+    t->tsc_shift         = _pvclock_shift;
+    t->flags             = 0;
+    __sync_synchronize();
+    t->version++;
+  }
+
+  /**
+   * Tell the guest the wall clock time at guest time zero.
+   */
+  void write_wallclock(unsigned long long addr) {
+    PvclockWallClock *w = guest_ptr<PvclockWallClock>(addr);
+    if (!w) return;
+
+    MessageTime time;
+    _mb.bus_time.send(time);
+    unsigned long long now  = time.wallclocktime + _mb.clock()->clock(MessageTime::FREQUENCY) - time.timestamp;
+    unsigned long long boot = now * 1000 - pvclock_ns(guest_tsc());
+
+    w->version = (w->version + 1) | 1;
+    __sync_synchronize();
+    w->sec  = boot / 1000000000;
+    w->nsec = boot % 1000000000;
+    __sync_synchronize();
+    w->version++;
+  }
+
+  /**
+   * Paravirtual CPUID leaves. We look like KVM with kvmclock only.
+   */
+  bool handle_cpuid_kvm(CpuMessage &msg) {
+    msg.cpu->eax = msg.cpu->ebx = msg.cpu->ecx = msg.cpu->edx = 0;
+    if (msg.cpuid_index == KVM_CPUID_SIGNATURE) {
+      msg.cpu->eax = KVM_CPUID_FEATURES;
+      msg.cpu->ebx = 0x4b4d564b; // "KVMKVMKVM\0\0\0"
+      msg.cpu->ecx = 0x564b4d56;
+      msg.cpu->edx = 0x4d;
+    }
+    else if (msg.cpuid_index == KVM_CPUID_FEATURES)
+      msg.cpu->eax = KVM_FEATURE_CLOCKSOURCE | KVM_FEATURE_CLOCKSOURCE2;
+    msg.mtr_out |= MTD_GPR_ACDB;
+    return true;
+  }
+
   void GP0(CpuMessage &msg) {
     msg.cpu->inj_info = 0x80000b0d;
     msg.cpu->inj_error = 0;
@@ -57,6 +198,8 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 
 
   bool handle_cpuid(CpuMessage &msg) {
+    if ((msg.cpuid_index & 0xffff0000u) == KVM_CPUID_SIGNATURE) return handle_cpuid_kvm(msg);
+
     bool res = true;
     unsigned reg;
     if (msg.cpuid_index & 0x80000000u && msg.cpuid_index <= CPUID_EAX80)
@@ -105,6 +248,22 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
       assert(msg.mtr_in & MTD_SYSENTER);
       msg.cpu->edx_eax((&msg.cpu->sysenter_cs)[msg.cpu->ecx - 0x174]);
       break;
+    case MSR_KVM_SYSTEM_TIME:
+    case MSR_KVM_SYSTEM_TIME_NEW:
+      msg.cpu->edx_eax(_pvclock_msr);
+      break;
+    case MSR_KVM_WALL_CLOCK:
+    case MSR_KVM_WALL_CLOCK_NEW:
+      msg.cpu->edx_eax(0);
+      break;
+    case 0x6e0: // TSC deadline
+      {
+        assert(msg.mtr_in & MTD_TSC);
+        LapicEvent deadline(LapicEvent::GET_DEADLINE);
+        if (!bus_lapic.send(deadline, true)) { GP0(msg); break; }
+        msg.cpu->edx_eax(deadline.deadline ? deadline.deadline + get_tsc_off(msg) : 0);
+      }
+      break;
     case 0x8b: // microcode
       // MTRRs
     case 0xfe:
@@ -134,6 +293,14 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 
           msg.current_tsc_off = - Cpu::rdtsc()        + cpu->edx_eax();
           cpu->tsc_off        =   msg.current_tsc_off - offset;
+
+          // Keep the new offset beyond this exit and move everything
+          // that counts in guest TSC along, like the TSC deadline.
+          // kvmclock keeps counting where it was.
+          _pvclock_tsc += msg.current_tsc_off - offset;
+          CpuMessage add(CpuMessage::TYPE_ADD_TSC_OFF, NULL, 0);
+          add.current_tsc_off = msg.current_tsc_off - offset;
+          executor.send(add);
         }
 	msg.mtr_out |= MTD_TSC;
 	break;
@@ -141,6 +308,24 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 	(&cpu->sysenter_cs)[cpu->ecx - 0x174] = cpu->edx_eax();
 	msg.mtr_out |= MTD_SYSENTER;
 	break;
+      case MSR_KVM_SYSTEM_TIME:
+      case MSR_KVM_SYSTEM_TIME_NEW:
+	_pvclock_msr = cpu->edx_eax();
+	update_pvclock();
+	break;
+      case MSR_KVM_WALL_CLOCK:
+      case MSR_KVM_WALL_CLOCK_NEW:
+	write_wallclock(cpu->edx_eax());
+	break;
+      case 0x6e0: // TSC deadline
+	assert(msg.mtr_in & MTD_TSC);
+	{
+	  // The LAPIC arms its timer in host TSC.
+	  LapicEvent deadline(LapicEvent::SET_DEADLINE);
+	  if (cpu->edx_eax()) deadline.deadline = cpu->edx_eax() - get_tsc_off(msg);
+	  if (!bus_lapic.send(deadline, true)) GP0(msg);
+	}
+	break;
       default:
 	dprintf("unsupported wrmsr %x <-(%x:%x) at %x\n",  cpu->ecx, cpu->edx, cpu->eax, cpu->eip);
 	GP0(msg);
@@ -175,6 +360,8 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
     // cpu->_dr = {0, 0, 0, 0};
     cpu->dr7      = 0x400;
     msg.mtr_out  |= MTD_ALL;
+    _pvclock_msr  = 0;
+    _pvclock_mul  = 0;
     if (reset) {
       Logging::printf("reset CPU from %x mtr_in %x\n", msg.type, msg.mtr_in);
 
@@ -429,6 +616,7 @@ public:
 
     if (msg.type == CpuMessage::TYPE_ADD_TSC_OFF) {
         _reset_tsc_off += msg.current_tsc_off;
+        update_pvclock();
         return true;
     }
 
@@ -503,13 +691,84 @@ public:
     // handle IRQ injection
     for (prioritize_events(msg); msg.cpu->actv_state & 0x3; prioritize_events(msg)) {
       MessageHostOp msg2(MessageHostOp::OP_VCPU_BLOCK, _hostop_id);
+      msg2.event = &_event;
       Cpu::atomic_or<volatile unsigned>(&_event, STATE_BLOCK);
-      if (~_event & STATE_WAKEUP) _mb.bus_hostop.send(msg2);
+      if (~_event & STATE_WAKEUP) {
+        blocked = true;
+        _mb.bus_hostop.send(msg2);
+        blocked = false;
+      }
       Cpu::atomic_and<volatile unsigned>(&_event, ~(STATE_BLOCK | STATE_WAKEUP));
     }
     return true;
   }
 
+  /**
+   * What a vCPU saves on bus_restore. Fields are copied one by one,
+   * so new members do not silently change the record. Bump the
+   * version whenever the record changes.
+   */
+  struct RestoreState {
+    enum { VERSION = 2 };
+    unsigned           version;
+    unsigned           event;
+    unsigned           sipi;
+    unsigned           pad;
+    long long          tsc_off;
+    unsigned long long intr_hint;
+    unsigned long long pvclock_msr;
+    unsigned long long pvclock_tsc;
+    unsigned long long pvclock_ns;
+    unsigned           pvclock_mul;
+    int                pvclock_shift;
+  };
+
+  bool receive(MessageRestore &msg)
+  {
+    const mword bytes = sizeof(RestoreState);
+
+    if (msg.devtype == MessageRestore::RESTORE_RESTART) {
+      _restore_processed = false;
+      msg.bytes += bytes + sizeof(msg);
+      return false;
+    }
+
+    if (msg.devtype != MessageRestore::RESTORE_VCPU || _restore_processed) return false;
+
+    RestoreState *s = reinterpret_cast<RestoreState *>(msg.space);
+    if (msg.write) {
+      msg.bytes        = bytes;
+      memset(s, 0, bytes);
+      s->version       = RestoreState::VERSION;
+      s->event         = _event;
+      s->sipi          = _sipi;
+      s->tsc_off       = _reset_tsc_off;
+      s->intr_hint     = _intr_hint;
+      s->pvclock_msr   = _pvclock_msr;
+      s->pvclock_tsc   = _pvclock_tsc;
+      s->pvclock_ns    = _pvclock_ns;
+      s->pvclock_mul   = _pvclock_mul;
+      s->pvclock_shift = _pvclock_shift;
+    } else {
+      if (msg.bytes != bytes || s->version != RestoreState::VERSION)
+        Logging::panic("vCPU restore record has version %u and %lu bytes, expected version %u and %lu bytes.\n",
+                       msg.bytes >= sizeof(s->version) ? s->version : 0, msg.bytes, RestoreState::VERSION, bytes);
+      // Block state belonged to the host thread that saved us.
+      _event         = s->event & ~(STATE_BLOCK | STATE_WAKEUP);
+      _sipi          = s->sipi;
+      _reset_tsc_off = s->tsc_off;
+      _intr_hint     = s->intr_hint;
+      _pvclock_msr   = s->pvclock_msr;
+      _pvclock_tsc   = s->pvclock_tsc;
+      _pvclock_ns    = s->pvclock_ns;
+      _pvclock_mul   = s->pvclock_mul;
+      _pvclock_shift = s->pvclock_shift;
+    }
+
+    _restore_processed = true;
+    return true;
+  }
+
   VirtualCpu(VCpu *_last, Motherboard &mb) : VCpu(_last), _mb(mb), _event(0), _sipi(~0u) {
     MessageHostOp msg(this);
     if (!mb.bus_hostop.send(msg)) Logging::panic("could not create VCpu backend.");
@@ -525,8 +784,11 @@ public:
     memregion.add(this, VirtualCpu::receive_static<MessageMemRegion>);
     mb.bus_legacy.add(this, VirtualCpu::receive_static<MessageLegacy>);
     bus_lapic.add(this, VirtualCpu::receive_static<LapicEvent>);
+    mb.bus_restore.add(this, VirtualCpu::receive_static<MessageRestore>);
 
     CPUID_reset();
+    // we are a hypervisor, see handle_cpuid_kvm()
+    CPUID_ECX1 |= 1u << 31;
   }
 };
 
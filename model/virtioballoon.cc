@@ -0,0 +1,156 @@
+/** @file
+ * Virtio memory balloon device.
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "nul/motherboard.h"
+#include "model/virtio.h"
+
+/**
+ * A virtio-balloon device on the modern PCI transport.
+ *
+ * Pages the guest puts into the balloon and ranges it reports as free
+ * go back to the host via OP_DISCARD_GUEST_MEM. The next access faults
+ * in a fresh page, so neither deflating nor reusing a reported range
+ * needs the host. Everyone accessing guest memory, including the
+ * migration code, simply sees zero pages there.
+ *
+ * State: testing
+ * Features: inflate, deflate, free page reporting, deflate on OOM
+ * Missing: statistics queue, free page hinting, page poisoning
+ * Documentation: Virtual I/O Device (VIRTIO) Version 1.1
+ */
+class VirtioBalloon : public VirtioPciDevice, public StaticReceiver<VirtioBalloon>
+{
+  enum {
+    DEVICE_TYPE      = 5,
+    CFG_LEN          = 0x8,
+    PAGE_SHIFT       = 12,
+
+    F_DEFLATE_ON_OOM = 2,
+    F_REPORTING      = 5,
+
+    Q_INFLATE        = 0,
+    Q_DEFLATE        = 1,
+    Q_REPORTING      = 2,
+  };
+
+  DBus<MessageHostOp> &_bus_hostop;
+  unsigned             _target;     ///< pages we want from the guest
+  unsigned             _actual;     ///< pages the guest says it gave us
+
+  uint64 device_features()
+  {
+    return 1ull << F_DEFLATE_ON_OOM | 1ull << F_REPORTING | 1ull << F_RING_EVENT_IDX | 1ull << F_VERSION_1;
+  }
+
+  bool device_config(unsigned offset, unsigned &value, bool read)
+  {
+    switch (offset) {
+    case 0x00: if (read) value = _target; break;
+    case 0x04:
+      if (read) value = _actual;
+      else      _actual = value;
+      break;
+    default:   if (read) value = 0;
+    }
+    return true;
+  }
+
+  void device_reset()
+  {
+    // The queues are fixed, as we offer neither statistics nor hints.
+    _num_queues = 3;
+    _actual     = 0;
+  }
+
+  /**
+   * Return a range of guest RAM to the host. Ranges outside of RAM
+   * are ignored, the guest gets no feedback anyway.
+   */
+  void discard(uint64 addr, uint64 len)
+  {
+    if (!len || (addr | len) & ((1 << PAGE_SHIFT) - 1) || !VirtQueue::guest_ptr(_bus_memregion, addr, len))
+      return;
+    MessageHostOp msg(MessageHostOp::OP_DISCARD_GUEST_MEM, static_cast<unsigned long>(addr), len);
+    _bus_hostop.send(msg);
+  }
+
+  /**
+   * An inflate buffer is an array of 4k page frame numbers. Runs of
+   * consecutive frames are discarded at once.
+   */
+  void inflate(const VirtQueue::Desc &d)
+  {
+    uint32 *pfns = reinterpret_cast<uint32 *>(VirtQueue::guest_ptr(_bus_memregion, d.addr, d.len));
+    if (!pfns || d.flags & VirtQueue::DESC_F_WRITE) return;
+
+    unsigned count = d.len / sizeof(uint32);
+    for (unsigned i=0, start=0; i < count; i++)
+      if (i + 1 == count || pfns[i + 1] != pfns[i] + 1) {
+        discard(uint64(pfns[start]) << PAGE_SHIFT, uint64(i + 1 - start) << PAGE_SHIFT);
+        start = i + 1;
+      }
+  }
+
+  void queue_notify(unsigned nr)
+  {
+    VirtQueue &q = _queues[nr];
+    do {
+      unsigned head;
+      while (q.pop(head)) {
+        VirtQueue::Desc *d = q.get(head);
+        for (unsigned i=0; d && i < q.size; i++) {
+          // The guest may change the descriptor, check and use one copy.
+          VirtQueue::Desc c = *d;
+          // Deflated pages need nothing, they fault back in on access.
+          if (nr == Q_INFLATE) inflate(c);
+          // Reported ranges are device writable, their length is the size.
+          if (nr == Q_REPORTING && has_feature(F_REPORTING) && c.flags & VirtQueue::DESC_F_WRITE)
+            discard(c.addr, c.len);
+          if (~c.flags & VirtQueue::DESC_F_NEXT) break;
+          d = q.get(c.next);
+        }
+        q.push(head, 0);
+      }
+    } while (has_feature(F_RING_EVENT_IDX) && q.publish_avail_event());
+    signal_queue(nr);
+  }
+
+public:
+  using VirtioPciDevice::receive;
+
+  VirtioBalloon(Motherboard &mb, unsigned bdf, unsigned target)
+    : VirtioPciDevice(mb, bdf, DEVICE_TYPE, 0x05ff00, CFG_LEN), _bus_hostop(mb.bus_hostop),
+      _target(target), _actual(0)
+  {
+    reset();
+    Logging::printf("virtio-balloon: target %u pages at %x\n", target, bdf);
+  }
+};
+
+PARAM_HANDLER(virtioballoon,
+	      "virtioballoon:mem,irq,bdf,target=0 - attach a virtio memory balloon to a PCI bus.",
+	      "Example: Use 'virtioballoon:0xe0a00000,11' to let the guest report free memory to the host.",
+	      "If no bdf is given, the first free one is searched.",
+	      "The guest is asked to inflate the balloon to target MB.")
+{
+  unsigned target = argv[3] == ~0ul ? 0 : argv[3] << (20 - 12);
+  VirtioBalloon *dev = new VirtioBalloon(mb, PciHelper::find_free_bdf(mb.bus_pcicfg, argv[2]), target);
+  mb.bus_mem.add(dev, VirtioBalloon::receive_static<MessageMem>);
+  mb.bus_pcicfg.add(dev, VirtioBalloon::receive_static<MessagePciConfig>);
+  mb.bus_legacy.add(dev, VirtioBalloon::receive_static<MessageLegacy>);
+  dev->pci_setup(argv[0], argv[1]);
+}
@@ -0,0 +1,266 @@
+/** @file
+ * Virtio block device.
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "nul/motherboard.h"
+#include "nul/vcpu.h"
+#include "host/dma.h"
+#include "model/virtio.h"
+
+/**
+ * A virtio-blk device on the modern PCI transport.
+ *
+ * Every vCPU gets its own request queue, so a guest with blk-mq never
+ * shares a ring between CPUs. Requests go to the disk backend as
+ * MessageDisk, the usertag names queue and chain head.
+ *
+ * State: testing
+ * Features: read, write, flush, get id, multiqueue, MSI-X, EVENT_IDX
+ * Missing: indirect descriptors, packed rings, discard, migration
+ * Documentation: Virtual I/O Device (VIRTIO) Version 1.0
+ */
+class VirtioBlk : public VirtioPciDevice, public StaticReceiver<VirtioBlk>
+{
+  enum {
+    DEVICE_TYPE   = 2,
+    CFG_LEN       = 0x24,
+    SEG_MAX       = 64,
+    SECTOR_SHIFT  = 9,
+    ID_BYTES      = 20,
+
+    F_SEG_MAX     = 2,
+    F_FLUSH       = 9,
+    F_MQ          = 12,
+
+    T_IN          = 0,
+    T_OUT         = 1,
+    T_FLUSH       = 4,
+    T_GET_ID      = 8,
+
+    S_OK          = 0,
+    S_IOERR       = 1,
+    S_UNSUPP      = 2,
+
+    TAG_VALID     = 1u << 31,
+  };
+
+  struct Header {
+    uint32 type;
+    uint32 reserved;
+    uint64 sector;
+  };
+
+  /**
+   * What we need to complete an in-flight request.
+   */
+  struct Request {
+    uint64   status;
+    unsigned len;
+  };
+
+  Motherboard      &_mb;
+  DBus<MessageDisk> &_bus_disk;
+  unsigned          _disknr;
+  DiskParameter     _params;
+  bool              _busy;
+  DmaDescriptor     _dma[SEG_MAX];
+  Request           _requests[MAX_QUEUES][VirtQueue::MAX_SIZE];
+
+  uint64 device_features()
+  {
+    return 1ull << F_SEG_MAX | 1ull << F_FLUSH | 1ull << F_MQ | 1ull << F_RING_EVENT_IDX | 1ull << F_VERSION_1;
+  }
+
+  bool device_config(unsigned offset, unsigned &value, bool read)
+  {
+    if (!read) return true;
+    switch (offset) {
+    case 0x00: value = _params.sectors; break;
+    case 0x04: value = _params.sectors >> 32; break;
+    case 0x0c: value = SEG_MAX; break;
+    case 0x20: value = _num_queues << 16; break;
+    default:   value = 0;
+    }
+    return true;
+  }
+
+  void device_reset()
+  {
+    _num_queues = 0;
+    for (VCpu *vcpu = _mb.last_vcpu; vcpu; vcpu = vcpu->get_last()) _num_queues++;
+    _num_queues = VMM_MAX(1u, VMM_MIN(_num_queues, unsigned(MAX_QUEUES)));
+  }
+
+  void complete(unsigned nr, unsigned head, unsigned char status)
+  {
+    VirtQueue &q = _queues[nr];
+    if (!q.enabled) return;
+
+    Request &r = _requests[nr][head];
+    char *s = VirtQueue::guest_ptr(_bus_memregion, r.status, 1);
+    if (s) *s = status;
+    q.push(head, r.len);
+    if (!_busy) signal_queue(nr);
+  }
+
+  /**
+   * Parse one descriptor chain and hand it to the disk. The chain is
+   * a read-only header, the data buffers and a writable status byte.
+   * The guest may change its memory while we look at it, so the
+   * descriptors and the header are copied once and only the copies
+   * are checked and used.
+   */
+  void handle(unsigned nr, unsigned head)
+  {
+    VirtQueue &q = _queues[nr];
+    VirtQueue::Desc chain[SEG_MAX + 2];
+    unsigned count = 0;
+
+    VirtQueue::Desc *d = q.get(head);
+    for (unsigned i=0; d && count < SEG_MAX + 2 && i < q.size; i++) {
+      VirtQueue::Desc &c = chain[count++];
+      c = *d;
+      if (~c.flags & VirtQueue::DESC_F_NEXT) break;
+      d = q.get(c.next);
+    }
+
+    Header hdr;
+    Header *guest_hdr = 0;
+    VirtQueue::Desc *st = count ? &chain[count - 1] : 0;
+    if (count >= 2 && ~st->flags & VirtQueue::DESC_F_NEXT)
+      guest_hdr = reinterpret_cast<Header *>(VirtQueue::guest_ptr(_bus_memregion, chain[0].addr, sizeof(Header)));
+    if (guest_hdr) memcpy(&hdr, guest_hdr, sizeof(hdr));
+    if (!guest_hdr || chain[0].flags & VirtQueue::DESC_F_WRITE || ~st->flags & VirtQueue::DESC_F_WRITE || !st->len) {
+      Logging::printf("virtio-blk %x: malformed request at %u/%u\n", _disknr, nr, head);
+      _status |= STATUS_NEEDS_RESET;
+      config_changed();
+      return;
+    }
+
+    Request &r = _requests[nr][head];
+    r.status = st->addr;
+    r.len    = 1;
+
+    unsigned dmacount = count - 2;
+    uint64 bytes = 0;
+    bool write = hdr.type == T_OUT;
+    for (unsigned i=0; i < dmacount; i++) {
+      VirtQueue::Desc *dd = &chain[i + 1];
+      // The backend trusts the addresses, so they have to be RAM.
+      if (!write != !!(dd->flags & VirtQueue::DESC_F_WRITE) ||
+          !VirtQueue::guest_ptr(_bus_memregion, dd->addr, dd->len)) {
+        complete(nr, head, S_IOERR);
+        return;
+      }
+      _dma[i].byteoffset = dd->addr;
+      _dma[i].bytecount  = dd->len;
+      bytes += dd->len;
+    }
+
+    MessageDisk::Type type;
+    switch (hdr.type) {
+    case T_IN:
+      type  = MessageDisk::DISK_READ;
+      r.len = bytes + 1;
+      break;
+    case T_OUT:
+      type  = MessageDisk::DISK_WRITE;
+      break;
+    case T_FLUSH:
+      type  = MessageDisk::DISK_FLUSH_CACHE;
+      break;
+    case T_GET_ID:
+      if (dmacount) {
+        unsigned len = VMM_MIN(unsigned(_dma[0].bytecount), unsigned(ID_BYTES));
+        memcpy(VirtQueue::guest_ptr(_bus_memregion, _dma[0].byteoffset, len), _params.name, len);
+        r.len = len + 1;
+      }
+      complete(nr, head, dmacount ? S_OK : S_IOERR);
+      return;
+    default:
+      complete(nr, head, S_UNSUPP);
+      return;
+    }
+
+    if (type != MessageDisk::DISK_FLUSH_CACHE &&
+        (bytes & ((1 << SECTOR_SHIFT) - 1) || hdr.sector > _params.sectors ||
+         _params.sectors - hdr.sector < bytes >> SECTOR_SHIFT)) {
+      r.len = 1;
+      complete(nr, head, S_IOERR);
+      return;
+    }
+
+    MessageDisk msg(type, _disknr, TAG_VALID | nr << 16 | head, hdr.sector, dmacount, _dma, 0, ~0ul);
+    if (!_bus_disk.send(msg)) {
+      r.len = 1;
+      complete(nr, head, S_IOERR);
+    }
+  }
+
+  void queue_notify(unsigned nr)
+  {
+    VirtQueue &q = _queues[nr];
+
+    // Backends may commit synchronously, we interrupt once afterwards.
+    _busy = true;
+    do {
+      unsigned head;
+      while (q.pop(head)) handle(nr, head);
+    } while (has_feature(F_RING_EVENT_IDX) && q.publish_avail_event());
+    _busy = false;
+    signal_queue(nr);
+  }
+
+public:
+  using VirtioPciDevice::receive;
+
+  bool receive(MessageDiskCommit &msg)
+  {
+    unsigned nr = (msg.usertag >> 16) & 0x7fff, head = msg.usertag & 0xffff;
+    if (msg.disknr != _disknr || ~msg.usertag & TAG_VALID || nr >= _num_queues || head >= _queues[nr].size)
+      return false;
+    if (msg.status) _requests[nr][head].len = 1;
+    complete(nr, head, msg.status ? S_IOERR : S_OK);
+    return true;
+  }
+
+  VirtioBlk(Motherboard &mb, unsigned bdf, unsigned disknr, DiskParameter &params)
+    : VirtioPciDevice(mb, bdf, DEVICE_TYPE, 0x010000, CFG_LEN), _mb(mb), _bus_disk(mb.bus_disk),
+      _disknr(disknr), _params(params), _busy(false), _dma(), _requests()
+  {
+    reset();
+    Logging::printf("virtio-blk %x: %llu sectors at %x\n", disknr, static_cast<unsigned long long>(_params.sectors), bdf);
+  }
+};
+
+PARAM_HANDLER(virtioblk,
+	      "virtioblk:disk,mem,irq,bdf - attach a virtio block device to a PCI bus.",
+	      "Example: Use 'virtioblk:0,0xe0900000,15' to attach the first disk on address 0xe0900000 with irq 15.",
+	      "If no bdf is given, the first free one is searched.",
+	      "The device offers one request queue per vCPU, up to 16.")
+{
+  DiskParameter params;
+  unsigned disknr = argv[0];
+  MessageDisk msg0(disknr, &params);
+  check0(!mb.bus_disk.send(msg0) || msg0.error != MessageDisk::DISK_OK, "%s could not get disk %x parameters error %x", __PRETTY_FUNCTION__, disknr, msg0.error);
+
+  VirtioBlk *dev = new VirtioBlk(mb, PciHelper::find_free_bdf(mb.bus_pcicfg, argv[3]), disknr, params);
+  mb.bus_mem.add(dev, VirtioBlk::receive_static<MessageMem>);
+  mb.bus_pcicfg.add(dev, VirtioBlk::receive_static<MessagePciConfig>);
+  mb.bus_diskcommit.add(dev, VirtioBlk::receive_static<MessageDiskCommit>);
+  mb.bus_legacy.add(dev, VirtioBlk::receive_static<MessageLegacy>);
+  dev->pci_setup(argv[1], argv[2]);
+}
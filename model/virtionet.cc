@@ -0,0 +1,474 @@
+/** @file
+ * Virtio network device.
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "nul/motherboard.h"
+#include "nul/vcpu.h"
+#include "service/net.h"
+#include "service/endian.h"
+#include "model/virtio.h"
+
+using namespace Endian;
+
+/**
+ * A virtio-net device on the modern PCI transport.
+ *
+ * There is one RX/TX queue pair per vCPU plus a control queue. Frames
+ * on bus_network carry no offload metadata, so checksum offload, TSO
+ * and UFO requests from the guest are resolved here before a frame
+ * leaves the device. Received frames are spread over the active RX
+ * queues by a flow hash and may span several mergeable buffers.
+ *
+ * State: testing
+ * Features: MQ, mergeable RX buffers, CSUM, HOST_TSO4/6, HOST_UFO, GUEST_CSUM, EVENT_IDX, MSI-X
+ * Missing: receive coalescing (GUEST_TSO), VLAN and MAC filtering, migration
+ * Documentation: Virtual I/O Device (VIRTIO) Version 1.0
+ */
+class VirtioNet : public VirtioPciDevice, public StaticReceiver<VirtioNet>
+{
+  enum {
+    DEVICE_TYPE     = 1,
+    CFG_LEN         = 0xc,
+    MAX_PAIRS       = (MAX_QUEUES - 1) / 2,
+    MAX_FRAME       = 0x10100,
+    MAX_MERGE       = 64,
+    HDR_LEN         = 12,
+
+    F_CSUM          = 0,
+    F_GUEST_CSUM    = 1,
+    F_MAC           = 5,
+    F_HOST_TSO4     = 11,
+    F_HOST_TSO6     = 12,
+    F_HOST_UFO      = 14,
+    F_MRG_RXBUF     = 15,
+    F_STATUS        = 16,
+    F_CTRL_VQ       = 17,
+    F_MQ            = 22,
+
+    HDR_F_NEEDS_CSUM = 1,
+    HDR_F_DATA_VALID = 2,
+    GSO_NONE        = 0,
+    GSO_TCPV4       = 1,
+    GSO_UDP         = 3,
+    GSO_TCPV6       = 4,
+    GSO_ECN         = 0x80,
+
+    S_LINK_UP       = 1,
+
+    CTRL_RX         = 0,
+    CTRL_MAC        = 1,
+    CTRL_MAC_ADDR_SET = 1,
+    CTRL_MQ         = 4,
+    CTRL_MQ_VQ_PAIRS_SET = 0,
+    CTRL_OK         = 0,
+    CTRL_ERR        = 1,
+
+    PROTO_TCP       = 6,
+    PROTO_UDP       = 17,
+  };
+
+  struct Header {
+    uint8  flags;
+    uint8  gso_type;
+    uint16 hdr_len;
+    uint16 gso_size;
+    uint16 csum_start;
+    uint16 csum_offset;
+    uint16 num_buffers;
+  } __attribute__((packed));
+
+  Motherboard          &_mb;
+  DBus<MessageNetwork> &_bus_network;
+  unsigned char _mac[6];
+  unsigned      _max_pairs;
+  unsigned      _pairs;
+  unsigned      _frag_id;
+  unsigned long _rx_dropped;
+  unsigned char _frame[MAX_FRAME] VMM_ALIGNED(16);
+  unsigned char _seg[MAX_FRAME] VMM_ALIGNED(16);
+
+  uint64 device_features()
+  {
+    return 1ull << F_CSUM | 1ull << F_GUEST_CSUM | 1ull << F_MAC | 1ull << F_HOST_TSO4 | 1ull << F_HOST_TSO6 |
+      1ull << F_HOST_UFO | 1ull << F_MRG_RXBUF | 1ull << F_STATUS | 1ull << F_CTRL_VQ | 1ull << F_MQ |
+      1ull << F_RING_EVENT_IDX | 1ull << F_VERSION_1;
+  }
+
+  bool device_config(unsigned offset, unsigned &value, bool read)
+  {
+    if (!read) return true;
+    switch (offset) {
+    case 0x0: value = _mac[3] << 24 | _mac[2] << 16 | _mac[1] << 8 | _mac[0]; break;
+    case 0x4: value = S_LINK_UP << 16 | _mac[5] << 8 | _mac[4]; break;
+    case 0x8: value = _max_pairs; break;
+    default:  value = 0;
+    }
+    return true;
+  }
+
+  void device_reset()
+  {
+    _max_pairs = 0;
+    for (VCpu *vcpu = _mb.last_vcpu; vcpu; vcpu = vcpu->get_last()) _max_pairs++;
+    _max_pairs  = VMM_MAX(1u, VMM_MIN(_max_pairs, unsigned(MAX_PAIRS)));
+    _num_queues = 2 * _max_pairs + 1;
+    _pairs      = 1;
+  }
+
+  unsigned ctrl_queue() { return has_feature(F_MQ) ? 2 * _max_pairs : 2; }
+
+  void malformed(unsigned nr, unsigned head)
+  {
+    Logging::printf("virtio-net: malformed chain at %u/%u\n", nr, head);
+    _status |= STATUS_NEEDS_RESET;
+    config_changed();
+  }
+
+  /**
+   * Gather the read-only part of a chain. Returns the chain length or
+   * ~0u if the chain is broken. The first writable descriptor, if any,
+   * is returned in wdesc.
+   */
+  unsigned gather(VirtQueue &q, unsigned head, unsigned char *buf, unsigned size, unsigned &len, VirtQueue::Desc *&wdesc)
+  {
+    len   = 0;
+    wdesc = 0;
+    VirtQueue::Desc *d = q.get(head);
+    for (unsigned i=0; d && i < q.size; i++) {
+      // The guest may change the descriptor, check and use one copy.
+      VirtQueue::Desc c = *d;
+      if (c.flags & VirtQueue::DESC_F_WRITE) { wdesc = d; return len; }
+      char *src = VirtQueue::guest_ptr(_bus_memregion, c.addr, c.len);
+      if (!src) return ~0u;
+      unsigned n = VMM_MIN(c.len, size - len);
+      memcpy(buf + len, src, n);
+      len += n;
+      if (~c.flags & VirtQueue::DESC_F_NEXT) return len;
+      d = q.get(c.next);
+    }
+    return ~0u;
+  }
+
+  void send_frame(unsigned char *frame, unsigned len)
+  {
+    MessageNetwork msg(frame, len, 0);
+    _bus_network.send(msg);
+  }
+
+  bool fill_csum(unsigned char *frame, unsigned len, unsigned start, unsigned offset)
+  {
+    if (start + offset + 2 > len) return false;
+    uint32 state = 0;
+    bool   odd   = false;
+    IPChecksum::sum(frame + start, len - start, state, odd);
+    *reinterpret_cast<uint16 *>(frame + start + offset) = ~IPChecksum::fixup(state);
+    return true;
+  }
+
+  /**
+   * TSO: cut a TCP frame into mss sized segments, each with its own
+   * headers and checksums.
+   */
+  void segment_tcp(unsigned char *p, unsigned len, unsigned l3, unsigned l4, unsigned mss, bool ipv6)
+  {
+    if (l4 + 20 > len) return;
+    unsigned hlen = l4 + (p[l4 + 12] >> 4) * 4;
+    if (hlen > len || hlen + mss > MAX_FRAME) return;
+
+    uint32 seq   = ntoh32(*reinterpret_cast<uint32 *>(p + l4 + 4));
+    uint16 id    = ntoh16(*reinterpret_cast<uint16 *>(p + l3 + 4));
+    uint8  flags = p[l4 + 13];
+    for (unsigned off = hlen; off < len; off += mss) {
+      unsigned chunk = VMM_MIN(mss, len - off);
+      unsigned slen  = hlen + chunk;
+      memcpy(_seg, p, hlen);
+      memcpy(_seg + hlen, p + off, chunk);
+
+      if (ipv6)
+        *reinterpret_cast<uint16 *>(_seg + l3 + 4) = hton16(slen - l3 - 40);
+      else {
+        *reinterpret_cast<uint16 *>(_seg + l3 + 2)  = hton16(slen - l3);
+        *reinterpret_cast<uint16 *>(_seg + l3 + 4)  = hton16(id++);
+        *reinterpret_cast<uint16 *>(_seg + l3 + 10) = 0;
+        *reinterpret_cast<uint16 *>(_seg + l3 + 10) = IPChecksum::ipsum(_seg, l3, l4 - l3);
+      }
+
+      // CWR only on the first segment, FIN and PSH only on the last
+      *reinterpret_cast<uint32 *>(_seg + l4 + 4) = hton32(seq + off - hlen);
+      _seg[l4 + 13] = flags & (off == hlen ? 0xff : ~0x80) & (off + chunk == len ? 0xff : ~0x09);
+      *reinterpret_cast<uint16 *>(_seg + l4 + 16) = 0;
+      *reinterpret_cast<uint16 *>(_seg + l4 + 16) = IPChecksum::tcpudpsum(_seg, PROTO_TCP, l3, l4 - l3, slen, ipv6);
+      send_frame(_seg, slen);
+    }
+  }
+
+  /**
+   * UFO: send a UDP datagram as IP fragments. IPv6 frames get a
+   * fragment header, we assume no other extension headers in front of
+   * UDP, as a GSO capable guest stack produces.
+   */
+  void fragment_udp(unsigned char *p, unsigned len, unsigned l3, unsigned l4, unsigned size, bool ipv6)
+  {
+    unsigned extra = ipv6 ? 8 : 0;
+    size &= ~7u;
+    if (!size || l4 + extra + size > MAX_FRAME || (ipv6 && l4 != l3 + 40)) return;
+
+    for (unsigned off = 0; off < len - l4; off += size) {
+      unsigned chunk = VMM_MIN(size, len - l4 - off);
+      unsigned slen  = l4 + extra + chunk;
+      bool     more  = off + chunk < len - l4;
+      memcpy(_seg, p, l4);
+      memcpy(_seg + l4 + extra, p + l4 + off, chunk);
+
+      if (ipv6) {
+        *reinterpret_cast<uint16 *>(_seg + l3 + 4) = hton16(slen - l3 - 40);
+        _seg[l3 + 6] = 44;
+        _seg[l4]     = PROTO_UDP;
+        _seg[l4 + 1] = 0;
+        *reinterpret_cast<uint16 *>(_seg + l4 + 2) = hton16(off | more);
+        *reinterpret_cast<uint32 *>(_seg + l4 + 4) = hton32(_frag_id);
+      } else {
+        *reinterpret_cast<uint16 *>(_seg + l3 + 2)  = hton16(slen - l3);
+        *reinterpret_cast<uint16 *>(_seg + l3 + 6)  = hton16((more ? 0x2000 : 0) | off >> 3);
+        *reinterpret_cast<uint16 *>(_seg + l3 + 10) = 0;
+        *reinterpret_cast<uint16 *>(_seg + l3 + 10) = IPChecksum::ipsum(_seg, l3, l4 - l3);
+      }
+      send_frame(_seg, slen);
+    }
+    _frag_id++;
+  }
+
+  void transmit(Header &hdr, unsigned char *frame, unsigned len)
+  {
+    unsigned gso = hdr.gso_type & ~GSO_ECN;
+    if (gso == GSO_NONE) {
+      if (hdr.flags & HDR_F_NEEDS_CSUM && has_feature(F_CSUM) && !fill_csum(frame, len, hdr.csum_start, hdr.csum_offset))
+        return;
+      send_frame(frame, len);
+      return;
+    }
+
+    // Segmentation needs the checksum start to find the L4 header.
+    unsigned l3 = ntoh16(*reinterpret_cast<uint16 *>(frame + 12)) == 0x8100 ? 18 : 14;
+    unsigned l4 = hdr.csum_start;
+    if (~hdr.flags & HDR_F_NEEDS_CSUM || len < l3 + 40 || l4 < l3 + 20 || l4 >= len || !hdr.gso_size) {
+      Logging::printf("virtio-net: dropping GSO frame type %x start %u len %u\n", gso, l4, len);
+      return;
+    }
+
+    switch (gso) {
+    case GSO_TCPV4:
+      if (has_feature(F_HOST_TSO4)) segment_tcp(frame, len, l3, l4, hdr.gso_size, false);
+      break;
+    case GSO_TCPV6:
+      if (has_feature(F_HOST_TSO6)) segment_tcp(frame, len, l3, l4, hdr.gso_size, true);
+      break;
+    case GSO_UDP:
+      if (has_feature(F_HOST_UFO) && fill_csum(frame, len, l4, hdr.csum_offset))
+        fragment_udp(frame, len, l3, l4, hdr.gso_size, (frame[l3] >> 4) == 6);
+      break;
+    default:
+      Logging::printf("virtio-net: unknown GSO type %x\n", gso);
+    }
+  }
+
+  void process_tx(unsigned nr)
+  {
+    VirtQueue &q = _queues[nr];
+    unsigned head, len;
+    VirtQueue::Desc *wdesc;
+    while (q.pop(head)) {
+      if (gather(q, head, _frame, MAX_FRAME, len, wdesc) == ~0u || wdesc || len < HDR_LEN) {
+        malformed(nr, head);
+        return;
+      }
+      Header hdr;
+      memcpy(&hdr, _frame, sizeof(hdr));
+      transmit(hdr, _frame + HDR_LEN, len - HDR_LEN);
+      q.push(head, 0);
+    }
+  }
+
+  unsigned char control(unsigned char *cmd, unsigned len)
+  {
+    if (len < 2) return CTRL_ERR;
+    switch (cmd[0] << 8 | cmd[1]) {
+    case CTRL_MQ << 8 | CTRL_MQ_VQ_PAIRS_SET: {
+      if (len < 4) return CTRL_ERR;
+      unsigned pairs = cmd[2] | cmd[3] << 8;
+      if (!has_feature(F_MQ) || !pairs || pairs > _max_pairs) return CTRL_ERR;
+      _pairs = pairs;
+      return CTRL_OK;
+    }
+    case CTRL_MAC << 8 | CTRL_MAC_ADDR_SET:
+      if (len < 8) return CTRL_ERR;
+      memcpy(_mac, cmd + 2, sizeof(_mac));
+      return CTRL_OK;
+    default:
+      // RX modes and MAC tables: we do not filter anyway.
+      return cmd[0] == CTRL_RX || cmd[0] == CTRL_MAC ? CTRL_OK : CTRL_ERR;
+    }
+  }
+
+  void process_ctrl(unsigned nr)
+  {
+    VirtQueue &q = _queues[nr];
+    unsigned char cmd[64];
+    unsigned head, len;
+    VirtQueue::Desc *wdesc;
+    while (q.pop(head)) {
+      if (gather(q, head, cmd, sizeof(cmd), len, wdesc) == ~0u || !wdesc) {
+        malformed(nr, head);
+        return;
+      }
+      char *ack = VirtQueue::guest_ptr(_bus_memregion, wdesc->addr, 1);
+      if (ack) *ack = control(cmd, len);
+      q.push(head, 1);
+    }
+  }
+
+  void queue_notify(unsigned nr)
+  {
+    // RX buffers are only needed once a frame arrives.
+    if (nr != ctrl_queue() && !(nr & 1)) return;
+
+    VirtQueue &q = _queues[nr];
+    do {
+      if (nr == ctrl_queue()) process_ctrl(nr);
+      else                    process_tx(nr);
+    } while (has_feature(F_RING_EVENT_IDX) && q.publish_avail_event());
+    signal_queue(nr);
+  }
+
+  /**
+   * Spread flows over the active RX queues. Frames of one TCP or UDP
+   * flow always take the same queue.
+   */
+  unsigned rx_queue(const unsigned char *p, unsigned len)
+  {
+    if (_pairs == 1 || len < 14) return 0;
+
+    uint32 hash = 0;
+    unsigned type = p[12] << 8 | p[13];
+    if (type == 0x0800 && len >= 34) {
+      unsigned l4 = 14 + (p[14] & 0xf) * 4;
+      hash = *reinterpret_cast<const uint32 *>(p + 26) ^ *reinterpret_cast<const uint32 *>(p + 30);
+      if ((p[23] == PROTO_TCP || p[23] == PROTO_UDP) && len >= l4 + 4)
+        hash ^= *reinterpret_cast<const uint32 *>(p + l4);
+    } else if (type == 0x86dd && len >= 54) {
+      for (unsigned i = 22; i < 54; i += 4) hash ^= *reinterpret_cast<const uint32 *>(p + i);
+      if ((p[20] == PROTO_TCP || p[20] == PROTO_UDP) && len >= 58)
+        hash ^= *reinterpret_cast<const uint32 *>(p + 54);
+    }
+    return 2 * (((hash * 2654435761u) >> 16) % _pairs);
+  }
+
+  bool receive_frame(const unsigned char *frame, unsigned len)
+  {
+    unsigned nr = rx_queue(frame, len);
+    VirtQueue &q = _queues[nr];
+    if (!running() || !q.enabled) return false;
+
+    Header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    if (has_feature(F_GUEST_CSUM)) hdr.flags = HDR_F_DATA_VALID;
+    hdr.num_buffers = 1;
+
+    // Fill chains until header and frame are in. Without mergeable
+    // buffers, everything has to fit into the first one.
+    unsigned heads[MAX_MERGE], lens[MAX_MERGE], count = 0;
+    unsigned pos = 0, total = HDR_LEN + len;
+    Header *ghdr = 0;
+    bool merge = has_feature(F_MRG_RXBUF);
+    while (pos < total && count < (merge ? unsigned(MAX_MERGE) : 1u) && q.pop(heads[count])) {
+      unsigned written = 0;
+      VirtQueue::Desc *d = q.get(heads[count]);
+      for (unsigned i=0; d && i < q.size && pos < total; i++) {
+        VirtQueue::Desc c = *d;
+        char *dst = VirtQueue::guest_ptr(_bus_memregion, c.addr, c.len);
+        if (~c.flags & VirtQueue::DESC_F_WRITE || !dst || (!pos && c.len < HDR_LEN)) {
+          q.last_avail -= count + 1;
+          malformed(nr, heads[count]);
+          return true;
+        }
+        if (!pos) ghdr = reinterpret_cast<Header *>(dst);
+        unsigned n = VMM_MIN(c.len, total - pos);
+        for (unsigned done = 0; done < n; ) {
+          const unsigned char *src = pos < HDR_LEN ? reinterpret_cast<unsigned char *>(&hdr) + pos : frame + pos - HDR_LEN;
+          unsigned chunk = VMM_MIN(n - done, pos < HDR_LEN ? HDR_LEN - pos : total - pos);
+          memcpy(dst + done, src, chunk);
+          done += chunk;
+          pos  += chunk;
+        }
+        written += n;
+        if (~c.flags & VirtQueue::DESC_F_NEXT) break;
+        d = q.get(c.next);
+      }
+      lens[count++] = written;
+    }
+
+    if (pos < total) {
+      // Not enough buffers, give them back and drop the frame.
+      q.last_avail -= count;
+      _rx_dropped++;
+      return true;
+    }
+
+    ghdr->num_buffers = count;
+    for (unsigned i=0; i < count; i++) q.push(heads[i], lens[i]);
+    signal_queue(nr);
+    return true;
+  }
+
+public:
+  using VirtioPciDevice::receive;
+
+  bool receive(MessageNetwork &msg)
+  {
+    if (msg.type != MessageNetwork::PACKET) return false;
+    // Avoid our own packets.
+    if ((msg.buffer >= _frame && msg.buffer < _frame + sizeof(_frame)) ||
+        (msg.buffer >= _seg && msg.buffer < _seg + sizeof(_seg)))
+      return false;
+    return receive_frame(msg.buffer, msg.len);
+  }
+
+  VirtioNet(Motherboard &mb, unsigned bdf, unsigned long long mac)
+    : VirtioPciDevice(mb, bdf, DEVICE_TYPE, 0x020000, CFG_LEN), _mb(mb), _bus_network(mb.bus_network),
+      _max_pairs(1), _pairs(1), _frag_id(0), _rx_dropped(0)
+  {
+    for (unsigned i=0; i < 6; i++) _mac[i] = reinterpret_cast<unsigned char *>(&mac)[5 - i];
+    reset();
+    Logging::printf("virtio-net " MAC_FMT " at %x\n", _mac[0], _mac[1], _mac[2], _mac[3], _mac[4], _mac[5], bdf);
+  }
+};
+
+PARAM_HANDLER(virtionet,
+	      "virtionet:mem,irq,bdf - attach a virtio network device to a PCI bus.",
+	      "Example: Use 'virtionet:0xe0a00000,11' to attach a NIC on address 0xe0a00000 with irq 11.",
+	      "If no bdf is given, the first free one is searched.",
+	      "The device offers one queue pair per vCPU, up to 7.")
+{
+  MessageHostOp msg(MessageHostOp::OP_GET_MAC, 0UL);
+  if (!mb.bus_hostop.send(msg))  Logging::panic("Could not get a MAC address");
+
+  VirtioNet *dev = new VirtioNet(mb, PciHelper::find_free_bdf(mb.bus_pcicfg, argv[2]), msg.mac);
+  mb.bus_mem.add(dev, VirtioNet::receive_static<MessageMem>);
+  mb.bus_pcicfg.add(dev, VirtioNet::receive_static<MessagePciConfig>);
+  mb.bus_network.add(dev, VirtioNet::receive_static<MessageNetwork>);
+  mb.bus_legacy.add(dev, VirtioNet::receive_static<MessageLegacy>);
+  dev->pci_setup(argv[0], argv[1]);
+}
@@ -228,7 +228,7 @@ bool Vancouver::receive(MessageHostOp &msg) {
             Serial::get() << "Create VCPU pinned to CPU " << fmt(cpu, "%d") << "\n";
             VCPUBackend *v = new VCPUBackend(&_mb, msg.vcpu, nre::Hip::get().has_svm(), cpu);
             msg.value = reinterpret_cast<ulong>(v);
-            msg.vcpu->executor.add(this, receive_static<CpuMessage> );
+            msg.vcpu->executor.add(this, receive_static<CpuMessage>, ExecutorBus::type(CpuMessage::TYPE_CPUID));
             _vcpus.append(v);
         }
         break;
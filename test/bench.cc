@@ -0,0 +1,984 @@
+/**
+ * Device Model Microbenchmarks
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "bench.h"
+
+#include <host/dma.h>
+#include <nul/net.h>
+#include <service/lifo.h>
+#include <service/ring.h>
+#include <service/seqlock.h>
+#include <service/futex.h>
+#include <service/pagecodec.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef BENCH_HALIFAX
+#include <executor/cpustate.h>
+#endif
+
+/*
+ * Every benchmark group gets its own motherboard, so that the
+ * busses only carry the listeners of the models under test. The
+ * models are created through their PARAM_HANDLERs, exactly as on the
+ * command line of a real VMM.
+ */
+
+static Clock mb_clock(1000000);
+
+enum {
+  RAM_SIZE  = 4 << 20,
+  LAPIC_BASE = 0xfee00000,
+  IOAPIC_BASE = 0xfec00000,
+  AHCI_BASE = 0xe0800000,
+  VIRTIO_BASE = 0xe0900000,
+  NIC_MMIO  = 0xf7ce0000,
+  NIC_MSIX  = 0xf7cc0000,
+
+  // guest-physical layout
+  HALIFAX_CODE = 0x1000,
+  AHCI_CLB     = 0x10000,
+  AHCI_FB      = 0x10400,
+  AHCI_CTBA    = 0x11000,
+  AHCI_DATA    = 0x12000,
+  VQ_DESC      = 0x14000,
+  VQ_AVAIL     = 0x15000,
+  VQ_USED      = 0x16000,
+  VQ_REQ       = 0x17000,
+  VQ_SIZE      = 64,
+  VQ2_DESC     = 0x18000,
+  NIC_TX_RING  = 0x20000,
+  NIC_RX_RING  = 0x21000,
+  NIC_TX_BUF   = 0x30000,
+  NIC_RX_BUF   = 0x40000,
+  NIC_RING     = 64,
+  NIC_PACKET   = 1514,
+};
+
+static char ram[RAM_SIZE] VMM_ALIGNED(4096);
+static VCpu *vcpu;
+static unsigned timer_count;
+static unsigned long discarded_pages;
+static unsigned long pending_disk_tag;
+
+/****************************************************/
+/* Host stubs                                       */
+/****************************************************/
+
+static bool receive(Device *, MessageHostOp &msg) {
+  switch (msg.type) {
+  case MessageHostOp::OP_VCPU_CREATE_BACKEND:
+    vcpu = msg.vcpu;
+    msg.value = 0;
+    return true;
+  case MessageHostOp::OP_VCPU_BLOCK:
+  case MessageHostOp::OP_VCPU_RELEASE:
+    return true;
+  case MessageHostOp::OP_GET_MAC:
+    msg.mac = 0x525400000001ull;
+    return true;
+  case MessageHostOp::OP_DISCARD_GUEST_MEM:
+    discarded_pages += msg.len >> 12;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool receive(Device *, MessageTimer &msg) {
+  if (msg.type == MessageTimer::TIMER_NEW) msg.nr = timer_count++;
+  return true;
+}
+
+static bool receive(Device *, MessageTime &msg) {
+  msg.wallclocktime = 0;
+  msg.timestamp = 0;
+  return true;
+}
+
+static bool receive(Device *, MessageMemRegion &msg) {
+  if (msg.page >= (RAM_SIZE >> 12)) return false;
+  msg.start_page = 0;
+  msg.count = RAM_SIZE >> 12;
+  msg.ptr = ram;
+  return true;
+}
+
+static bool receive(Device *, MessageDisk &msg) {
+  switch (msg.type) {
+  case MessageDisk::DISK_GET_PARAMS:
+    msg.params->flags = DiskParameter::FLAG_HARDDISK;
+    msg.params->sectors = 1 << 20;
+    msg.params->sectorsize = 512;
+    msg.params->maxrequestcount = 32;
+    strcpy(msg.params->name, "bench");
+    return true;
+  case MessageDisk::DISK_READ:
+  case MessageDisk::DISK_WRITE:
+    // complete the request later, like an asynchronous backend
+    pending_disk_tag = msg.usertag;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool receive(Device *, MessageNetwork &) { return false; }
+static bool receive(Device *, MessageLegacy &)  { return false; }
+static bool receive(Device *, MessageIrqNotify &) { return true; }
+
+static Motherboard *new_motherboard() {
+  Motherboard *mb = new Motherboard(&mb_clock, NULL);
+  mb->bus_hostop.   add(nullptr, receive);
+  mb->bus_timer.    add(nullptr, receive);
+  mb->bus_time.     add(nullptr, receive);
+  mb->bus_memregion.add(nullptr, receive);
+  mb->bus_disk.     add(nullptr, receive);
+  mb->bus_network.  add(nullptr, receive);
+  mb->bus_legacy.   add(nullptr, receive);
+  mb->bus_irqnotify.add(nullptr, receive);
+  return mb;
+}
+
+static void outb(Motherboard *mb, unsigned short port, unsigned char value) {
+  MessageIOOut msg(MessageIOOut::TYPE_OUTB, port, value);
+  mb->bus_ioout.send(msg);
+}
+
+static void mem_write(DBus<MessageMem> &bus, uintptr_t phys, unsigned value) {
+  MessageMem msg(false, phys, &value);
+  bus.send(msg, true);
+}
+
+static unsigned mem_read(DBus<MessageMem> &bus, uintptr_t phys) {
+  unsigned value = 0;
+  MessageMem msg(true, phys, &value);
+  bus.send(msg, true);
+  return value;
+}
+
+/****************************************************/
+/* DBus dispatch                                    */
+/****************************************************/
+
+static bool receive_none(Device *, MessageIrqLines &msg) { return false; }
+
+static void bench_dbus(unsigned long ops) {
+  const unsigned counts[] = { 1, 4, 16, 64 };
+  for (unsigned c = 0; c < sizeof(counts) / sizeof(*counts); c++) {
+    DBus<MessageIrqLines> bus;
+    for (unsigned i = 0; i < counts[c]; i++) bus.add(nullptr, receive_none);
+
+    MessageIrqLines msg(MessageIrq::ASSERT_IRQ, 0);
+    {
+      BenchTimer t("dbus_send", counts[c], ops);
+      for (unsigned long i = 0; i < ops; i++) bus.send(msg);
+    }
+    {
+      BenchTimer t("dbus_send_fifo", counts[c], ops);
+      for (unsigned long i = 0; i < ops; i++) bus.send_fifo(msg);
+    }
+
+    // Every listener claims a line of its own, like the PICs and IOAPICs do.
+    DBus<MessageIrqLines> decoded;
+    for (unsigned i = 0; i < counts[c]; i++) decoded.add(nullptr, receive_none, i, 1);
+    {
+      BenchTimer t("dbus_send_decoded", counts[c], ops);
+      for (unsigned long i = 0; i < ops; i++) decoded.send(msg);
+    }
+  }
+}
+
+/**
+ * A single step as the unix frontend sends it for every emulated
+ * instruction. The stub plays Halifax, the LAPIC and the VCPU are
+ * registered like in the default configuration.
+ */
+static bool receive_step(Device *, CpuMessage &msg) { return msg.type == CpuMessage::TYPE_SINGLE_STEP; }
+
+static void bench_executor(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("vcpu");
+  vcpu->executor.add(nullptr, receive_step, ExecutorBus::type(CpuMessage::TYPE_SINGLE_STEP));
+  mb->handle_arg("lapic:0");
+
+  CpuState cpu;
+  cpu.clear();
+  BenchTimer t("executor_single_step", CpuMessage::TYPE_SINGLE_STEP, ops);
+  for (unsigned long i = 0; i < ops; i++) {
+    CpuMessage msg(CpuMessage::TYPE_SINGLE_STEP, &cpu, MTD_ALL);
+    bool res = vcpu->executor.send(msg, true);
+    assert(res);
+  }
+}
+
+/****************************************************/
+/* Lock-free primitives                             */
+/****************************************************/
+
+/*
+ * The contended variants run the primitive from several threads at
+ * once. Spinning threads yield, so the numbers stay meaningful on
+ * hosts with fewer CPUs than threads.
+ */
+enum { BENCH_THREADS = 4 };
+
+struct ContentionArgs {
+  unsigned long ops;
+  unsigned      id;
+};
+
+static void run_contended(void *(*fn)(void *), unsigned threads, unsigned long ops) {
+  pthread_t t[BENCH_THREADS];
+  ContentionArgs args[BENCH_THREADS];
+  for (unsigned i = 0; i < threads; i++) {
+    args[i].ops = ops;
+    args[i].id  = i;
+    assert(!pthread_create(t + i, nullptr, fn, args + i));
+  }
+  for (unsigned i = 0; i < threads; i++) pthread_join(t[i], nullptr);
+}
+
+static TaggedLifo<64> bench_tagged;
+
+static void *tagged_lifo_fn(void *arg) {
+  ContentionArgs *a = reinterpret_cast<ContentionArgs *>(arg);
+  for (unsigned long i = 0; i < a->ops; i++) {
+    unsigned index = bench_tagged.pop();
+    if (index != TaggedLifo<64>::EMPTY) bench_tagged.push(index);
+  }
+  return nullptr;
+}
+
+static void bench_lifo(unsigned long ops) {
+  for (unsigned i = 0; i < 64; i++) bench_tagged.push(i);
+  for (unsigned threads = 1; threads <= BENCH_THREADS; threads *= 2) {
+    BenchTimer t("tagged_lifo_pop_push", threads, ops * threads);
+    run_contended(tagged_lifo_fn, threads, ops);
+  }
+}
+
+static MpscRing<unsigned long, 256> bench_mpsc;
+static SpscRing<unsigned long, 256> bench_spsc;
+
+static void *mpsc_fn(void *arg) {
+  ContentionArgs *a = reinterpret_cast<ContentionArgs *>(arg);
+  for (unsigned long i = 0; i < a->ops; i++)
+    while (!bench_mpsc.push(i)) sched_yield();
+  return nullptr;
+}
+
+static void *spsc_fn(void *arg) {
+  ContentionArgs *a = reinterpret_cast<ContentionArgs *>(arg);
+  for (unsigned long i = 0; i < a->ops; i++)
+    while (!bench_spsc.push(i)) sched_yield();
+  return nullptr;
+}
+
+static void bench_ring(unsigned long ops) {
+  unsigned long value;
+  {
+    BenchTimer t("spsc_ring", 1, ops);
+    pthread_t producer;
+    ContentionArgs args = { ops, 0 };
+    assert(!pthread_create(&producer, nullptr, spsc_fn, &args));
+    for (unsigned long i = 0; i < ops;)
+      if (bench_spsc.pop(value)) i++; else sched_yield();
+    pthread_join(producer, nullptr);
+  }
+
+  for (unsigned producers = 1; producers < BENCH_THREADS; producers++) {
+    BenchTimer t("mpsc_ring", producers, ops * producers);
+    pthread_t p[BENCH_THREADS];
+    ContentionArgs args = { ops, 0 };
+    for (unsigned i = 0; i < producers; i++)
+      assert(!pthread_create(p + i, nullptr, mpsc_fn, &args));
+    for (unsigned long i = 0; i < ops * producers;)
+      if (bench_mpsc.pop(value)) i++; else sched_yield();
+    for (unsigned i = 0; i < producers; i++) pthread_join(p[i], nullptr);
+  }
+}
+
+static SeqLock bench_seqlock;
+static CpuState bench_cpu;
+static volatile bool seqlock_stop;
+
+static void *seqlock_writer_fn(void *) {
+  CpuState cpu;
+  cpu.clear();
+  while (!seqlock_stop) {
+    cpu.eax++;
+    bench_seqlock.write(bench_cpu, cpu);
+    sched_yield();
+  }
+  return nullptr;
+}
+
+static void bench_seqlock_read(unsigned long ops) {
+  CpuState snapshot;
+  {
+    BenchTimer t("seqlock_read_cpustate", 0, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      bench_seqlock.read(snapshot, bench_cpu);
+      asm volatile ("" : : "r"(&snapshot) : "memory");
+    }
+  }
+
+  pthread_t writer;
+  seqlock_stop = false;
+  assert(!pthread_create(&writer, nullptr, seqlock_writer_fn, nullptr));
+  {
+    BenchTimer t("seqlock_read_cpustate", 1, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      bench_seqlock.read(snapshot, bench_cpu);
+      asm volatile ("" : : "r"(&snapshot) : "memory");
+    }
+  }
+  seqlock_stop = true;
+  pthread_join(writer, nullptr);
+}
+
+static FutexEvent bench_ping, bench_pong;
+
+static void *futex_fn(void *arg) {
+  ContentionArgs *a = reinterpret_cast<ContentionArgs *>(arg);
+  for (unsigned long i = 0; i < a->ops; i++) {
+    bench_ping.wait();
+    bench_pong.set();
+  }
+  return nullptr;
+}
+
+static void bench_futex(unsigned long ops) {
+  {
+    BenchTimer t("futex_event_set_wait", 0, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      bench_ping.set();
+      bench_ping.wait();
+    }
+  }
+
+  pthread_t partner;
+  ContentionArgs args = { ops, 0 };
+  assert(!pthread_create(&partner, nullptr, futex_fn, &args));
+  {
+    BenchTimer t("futex_event_pingpong", 1, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      bench_ping.set();
+      bench_pong.wait();
+    }
+  }
+  pthread_join(partner, nullptr);
+}
+
+
+/****************************************************/
+/* Interrupt controllers                            */
+/****************************************************/
+
+static void bench_pic(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("pic:0x20,,0x4d0");
+  mb->handle_arg("pic:0xa0,2");
+
+  // ICW1-4 and OCW1 for the master: vectors 0x20-0x27, all unmasked
+  outb(mb, 0x20, 0x11);
+  outb(mb, 0x21, 0x20);
+  outb(mb, 0x21, 0x04);
+  outb(mb, 0x21, 0x01);
+  outb(mb, 0x21, 0x00);
+
+  // a device polling its status deasserts a line that is already low
+  {
+    MessageIrqLines deassert(MessageIrq::DEASSERT_IRQ, 4);
+    BenchTimer t("pic_deassert_low", 4, ops);
+    for (unsigned long i = 0; i < ops; i++)
+      mb->bus_irqlines.send(deassert);
+  }
+
+  // four updates of the same line during one request
+  {
+    BenchTimer t("pic_batch4_inject_eoi", 4, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      {
+        IrqLineBatch batch(mb->bus_irqlines);
+        for (unsigned j = 0; j < 4; j++) batch.post(MessageIrq::ASSERT_IRQ, 4);
+      }
+      MessageLegacy inta(MessageLegacy::INTA, 0);
+      mb->bus_legacy.send(inta);
+      assert(inta.value == 0x24);
+      outb(mb, 0x20, 0x20);
+    }
+  }
+
+  MessageIrqLines irq(MessageIrq::ASSERT_IRQ, 3);
+  BenchTimer t("pic_inject_eoi", 3, ops);
+  for (unsigned long i = 0; i < ops; i++) {
+    mb->bus_irqlines.send(irq);
+    MessageLegacy inta(MessageLegacy::INTA, 0);
+    mb->bus_legacy.send(inta);
+    assert(inta.value == 0x23);
+    outb(mb, 0x20, 0x20);
+  }
+}
+
+/**
+ * IOAPIC, MSI and LAPIC are measured together as they are used in a
+ * guest: an irqline assert travels as MSI to the LAPIC, the vCPU
+ * takes it with an INTA and acknowledges it with an EOI.
+ */
+static void bench_apic(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("vcpu");
+  mb->handle_arg("lapic:0");
+  mb->handle_arg("msi");
+  mb->handle_arg("ioapic");
+
+  MessageLegacy reset(MessageLegacy::RESET, 0);
+  mb->bus_legacy.send_fifo(reset);
+
+  // software enable the LAPIC with spurious vector 0xff
+  mem_write(vcpu->mem, LAPIC_BASE + 0xf0, 0x1ff);
+
+  const unsigned pin = 5, vector = 0x40;
+  for (unsigned level = 0; level < 2; level++) {
+    mem_write(mb->bus_mem, IOAPIC_BASE, 0x11 + pin * 2);
+    mem_write(mb->bus_mem, IOAPIC_BASE + 0x10, 0);
+    mem_write(mb->bus_mem, IOAPIC_BASE, 0x10 + pin * 2);
+    mem_write(mb->bus_mem, IOAPIC_BASE + 0x10, vector | (level ? MessageApic::ICR_LEVEL : 0));
+
+    MessageIrqLines assert_irq(MessageIrq::ASSERT_IRQ, pin);
+    MessageIrqLines deassert_irq(MessageIrq::DEASSERT_IRQ, pin);
+    BenchTimer t(level ? "ioapic_level_inject_eoi" : "ioapic_edge_inject_eoi", pin, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      mb->bus_irqlines.send(assert_irq);
+      LapicEvent inta(LapicEvent::INTA);
+      vcpu->bus_lapic.send(inta, true);
+      assert(inta.value == vector);
+      if (level) mb->bus_irqlines.send(deassert_irq);
+      mem_write(vcpu->mem, LAPIC_BASE + 0xb0, 0);
+    }
+  }
+
+  // fixed IPI to ourself through the ICR
+  {
+    const unsigned ipi_vector = 0x50;
+    mem_write(vcpu->mem, LAPIC_BASE + 0x310, 0);
+    BenchTimer t("lapic_ipi_inject_eoi", ipi_vector, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      mem_write(vcpu->mem, LAPIC_BASE + 0x300, 0x4000 | ipi_vector);
+      LapicEvent inta(LapicEvent::INTA);
+      vcpu->bus_lapic.send(inta, true);
+      assert(inta.value == ipi_vector);
+      mem_write(vcpu->mem, LAPIC_BASE + 0xb0, 0);
+    }
+  }
+}
+
+/**
+ * Unicast IPIs on a large guest: only the destination LAPIC should
+ * have to look at the message.
+ */
+static void bench_ipi(unsigned cpus, unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  for (unsigned i = 0; i < cpus; i++) {
+    char arg[16];
+    snprintf(arg, sizeof(arg), "lapic:%u", i);
+    mb->handle_arg("vcpu");
+    mb->handle_arg(arg);
+  }
+
+  MessageLegacy reset(MessageLegacy::RESET, 0);
+  mb->bus_legacy.send_fifo(reset);
+
+  // the last vCPU sends to APIC ID 0, which is the first one
+  VCpu *target = mb->last_vcpu;
+  while (target->get_last()) target = target->get_last();
+  mem_write(target->mem, LAPIC_BASE + 0xf0, 0x1ff);
+
+  const unsigned ipi_vector = 0x60;
+  mem_write(vcpu->mem, LAPIC_BASE + 0x310, 0);
+  BenchTimer t("lapic_ipi_unicast", cpus, ops);
+  for (unsigned long i = 0; i < ops; i++) {
+    mem_write(vcpu->mem, LAPIC_BASE + 0x300, 0x4000 | ipi_vector);
+    LapicEvent inta(LapicEvent::INTA);
+    target->bus_lapic.send(inta, true);
+    assert(inta.value == ipi_vector);
+    mem_write(target->mem, LAPIC_BASE + 0xb0, 0);
+  }
+}
+
+/**
+ * Lowest priority IPIs to all vCPUs: only the target has a TPR low
+ * enough to take the vector, so arbitration has to pick it.
+ */
+static void bench_ipi_lowest(unsigned cpus, unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  for (unsigned i = 0; i < cpus; i++) {
+    char arg[16];
+    snprintf(arg, sizeof(arg), "lapic:%u", i);
+    mb->handle_arg("vcpu");
+    mb->handle_arg(arg);
+  }
+
+  MessageLegacy reset(MessageLegacy::RESET, 0);
+  mb->bus_legacy.send_fifo(reset);
+
+  VCpu *target = mb->last_vcpu;
+  for (unsigned i = 0; i < cpus / 2; i++) target = target->get_last();
+  for (VCpu *v = mb->last_vcpu; v; v = v->get_last())
+    mem_write(v->mem, LAPIC_BASE + 0x80, v == target ? 0 : 0xf0);
+
+  const unsigned ipi_vector = 0x70;
+  mem_write(vcpu->mem, LAPIC_BASE + 0x310, 0xff000000);
+  BenchTimer t("lapic_ipi_lowest", cpus, ops);
+  for (unsigned long i = 0; i < ops; i++) {
+    mem_write(vcpu->mem, LAPIC_BASE + 0x300, 0x4000 | MessageApic::ICR_DM | 0x100 | ipi_vector);
+    LapicEvent inta(LapicEvent::INTA);
+    target->bus_lapic.send(inta, true);
+    assert(inta.value == ipi_vector);
+    mem_write(target->mem, LAPIC_BASE + 0xb0, 0);
+  }
+}
+
+/****************************************************/
+/* Timers                                           */
+/****************************************************/
+
+static void bench_pit(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("pit:0x40,0");
+
+  BenchTimer t("pit_reprogram", 2, ops);
+  for (unsigned long i = 0; i < ops; i++) {
+    // counter 0, lobyte/hibyte, mode 2
+    unsigned short count = 1193 + (i & 0xff);
+    outb(mb, 0x43, 0x34);
+    outb(mb, 0x40, count & 0xff);
+    outb(mb, 0x40, count >> 8);
+  }
+}
+
+static void bench_rtc(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("rtc:0x70,8");
+
+  // enable the periodic interrupt
+  outb(mb, 0x70, 0xb);
+  outb(mb, 0x71, 0x42);
+
+  BenchTimer t("rtc_reprogram", 0xa, ops);
+  for (unsigned long i = 0; i < ops; i++) {
+    // alternate between 1024Hz and 512Hz
+    outb(mb, 0x70, 0xa);
+    outb(mb, 0x71, 0x26 | (i & 1));
+  }
+}
+
+/****************************************************/
+/* Serial                                           */
+/****************************************************/
+
+static unsigned long serial_msgs;
+static bool receive_serial(Device *, MessageSerial &msg) { serial_msgs++; return true; }
+
+static void bench_serial(unsigned long ops) {
+  const unsigned char fcr[] = { 0x00, 0x07 };
+  for (unsigned f = 0; f < sizeof(fcr); f++) {
+    Motherboard *mb = new_motherboard();
+    mb->handle_arg("serial:0x3f8,4,0x4711");
+    mb->bus_serial.add(nullptr, receive_serial);
+    outb(mb, 0x3fb, 0x03);
+    outb(mb, 0x3fa, fcr[f]);
+
+    serial_msgs = 0;
+    {
+      BenchTimer t(fcr[f] ? "serial_tx_fifo" : "serial_tx", fcr[f], ops);
+      for (unsigned long i = 0; i < ops; i++)
+        outb(mb, 0x3f8, 'a' + (i & 0xf));
+    }
+    // the FIFO drains in 16-byte bursts
+    assert(serial_msgs == (fcr[f] ? ops / 16 : ops));
+  }
+}
+
+/****************************************************/
+/* AHCI                                             */
+/****************************************************/
+
+static void bench_ahci(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("ahci:0xe0800000,14,0x30");
+  mb->handle_arg("drive:0,0,0");
+
+  const uintptr_t port = AHCI_BASE + 0x100;
+  mem_write(mb->bus_mem, port + 0x00, AHCI_CLB);
+  mem_write(mb->bus_mem, port + 0x08, AHCI_FB);
+  // FRE, then ST
+  mem_write(mb->bus_mem, port + 0x18, 0x10);
+  mem_write(mb->bus_mem, port + 0x18, 0x11);
+
+  // command header for slot 0: 5 dword CFIS, one PRD
+  unsigned *cl = reinterpret_cast<unsigned *>(ram + AHCI_CLB);
+  cl[0] = 1 << 16 | 5;
+  cl[1] = 0;
+  cl[2] = AHCI_CTBA;
+  cl[3] = 0;
+
+  // READ DMA EXT of one sector
+  unsigned *ct = reinterpret_cast<unsigned *>(ram + AHCI_CTBA);
+  ct[0] = 0x25 << 16 | 0x8000 | 0x27;
+  ct[1] = 0x40 << 24;
+  ct[2] = 0;
+  ct[3] = 1;
+  ct[4] = 0;
+
+  unsigned *prd = reinterpret_cast<unsigned *>(ram + AHCI_CTBA + 0x80);
+  prd[0] = AHCI_DATA;
+  prd[1] = 0;
+  prd[2] = 0;
+  prd[3] = 511;
+
+  BenchTimer t("ahci_read_dma", 1, ops);
+  for (unsigned long i = 0; i < ops; i++) {
+    ct[1] = 0x40 << 24 | (i & 0xffff);
+    mem_write(mb->bus_mem, port + 0x38, 1);
+    MessageDiskCommit commit(0, pending_disk_tag);
+    mb->bus_diskcommit.send(commit);
+    assert(!(mem_read(mb->bus_mem, port + 0x38) & 1));
+  }
+}
+
+/****************************************************/
+/* Virtio block                                     */
+/****************************************************/
+
+// reset, ACKNOWLEDGE | DRIVER, features, FEATURES_OK
+static void virtio_setup(Motherboard *mb, uintptr_t base, unsigned features) {
+  mem_write(mb->bus_mem, base + 0x14, 0);
+  mem_write(mb->bus_mem, base + 0x14, 3);
+  mem_write(mb->bus_mem, base + 0x08, 1);
+  mem_write(mb->bus_mem, base + 0x0c, 1);
+  mem_write(mb->bus_mem, base + 0x08, 0);
+  mem_write(mb->bus_mem, base + 0x0c, features);
+  mem_write(mb->bus_mem, base + 0x14, 0xb);
+  assert(mem_read(mb->bus_mem, base + 0x14) & 0x8);
+}
+
+static void virtio_queue(Motherboard *mb, uintptr_t base, unsigned nr, unsigned desc) {
+  memset(ram + desc, 0, VQ_USED - VQ_DESC + 0x1000);
+  mem_write(mb->bus_mem, base + 0x14, nr << 16 | 0xb);
+  mem_write(mb->bus_mem, base + 0x18, 0xffff0000 | VQ_SIZE);
+  mem_write(mb->bus_mem, base + 0x20, desc);
+  mem_write(mb->bus_mem, base + 0x28, desc + VQ_AVAIL - VQ_DESC);
+  mem_write(mb->bus_mem, base + 0x30, desc + VQ_USED - VQ_DESC);
+  mem_write(mb->bus_mem, base + 0x1c, 1);
+}
+
+static void bench_virtio_blk(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("virtioblk:0,0xe0900000,15,0x38");
+
+  // EVENT_IDX
+  virtio_setup(mb, VIRTIO_BASE, 1 << 29);
+  virtio_queue(mb, VIRTIO_BASE, 0, VQ_DESC);
+  mem_write(mb->bus_mem, VIRTIO_BASE + 0x14, 0xf);
+
+  // header, one data sector, status byte
+  unsigned *req = reinterpret_cast<unsigned *>(ram + VQ_REQ);
+  req[0] = 0;
+  req[1] = 0;
+  unsigned *desc = reinterpret_cast<unsigned *>(ram + VQ_DESC);
+  const unsigned chain[3][4] = {
+    { VQ_REQ,        16,  1 | 1 << 16 },
+    { AHCI_DATA,     512, 3 | 2 << 16 },
+    { VQ_REQ + 0x10, 1,   2 },
+  };
+  for (unsigned i = 0; i < 3; i++) {
+    desc[i * 4 + 0] = chain[i][0];
+    desc[i * 4 + 1] = 0;
+    desc[i * 4 + 2] = chain[i][1];
+    desc[i * 4 + 3] = chain[i][2];
+  }
+
+  unsigned short *avail = reinterpret_cast<unsigned short *>(ram + VQ_AVAIL);
+  unsigned short *used  = reinterpret_cast<unsigned short *>(ram + VQ_USED);
+  BenchTimer t("virtio_blk_read", 1, ops);
+  for (unsigned long i = 0; i < ops; i++) {
+    req[2] = i & 0xffff;
+    avail[2 + i % VQ_SIZE] = 0;
+    avail[1] = i + 1;
+    mem_write(mb->bus_mem, VIRTIO_BASE + 0x3000, 0);
+    MessageDiskCommit commit(0, pending_disk_tag);
+    mb->bus_diskcommit.send(commit);
+    assert(used[1] == static_cast<unsigned short>(i + 1));
+  }
+}
+
+static void bench_virtio_net(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("virtionet:0xe0900000,11,0x40");
+
+  // EVENT_IDX and mergeable RX buffers, RX is queue 0, TX is queue 1
+  virtio_setup(mb, VIRTIO_BASE, 1 << 29 | 1 << 15);
+  virtio_queue(mb, VIRTIO_BASE, 0, VQ_DESC);
+  virtio_queue(mb, VIRTIO_BASE, 1, VQ2_DESC);
+  mem_write(mb->bus_mem, VIRTIO_BASE + 0x14, 0xf);
+
+  // TX: a single descriptor with header and frame
+  unsigned *desc = reinterpret_cast<unsigned *>(ram + VQ2_DESC);
+  for (unsigned i = 0; i < VQ_SIZE; i++) {
+    desc[i * 4 + 0] = NIC_TX_BUF;
+    desc[i * 4 + 1] = 0;
+    desc[i * 4 + 2] = 12 + NIC_PACKET;
+    desc[i * 4 + 3] = 0;
+  }
+  memset(ram + NIC_TX_BUF, 0, 12);
+  memset(ram + NIC_TX_BUF + 12, 0xff, NIC_PACKET);
+
+  unsigned short *avail = reinterpret_cast<unsigned short *>(ram + VQ2_DESC + VQ_AVAIL - VQ_DESC);
+  unsigned short *used  = reinterpret_cast<unsigned short *>(ram + VQ2_DESC + VQ_USED - VQ_DESC);
+  {
+    BenchTimer t("virtio_net_tx", NIC_PACKET, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      avail[2 + i % VQ_SIZE] = i % VQ_SIZE;
+      avail[1] = i + 1;
+      mem_write(mb->bus_mem, VIRTIO_BASE + 0x3004, 1);
+    }
+    assert(used[1] == static_cast<unsigned short>(ops));
+  }
+
+  // RX: 2k buffers, the guest refills right away
+  desc = reinterpret_cast<unsigned *>(ram + VQ_DESC);
+  for (unsigned i = 0; i < VQ_SIZE; i++) {
+    desc[i * 4 + 0] = NIC_RX_BUF + i * 2048;
+    desc[i * 4 + 1] = 0;
+    desc[i * 4 + 2] = 2048;
+    desc[i * 4 + 3] = 2;
+  }
+  avail = reinterpret_cast<unsigned short *>(ram + VQ_AVAIL);
+  used  = reinterpret_cast<unsigned short *>(ram + VQ_USED);
+  for (unsigned i = 0; i < VQ_SIZE; i++) avail[2 + i] = i;
+  avail[1] = VQ_SIZE;
+
+  unsigned char packet[NIC_PACKET];
+  memset(packet, 0xff, sizeof(packet));
+  {
+    BenchTimer t("virtio_net_rx", NIC_PACKET, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      MessageNetwork msg(packet, sizeof(packet), 0);
+      mb->bus_network.send(msg);
+      avail[1]++;
+    }
+    assert(used[1] == static_cast<unsigned short>(ops));
+  }
+}
+
+/****************************************************/
+/* Virtio balloon                                   */
+/****************************************************/
+
+static void bench_virtio_balloon(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("virtioballoon:0xe0900000,11,0x48");
+
+  // EVENT_IDX and free page reporting, reports go to queue 2
+  virtio_setup(mb, VIRTIO_BASE, 1 << 29 | 1 << 5);
+  virtio_queue(mb, VIRTIO_BASE, 2, VQ_DESC);
+  mem_write(mb->bus_mem, VIRTIO_BASE + 0x14, 0xf);
+
+  // every report is a single 2M range
+  unsigned *desc = reinterpret_cast<unsigned *>(ram + VQ_DESC);
+  for (unsigned i = 0; i < VQ_SIZE; i++) {
+    desc[i * 4 + 0] = 2 << 20;
+    desc[i * 4 + 1] = 0;
+    desc[i * 4 + 2] = 2 << 20;
+    desc[i * 4 + 3] = 2;
+  }
+
+  discarded_pages = 0;
+  unsigned short *avail = reinterpret_cast<unsigned short *>(ram + VQ_AVAIL);
+  unsigned short *used  = reinterpret_cast<unsigned short *>(ram + VQ_USED);
+  {
+    BenchTimer t("virtio_balloon_report", 512, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      avail[2 + i % VQ_SIZE] = i % VQ_SIZE;
+      avail[1] = i + 1;
+      mem_write(mb->bus_mem, VIRTIO_BASE + 0x3008, 2);
+    }
+  }
+  assert(used[1] == static_cast<unsigned short>(ops));
+  assert(discarded_pages == ops * 512);
+}
+
+/****************************************************/
+/* Intel 82576 VF                                   */
+/****************************************************/
+
+static unsigned find_bdf(Motherboard *mb, unsigned id) {
+  for (unsigned bdf = 0; bdf < 0x10000; bdf += 8) {
+    MessagePciConfig msg(bdf, 0);
+    mb->bus_pcicfg.send(msg, true);
+    if (msg.value == id) return bdf;
+  }
+  Logging::panic("PCI device %x not found", id);
+}
+
+static void bench_82576vf(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("intel82576vf");
+
+  // memory decode and busmaster
+  MessagePciConfig pcicmd(find_bdf(mb, 0x10ca8086), 1, 6);
+  mb->bus_pcicfg.send(pcicmd, true);
+
+  const uintptr_t rx = NIC_MMIO + 0x2000, tx = NIC_MMIO + 0x3000;
+  const unsigned ring_len = NIC_RING * 16;
+
+  mem_write(mb->bus_mem, tx + 0x800, NIC_TX_RING);
+  mem_write(mb->bus_mem, tx + 0x808, ring_len);
+  mem_write(mb->bus_mem, rx + 0x800, NIC_RX_RING);
+  mem_write(mb->bus_mem, rx + 0x808, ring_len);
+
+  // advanced data descriptors: DEXT, RS, IFCS, EOP
+  tx_desc *txr = reinterpret_cast<tx_desc *>(ram + NIC_TX_RING);
+  memset(ram + NIC_TX_BUF, 0xff, NIC_PACKET);
+  {
+    BenchTimer t("82576vf_tx_desc", NIC_PACKET, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      tx_desc &desc = txr[i % NIC_RING];
+      desc.raw[0]  = NIC_TX_BUF;
+      desc.rawd[2] = NIC_PACKET | tx_desc::DTYP_DATA << 20 | (0x20 | 0x8 | 0x2 | 0x1) << 24;
+      desc.rawd[3] = NIC_PACKET << 14;
+      mem_write(mb->bus_mem, tx + 0x818, (i + 1) % NIC_RING);
+    }
+  }
+
+  // legacy descriptors, all but one handed to the device
+  unsigned long long *rxr = reinterpret_cast<unsigned long long *>(ram + NIC_RX_RING);
+  for (unsigned i = 0; i < NIC_RING; i++) {
+    rxr[i * 2]     = NIC_RX_BUF + i * 2048;
+    rxr[i * 2 + 1] = 0;
+  }
+  mem_write(mb->bus_mem, rx + 0x818, NIC_RING - 1);
+
+  unsigned char packet[NIC_PACKET];
+  memset(packet, 0xff, sizeof(packet));
+  {
+    BenchTimer t("82576vf_rx_desc", NIC_PACKET, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      MessageNetwork msg(packet, sizeof(packet), 0);
+      mb->bus_network.send(msg);
+      // the guest returns the used descriptor immediately
+      mem_write(mb->bus_mem, rx + 0x818, i % NIC_RING);
+    }
+  }
+}
+
+/****************************************************/
+/* Migration                                        */
+/****************************************************/
+
+static void bench_page_hash(unsigned long ops) {
+  for (unsigned i = 0; i < RAM_SIZE; i++) ram[i] = i * 7 + (i >> 12);
+  unsigned long long sum = 0;
+  {
+    BenchTimer t("page_hash", PageCodec::PAGE_SIZE, ops);
+    for (unsigned long i = 0; i < ops; i++) {
+      PageCodec::Hash h = PageCodec::hash(ram + ((i << 12) & (RAM_SIZE - 1)));
+      sum += h.lo ^ h.hi;
+    }
+  }
+  assert(sum);
+}
+
+
+/****************************************************/
+/* Halifax                                          */
+/****************************************************/
+
+#ifdef BENCH_HALIFAX
+static void bench_halifax_insn(Motherboard *mb, const char *name, const unsigned char *code,
+                               unsigned len, unsigned long ops) {
+  memcpy(ram + HALIFAX_CODE, code, len);
+
+  CpuState cpu;
+  cpu.clear();
+  cpu.cr0 = 0x10;
+  cpu.cs.set(0, 0, 0xffff, 0x9b);
+  cpu.ds.set(0, 0, 0xffff, 0x93);
+  cpu.ss.set(0, 0, 0xffff, 0x93);
+  cpu.es = cpu.fs = cpu.gs = cpu.ds;
+  cpu.efl = 2;
+  cpu.ebx = 0x8000;
+
+  BenchTimer t(name, len, ops);
+  for (unsigned long i = 0; i < ops; i++) {
+    cpu.eip = HALIFAX_CODE;
+    cpu.mtd = MTD_ALL;
+    CpuMessage msg(CpuMessage::TYPE_SINGLE_STEP, &cpu, MTD_ALL);
+    vcpu->executor.send(msg, true);
+  }
+}
+
+static void bench_halifax(unsigned long ops) {
+  Motherboard *mb = new_motherboard();
+  mb->handle_arg("vcpu");
+  mb->handle_arg("halifax");
+
+  static const unsigned char nop[]   = { 0x90 };
+  static const unsigned char inc[]   = { 0x40 };
+  static const unsigned char store[] = { 0x89, 0x07 };
+  static const unsigned char load[]  = { 0x8b, 0x07 };
+  bench_halifax_insn(mb, "halifax_nop",   nop,   sizeof(nop),   ops);
+  bench_halifax_insn(mb, "halifax_inc",   inc,   sizeof(inc),   ops);
+  bench_halifax_insn(mb, "halifax_store", store, sizeof(store), ops);
+  bench_halifax_insn(mb, "halifax_load",  load,  sizeof(load),  ops);
+
+  static const unsigned char fnstcw[] = { 0xd9, 0x3f };
+  static const unsigned char ficom[]  = { 0xde, 0x17 };
+  bench_halifax_insn(mb, "halifax_fnstcw", fnstcw, sizeof(fnstcw), ops);
+  bench_halifax_insn(mb, "halifax_ficom",  ficom,  sizeof(ficom),  ops);
+}
+#endif
+
+int runBench() {
+  BenchTimer::header();
+  bench_dbus(10000000);
+  bench_executor(10000000);
+  bench_lifo(1000000);
+  bench_ring(1000000);
+  bench_seqlock_read(1000000);
+  bench_futex(100000);
+  bench_pic(1000000);
+  bench_apic(1000000);
+  bench_ipi(4, 1000000);
+  bench_ipi(64, 1000000);
+  bench_ipi_lowest(64, 200000);
+  bench_pit(1000000);
+  bench_rtc(1000000);
+  bench_serial(1000000);
+  bench_ahci(200000);
+  bench_virtio_blk(200000);
+  bench_virtio_net(200000);
+  bench_virtio_balloon(200000);
+  bench_82576vf(200000);
+  bench_page_hash(1000000);
+#ifdef BENCH_HALIFAX
+  bench_halifax(1000000);
+#endif
+  return 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * Device Model Microbenchmarks header file
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <nul/motherboard.h>
+#include <nul/vcpu.h>
+
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+
+int runBench();
+
+/**
+ * Measures a hot loop and emits one machine-readable result line on
+ * stdout. Columns are tab-separated:
+ *
+ *   BENCH <name> <param> <ops> <ns/op> <ops/s>
+ *
+ * Model output (Logging::printf) goes to stderr and does not disturb
+ * the result stream.
+ */
+class BenchTimer {
+  const char *_name;
+  unsigned    _param;
+  unsigned long _ops;
+  timespec    _start;
+
+  static unsigned long long ns(const timespec &t) {
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+  }
+
+public:
+  static void header() {
+    printf("#\tname\tparam\tops\tns/op\tops/s\n");
+  }
+
+  BenchTimer(const char *name, unsigned param, unsigned long ops)
+    : _name(name), _param(param), _ops(ops), _start() {
+    clock_gettime(CLOCK_MONOTONIC, &_start);
+  }
+
+  ~BenchTimer() {
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long long delta = ns(end) - ns(_start);
+    if (!delta) delta = 1;
+    printf("BENCH\t%s\t%u\t%lu\t%.2f\t%.0f\n", _name, _param, _ops,
+           double(delta) / _ops, _ops * 1e9 / delta);
+    fflush(stdout);
+  }
+};
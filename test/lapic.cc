@@ -46,7 +46,8 @@ bool ipi_free = false;
 unsigned irq_sent_timer = 0, irq_sent_ipi = 0;
 unsigned irq_received_timer = 0, irq_received_ipi = 0;
 unsigned long intr = 0;
-bool wakeup = false;
+unsigned wakeup = 0;
+timevalue last_timeout = 0;
 
 static bool receive(Device *, CpuEvent &msg) {
   if (msg.value == VCpu::EVENT_INTR) {
@@ -54,10 +55,11 @@ static bool receive(Device *, CpuEvent &msg) {
     if (!(__sync_fetch_and_or(&intr, 1) & 0x1)) {
       logger.log(LOG_INTR);
     }
-    wakeup = true;
+    wakeup = 1;
   } else if (msg.value == VCpu::DEASS_INTR) {
     logger.log(LOG_DEASS);
   }
+  return true;
 }
 
 static bool receive(Device *, MessageHostOp &msg) {
@@ -71,12 +73,14 @@ static bool receive(Device *, MessageHostOp &msg) {
   } else {
     Logging::printf("Hostop msg type %u\n", msg.type);
   }
+  return false;
 }
 
 static bool receive(Device *, MessageTimer &msg) {
   if (msg.type == MessageTimer::TIMER_NEW) {
     msg.nr = 0;
   } else {
+    last_timeout = msg.abstime;
     // Ready to fire new
     logger.log(LOG_NOTIFY, TIMER_VEC);
     __sync_bool_compare_and_swap(&irq_free, false, true);
@@ -171,6 +175,370 @@ static void * ipi_fn(void *) {
   return nullptr;
 }
 
+static unsigned long long msr(unsigned nr, CpuState &cpu, bool write = false, unsigned long long value = 0) {
+  cpu.ecx = nr;
+  cpu.edx_eax(value);
+  CpuMessage msg(write ? CpuMessage::TYPE_WRMSR : CpuMessage::TYPE_RDMSR, &cpu, MTD_TSC | MTD_GPR_ACDB);
+  vcpu->executor.send(msg, true);
+  if (msg.mtr_out & MTD_TSC) cpu.tsc_off = msg.current_tsc_off;
+  return cpu.edx_eax();
+}
+
+/**
+ * Moving the guest TSC must not move an armed TSC deadline in guest
+ * terms, so the host timer has to follow.
+ */
+static void testTscDeadline() {
+  CpuState cpu;
+  memset(&cpu, 0, sizeof(cpu));
+
+  unsigned val = 0x1ff;
+  writeIO(LAPIC_BASE + 0xf0, &val);
+  val = TIMER_VEC | (2 << 17);
+  writeIO(LAPIC_BASE + 0x320, &val);
+
+  unsigned long long deadline = msr(0x10, cpu) + 1000000000ull;
+  msr(0x6e0, cpu, true, deadline);
+  timevalue armed = last_timeout;
+
+  msr(0x10, cpu, true, msr(0x10, cpu) + 500000000ull);
+  assert(msr(0x6e0, cpu) == deadline);
+  assert(last_timeout < armed);
+  assert(last_timeout == deadline - cpu.tsc_off);
+
+  msr(0x10, cpu, true, msr(0x10, cpu) - 2000000000ull);
+  assert(msr(0x6e0, cpu) == deadline);
+  assert(last_timeout == deadline - cpu.tsc_off);
+
+  // leave TSC-deadline mode, which disarms the timer
+  val = 1 << 16;
+  writeIO(LAPIC_BASE + 0x320, &val);
+  irq_free = false;
+  printf("TSC deadline follows TSC writes.\n");
+}
+
+/**
+ * Stand-ins for LAPICs on a bare ApicRouter. They accept whatever
+ * they are offered, so the delivered set is the router's candidate
+ * set and a stale or too wide table shows up.
+ */
+struct FakeApic : public Device {
+  unsigned nr;
+  unsigned prio;
+  bool     refuse;
+  FakeApic() : Device("fake apic"), nr(0), prio(0), refuse(false) {}
+};
+
+static FakeApic fake_apics[6];
+static ApicRouter fake_router;
+static unsigned fake_hits;
+
+static bool fake_receive(Device *dev, MessageApic &) {
+  fake_hits |= 1 << static_cast<FakeApic *>(dev)->nr;
+  return true;
+}
+
+static bool fake_prio(Device *dev, MessageApicPrio &msg) {
+  FakeApic *a = static_cast<FakeApic *>(dev);
+  msg.prio = a->prio;
+  return !a->refuse;
+}
+
+static unsigned route(unsigned icr, unsigned dst) {
+  fake_hits = 0;
+  MessageApic msg(icr, dst, 0);
+  fake_router.send(msg);
+  return fake_hits;
+}
+
+static unsigned route_lowest(unsigned vector, unsigned &start) {
+  fake_hits = 0;
+  MessageApic msg(MessageApic::ICR_DM | vector, 0xff, 0);
+  if (!fake_router.send_lowest(msg, start)) return 0;
+  return fake_hits;
+}
+
+/**
+ * Every destination mode must reach exactly the LAPICs that the
+ * router was told about, also after they changed their addressing.
+ */
+static void testRouterModes() {
+  const unsigned DM = MessageApic::ICR_DM;
+  for (unsigned i=0; i < 6; i++) {
+    fake_apics[i].nr = i;
+    assert(fake_router.add(&fake_apics[i], fake_receive, fake_prio) == i);
+  }
+
+  // All start as xAPIC with ID 0 in cluster 0.
+  assert(route(0, 0) == 0x3f);
+
+  // xAPIC physical and broadcast
+  for (unsigned i=0; i < 6; i++) fake_router.update(i, false, i, 1 << i, true);
+  assert(route(0, 3) == 0x08);
+  assert(route(0, 6) == 0);
+  assert(route(0, 0xff) == 0x3f);
+  assert(route(DM, 0xff) == 0x3f);
+  // only the lowest byte counts
+  assert(route(0, 0x102) == 0x04);
+
+  // flat model: one bit per LAPIC
+  assert(route(DM, 0x05) == 0x05);
+  assert(route(DM, 0x30) == 0x30);
+  assert(route(DM, 0xc0) == 0);
+
+  // cluster model: cluster in the upper nibble
+  fake_router.update(0, false, 0, 0x11, false);
+  fake_router.update(1, false, 1, 0x12, false);
+  fake_router.update(2, false, 2, 0x21, false);
+  fake_router.update(3, false, 3, 0x28, false);
+  fake_router.update(4, false, 4, 0x31, false);
+  fake_router.update(5, false, 5, 0x34, false);
+  assert(route(DM, 0x13) == 0x03);
+  assert(route(DM, 0x29) == 0x0c);
+  assert(route(DM, 0x35) == 0x30);
+  assert(route(DM, 0x41) == 0);
+
+  // a new APIC ID and LDR move the LAPIC in the tables
+  fake_router.update(1, false, 9, 0x42, false);
+  assert(route(0, 1) == 0);
+  assert(route(0, 9) == 0x02);
+  assert(route(DM, 0x12) == 0);
+  assert(route(DM, 0x42) == 0x02);
+
+  // DFR switch: in the cluster model LDR 0x10 names no member,
+  // in the flat model it is bit 4
+  fake_router.update(4, false, 4, 0x10, false);
+  assert(route(DM, 0x10) == 0);
+  assert(route(DM, 0x11) == 0x01);
+  fake_router.update(4, false, 4, 0x10, true);
+  assert(route(DM, 0x10) == 0x10);
+  // both models on one bus
+  assert(route(DM, 0x11) == 0x11);
+
+  // x2APIC: 32-bit IDs, logical IDs derived from them
+  fake_router.update(2, true, 0x21, 0, false);
+  fake_router.update(3, true, 0x2f, 0, false);
+  fake_router.update(5, true, 0x1234, 0, false);
+  assert(route(0, 0x21) == 0x20 + 0x04);
+  assert(route(0, 0x2f) == 0x20 + 0x08);
+  assert(route(0, 0x1234) == 0x20);
+  assert(route(0, ~0u) == 0x2c + 0x13);
+  assert(route(DM, 0x20002) == 0x20 + 0x04);
+  assert(route(DM, 0x28002) == 0x20 + 0x0c);
+  assert(route(DM, 0x30002) == 0x20);
+  // xAPICs in the same system still see their own destinations
+  assert(route(DM, 0x11) == 0x11 + 0x20);
+  assert(route(0, 9) == 0x02 + 0x20);
+
+  // back to xAPIC mode
+  fake_router.update(5, false, 5, 0x80, true);
+  assert(route(0, 0x1234) == 0);
+  assert(route(DM, 0x80) == 0x20);
+  assert(route(0, 0xff) == 0x33);
+  printf("APIC router follows every destination mode.\n");
+}
+
+/**
+ * Lowest priority messages go to the lowest prio. On a tie the last
+ * recipient of the vector wins, otherwise the next one after start.
+ */
+static void testRouterLowest() {
+  for (unsigned i=0; i < 6; i++) {
+    fake_router.update(i, false, i, 0x01, true);
+    fake_apics[i].prio = 10;
+  }
+
+  unsigned start = 0;
+  fake_apics[4].prio = 3;
+  fake_apics[2].prio = 5;
+  assert(route_lowest(0x40, start) == 0x10);
+  assert(start == 5);
+  start = 3;
+  assert(route_lowest(0x41, start) == 0x10);
+
+  // a LAPIC that does not take the message is out
+  fake_apics[4].refuse = true;
+  assert(route_lowest(0x42, start) == 0x04);
+  fake_apics[2].refuse = true;
+  fake_apics[4].prio = fake_apics[2].prio = 10;
+
+  // ties: round-robin for new vectors...
+  start = 0;
+  assert(route_lowest(0x50, start) == 0x01);
+  assert(route_lowest(0x51, start) == 0x02);
+  assert(route_lowest(0x52, start) == 0x08);
+  // ...but a vector sticks with its last recipient
+  assert(route_lowest(0x50, start) == 0x01);
+  start = 4;
+  assert(route_lowest(0x51, start) == 0x02);
+  // unless somebody is less busy
+  fake_apics[5].prio = 9;
+  assert(route_lowest(0x51, start) == 0x20);
+  assert(route_lowest(0x51, start) == 0x20);
+
+  for (unsigned i=0; i < 6; i++) fake_apics[i].refuse = true;
+  assert(route_lowest(0x53, start) == 0);
+  printf("APIC router arbitrates lowest priority messages.\n");
+}
+
+/**
+ * Real LAPICs on their own motherboard: register writes have to
+ * reach the router and their priority has to decide arbitration.
+ */
+enum { ROUTE_CPUS = 4 };
+
+static Motherboard route_mb(&mb_clock, NULL);
+static VCpu *route_vcpu[ROUTE_CPUS];
+static unsigned route_vcpus;
+static bool route_x2apic[ROUTE_CPUS];
+
+static bool route_receive(Device *, MessageHostOp &msg) {
+  if (msg.type == MessageHostOp::OP_VCPU_CREATE_BACKEND) {
+    msg.value = route_vcpus;
+    route_vcpu[route_vcpus++] = msg.vcpu;
+    return true;
+  }
+  return msg.type == MessageHostOp::OP_VCPU_RELEASE;
+}
+
+static bool route_receive(Device *, MessageTimer &msg) {
+  msg.nr = 0;
+  return true;
+}
+
+static unsigned long long route_msr(unsigned cpu, unsigned nr, bool write = false, unsigned long long value = 0) {
+  CpuState state;
+  memset(&state, 0, sizeof(state));
+  state.ecx = nr;
+  state.edx_eax(value);
+  CpuMessage msg(write ? CpuMessage::TYPE_WRMSR : CpuMessage::TYPE_RDMSR, &state, MTD_GPR_ACDB);
+  assert(route_vcpu[cpu]->executor.send(msg, true));
+  return state.edx_eax();
+}
+
+/// Access a LAPIC register by its x2APIC MSR index.
+static unsigned route_reg(unsigned cpu, unsigned reg, bool write = false, unsigned value = 0) {
+  if (route_x2apic[cpu]) return route_msr(cpu, 0x800 + reg, write, value);
+  MessageMem msg(!write, LAPIC_BASE + reg * 0x10, &value);
+  assert(route_vcpu[cpu]->mem.send(msg));
+  return value;
+}
+
+/// Which LAPICs got vector since the last call?
+static unsigned route_irr(unsigned vector) {
+  unsigned res = 0;
+  for (unsigned i=0; i < ROUTE_CPUS; i++) {
+    if (route_reg(i, 0x20 + vector / 32) & (1 << vector % 32)) res |= 1 << i;
+
+    // take all pending vectors, ignoring the PPR
+    unsigned tpr = route_reg(i, 0x08);
+    route_reg(i, 0x08, true, 0);
+    for (;;) {
+      LapicEvent inta(LapicEvent::INTA);
+      route_vcpu[i]->bus_lapic.send(inta);
+      if (inta.value == 0xff) break;
+      route_reg(i, 0x0b, true, 0);
+    }
+    route_reg(i, 0x08, true, tpr);
+  }
+  return res;
+}
+
+static unsigned route_send(unsigned icr, unsigned dst) {
+  MessageApic msg(icr, dst, 0);
+  route_mb.apic_router.send(msg);
+  return route_irr(icr & 0xff);
+}
+
+static unsigned lapic_lowest(unsigned vector, unsigned dst) {
+  static unsigned start;
+  MessageApic msg(MessageApic::ICR_DM | vector, dst, 0);
+  route_mb.apic_router.send_lowest(msg, start);
+  return route_irr(vector);
+}
+
+static void testLapicRoutes() {
+  const unsigned DM = MessageApic::ICR_DM;
+  route_mb.bus_hostop.add(nullptr, route_receive);
+  route_mb.bus_timer.add(nullptr, route_receive);
+  for (unsigned i=0; i < ROUTE_CPUS; i++) {
+    char arg[16];
+    snprintf(arg, sizeof(arg), "lapic:%u", i);
+    route_mb.handle_arg("vcpu");
+    route_mb.handle_arg(arg);
+  }
+  assert(route_vcpus == ROUTE_CPUS);
+  for (unsigned i=0; i < ROUTE_CPUS; i++) route_reg(i, 0x0f, true, 0x1ff);
+
+  assert(route_send(0x60, 2) == 0x04);
+  assert(route_send(0x60, 0xff) == 0x0f);
+
+  // APIC ID
+  route_reg(1, 0x02, true, 7 << 24);
+  assert(route_send(0x61, 1) == 0);
+  assert(route_send(0x61, 7) == 0x02);
+
+  // LDR in the flat model
+  for (unsigned i=0; i < ROUTE_CPUS; i++) route_reg(i, 0x0d, true, 1 << (i + 24));
+  assert(route_send(DM | 0x62, 0x06) == 0x06);
+
+  // DFR: cluster model, two clusters of two
+  for (unsigned i=0; i < ROUTE_CPUS; i++) {
+    route_reg(i, 0x0e, true, 0x0fffffff);
+    route_reg(i, 0x0d, true, ((i / 2 + 1) << 28) | (1 << (i % 2 + 24)));
+  }
+  assert(route_send(DM | 0x63, 0x06) == 0);
+  assert(route_send(DM | 0x63, 0x13) == 0x03);
+  assert(route_send(DM | 0x63, 0x22) == 0x08);
+
+  // x2APIC mode: the initial APIC ID is back, LDR follows from it
+  route_msr(3, 0x1b, true, LAPIC_BASE | 0xc00);
+  route_x2apic[3] = true;
+  assert(route_send(0x64, 3) == 0x08);
+  assert(route_send(DM | 0x64, 0x08) == 0x08);
+  assert(route_send(DM | 0x64, 0x22) == 0);
+  // xAPICs see the low byte of an x2APIC broadcast, but not vice versa
+  assert(route_send(0x64, ~0u) == 0x0f);
+  assert(route_send(0x64, 0xff) == 0x07);
+  printf("LAPIC register writes update the APIC router.\n");
+}
+
+/**
+ * The PPR and a blocked vCPU decide lowest priority arbitration
+ * between real LAPICs.
+ */
+static void testLapicLowest() {
+  // the three xAPICs from above, now all in cluster 1
+  const unsigned ALL = 0x17;
+  route_reg(2, 0x0d, true, (1 << 28) | (1 << 26));
+  route_reg(0, 0x08, true, 0x30);
+  route_reg(1, 0x08, true, 0x10);
+  route_reg(2, 0x08, true, 0x20);
+  assert(lapic_lowest(0x70, ALL) == 0x02);
+  route_reg(2, 0x08, true, 0x00);
+  assert(lapic_lowest(0x70, ALL) == 0x04);
+
+  // a blocked vCPU only loses against an equally busy one, even
+  // when it got the vector last time
+  assert(lapic_lowest(0x71, ALL) == 0x04);
+  route_reg(1, 0x08, true, 0x00);
+  route_vcpu[2]->blocked = true;
+  assert(lapic_lowest(0x71, ALL) == 0x02);
+  route_reg(1, 0x08, true, 0x10);
+  assert(lapic_lowest(0x71, ALL) == 0x04);
+  route_vcpu[2]->blocked = false;
+
+  // equally busy: the vector stays where it went last
+  route_reg(0, 0x08, true, 0x00);
+  route_reg(1, 0x08, true, 0x00);
+  unsigned first = lapic_lowest(0x72, ALL);
+  assert(first == 0x01 || first == 0x02 || first == 0x04);
+  for (unsigned i=0; i < 3; i++) assert(lapic_lowest(0x72, ALL) == first);
+  // a new vector goes round-robin
+  assert(lapic_lowest(0x73, ALL) != first);
+  printf("LAPIC priorities decide lowest priority arbitration.\n");
+}
+
 int runLAPICTest() {
   // attach handlers
   mb.bus_hostop.add(nullptr, receive);
@@ -181,6 +549,12 @@ int runLAPICTest() {
   mb.handle_arg("vcpu");
   mb.handle_arg("lapic");
 
+  testTscDeadline();
+  testRouterModes();
+  testRouterLowest();
+  testLapicRoutes();
+  testLapicLowest();
+
   // init LAPIC
   //software enable, map spurious interrupt to dummy isr
   unsigned val = 39 | 0x100;
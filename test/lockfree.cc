@@ -0,0 +1,219 @@
+/**
+ * Lock-free primitives test
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "lockfree.h"
+
+enum {
+  THREADS = 4,
+  ROUNDS  = 100000,
+};
+
+static void run_threads(void *(*fn)(void *), unsigned count)
+{
+  pthread_t t[THREADS];
+  for (unsigned long i = 0; i < count; i++)
+    assert(!pthread_create(t + i, NULL, fn, reinterpret_cast<void *>(i)));
+  for (unsigned i = 0; i < count; i++)
+    pthread_join(t[i], NULL);
+}
+
+/*
+ * All threads pop an index and push it back. An ABA problem would
+ * lose or duplicate indices, so in the end all of them have to be
+ * there exactly once.
+ */
+static TaggedLifo<8> tagged;
+
+static void *tagged_fn(void *)
+{
+  for (unsigned i = 0; i < ROUNDS; i++) {
+    unsigned index = tagged.pop();
+    if (index != TaggedLifo<8>::EMPTY) tagged.push(index);
+  }
+  return NULL;
+}
+
+static void test_tagged_lifo()
+{
+  for (unsigned i = 0; i < 8; i++) tagged.push(i);
+  run_threads(tagged_fn, THREADS);
+
+  unsigned seen = 0, index;
+  while ((index = tagged.pop()) != TaggedLifo<8>::EMPTY) {
+    assert(index < 8 && !(seen & (1 << index)));
+    seen |= 1 << index;
+  }
+  assert(seen == 0xff);
+}
+
+
+struct Node {
+  Node *lifo_next;
+};
+
+static AtomicLifo<Node> lifo;
+static Node nodes[THREADS][1000];
+
+static void *lifo_fn(void *arg)
+{
+  Node *n = nodes[reinterpret_cast<unsigned long>(arg)];
+  for (unsigned i = 0; i < 1000; i++) lifo.enqueue(n + i);
+  return NULL;
+}
+
+static void test_atomic_lifo()
+{
+  run_threads(lifo_fn, THREADS);
+  unsigned count = 0;
+  for (Node *n = lifo.dequeue_all(); n; n = n->lifo_next) count++;
+  assert(count == THREADS * 1000);
+  assert(!lifo.head());
+}
+
+
+/*
+ * Every producer sends an increasing sequence. The consumer has to get
+ * all of them, each one in order.
+ */
+static MpscRing<unsigned long, 64> mpsc;
+
+static void *mpsc_fn(void *arg)
+{
+  unsigned long producer = reinterpret_cast<unsigned long>(arg);
+  for (unsigned long i = 0; i < ROUNDS; i++)
+    while (!mpsc.push(producer << 32 | i)) sched_yield();
+  return NULL;
+}
+
+static void test_mpsc_ring()
+{
+  pthread_t t[THREADS - 1];
+  for (unsigned long i = 0; i < THREADS - 1; i++)
+    assert(!pthread_create(t + i, NULL, mpsc_fn, reinterpret_cast<void *>(i)));
+
+  unsigned long next[THREADS - 1] = { };
+  for (unsigned long count = 0, value; count < (THREADS - 1) * ROUNDS;) {
+    if (!mpsc.pop(value)) { sched_yield(); continue; }
+    assert((value >> 32) < THREADS - 1);
+    assert((value & 0xffffffff) == next[value >> 32]++);
+    count++;
+  }
+  for (unsigned i = 0; i < THREADS - 1; i++)
+    pthread_join(t[i], NULL);
+  unsigned long value;
+  assert(!mpsc.pop(value));
+}
+
+
+static SpscRing<unsigned, 64> spsc;
+
+static void *spsc_fn(void *)
+{
+  for (unsigned i = 0; i < ROUNDS; i++)
+    while (!spsc.push(i)) sched_yield();
+  return NULL;
+}
+
+static void test_spsc_ring()
+{
+  pthread_t t;
+  assert(!pthread_create(&t, NULL, spsc_fn, NULL));
+  for (unsigned i = 0, value; i < ROUNDS;)
+    if (spsc.pop(value)) assert(value == i++);
+    else sched_yield();
+  pthread_join(t, NULL);
+  assert(spsc.empty());
+}
+
+
+/*
+ * The writer keeps all fields of the snapshot equal, readers must
+ * never see a mix.
+ */
+struct Snapshot {
+  unsigned long long v[8];
+};
+
+static SeqLock seqlock;
+static Snapshot shared;
+static volatile bool writer_done;
+
+static void *seqlock_fn(void *arg)
+{
+  if (!arg) {
+    Snapshot s;
+    for (unsigned i = 1; i <= ROUNDS; i++) {
+      for (unsigned j = 0; j < 8; j++) s.v[j] = i;
+      seqlock.write(shared, s);
+    }
+    writer_done = true;
+    return NULL;
+  }
+
+  Snapshot s;
+  do {
+    seqlock.read(s, shared);
+    for (unsigned j = 1; j < 8; j++) assert(s.v[j] == s.v[0]);
+  } while (!writer_done);
+  return NULL;
+}
+
+static void test_seqlock()
+{
+  run_threads(seqlock_fn, THREADS);
+  assert(shared.v[7] == ROUNDS);
+}
+
+
+/*
+ * Two threads hand a token back and forth, each wakeup has to arrive.
+ */
+static FutexEvent ping, pong;
+
+static void *futex_fn(void *)
+{
+  for (unsigned i = 0; i < ROUNDS / 10; i++) {
+    ping.wait();
+    pong.set();
+  }
+  return NULL;
+}
+
+static void test_futex_event()
+{
+  pthread_t t;
+  assert(!pthread_create(&t, NULL, futex_fn, NULL));
+  for (unsigned i = 0; i < ROUNDS / 10; i++) {
+    ping.set();
+    pong.wait();
+  }
+  pthread_join(t, NULL);
+  assert(!ping.try_wait() && !pong.try_wait());
+}
+
+
+int runLockfreeTest()
+{
+  test_tagged_lifo();
+  test_atomic_lifo();
+  test_mpsc_ring();
+  test_spsc_ring();
+  test_seqlock();
+  test_futex_event();
+  printf("All lock-free tests passed.\n");
+  return 0;
+}
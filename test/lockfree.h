@@ -0,0 +1,28 @@
+/**
+ * Lock-free primitives test header file
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <service/lifo.h>
+#include <service/ring.h>
+#include <service/seqlock.h>
+#include <service/futex.h>
+
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+int runLockfreeTest();
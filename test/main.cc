@@ -29,10 +29,26 @@
 #include "lapic.h"
 #endif
 
+#ifdef PITTEST
+#include "pit.h"
+#endif
+
 #ifdef SATATEST
 #include "sata.h"
 #endif
 
+#ifdef MIGRATIONTEST
+#include "migration.h"
+#endif
+
+#ifdef LOCKFREETEST
+#include "lockfree.h"
+#endif
+
+#ifdef BENCH
+#include "bench.h"
+#endif
+
 int main(int argc, char **argv) {
   std::cout << "Hello, this is Seoulcheck." << std::endl;
 
@@ -51,9 +67,29 @@ int main(int argc, char **argv) {
   runLAPICTest();
 #endif
 
+#ifdef PITTEST
+  std::cout << "Running PIT test." << std::endl;
+  runPitTest();
+#endif
+
 #ifdef SATATEST
   std::cout << "Running SATA test." << std::endl;
   runSATATest();
 #endif
 
+#ifdef MIGRATIONTEST
+  std::cout << "Running migration page stream test." << std::endl;
+  runMigrationTest();
+#endif
+
+#ifdef LOCKFREETEST
+  std::cout << "Running lock-free primitives test." << std::endl;
+  runLockfreeTest();
+#endif
+
+#ifdef BENCH
+  std::cout << "Running device model benchmarks." << std::endl;
+  runBench();
+#endif
+
 }
@@ -0,0 +1,498 @@
+/**
+ * Migration page stream test
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "migration.h"
+
+enum {
+  PAGES  = 2048,
+  ROUNDS = 8,
+  PORT   = 47011,
+  POSTCOPY_PORT = 47012,
+  VERIFY_PORT   = 47013,
+  CONVERGE_PORT = 47014,
+  HOT_PAGES     = 16,
+};
+
+static char sender[PAGES << 12] VMM_ALIGNED(4096);
+static char receiver[PAGES << 12] VMM_ALIGNED(4096);
+
+// Dirty some pages the way guests do: few bytes, whole pages, or zeroing.
+static void dirty(unsigned round)
+{
+  for (unsigned i=0; i < PAGES / 4; i++) {
+    unsigned page = random() % PAGES;
+    char *p = sender + (page << 12);
+    switch (random() % 4) {
+    case 0: p[random() % 4096] = random(); break;
+    case 1: for (unsigned j=0; j < 4096; j++) p[j] = random(); break;
+    case 2: memset(p, 0, 4096); break;
+    case 3: for (unsigned j=0; j < 4096; j++) p[j] = (j / 16) ^ round; break;
+    }
+  }
+}
+
+// Push every page through the encoder and decode it on the other side.
+static void transfer(PageEncoder &enc)
+{
+  for (unsigned base=0; base < PAGES; base += PageEncoder::BATCH_PAGES) {
+    enc.reset();
+    for (unsigned page=base; page < PAGES && enc.add(page); page++);
+    enc.encode();
+
+    for (unsigned i=0; i < PageEncoder::BATCH_PAGES && base + i < PAGES; i++) {
+      MigrationPage *rec = enc.record(i);
+      unsigned char *payload = reinterpret_cast<unsigned char *>(rec + 1);
+      unsigned char *page = reinterpret_cast<unsigned char *>(receiver + ((base + i) << 12));
+      if (!PageEncoder::decode(*rec, payload, page)) {
+        Logging::printf("Decoding page %u failed.\n", base + i);
+        abort();
+      }
+    }
+  }
+}
+
+static void run(unsigned workers, unsigned cache_pages, bool lz)
+{
+  PageEncoder::config.workers     = workers;
+  PageEncoder::config.cache_pages = cache_pages;
+  PageEncoder::config.lz          = lz;
+
+  srandom(workers * 7 + cache_pages + lz);
+  memset(sender, 0, sizeof(sender));
+  memset(receiver, 0x55, sizeof(receiver));
+
+  PageEncoder enc(sender, sizeof(sender));
+  for (unsigned r=0; r < ROUNDS; r++) {
+    dirty(r);
+    transfer(enc);
+    assert(!memcmp(sender, receiver, sizeof(sender)));
+  }
+
+  printf("workers %u cache %5u lz %u: ok\n", workers, cache_pages, lz);
+  enc.print_stats();
+}
+
+// Any flipped bit must change both halves of the page hash.
+static void run_hash()
+{
+  unsigned char page[PageCodec::PAGE_SIZE];
+  for (unsigned i=0; i < sizeof(page); i++) page[i] = random();
+
+  PageCodec::Hash orig = PageCodec::hash(page);
+  for (unsigned bit=0; bit < sizeof(page) * 8; bit++) {
+    page[bit / 8] ^= 1 << (bit % 8);
+    PageCodec::Hash h = PageCodec::hash(page);
+    page[bit / 8] ^= 1 << (bit % 8);
+    assert(h.lo != orig.lo && h.hi != orig.hi);
+  }
+  assert(PageCodec::hash(page) == orig);
+  printf("hash: ok\n");
+}
+
+// A run of dirty pages comes back in pieces, without gaps.
+static void run_dirt()
+{
+  DirtManager dirt(PAGES);
+  for (unsigned page=10; page < 17; page++) dirt.mark_dirty(page);
+  dirt.mark_dirty(100);
+
+  Prd range = dirt.next_dirty();
+  assert(range.base() >> 12 == 10 && range.order() == 2);
+  dirt.mark_clean(range);
+  range = dirt.next_dirty();
+  assert(range.base() >> 12 == 14 && range.order() == 1);
+
+  // Take only the first page, the rest comes next.
+  dirt.mark_clean(Prd(14, 0, Prd::VALID));
+  range = dirt.next_dirty();
+  assert(range.base() >> 12 == 15 && range.order() == 1);
+  dirt.mark_clean(range);
+  range = dirt.next_dirty();
+  assert(range.base() >> 12 == 100 && range.order() == 0);
+  dirt.mark_clean(range);
+  assert(!dirt.dirty_pages() && !dirt.next_dirty().value());
+  printf("dirt: ok\n");
+}
+
+/*
+ * Stripe the same rounds over several loopback connections and let
+ * MigrationStreams reassemble them on the other side.
+ */
+struct ReceiverArgs {
+  unsigned streams;
+  bool     ok;
+};
+
+static bool receive_stream(void *, TcpSocket *socket, unsigned)
+{
+  unsigned long bytes = 0, wire = 0;
+  return PageEncoder::receive_ranges(socket, receiver, sizeof(receiver), bytes, wire);
+}
+
+static void *receiver_fn(void *arg)
+{
+  ReceiverArgs &args = *reinterpret_cast<ReceiverArgs *>(arg);
+  MigrationStreams streams;
+  TcpSocket *control = IpHelper::instance().listen(PORT);
+
+  args.ok = control and streams.accept(PORT, args.streams, control) and
+    streams.run(receive_stream, NULL);
+  return NULL;
+}
+
+static void run_streams(unsigned count)
+{
+  PageEncoder::config.workers     = 2;
+  PageEncoder::config.cache_pages = PAGES;
+  PageEncoder::config.lz          = true;
+
+  srandom(count);
+  memset(sender, 0, sizeof(sender));
+  memset(receiver, 0x55, sizeof(receiver));
+
+  ReceiverArgs args = { count, false };
+  pthread_t rx;
+  pthread_create(&rx, NULL, receiver_fn, &args);
+
+  TcpSocket *control;
+  while (!(control = IpHelper::instance().connect(IP_AS_UL(127, 0, 0, 1), PORT)))
+    usleep(10000);
+
+  MigrationStreams streams;
+  if (!streams.connect(IP_AS_UL(127, 0, 0, 1), PORT, count, control)) abort();
+
+  enum { CHUNK = 1 << MigrationStreams::CHUNK_ORDER };
+  static Prd ranges[PAGES / CHUNK];
+  static Prd end_of_crds;
+
+  PageEncoder enc(sender, sizeof(sender));
+  for (unsigned r=0; r < ROUNDS; r++) {
+    dirty(r);
+
+    enc.reset();
+    for (unsigned page=0; page < PAGES; page++) enc.add(page);
+    enc.encode();
+
+    for (unsigned c=0; c < PAGES / CHUNK; c++) {
+      ranges[c] = Prd(c * CHUNK, MigrationStreams::CHUNK_ORDER, 0);
+      unsigned s = streams.stream_of(ranges[c]);
+      streams.send_nonblocking(s, &ranges[c], sizeof(ranges[c]));
+      for (unsigned i=c * CHUNK; i < (c + 1) * CHUNK; i++)
+        streams.send_nonblocking(s, enc.record(i), enc.record_size(i));
+    }
+    if (!streams.wait_complete()) abort();
+  }
+
+  for (unsigned i=0; i < streams.count(); i++)
+    streams.send_nonblocking(i, &end_of_crds, sizeof(end_of_crds));
+  if (!streams.wait_complete()) abort();
+
+  pthread_join(rx, NULL);
+  assert(args.ok);
+  assert(!memcmp(sender, receiver, sizeof(sender)));
+  for (unsigned i=0; i < streams.count(); i++) streams.socket(i)->close();
+
+  printf("streams %u: ok\n", count);
+}
+
+/*
+ * Post-copy over loopback: the receiving side touches pages before
+ * they arrived, which has to fault them in on demand.
+ */
+static void *postcopy_sender_fn(void *)
+{
+  TcpSocket *sock = IpHelper::instance().listen(POSTCOPY_PORT);
+  if (!sock) abort();
+
+  PostcopySender pc(sock, sender, sizeof(sender));
+  pc.start();
+  if (!pc.wait()) abort();
+  sock->close();
+  return NULL;
+}
+
+static void run_postcopy()
+{
+  PageEncoder::config.workers = 2;
+  PageEncoder::config.lz      = true;
+
+  srandom(42);
+  memset(sender, 0, sizeof(sender));
+  for (unsigned r=0; r < ROUNDS; r++) dirty(r);
+
+  // userfaultfd wants anonymous memory
+  char *mem = reinterpret_cast<char *>(mmap(NULL, sizeof(sender), PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (mem == MAP_FAILED) abort();
+  memset(mem, 0x55, sizeof(sender));
+
+  pthread_t tx;
+  pthread_create(&tx, NULL, postcopy_sender_fn, NULL);
+
+  TcpSocket *sock;
+  while (!(sock = IpHelper::instance().connect(IP_AS_UL(127, 0, 0, 1), POSTCOPY_PORT)))
+    usleep(10000);
+
+  PostcopyReceiver pc(sock, mem, sizeof(sender));
+  if (!pc.start()) {
+    printf("postcopy: userfaultfd not available\n");
+    abort();
+  }
+
+  // Play guest while memory is still in flight.
+  for (unsigned i=0; i < PAGES / 8; i++) {
+    unsigned page = random() % PAGES;
+    assert(!memcmp(mem + (page << 12), sender + (page << 12), 4096));
+  }
+
+  assert(pc.wait());
+  pthread_join(tx, NULL);
+  assert(!memcmp(sender, mem, sizeof(sender)));
+  sock->close();
+  munmap(mem, sizeof(sender));
+
+  printf("postcopy: ok, %lu faults\n", pc.faults());
+}
+
+/*
+ * Break some pages on the receiving side, verification has to find
+ * and repair exactly those.
+ */
+static unsigned long verify_repaired;
+
+static void *verify_sender_fn(void *)
+{
+  TcpSocket *sock = IpHelper::instance().listen(VERIFY_PORT);
+  if (!sock || !PageVerifier::send(sock, sender, sizeof(sender), verify_repaired)) abort();
+  sock->close();
+  return NULL;
+}
+
+static void run_verify()
+{
+  PageEncoder::config.workers = 3;
+
+  srandom(7);
+  memset(sender, 0, sizeof(sender));
+  for (unsigned r=0; r < ROUNDS; r++) dirty(r);
+  memcpy(receiver, sender, sizeof(sender));
+
+  // The first page, a single byte, a run crossing an alignment boundary and the last page
+  receiver[0] ^= 1;
+  receiver[(5 << 12) + 123] ^= 1;
+  for (unsigned page=14; page < 19; page++) receiver[(page << 12) + page] ^= 0x80;
+  receiver[sizeof(receiver) - 1] ^= 0xff;
+
+  pthread_t tx;
+  pthread_create(&tx, NULL, verify_sender_fn, NULL);
+
+  TcpSocket *sock;
+  while (!(sock = IpHelper::instance().connect(IP_AS_UL(127, 0, 0, 1), VERIFY_PORT)))
+    usleep(10000);
+
+  unsigned long repaired = 0;
+  assert(PageVerifier::receive(sock, receiver, sizeof(receiver), repaired));
+  pthread_join(tx, NULL);
+  sock->close();
+
+  assert(repaired == 8 && verify_repaired == 8);
+  assert(!memcmp(sender, receiver, sizeof(sender)));
+  printf("verify: ok, %lu pages repaired\n", repaired);
+}
+
+/*
+ * Pre-copy against a guest that dirties memory much faster than
+ * loopback drains it. Only throttling gets the rest below the
+ * downtime, the hot pages wait for the final round.
+ */
+static ConvergenceControl converge;
+static volatile bool guest_frozen;
+static unsigned guest_dirty[PAGES / 32];
+
+static timevalue now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void *guest_fn(void *)
+{
+  timevalue slice = 0;
+  unsigned seed = 1;
+  for (unsigned n=0; !guest_frozen; n++) {
+    // Every other write hits a small hot set, the rest all of memory.
+    seed = seed * 1103515245 + 12345;
+    unsigned page = n & 1 ? n / 2 % HOT_PAGES : (seed >> 8) % PAGES;
+    sender[(page << 12) + (seed >> 4) % 4096] = n;
+    __sync_fetch_and_or(&guest_dirty[page / 32], 1u << page % 32);
+
+    if (n % 64 == 0) {
+      unsigned long sleep = converge.throttle_sleep(now_us(), slice);
+      if (sleep) usleep(sleep);
+    }
+  }
+  return NULL;
+}
+
+static unsigned collect(DirtManager &dirt)
+{
+  unsigned fresh = 0;
+  for (unsigned i=0; i < PAGES / 32; i++)
+    for (unsigned bits = Cpu::xchg(&guest_dirty[i], 0u); bits; bits &= bits - 1)
+      fresh += dirt.mark_dirty(i * 32 + Cpu::bsf(bits));
+  return fresh;
+}
+
+// One batch of dirty pages, the way Migration::enqueue_dirty_pages does it.
+static unsigned send_dirty(TcpSocket *sock, PageEncoder &enc, DirtManager &dirt, unsigned hot_rounds)
+{
+  static Prd ranges[PageEncoder::BATCH_PAGES];
+  unsigned count = 0, pages = 0;
+
+  enc.reset();
+  while (dirt.dirty_pages()) {
+    Prd range = dirt.next_dirty(hot_rounds);
+    if (!range.value()) break;
+    unsigned order = range.order();
+    while (order && (1u << order) > enc.room()) --order;
+    if ((1u << order) > enc.room()) break;
+
+    ranges[count] = Prd(range.base() >> 12, order, Prd::VALID);
+    dirt.mark_clean(ranges[count]);
+    for (unsigned i=0; i < (1u << order); i++) enc.add((range.base() >> 12) + i);
+    count++;
+  }
+  enc.encode();
+
+  for (unsigned c=0, idx=0; c < count; c++) {
+    sock->send_nonblocking(&ranges[c], sizeof(ranges[c]));
+    for (unsigned i=0; i < (1u << ranges[c].order()); i++, idx++)
+      sock->send_nonblocking(enc.record(idx), enc.record_size(idx));
+    pages += 1 << ranges[c].order();
+  }
+  if (!sock->wait_complete()) abort();
+  return pages;
+}
+
+static void *converge_receiver_fn(void *arg)
+{
+  bool &ok = *reinterpret_cast<bool *>(arg);
+  unsigned long bytes = 0, wire = 0;
+  TcpSocket *sock = IpHelper::instance().listen(CONVERGE_PORT);
+  ok = sock && PageEncoder::receive_ranges(sock, receiver, sizeof(receiver), bytes, wire);
+  return NULL;
+}
+
+static void run_converge()
+{
+  // A guest that dirties everything we send gets throttled more and more.
+  ConvergenceControl model;
+  ConvergenceControl::config.downtime = 100;
+  for (unsigned r=0; r < 2 * 9; r++)
+    assert(!model.round_done(10000, 10000, 20000, 100));
+  assert(model.throttle() == 99 && model.bandwidth() == 409600);
+  assert(!model.round_done(10000, 10000, 20000, 100) && model.round_done(10000, 10000, 20000, 100));
+  assert(model.gave_up());
+
+  // It runs a slice, then sleeps 99 times as long.
+  timevalue slice = 0;
+  assert(!model.throttle_sleep(1000, slice) && slice == 1000);
+  assert(!model.throttle_sleep(1000 + ConvergenceControl::SLICE_US - 1, slice));
+  assert(model.throttle_sleep(1000 + ConvergenceControl::SLICE_US, slice) == 99 * ConvergenceControl::SLICE_US);
+  model.unthrottle();
+  assert(!model.throttle_sleep(1000000000, slice) && !slice);
+
+  // Once the rest fits into the downtime, we are done.
+  ConvergenceControl fits;
+  assert(!fits.round_done(10000, 100, 10100, 100) && fits.round_done(10000, 100, 10000, 100));
+  assert(!fits.throttle() && !fits.gave_up());
+
+  PageEncoder::config.workers     = 0;
+  PageEncoder::config.cache_pages = PAGES;
+  PageEncoder::config.lz          = false;
+  ConvergenceControl::config.downtime = 2;
+
+  memset(sender, 0, sizeof(sender));
+  memset(receiver, 0x55, sizeof(receiver));
+  memset(guest_dirty, 0xff, sizeof(guest_dirty));
+
+  bool ok = false;
+  pthread_t rx, guest;
+  pthread_create(&rx, NULL, converge_receiver_fn, &ok);
+  TcpSocket *sock;
+  while (!(sock = IpHelper::instance().connect(IP_AS_UL(127, 0, 0, 1), CONVERGE_PORT)))
+    usleep(10000);
+
+  DirtManager dirt(PAGES);
+  PageEncoder enc(sender, sizeof(sender));
+  unsigned max_throttle = 0;
+
+  guest_frozen = false;
+  pthread_create(&guest, NULL, guest_fn, NULL);
+  collect(dirt);
+  for (bool converged = false; !converged;) {
+    unsigned hot_rounds = ConvergenceControl::HOT_ROUNDS;
+    if (!converge.round() || dirt.hot_pages(hot_rounds) > converge.budget()) hot_rounds = ~0u;
+
+    timevalue start = now_us();
+    unsigned sent = 0, pages;
+    while ((pages = send_dirty(sock, enc, dirt, hot_rounds))) sent += pages;
+    unsigned dirtied = collect(dirt);
+    converged = converge.round_done(sent, dirtied, dirt.dirty_pages(), (now_us() - start) / 1000);
+    max_throttle = VMM_MAX(max_throttle, converge.throttle());
+  }
+
+  // Freeze the guest, everything left has to fit into the downtime.
+  guest_frozen = true;
+  pthread_join(guest, NULL);
+  converge.unthrottle();
+  collect(dirt);
+  unsigned last = dirt.dirty_pages(), budget = converge.budget();
+  while (send_dirty(sock, enc, dirt, ~0u));
+
+  static Prd end_of_crds;
+  sock->send(&end_of_crds, sizeof(end_of_crds));
+  pthread_join(rx, NULL);
+  sock->close();
+
+  assert(ok);
+  assert(!memcmp(sender, receiver, sizeof(sender)));
+  assert(!converge.gave_up());
+  printf("converge: ok, %u rounds, throttled up to %u%%, %u pages left for %u\n",
+         converge.round(), max_throttle, last, budget);
+  assert(last <= budget + HOT_PAGES);
+}
+
+int runMigrationTest()
+{
+  run_hash();
+  run_dirt();
+  run(0, 0,     false);
+  run(0, 0,     true);
+  run(0, PAGES, false);
+  run(3, PAGES, true);
+  // A cache smaller than memory makes pages evict each other.
+  run(3, 100,   true);
+
+  run_streams(1);
+  run_streams(4);
+  run_postcopy();
+  run_verify();
+  run_converge();
+  return 0;
+}
@@ -0,0 +1,265 @@
+/**
+ * PIT Unit Test
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "pit.h"
+
+static timevalue now = 1000000;
+static const timevalue FREQ = 1193180;
+
+/**
+ * A clock that only moves when the test says so. It runs at the PIT
+ * frequency, so timeouts are in PIT clocks.
+ */
+class TestClock : public Clock
+{
+public:
+  timevalue time() override { return now; }
+  TestClock() : Clock(FREQ) {}
+};
+
+/**
+ * PITs in front of a PIC, one for each catchup value we test. The
+ * test plays host timer and CPU: it fires the timeout a PIT may have
+ * armed and acknowledges interrupts with INTA and EOI when it wants.
+ */
+class PitTest : public StaticReceiver<PitTest>
+{
+public:
+  enum { PIC = 0x20, VECTOR = 0x20, PITS = 3 };
+
+private:
+  TestClock   _clock;
+  Motherboard _mb;
+  unsigned    _timers;
+  timevalue   _timeout[PITS];   ///< the armed timeout or zero
+  unsigned    _requests[PITS];  ///< timeouts the PIT asked for
+  bool        _intr;
+
+  void outb(unsigned short port, unsigned char value) {
+    MessageIOOut msg(MessageIOOut::TYPE_OUTB, port, value);
+    assert(_mb.bus_ioout.send(msg));
+  }
+
+  static unsigned short port(unsigned pit) { return 0x40 + pit * 8; }
+
+public:
+  static const unsigned catchup[PITS];
+
+  unsigned char inb(unsigned short port) {
+    MessageIOIn msg(MessageIOIn::TYPE_INB, port);
+    assert(_mb.bus_ioin.send(msg));
+    return msg.value;
+  }
+
+  bool receive(MessageTimer &msg) {
+    if (msg.type == MessageTimer::TIMER_NEW)
+      msg.nr = _timers++;
+    else {
+      assert(msg.nr < PITS);
+      _timeout[msg.nr] = msg.abstime;
+      _requests[msg.nr]++;
+    }
+    return true;
+  }
+
+  bool receive(MessageLegacy &msg) {
+    if (msg.type == MessageLegacy::INTR)       _intr = true;
+    if (msg.type == MessageLegacy::DEASS_INTR) _intr = false;
+    return false;
+  }
+
+  timevalue timeout(unsigned pit) { return _timeout[pit]; }
+  unsigned requests(unsigned pit) { unsigned res = _requests[pit]; _requests[pit] = 0; return res; }
+
+  /// Counter 0 in mode 2, the periodic rate generator.
+  void program(unsigned pit, unsigned short count) {
+    outb(port(pit) + 3, 0x34);
+    reload(pit, count);
+  }
+
+  /// A new count without a new mode takes effect at the next wrap.
+  void reload(unsigned pit, unsigned short count) {
+    outb(port(pit), count & 0xff);
+    outb(port(pit), count >> 8);
+  }
+
+  void read(unsigned pit) { inb(port(pit)); inb(port(pit)); }
+
+  void mask(unsigned pit, bool masked) { outb(PIC + 1, masked ? 0xff : ~(1 << pit)); }
+
+  /// Let the host timer fire.
+  void fire(unsigned pit) {
+    assert(_timeout[pit]);
+    if (now < _timeout[pit]) now = _timeout[pit];
+    _timeout[pit] = 0;
+    MessageTimeout msg(pit, now);
+    assert(_mb.bus_timeout.send(msg));
+  }
+
+  /// INTA and EOI, if the PIC asks for it.
+  bool ack(unsigned pit) {
+    if (!_intr) return false;
+    _intr = false;
+    MessageLegacy inta(MessageLegacy::INTA, 0);
+    _mb.bus_legacy.send(inta);
+    assert(inta.value == VECTOR + pit);
+    outb(PIC, 0x20);
+    return true;
+  }
+
+  /// Deliver the next tick right when it is due.
+  void tick(unsigned pit) {
+    fire(pit);
+    assert(ack(pit));
+  }
+
+  PitTest() : _clock(), _mb(&_clock, NULL), _timers(0), _timeout(), _requests(), _intr(false) {
+    _mb.bus_timer.add(this,  receive_static<MessageTimer>);
+    _mb.bus_legacy.add(this, receive_static<MessageLegacy>);
+    _mb.handle_arg("pic:0x20,,0x4d0");
+    for (unsigned i=0; i < PITS; i++) {
+      char arg[32];
+      snprintf(arg, sizeof(arg), "pit:%#x,%u,%u", port(i), i, catchup[i]);
+      _mb.handle_arg(arg);
+    }
+    assert(_timers == PITS);
+
+    // a single PIC without slaves, vectors from 0x20, all masked
+    outb(PIC, 0x13);
+    outb(PIC + 1, VECTOR);
+    outb(PIC + 1, 0x01);
+    outb(PIC + 1, 0xff);
+  }
+};
+
+const unsigned PitTest::catchup[PITS] = { 0, 3, 20 };
+
+/**
+ * Ticks come at the start of the counter plus multiples of the
+ * count, no matter when the guest acknowledged the previous one.
+ */
+static void testPhase(PitTest &t) {
+  const unsigned N = 1000;
+  t.mask(0, false);
+
+  timevalue start = now + N + 1;
+  t.program(0, N);
+  assert(t.requests(0) == 1 && t.timeout(0) == start);
+  t.tick(0);
+  assert(t.requests(0) == 1 && t.timeout(0) == start + N);
+
+  // a late acknowledge does not move the phase
+  t.fire(0);
+  now += N / 2;
+  assert(t.ack(0));
+  assert(t.requests(0) == 1 && t.timeout(0) == start + 2 * N);
+
+  // reprogramming in the middle of a period restarts the phase
+  t.tick(0);
+  assert(t.requests(0) == 1);
+  now += 300;
+  const unsigned N2 = 500;
+  start = now + N2 + 1;
+  t.program(0, N2);
+  assert(t.requests(0) == 1 && t.timeout(0) == start);
+  for (unsigned i=1; i < 10; i++) {
+    t.tick(0);
+    assert(t.requests(0) == 1 && t.timeout(0) == start + i * N2);
+  }
+
+  // a new count alone is loaded when the current period ends
+  now += 100;
+  const unsigned N3 = 2000;
+  t.reload(0, N3);
+  assert(t.requests(0) == 0 && t.timeout(0) == start + 9 * N2);
+  t.tick(0);
+  assert(t.requests(0) == 1 && t.timeout(0) == start + 9 * N2 + N3);
+  t.tick(0);
+  assert(t.requests(0) == 1 && t.timeout(0) == start + 9 * N2 + 2 * N3);
+  printf("PIT ticks keep their phase.\n");
+}
+
+/**
+ * A masked PIT costs no host timers, whatever the guest does with
+ * the counter meanwhile.
+ */
+static void testMasked(PitTest &t) {
+  const unsigned N = 1000;
+  t.mask(0, false);
+
+  timevalue start = now + N + 1;
+  t.program(0, N);
+  assert(t.requests(0) == 1);
+  t.tick(0);
+  assert(t.requests(0) == 1);
+
+  t.mask(0, true);
+  t.fire(0);
+  assert(!t.ack(0));
+  for (unsigned i=0; i < 100; i++) {
+    now += N;
+    t.read(0);
+    assert(!t.ack(0));
+  }
+  assert(t.requests(0) == 0 && !t.timeout(0));
+
+  // unmasking delivers the pending tick, then the next one is armed
+  now += N / 2;
+  t.mask(0, false);
+  assert(t.ack(0));
+  assert(t.requests(0) == 1 && t.timeout(0) == start + 102 * N);
+  printf("A masked PIT arms no timers.\n");
+}
+
+/**
+ * Ticks the guest did not acknowledge in time are delivered late,
+ * back-to-back, but no more than catchup of them.
+ */
+static void testCatchup(PitTest &t, unsigned pit, unsigned expected) {
+  const unsigned N = 1000;
+  t.mask(pit, false);
+
+  timevalue start = now + N + 1;
+  t.program(pit, N);
+  t.tick(pit);
+  assert(t.requests(pit) == 2);
+
+  // the guest sits on one tick for 8.5 periods
+  t.fire(pit);
+  now += 8 * N + N / 2;
+  assert(t.ack(pit));
+
+  unsigned late = 0;
+  while (t.timeout(pit) <= now) {
+    assert(t.requests(pit) == 1);
+    t.tick(pit);
+    late++;
+  }
+  assert(late == expected);
+  assert(t.requests(pit) == 1 && t.timeout(pit) == start + 10 * N);
+  printf("PIT with catchup %u delivers %u late ticks.\n", PitTest::catchup[pit], late);
+}
+
+int runPitTest() {
+  PitTest *t = new PitTest;
+  testPhase(*t);
+  testMasked(*t);
+  testCatchup(*t, 0, 0);
+  testCatchup(*t, 1, 3);
+  testCatchup(*t, 2, 8);
+  return 0;
+}
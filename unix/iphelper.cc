@@ -0,0 +1,172 @@
+/**
+ * TCP sockets for the IpHelper interface
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <nul/iphelper.h>
+#include <service/logging.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+void TcpSocket::close()
+{
+  if (_fd < 0) return;
+
+  wait_complete();
+  ::close(_fd);
+  _fd        = -1;
+  _connected = false;
+  _closed    = true;
+}
+
+bool TcpSocket::receive(void *data, unsigned bytes)
+{
+  char *p = reinterpret_cast<char *>(data);
+  while (bytes) {
+    ssize_t res = recv(_fd, p, bytes, MSG_WAITALL);
+    if (res < 0 and errno == EINTR) continue;
+    if (res <= 0) return false;
+    p     += res;
+    bytes -= res;
+  }
+  return true;
+}
+
+bool TcpSocket::send(void *data, unsigned bytes)
+{
+  return send_nonblocking(data, bytes) and wait_complete();
+}
+
+bool TcpSocket::send_nonblocking(void *data, unsigned bytes)
+{
+  if (_fd < 0) return false;
+  if (!bytes)  return true;
+
+  struct iovec v = { data, bytes };
+  _pending.push_back(v);
+  return true;
+}
+
+bool TcpSocket::wait_complete()
+{
+  size_t i = 0;
+  while (i < _pending.size()) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = &_pending[i];
+    msg.msg_iovlen = VMM_MIN(_pending.size() - i, static_cast<size_t>(IOV_MAX));
+
+    ssize_t res = sendmsg(_fd, &msg, MSG_NOSIGNAL);
+    if (res < 0 and errno == EINTR) continue;
+    if (res < 0) {
+      perror("send");
+      _pending.clear();
+      return false;
+    }
+
+    // Skip what went out, the kernel may have taken a partial range.
+    for (size_t done = res; done; ) {
+      struct iovec &v = _pending[i];
+      if (done >= v.iov_len) {
+        done -= v.iov_len;
+        i++;
+      } else {
+        v.iov_base = reinterpret_cast<char *>(v.iov_base) + done;
+        v.iov_len -= done;
+        done = 0;
+      }
+    }
+  }
+
+  _pending.clear();
+  return true;
+}
+
+TcpSocket * IpHelper::connect(unsigned addr, unsigned port)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return NULL;
+  }
+
+  // IP_AS_UL already yields network byte order.
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family      = AF_INET;
+  sa.sin_port        = htons(port);
+  sa.sin_addr.s_addr = addr;
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (0 != ::connect(fd, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa))) {
+    perror("connect");
+    ::close(fd);
+    return NULL;
+  }
+
+  TcpSocket *sock = new TcpSocket(fd, 0, port);
+  sock->_outgoing = true;
+  return sock;
+}
+
+TcpSocket * IpHelper::listen(unsigned port)
+{
+  int lfd = -1;
+  for (Listener &l : _listeners)
+    if (l.port == port) lfd = l.fd;
+
+  if (lfd < 0) {
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family      = AF_INET;
+    sa.sin_port        = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    int one = 1;
+    if (0 > (lfd = socket(AF_INET, SOCK_STREAM, 0)) or
+        0 != setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) or
+        0 != bind(lfd, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) or
+        0 != ::listen(lfd, 16)) {
+      perror("listen");
+      if (lfd >= 0) ::close(lfd);
+      return NULL;
+    }
+
+    Listener l = { port, lfd };
+    _listeners.push_back(l);
+  }
+
+  int fd;
+  do fd = accept(lfd, NULL, NULL); while (fd < 0 and errno == EINTR);
+  if (fd < 0) {
+    perror("accept");
+    return NULL;
+  }
+
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return new TcpSocket(fd, port, 0);
+}
+
+// EOF
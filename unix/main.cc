@@ -34,6 +34,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/time.h>
@@ -46,7 +47,8 @@
 #include <errno.h>
 
 #include <pthread.h>
-#include <semaphore.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <vector>
 
@@ -59,6 +61,8 @@
 #include "iothread.h"
 #endif
 
+#include "snapshot.h"
+
 const char version_str[] =
 #include "version.inc"
   ;
@@ -67,8 +71,19 @@ const char version_str[] =
 
 static char  *ram;
 static size_t ram_size = 128 << 20; // 128 MB
+static size_t ram_total;            // Size of the mapping, before OP_ALLOC_FROM_GUEST
+static bool   ram_merge;            // Let the kernel merge identical guest pages
+static const char *module_cache = "/dev/shm"; // Shared read-only module copies
 static int    tap_fd;               // TAP device. If 0, network packets go to /dev/null.
 
+// Halt polling. A halted vCPU spins this long before it sleeps. The
+// window adapts per vCPU between 0 and the maximum (in microseconds).
+enum {
+  HALT_POLL_START = 10,
+  HALT_POLL_MAX   = 200,
+};
+static unsigned halt_poll_max = HALT_POLL_MAX;  // 0 on a single host CPU
+
 static const char *pc_ps2[] = {
   // Unix backend
   "ncurses",
@@ -119,10 +134,81 @@ IOThread                    *iothread_obj;
 // Multiboot module data
 
 struct Module {
+  int         fd;       // Shared read-only copy, or -1
   char       *memory;
   size_t      size;
   const char *cmdline;
 
+  // Content hash that names the shared copy. A match is verified
+  // byte by byte, so this only needs to spread well.
+  static unsigned long long hash(const char *data, size_t size)
+  {
+    unsigned long long h = 0xcbf29ce484222325ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+      unsigned long long v;
+      memcpy(&v, data + i, sizeof(v));
+      h = (h ^ v) * 0x100000001b3ULL;
+      h ^= h >> 29;
+    }
+    for (; i < size; i++)
+      h = (h ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ULL;
+    return h;
+  }
+
+  /**
+   * Find the copy of data in the module cache, or publish one. All VMs
+   * that boot the same module map this file and thus share its page
+   * cache. The file is made read-only before it appears under its
+   * name and is never written again. A file that someone else owns,
+   * that is writable or whose content differs is not used. Returns
+   * the open file or -1.
+   */
+  static int share(const char *data, size_t size)
+  {
+    char name[PATH_MAX], tmp[PATH_MAX + 8];
+    snprintf(name, sizeof(name), "%s/seoul-module-%zx-%016llx", module_cache, size, hash(data, size));
+
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 and errno == ENOENT) {
+      snprintf(tmp, sizeof(tmp), "%s.XXXXXX", name);
+      int out = mkstemp(tmp);
+      if (out < 0) return -1;
+
+      size_t done = 0;
+      ssize_t res = 1;
+      while (done < size and (res = write(out, data + done, size - done)) > 0)
+        done += res;
+
+      // Whoever links first wins, a concurrent VM uses that copy.
+      bool ok = done == size and !fchmod(out, 0444) and
+        (!link(tmp, name) or errno == EEXIST);
+      unlink(tmp);
+      close(out);
+      if (!ok) return -1;
+      fd = open(name, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) return -1;
+
+    struct stat info;
+    void *copy = MAP_FAILED;
+    if (fstat(fd, &info) or info.st_uid != getuid() or info.st_mode & 0222 or
+        static_cast<size_t>(info.st_size) != size or
+        MAP_FAILED == (copy = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) or
+        memcmp(copy, data, size)) {
+      fprintf(stderr, "module cache: not using %s\n", name);
+      if (copy != MAP_FAILED) munmap(copy, size);
+      close(fd);
+      return -1;
+    }
+    munmap(copy, size);
+    return fd;
+  }
+
+  /**
+   * Read the module and look for a shared copy of it. Without one,
+   * the module is copied into guest memory like any other data.
+   */
   static Module from_file(const char *filename, const char *cmdline)
   {
     Module m;
@@ -137,20 +223,66 @@ struct Module {
 
     m.cmdline = cmdline;
     m.size    = info.st_size;
-
-    m.memory  = reinterpret_cast<char *>(mmap(NULL, m.size, PROT_READ, MAP_PRIVATE,
-                                              fd, 0));
+    m.memory  = reinterpret_cast<char *>(mmap(NULL, m.size, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANON, -1, 0));
     if (m.memory == MAP_FAILED) {
       perror("mmap");
       exit(EXIT_FAILURE);
     }
 
+    size_t done = 0;
+    while (done < m.size) {
+      ssize_t res = pread(fd, m.memory + done, m.size - done, done);
+      if (res <= 0) {
+        fprintf(stderr, "read %s: %s\n", filename, res ? strerror(errno) : "unexpected end of file");
+        exit(EXIT_FAILURE);
+      }
+      done += res;
+    }
+    close(fd);
+
+    // The loader reads through the shared copy as well.
+    m.fd = share(m.memory, m.size);
+    if (m.fd >= 0) {
+      munmap(m.memory, m.size);
+      m.memory = reinterpret_cast<char *>(mmap(NULL, m.size, PROT_READ, MAP_PRIVATE,
+                                                m.fd, 0));
+      if (m.memory == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+      }
+    }
+
     return m;
   }
+
+  /**
+   * Back guest memory at dst with the shared copy instead of copying.
+   * MAP_PRIVATE shares its pages with every other VM until a guest
+   * write faults in a private page.
+   */
+  bool map_to(char *dst) const
+  {
+    size_t len = (size + 0xFFFUL) & ~0xFFFUL;
+    if (fd < 0 or reinterpret_cast<uintptr_t>(dst) & 0xFFFUL or
+        dst < ram or dst + len > ram + ram_total)
+      return false;
+
+    return mmap(dst, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fd, 0) != MAP_FAILED;
+  }
 };
 
 static std::vector<Module> modules;
 
+// New mappings start out unmergeable, so this is repeated whenever
+// part of guest memory is replaced.
+static void merge_ram(char *start, size_t len)
+{
+  if (ram_merge and madvise(start, len, MADV_MERGEABLE))
+    perror("madvise");
+}
+
 // Disk data
 
 struct Disk {
@@ -188,6 +320,11 @@ Migration::RestoreModes _restore_mode = Migration::MODE_OFF;
 unsigned _migration_ip;
 unsigned _migration_port;
 
+// Snapshot support
+
+static const char *snapshot_file;    // Saved to on SIGUSR1
+static Snapshot   *snapshot_restore; // Template we started from
+
 // the memory remapping procedure should only
 // remap memory in page size granularity, if set
 bool _track_page_usage = false;
@@ -245,56 +382,164 @@ static void handle_vcpu(bool skip, CpuMessage::Type type, VCpu *vcpu, CpuState *
 }
 
 
+struct  Vcpu_info {
+  pthread_t tid;
+  VCpu     *vcpu;
+  CpuState *state;
+
+  // Halt polling
+  volatile unsigned *event;     ///< the event word we wait on
+  volatile unsigned  sleeping;  ///< set while in FUTEX_WAIT
+  timevalue          poll;      ///< current poll window in TSC ticks
+  unsigned long      halts, poll_hits, wakeups;
+};
+
+static std::vector<Vcpu_info> vcpu_info;
+
+static timevalue halt_poll_ticks(unsigned us)
+{
+  return mb_clock->freq() * us / 1000000;
+}
+
+/**
+ * Wait until the event word shows VCpu::STATE_WAKEUP. Short halts,
+ * like waiting for an IPI, are served by polling. Longer ones sleep
+ * on a futex on the event word.
+ *
+ * The poll window grows while the vCPU is woken up shortly after it
+ * went to sleep and shrinks when it sleeps longer than polling could
+ * ever cover.
+ */
+static void vcpu_halt(Vcpu_info &v)
+{
+  volatile unsigned *event = v.event;
+  timevalue start = Cpu::rdtsc();
+  v.halts++;
+
+  while (Cpu::rdtsc() - start < v.poll)
+    if (*event & VCpu::STATE_WAKEUP) {
+      v.poll_hits++;
+      return;
+    }
+    else Cpu::pause();
+
+  // Pairs with the check in OP_VCPU_RELEASE.
+  Cpu::xchg(&v.sleeping, 1U);
+  for (unsigned value; !((value = *event) & VCpu::STATE_WAKEUP); )
+    syscall(SYS_futex, event, FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+  v.sleeping = 0;
+
+  timevalue blocked = Cpu::rdtsc() - start;
+  timevalue max     = halt_poll_ticks(halt_poll_max);
+  if (blocked > max)
+    v.poll /= 2;
+  else if (v.poll < max)
+    v.poll = VMM_MIN(VMM_MAX(v.poll * 2, halt_poll_ticks(HALT_POLL_START)), max);
+}
+
+/**
+ * A migration stops all vCPUs before it takes their state. Stopped
+ * vCPUs wait here with irq_mtx released. vCPUs sleeping in
+ * OP_VCPU_BLOCK count as stopped, too, because they touch neither
+ * their CpuState nor any device until they get irq_mtx back.
+ */
+static bool           vcpus_frozen;
+static unsigned       vcpus_parked;
+static pthread_cond_t vcpus_park_cond = PTHREAD_COND_INITIALIZER;
+
+static void park_vcpu()
+{
+  if (!vcpus_frozen) return;
+
+  vcpus_parked++;
+  pthread_cond_broadcast(&vcpus_park_cond);
+  while (vcpus_frozen)
+    pthread_cond_wait(&vcpus_park_cond, &irq_mtx);
+  vcpus_parked--;
+}
+
+static void *migration_done_fn(void *arg)
+{
+  // Waits for post-copy pages, if any.
+  delete static_cast<Migration *>(arg);
+  return NULL;
+}
+
 static void *vcpu_thread_fn(void *arg)
 {
   VCpu * vcpu = static_cast<VCpu *>(arg);
   CpuState cpu_state;
   memset(&cpu_state, 0, sizeof(cpu_state));
+  timevalue throttle_slice = 0;
 
   pthread_mutex_lock(&irq_mtx);
-  handle_vcpu(false, CpuMessage::TYPE_HLT, vcpu, &cpu_state);
+  unsigned nr = 0;
+  while (vcpu_info[nr].vcpu != vcpu) nr++;
+  vcpu_info[nr].state = &cpu_state;
+
+  if (snapshot_restore) {
+    if (!snapshot_restore->restore_vcpu(nr, &cpu_state))
+      Logging::panic("Snapshot has no state for vCPU %u.\n", nr);
+    // A halted vCPU goes back to sleep until it gets an interrupt.
+    if (cpu_state.actv_state & 0x3)
+      handle_vcpu(false, CpuMessage::TYPE_CHECK_IRQ, vcpu, &cpu_state);
+  } else
+    handle_vcpu(false, CpuMessage::TYPE_HLT, vcpu, &cpu_state);
   pthread_mutex_unlock(&irq_mtx);
 
   while (true) {
     pthread_mutex_lock(&irq_mtx);
 
-    if (_restore_mode == Migration::MODE_RECEIVE)
+    if (_restore_mode == Migration::MODE_RECEIVE) {
         // This will block until everything is restored
         _migrator->listen(_migration_port, &cpu_state);
-    else if (_restore_mode == Migration::MODE_SEND)
-        // This will block if the last memory resend round is reached
-        _migrator->save_guestregs(&cpu_state);
 
-    handle_vcpu(false, CpuMessage::TYPE_SINGLE_STEP, vcpu, &cpu_state);
-    // Logging::printf("eip %x\n", cpu_state.eip);
-
-    if (_restore_mode == Migration::MODE_RECEIVE) {
         _restore_mode = Migration::MODE_OFF;
-        delete _migrator;
+        // Post-copy memory may still arrive, so tear down elsewhere.
+        pthread_t t;
+        if (0 != pthread_create(&t, NULL, migration_done_fn, _migrator))
+          Logging::panic("Could not create migration teardown thread.\n");
+        pthread_detach(t);
         _migrator = NULL;
         cpu_state.mtd = MTD_ALL;
+
+        // Like a restored snapshot, a halted guest waits for an interrupt.
+        if (cpu_state.actv_state & 0x3)
+          handle_vcpu(false, CpuMessage::TYPE_CHECK_IRQ, vcpu, &cpu_state);
     }
+
+    // The migration takes our state while we are stopped here.
+    park_vcpu();
+
+    handle_vcpu(false, CpuMessage::TYPE_SINGLE_STEP, vcpu, &cpu_state);
+    // Logging::printf("eip %x\n", cpu_state.eip);
+
+    // A guest outrunning the migration sleeps a bit, outside of the lock.
+    unsigned long sleep = 0;
+    if (_restore_mode == Migration::MODE_SEND && _migrator)
+        sleep = _migrator->throttle_vcpu(throttle_slice);
     pthread_mutex_unlock(&irq_mtx);
+    if (sleep) usleep(sleep);
   }
 
   // NOTREACHED
   return NULL;
 }
 
-struct  Vcpu_info {
-  pthread_t tid;
-  sem_t     block;
-};
-
-static std::vector<Vcpu_info> vcpu_info;
-
 static void *migration_thread_fn(void *)
 {
-    _migrator = new Migration(mb);
-    _migrator->send(_migration_ip, _migration_port);
+    // vCPUs only look at _migrator with irq_mtx held.
+    Migration *migrator = new Migration(mb);
+    pthread_mutex_lock(&irq_mtx);
+    _migrator = migrator;
+    pthread_mutex_unlock(&irq_mtx);
+
+    migrator->send(_migration_ip, _migration_port);
 
-    delete _migrator;
+    pthread_mutex_lock(&irq_mtx);
     _migrator = nullptr;
+    pthread_mutex_unlock(&irq_mtx);
+    delete migrator;
 
     return nullptr;
 }
@@ -313,6 +558,59 @@ static void start_migration_to(unsigned ip, unsigned port)
     pthread_setname_np(migthread, "migration");
 }
 
+static void print_halt_stats()
+{
+  for (unsigned i = 0; i < vcpu_info.size(); i++) {
+    Vcpu_info &v = vcpu_info[i];
+    Logging::printf("vCPU%u: %lu halts, %lu%% polled, %lu futex wakeups, poll window %llu us\n",
+                    i, v.halts, v.halts ? v.poll_hits * 100 / v.halts : 0, v.wakeups,
+                    v.poll * 1000000 / mb_clock->freq());
+  }
+}
+
+/**
+ * Save a snapshot whenever we get SIGUSR1 and print halt polling
+ * statistics on SIGUSR2. Holding irq_mtx keeps every vCPU either
+ * between two steps or blocked in OP_VCPU_BLOCK, so their CpuState
+ * is consistent while we write it out.
+ */
+static void *signal_thread_fn(void *)
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+
+  while (true) {
+    int sig;
+    if (0 != sigwait(&set, &sig)) continue;
+
+    if (sig == SIGUSR2) {
+      print_halt_stats();
+      continue;
+    }
+
+    pthread_mutex_lock(&irq_mtx);
+    if (!snapshot_file)
+      Logging::printf("Snapshot: no snapshot file given.\n");
+    else if (_restore_mode != Migration::MODE_OFF)
+      Logging::printf("Snapshot: migration in progress, ignoring request.\n");
+    else {
+      std::vector<CpuState *> cpus;
+      for (Vcpu_info &i : vcpu_info)
+        if (i.state) cpus.push_back(i.state);
+
+      if (cpus.size() != vcpu_info.size())
+        Logging::printf("Snapshot: vCPUs not started yet, ignoring request.\n");
+      else
+        Snapshot::save(snapshot_file, mb, ram, ram_total, cpus.data(), cpus.size());
+    }
+    pthread_mutex_unlock(&irq_mtx);
+  }
+
+  return nullptr;
+}
+
 #ifdef USE_IOTHREAD
 void * iothread_worker(void *) {
   iothread_obj->worker();
@@ -341,14 +639,29 @@ static bool receive(Device *, MessageHostOp &msg)
         Logging::printf("host: Allocating from guest %08zx+%lx\n", ram_size, msg.value);
       } else res = false;
       break;
+    case MessageHostOp::OP_DISCARD_GUEST_MEM:
+      // The guest does not need these pages anymore. MADV_DONTNEED
+      // would let module or snapshot backed ranges fall back to the
+      // file, so put fresh anonymous memory there. The kernel takes
+      // the old pages back and the next access faults in a zero page.
+      if ((msg.value | msg.len) & 0xFFF or msg.value > ram_total or
+          msg.len > ram_total - msg.value)
+        res = false;
+      else if (mmap(ram + msg.value, msg.len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        perror("mmap");
+        res = false;
+      } else
+        merge_ram(ram + msg.value, msg.len);
+      break;
     case MessageHostOp::OP_VCPU_CREATE_BACKEND: {
       msg.value = vcpu_info.size();
 
       vcpu_info.push_back(Vcpu_info());
+      vcpu_info[msg.value].vcpu = msg.vcpu;
 
-      if ((0 != sem_init(&vcpu_info[msg.value].block, 0, 0)) or
-          (0 != pthread_create(&vcpu_info[msg.value].tid, NULL, vcpu_thread_fn, msg.vcpu))) {
-        perror("sem_init/pthread_create");
+      if (0 != pthread_create(&vcpu_info[msg.value].tid, NULL, vcpu_thread_fn, msg.vcpu)) {
+        perror("pthread_create");
         res = false;
         break;
       }
@@ -357,20 +670,48 @@ static bool receive(Device *, MessageHostOp &msg)
       break;
     }
     case MessageHostOp::OP_VCPU_BLOCK:
+      vcpu_info[msg.value].event = msg.event;
+      vcpus_parked++;
+      if (vcpus_frozen) pthread_cond_broadcast(&vcpus_park_cond);
       pthread_mutex_unlock(&irq_mtx);
-      sem_wait(&vcpu_info[msg.value].block);
+      vcpu_halt(vcpu_info[msg.value]);
+      pthread_mutex_lock(&irq_mtx);
+      vcpus_parked--;
+      // Woken up during a migration: stay where the state was taken.
+      park_vcpu();
+      break;
+    case MessageHostOp::OP_VCPU_FREEZE:
+      // Called by the migration thread, which does not hold irq_mtx.
       pthread_mutex_lock(&irq_mtx);
+      vcpus_frozen = msg.value;
+      pthread_cond_broadcast(&vcpus_park_cond);
+      while (vcpus_frozen and vcpus_parked < vcpu_info.size())
+        pthread_cond_wait(&vcpus_park_cond, &irq_mtx);
+      msg.vcpu_state = vcpu_info.empty() ? nullptr : vcpu_info[0].state;
+      pthread_mutex_unlock(&irq_mtx);
+      res = msg.vcpu_state != nullptr;
       break;
-    case MessageHostOp::OP_VCPU_RELEASE:
-      sem_post(&vcpu_info[msg.value].block);
+    case MessageHostOp::OP_VCPU_RELEASE: {
+      // A running or polling vCPU sees the event by itself. len tells
+      // whether the vCPU was about to block when the event came in.
+      Vcpu_info &v = vcpu_info[msg.value];
+      if (msg.len and v.sleeping) {
+        v.wakeups++;
+        syscall(SYS_futex, v.event, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+      }
       break;
+    }
     case MessageHostOp::OP_GET_MODULE:
       // For historical reasons, modules numbers start with 1.
       msg.module --;
 
       if (msg.module < modules.size() and
           msg.size   > modules[msg.module].size) {
-        memcpy(msg.start, modules[msg.module].memory, modules[msg.module].size);
+        Module &m = modules[msg.module];
+        if (m.map_to(msg.start))
+          merge_ram(msg.start, m.size);
+        else
+          memcpy(msg.start, m.memory, m.size);
 
         // Align the end of the module to get the cmdline on a new page.
         uintptr_t s = reinterpret_cast<uintptr_t>(msg.start) + modules[msg.module].size;
@@ -709,7 +1050,16 @@ static bool receive(Device *, MessageDisk &msg)
 static void usage()
 {
   fprintf(stderr, "Usage: seoul [-m RAM] [-n tap-device] [-d disk-image]\n"
-                  "             [kernel parameters] [module1 parameters] ...\n");
+                  "             [-s snapshot-file] [-r snapshot-file] [-k] [-c cache-dir]\n"
+                  "             [kernel parameters] [module1 parameters] ...\n"
+                  "\n"
+                  "  -k  let the host kernel merge identical guest pages (KSM)\n"
+                  "  -c  share module pages with other VMs through this directory\n"
+                  "      (default /dev/shm)\n"
+                  "  -s  write a snapshot to the given file on SIGUSR1\n"
+                  "  -r  resume from a snapshot instead of booting\n"
+                  "\n"
+                  "SIGUSR2 prints halt polling statistics per vCPU.\n");
   exit(EXIT_FAILURE);
 }
 
@@ -725,7 +1075,7 @@ int main(int argc, char **argv)
   }
 
   int ch;
-  while ((ch = getopt(argc, argv, "hm:n:d:")) != -1) {
+  while ((ch = getopt(argc, argv, "hkc:m:n:d:s:r:")) != -1) {
     switch (ch) {
     case 'm':
       ram_size = atoi(optarg) << 20;
@@ -740,6 +1090,19 @@ int main(int argc, char **argv)
     case 'd':
       disks.push_back(Disk::from_file(optarg));
       break;
+    case 's':
+      snapshot_file = optarg;
+      break;
+    case 'r':
+      snapshot_restore = new Snapshot;
+      if (!snapshot_restore->open(optarg)) return EXIT_FAILURE;
+      break;
+    case 'k':
+      ram_merge = true;
+      break;
+    case 'c':
+      module_cache = optarg;
+      break;
     case 'h':
     case '?':
     default:
@@ -757,14 +1120,27 @@ int main(int argc, char **argv)
     modules.push_back(Module::from_file(argv[i], argv[i+1]));
   }
 
+  // The snapshot dictates the memory layout.
+  if (snapshot_restore) ram_size = snapshot_restore->ram_size();
+
   // Allocating RAM.
 
+  ram_total = ram_size;
   ram = reinterpret_cast<char *>(mmap(nullptr, ram_size, PROT_READ | PROT_WRITE,
                                         MAP_PRIVATE | MAP_ANON, -1, 0));
   if (ram == MAP_FAILED) {
     perror("mmap");
     return EXIT_FAILURE;
   }
+  merge_ram(ram, ram_total);
+
+  // Only the signal thread wants to see SIGUSR1 and SIGUSR2. Block
+  // them before any other thread inherits our signal mask.
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGUSR1);
+  sigaddset(&sigset, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &sigset, nullptr);
 
   // Creating timer. I hate C++: No useful initializers...
   struct sigevent ev;
@@ -778,6 +1154,9 @@ int main(int argc, char **argv)
   }
 
   mb_clock = new Clock(get_tsc_frequency());
+
+  // Spinning only helps if whoever wakes us can run meanwhile.
+  if (sysconf(_SC_NPROCESSORS_ONLN) < 2) halt_poll_max = 0;
   mb = new Motherboard(mb_clock, NULL);
 
 #ifdef USE_IOTHREAD
@@ -853,6 +1232,28 @@ int main(int argc, char **argv)
        mb->bus_legacy.send_fifo(msg3);
   }
 
+  if (snapshot_restore) {
+    // RESET may have scribbled on guest memory. Dropping those pages
+    // is fine, the image has what the guest saw when it was saved.
+    Logging::printf("Restoring snapshot.\n");
+    if (snapshot_restore->vcpus() != vcpu_info.size() or
+        !snapshot_restore->map_memory(ram, ram_total) or
+        !snapshot_restore->restore_devices(mb)) {
+      fprintf(stderr, "Snapshot does not match this VM configuration.\n");
+      return EXIT_FAILURE;
+    }
+    merge_ram(ram, ram_total);
+  }
+
+  pthread_t signal_thread;
+  if (0 != pthread_create(&signal_thread, NULL, signal_thread_fn, NULL)) {
+    perror("pthread_create");
+    return EXIT_FAILURE;
+  }
+  pthread_setname_np(signal_thread, "signal");
+  if (snapshot_file)
+    Logging::printf("Send SIGUSR1 to save a snapshot to '%s'.\n", snapshot_file);
+
   pthread_t iothread;
   if (tap_fd) {
     Logging::printf("Starting background threads.\n");
@@ -0,0 +1,345 @@
+/**
+ * Post-copy migration of guest memory
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <nul/migration.h>
+#include <service/logging.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+enum {
+    PAGE_SIZE = 0x1000,
+    PAGE_DONE = ~0u,
+};
+
+/***********************************************************************
+ * Sending side
+ ***********************************************************************/
+
+PostcopySender::PostcopySender(TcpSocket *socket, char *physmem, unsigned long size)
+    : _socket(socket), _physmem(physmem), _pages(size >> 12),
+    // Every page is sent exactly once, a delta cache would be wasted.
+    _encoder(physmem, size, false),
+    _sent(new unsigned char[_pages]),
+    _queue_head(0), _queue_tail(0), _requests(0), _ok(false)
+{
+    memset(_sent, 0, _pages);
+    pthread_mutex_init(&_lock, NULL);
+}
+
+PostcopySender::~PostcopySender()
+{
+    pthread_mutex_destroy(&_lock);
+    delete [] _sent;
+}
+
+bool PostcopySender::next_request(unsigned &page)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&_lock);
+    while (!found && _queue_head != _queue_tail) {
+        page  = _queue[_queue_head++ % QUEUE];
+        found = !_sent[page];
+    }
+    pthread_mutex_unlock(&_lock);
+    return found;
+}
+
+bool PostcopySender::push()
+{
+    unsigned batch[BATCH];
+    unsigned cursor = 0, left = _pages;
+
+    while (left) {
+        unsigned count = 0, page;
+
+        _encoder.reset();
+        while (count < BATCH && left && next_request(page)) {
+            // Neighbours of a faulting page are likely next.
+            cursor = page + 1;
+            batch[count++] = page;
+            _sent[page] = 1;
+            _encoder.add(page);
+            left--;
+        }
+        while (count < BATCH && left) {
+            while (_sent[cursor % _pages]) cursor++;
+            page = cursor++ % _pages;
+            batch[count++] = page;
+            _sent[page] = 1;
+            _encoder.add(page);
+            left--;
+        }
+        _encoder.encode();
+
+        for (unsigned i=0; i < count; ++i)
+            if (!_socket->send_nonblocking(&batch[i], sizeof(batch[i])) ||
+                !_socket->send_nonblocking(_encoder.record(i), _encoder.record_size(i)))
+                return false;
+        if (!_socket->wait_complete()) return false;
+    }
+
+    PostcopyPage done;
+    memset(&done, 0, sizeof(done));
+    done.page = PAGE_DONE;
+    return _socket->send(&done, sizeof(done));
+}
+
+void *PostcopySender::push_fn(void *arg)
+{
+    PostcopySender *s = reinterpret_cast<PostcopySender *>(arg);
+    s->_ok = s->push();
+    return NULL;
+}
+
+void *PostcopySender::request_fn(void *arg)
+{
+    PostcopySender *s = reinterpret_cast<PostcopySender *>(arg);
+    unsigned page;
+
+    // The receiver says PAGE_DONE once it has everything.
+    while (s->_socket->receive(&page, sizeof(page)) && page != PAGE_DONE) {
+        if (page >= s->_pages) continue;
+
+        pthread_mutex_lock(&s->_lock);
+        // On overflow the request is dropped, the push reaches it anyway.
+        if (s->_queue_tail - s->_queue_head < QUEUE)
+            s->_queue[s->_queue_tail++ % QUEUE] = page;
+        s->_requests++;
+        pthread_mutex_unlock(&s->_lock);
+    }
+    return NULL;
+}
+
+void PostcopySender::start()
+{
+    if (0 != pthread_create(&_push_thread, NULL, push_fn, this) ||
+        0 != pthread_create(&_request_thread, NULL, request_fn, this))
+        Logging::panic("Could not create post-copy threads.\n");
+}
+
+bool PostcopySender::wait()
+{
+    pthread_join(_push_thread, NULL);
+    // The receiver always ends the request stream, even on failure.
+    pthread_join(_request_thread, NULL);
+
+    Logging::printf("Post-copy: pushed %u pages, %lu requested on demand.\n",
+            _pages, _requests);
+    _encoder.print_stats();
+    return _ok;
+}
+
+/***********************************************************************
+ * Receiving side
+ ***********************************************************************/
+
+PostcopyReceiver::PostcopyReceiver(TcpSocket *socket, char *physmem, unsigned long size)
+    : _socket(socket), _physmem(physmem), _pages(size >> 12), _uffd(-1),
+    _received(new unsigned char[_pages]), _requested(new unsigned char[_pages]),
+    _ok(false), _faults(0), _received_pages(0)
+{
+    _wakeup[0] = _wakeup[1] = -1;
+    memset(const_cast<unsigned char *>(_received), 0, _pages);
+    memset(_requested, 0, _pages);
+    pthread_mutex_init(&_send_lock, NULL);
+}
+
+PostcopyReceiver::~PostcopyReceiver()
+{
+    pthread_mutex_destroy(&_send_lock);
+    delete [] _requested;
+    delete [] _received;
+}
+
+bool PostcopyReceiver::request(unsigned page)
+{
+    pthread_mutex_lock(&_send_lock);
+    bool ok = _socket->send(&page, sizeof(page));
+    pthread_mutex_unlock(&_send_lock);
+    return ok;
+}
+
+bool PostcopyReceiver::place(unsigned page, MigrationPage &rec, unsigned char *payload,
+        unsigned char *scratch)
+{
+    mword dst = reinterpret_cast<mword>(_physmem) + (static_cast<mword>(page) << 12);
+    int res;
+
+    if (rec.encoding == MigrationPage::ZERO) {
+        struct uffdio_zeropage zp;
+        zp.range.start = dst;
+        zp.range.len   = PAGE_SIZE;
+        zp.mode        = 0;
+        do res = ioctl(_uffd, UFFDIO_ZEROPAGE, &zp); while (res && errno == EAGAIN);
+    } else {
+        if (!PageEncoder::decode(rec, payload, scratch)) {
+            Logging::printf("Could not decode page %#x (encoding %u)\n", page, rec.encoding);
+            return false;
+        }
+
+        // Copying also wakes up everyone who faulted on the page.
+        struct uffdio_copy copy;
+        copy.dst  = dst;
+        copy.src  = reinterpret_cast<mword>(scratch);
+        copy.len  = PAGE_SIZE;
+        copy.mode = 0;
+        do res = ioctl(_uffd, UFFDIO_COPY, &copy); while (res && errno == EAGAIN);
+    }
+
+    if (res && errno != EEXIST) {
+        perror("userfaultfd place");
+        return false;
+    }
+
+    _received[page] = 1;
+    _received_pages++;
+    return true;
+}
+
+void *PostcopyReceiver::fault_fn(void *arg)
+{
+    PostcopyReceiver *r = reinterpret_cast<PostcopyReceiver *>(arg);
+    struct pollfd fds[2] = { { r->_uffd, POLLIN, 0 }, { r->_wakeup[0], POLLIN, 0 } };
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents) break;
+
+        struct uffd_msg msg;
+        ssize_t res = read(r->_uffd, &msg, sizeof(msg));
+        if (res != sizeof(msg) || msg.event != UFFD_EVENT_PAGEFAULT) continue;
+
+        unsigned page = (msg.arg.pagefault.address - reinterpret_cast<mword>(r->_physmem)) >> 12;
+        if (page >= r->_pages) continue;
+        r->_faults++;
+
+        if (r->_received[page]) {
+            // The page arrived while we were looking.
+            struct uffdio_range range = { msg.arg.pagefault.address & ~(PAGE_SIZE - 1ull), PAGE_SIZE };
+            ioctl(r->_uffd, UFFDIO_WAKE, &range);
+        } else if (!r->_requested[page]) {
+            r->_requested[page] = 1;
+            r->request(page);
+        }
+    }
+    return NULL;
+}
+
+void *PostcopyReceiver::page_fn(void *arg)
+{
+    PostcopyReceiver *r = reinterpret_cast<PostcopyReceiver *>(arg);
+    unsigned char payload[PAGE_SIZE], scratch[PAGE_SIZE] VMM_ALIGNED(PAGE_SIZE);
+    PostcopyPage hdr;
+
+    bool ok;
+    while ((ok = r->_socket->receive(&hdr, sizeof(hdr))) && hdr.page != PAGE_DONE) {
+        if (hdr.page >= r->_pages || hdr.rec.length > sizeof(payload) ||
+            (hdr.rec.length && !r->_socket->receive(payload, hdr.rec.length)) ||
+            !r->place(hdr.page, hdr.rec, payload, scratch)) {
+            ok = false;
+            break;
+        }
+    }
+
+    /* The guest already runs on memory that will never arrive.
+     * Die while its threads still wait on the missing pages,
+     * instead of letting them see zero pages. */
+    if (!ok || r->_received_pages != r->_pages)
+        Logging::panic("Post-copy: guest memory transfer failed after %lu of %u pages.\n",
+                r->_received_pages, r->_pages);
+
+    // Stop the fault handler and hand guest memory back to the kernel.
+    char c = 0;
+    if (write(r->_wakeup[1], &c, 1) != 1) perror("write");
+    pthread_join(r->_fault_thread, NULL);
+
+    struct uffdio_range range = { reinterpret_cast<mword>(r->_physmem),
+                                  static_cast<unsigned long long>(r->_pages) << 12 };
+    ioctl(r->_uffd, UFFDIO_UNREGISTER, &range);
+    close(r->_uffd);
+    close(r->_wakeup[0]);
+    close(r->_wakeup[1]);
+
+    // The sender only waits for this to finish, the memory is complete.
+    r->_ok = r->request(PAGE_DONE);
+    Logging::printf("Post-copy: all %u pages arrived, %lu faults on missing pages.\n",
+            r->_pages, r->_faults);
+    return NULL;
+}
+
+bool PostcopyReceiver::start()
+{
+    // Whatever guest memory contained before has to fault from now on.
+    if (madvise(_physmem, static_cast<size_t>(_pages) << 12, MADV_DONTNEED)) {
+        perror("madvise");
+        return false;
+    }
+
+    _uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+#ifdef UFFD_USER_MODE_ONLY
+    // Without privileges, we may only catch faults from user space.
+    if (_uffd < 0 && errno == EPERM)
+        _uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+#endif
+    if (_uffd < 0) {
+        perror("userfaultfd");
+        return false;
+    }
+
+    struct uffdio_api api;
+    api.api      = UFFD_API;
+    api.features = 0;
+
+    struct uffdio_register reg;
+    reg.range.start = reinterpret_cast<mword>(_physmem);
+    reg.range.len   = static_cast<unsigned long long>(_pages) << 12;
+    reg.mode        = UFFDIO_REGISTER_MODE_MISSING;
+
+    if (ioctl(_uffd, UFFDIO_API, &api) || ioctl(_uffd, UFFDIO_REGISTER, &reg) ||
+        pipe(_wakeup)) {
+        perror("userfaultfd setup");
+        close(_uffd);
+        return false;
+    }
+
+    if (0 != pthread_create(&_fault_thread, NULL, fault_fn, this) ||
+        0 != pthread_create(&_page_thread, NULL, page_fn, this))
+        Logging::panic("Could not create post-copy threads.\n");
+    return true;
+}
+
+bool PostcopyReceiver::wait()
+{
+    pthread_join(_page_thread, NULL);
+    return _ok;
+}
+
+// EOF
@@ -0,0 +1,123 @@
+/**
+ * Buffered serial output
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <nul/motherboard.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+/**
+ * Writes the output of a serial port to a file descriptor.
+ *
+ * The caller only copies the characters into a ring buffer, a thread
+ * of its own writes them out in large chunks. A guest that prints
+ * faster than the descriptor drains loses characters, which are
+ * counted and reported, but it is never stalled.
+ */
+class SerialWriter : public StaticReceiver<SerialWriter> {
+  unsigned        _hdev;
+  int             _fd;
+  unsigned        _size;
+  unsigned char  *_buffer;
+  unsigned long   _head;      ///< written to fd
+  unsigned long   _tail;      ///< filled by the guest
+  unsigned long   _dropped;
+  pthread_mutex_t _lock;
+  pthread_cond_t  _cond;
+
+  SerialWriter(const SerialWriter &);
+  SerialWriter &operator = (const SerialWriter &);
+
+  static void *writer_fn(void *arg)
+  {
+    SerialWriter *w = reinterpret_cast<SerialWriter *>(arg);
+
+    pthread_mutex_lock(&w->_lock);
+    while (1) {
+      while (w->_head == w->_tail)
+        pthread_cond_wait(&w->_cond, &w->_lock);
+
+      // Up to the end of the ring, the rest comes next round.
+      unsigned pos = w->_head % w->_size;
+      unsigned len = VMM_MIN(w->_tail - w->_head, static_cast<unsigned long>(w->_size - pos));
+      unsigned long dropped = w->_dropped;
+      w->_dropped = 0;
+      pthread_mutex_unlock(&w->_lock);
+
+      if (dropped)
+        Logging::printf("serialout %x: dropped %lu characters\n", w->_hdev, dropped);
+
+      ssize_t res = write(w->_fd, w->_buffer + pos, len);
+      if (res < 0 && errno != EINTR && errno != EAGAIN) {
+        perror("serialout write");
+        // Do not spin on a broken descriptor.
+        res = len;
+      }
+
+      pthread_mutex_lock(&w->_lock);
+      if (res > 0) w->_head += res;
+    }
+    return NULL;
+  }
+
+public:
+  bool receive(MessageSerial &msg)
+  {
+    if (msg.serial != _hdev) return false;
+
+    const unsigned char *data = msg.data();
+    pthread_mutex_lock(&_lock);
+    bool was_empty = _head == _tail;
+    unsigned len = VMM_MIN(msg.len, static_cast<unsigned>(_size - (_tail - _head)));
+    for (unsigned i=0; i < len; i++)
+      _buffer[_tail++ % _size] = data[i];
+    _dropped += msg.len - len;
+    if (was_empty && len) pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+    return true;
+  }
+
+  void start()
+  {
+    pthread_t t;
+    if (0 != pthread_create(&t, NULL, writer_fn, this))
+      Logging::panic("Could not create serial output thread.\n");
+  }
+
+  SerialWriter(unsigned hdev, int fd, unsigned size)
+    : _hdev(hdev), _fd(fd), _size(size), _buffer(new unsigned char[size]),
+      _head(0), _tail(0), _dropped(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+  }
+};
+
+
+PARAM_HANDLER(serialout,
+              "serialout:hostdevnr,fd=1,bufferlen=65536 - write the output of a serial port to a file descriptor.",
+              "Example: 'serialout:0x4712' sends the first serial port to stdout.",
+              "Writing happens asynchronously, characters are dropped if the buffer overflows.")
+{
+  unsigned size = argv[2] == ~0UL ? 65536 : VMM_MAX(argv[2], 16UL);
+  SerialWriter *w = new SerialWriter(argv[0], argv[1] == ~0UL ? 1 : argv[1], size);
+  mb.bus_serial.add(w, SerialWriter::receive_static<MessageSerial>);
+  w->start();
+}
+
+// EOF
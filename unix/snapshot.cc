@@ -0,0 +1,234 @@
+/**
+ * VM snapshot files
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "snapshot.h"
+
+#include <service/cpu.h>
+#include <service/logging.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum {
+  PAGE_SIZE = 0x1000,
+};
+
+unsigned Snapshot::cpu_bytes()
+{
+  return reinterpret_cast<mword>(&static_cast<CpuState *>(0)->id + 1)
+    - reinterpret_cast<mword>(&static_cast<CpuState *>(0)->mtd);
+}
+
+static bool write_all(int fd, const void *buf, size_t len, off_t offset)
+{
+  const char *p = reinterpret_cast<const char *>(buf);
+  while (len) {
+    ssize_t res = pwrite(fd, p, len, offset);
+    if (res <= 0) return false;
+    p += res; len -= res; offset += res;
+  }
+  return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len, off_t offset)
+{
+  char *p = reinterpret_cast<char *>(buf);
+  while (len) {
+    ssize_t res = pread(fd, p, len, offset);
+    if (res <= 0) return false;
+    p += res; len -= res; offset += res;
+  }
+  return true;
+}
+
+static bool page_is_zero(const char *page)
+{
+  const unsigned long *p = reinterpret_cast<const unsigned long *>(page);
+  for (unsigned i = 0; i < PAGE_SIZE / sizeof(*p); i++)
+    if (p[i]) return false;
+  return true;
+}
+
+bool Snapshot::save(const char *filename, Motherboard *mb, char *ram, size_t ram_size,
+                    CpuState * const *cpus, unsigned cpu_count)
+{
+  // Collect device state. This mirrors Migration::send_devices.
+  MessageRestore restart_msg(MessageRestore::RESTORE_RESTART, NULL, true);
+  mb->bus_restore.send_fifo(restart_msg);
+
+  mword restore_bytes = restart_msg.bytes;
+  mword restore_bytes_consumed = 0;
+  char *restore_buf = new char[restore_bytes + sizeof(MessageRestore)];
+
+  for (unsigned i = MessageRestore::RESTORE_RESTART + 1; i < MessageRestore::RESTORE_LAST; i++)
+    while (1) {
+      MessageRestore *rmsg = reinterpret_cast<MessageRestore *>(restore_buf + restore_bytes_consumed);
+      *rmsg = MessageRestore(i, restore_buf + restore_bytes_consumed + sizeof(*rmsg), true);
+
+      if (!mb->bus_restore.send(*rmsg, true)) break;
+      restore_bytes_consumed += sizeof(*rmsg) + rmsg->bytes;
+    }
+  assert(restore_bytes_consumed <= restore_bytes);
+
+  Header h;
+  memset(&h, 0, sizeof(h));
+  h.magic         = Header::MAGIC;
+  h.version       = Header::VERSION;
+  h.vcpus         = cpu_count;
+  h.cpu_bytes     = cpu_bytes();
+  h.ram_size      = ram_size;
+  h.tsc           = Cpu::rdtsc();
+  h.device_offset = sizeof(h) + cpu_count * h.cpu_bytes;
+  h.device_bytes  = restore_bytes_consumed;
+  h.memory_offset = (h.device_offset + h.device_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1ULL);
+
+  // The target may be the image we restored from and still have mapped
+  // over guest RAM. Truncating it would pull pages from under the guest,
+  // so write a new file next to it and rename it into place.
+  size_t len = strlen(filename);
+  char *tmpname = new char[len + sizeof(".XXXXXX")];
+  memcpy(tmpname, filename, len);
+  memcpy(tmpname + len, ".XXXXXX", sizeof(".XXXXXX"));
+
+  int  fd = mkstemp(tmpname);
+  bool ok = fd >= 0 and 0 == fchmod(fd, 0644);
+
+  ok = ok and write_all(fd, &h, sizeof(h), 0);
+  for (unsigned i = 0; ok and i < cpu_count; i++)
+    ok = write_all(fd, &cpus[i]->mtd, h.cpu_bytes, sizeof(h) + i * h.cpu_bytes);
+  ok = ok and write_all(fd, restore_buf, h.device_bytes, h.device_offset);
+
+  // Zero pages stay holes, which also keeps template images small.
+  unsigned written = 0;
+  for (size_t offset = 0; ok and offset < ram_size; offset += PAGE_SIZE) {
+    if (page_is_zero(ram + offset)) continue;
+    ok = write_all(fd, ram + offset, PAGE_SIZE, h.memory_offset + offset);
+    written++;
+  }
+  ok = ok and 0 == ftruncate(fd, h.memory_offset + ram_size);
+  ok = ok and 0 == fsync(fd);
+
+  delete [] restore_buf;
+  if (fd >= 0) close(fd);
+
+  ok = ok and 0 == rename(tmpname, filename);
+  if (!ok) {
+    perror("snapshot save");
+    if (fd >= 0) unlink(tmpname);
+    delete [] tmpname;
+    return false;
+  }
+  delete [] tmpname;
+  Logging::printf("Snapshot: saved %u vCPUs, %llu device bytes, %u of %zu pages to '%s'.\n",
+                  cpu_count, h.device_bytes, written, ram_size / PAGE_SIZE, filename);
+  return true;
+}
+
+bool Snapshot::open(const char *filename)
+{
+  _fd = ::open(filename, O_RDONLY);
+  if (_fd < 0 or !read_all(_fd, &_header, sizeof(_header), 0)) {
+    perror("snapshot open");
+    return false;
+  }
+
+  if (_header.magic != Header::MAGIC or _header.version != Header::VERSION or
+      _header.cpu_bytes != cpu_bytes() or _header.memory_offset & (PAGE_SIZE - 1)) {
+    Logging::printf("Snapshot: '%s' is not a compatible snapshot.\n", filename);
+    return false;
+  }
+  return true;
+}
+
+bool Snapshot::map_memory(char *ram, size_t ram_size)
+{
+  if (ram_size != _header.ram_size) {
+    Logging::printf("Snapshot: RAM size mismatch (%zu vs. %llu bytes).\n", ram_size, _header.ram_size);
+    return false;
+  }
+
+  // MAP_PRIVATE gives us copy-on-write: guest writes never reach the
+  // image, and pages are only read from the file when first touched.
+  void *res = mmap(ram, ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                   _fd, _header.memory_offset);
+  if (res == MAP_FAILED) {
+    perror("snapshot mmap");
+    return false;
+  }
+  return true;
+}
+
+bool Snapshot::restore_devices(Motherboard *mb)
+{
+  char *restore_buf = new char[_header.device_bytes];
+  if (!read_all(_fd, restore_buf, _header.device_bytes, _header.device_offset)) {
+    perror("snapshot read");
+    delete [] restore_buf;
+    return false;
+  }
+
+  MessageRestore restart_msg(MessageRestore::RESTORE_RESTART, NULL, false);
+  mb->bus_restore.send_fifo(restart_msg);
+
+  // Records point into our buffer, so fix up space before sending.
+  for (mword offset = 0; offset < _header.device_bytes; ) {
+    MessageRestore *rmsg = reinterpret_cast<MessageRestore *>(restore_buf + offset);
+    if (!rmsg->magic_string_check() or
+        offset + sizeof(*rmsg) + rmsg->bytes > _header.device_bytes) {
+      Logging::printf("Snapshot: corrupt device record at %#lx.\n", offset);
+      delete [] restore_buf;
+      return false;
+    }
+
+    rmsg->space = restore_buf + offset + sizeof(*rmsg);
+    rmsg->write = false;
+    if (!mb->bus_restore.send(*rmsg, true))
+      Logging::printf("No device replied on restore message!"
+                      " VMM-Configuration mismatch?\n");
+
+    offset += sizeof(*rmsg) + rmsg->bytes;
+  }
+  delete [] restore_buf;
+
+  // Hide the time the VM spent on disk from the guest.
+  CpuMessage rdtsc_msg(CpuMessage::TYPE_ADD_TSC_OFF, NULL, 0);
+  rdtsc_msg.current_tsc_off = _header.tsc - Cpu::rdtsc();
+  for (VCpu *vcpu = mb->last_vcpu; vcpu; vcpu = vcpu->get_last())
+    vcpu->executor.send(rdtsc_msg);
+
+  MessageRestore replug_msg(MessageRestore::PCI_PLUG, NULL, true);
+  mb->bus_restore.send(replug_msg, false);
+
+  return true;
+}
+
+bool Snapshot::restore_vcpu(unsigned nr, CpuState *cpu)
+{
+  if (nr >= _header.vcpus or
+      !read_all(_fd, &cpu->mtd, _header.cpu_bytes, sizeof(_header) + nr * _header.cpu_bytes))
+    return false;
+
+  cpu->mtd = MTD_ALL;
+  return true;
+}
+
+// EOF
@@ -0,0 +1,101 @@
+/**
+ * VM snapshot files
+ *
+ * Copyright (C) 2026, agent <agent@local>
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <nul/motherboard.h>
+#include <nul/vcpu.h>
+
+/**
+ * A snapshot file captures a stopped VM so that an identically
+ * configured VMM can continue it later. The layout is:
+ *
+ *   Header
+ *   CpuState (mtd..id) for every vCPU, in creation order
+ *   MessageRestore records, as they travel over bus_restore
+ *   padding up to the next page boundary
+ *   guest memory, page i at memory_offset + i * 4096
+ *
+ * All-zero guest pages are not written and end up as holes in the
+ * file. The memory image is never read on restore. It is mapped
+ * copy-on-write over guest RAM instead, so the guest faults in pages
+ * as it touches them and never writes back to the file.
+ */
+class Snapshot {
+public:
+  struct Header {
+    enum {
+      MAGIC   = 0x50414e53, // "SNAP"
+      VERSION = 2,
+    };
+
+    unsigned           magic;
+    unsigned           version;
+    unsigned           vcpus;
+    unsigned           cpu_bytes;
+    unsigned long long ram_size;
+    unsigned long long tsc;
+    unsigned long long device_offset;
+    unsigned long long device_bytes;
+    unsigned long long memory_offset;
+  };
+
+private:
+  int    _fd;
+  Header _header;
+
+  static unsigned cpu_bytes();
+
+public:
+  /**
+   * Write the state of all devices, the given vCPU states and guest
+   * memory to filename. The caller has to make sure that nothing
+   * modifies VM state in the meantime. The file is replaced
+   * atomically, so it may be the one the VM was restored from.
+   */
+  static bool save(const char *filename, Motherboard *mb, char *ram, size_t ram_size,
+                   CpuState * const *cpus, unsigned cpu_count);
+
+  /**
+   * Open a snapshot file and validate its header.
+   */
+  bool open(const char *filename);
+
+  size_t   ram_size() const { return _header.ram_size; }
+  unsigned vcpus()    const { return _header.vcpus; }
+
+  /**
+   * Replace guest RAM with a private file mapping of the memory
+   * image. Anything the guest memory contained before is discarded.
+   */
+  bool map_memory(char *ram, size_t ram_size);
+
+  /**
+   * Push the saved device state over bus_restore and adjust the TSC
+   * offsets of all vCPUs, so guest time continues where it stopped.
+   */
+  bool restore_devices(Motherboard *mb);
+
+  /**
+   * Load the register state of the given vCPU.
+   */
+  bool restore_vcpu(unsigned nr, CpuState *cpu);
+
+  Snapshot() : _fd(-1), _header() {}
+};
+
+// EOF